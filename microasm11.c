@@ -5,9 +5,29 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <utime.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "shm11.h"
+#include "sim11.h"
 
 enum {
     NO_ERROR = 0,
@@ -41,6 +61,13 @@ enum {
     SYNTAX_ERROR,
     CANNOT_OPEN_FILE,
     UNSUPPORTED_INSTRUCTION,
+    NOT_RELOCATABLE,
+    DATA_IN_BSS,
+    SECTION_ATTR_CONFLICT,
+    CYCLES_NESTING,
+    CYCLES_NO_BEGIN,
+    CYCLES_UNBOUNDED,
+    CYCLES_EXCEEDED,
 };
 
 enum {
@@ -75,6 +102,9 @@ enum {
     pseudo_cpu,
     pseudo_enabl,
     pseudo_dsabl,
+    pseudo_psect,
+    pseudo_keep,
+    pseudo_cycles,
 };
 
 typedef struct {
@@ -259,6 +289,12 @@ static OpCode opcode_table[] = {
     { "cpu", pseudo_cpu, 0x0, 0, CPU_ALL },
     { "enabl", pseudo_enabl, 0x0, 0, CPU_ALL },
     { "dsabl", pseudo_dsabl, 0x0, 0, CPU_ALL },
+    { "psect", pseudo_psect, 0x0, 0, CPU_ALL },
+    { "csect", pseudo_psect, 0x0, 0, CPU_ALL },
+    { "asect", pseudo_psect, 0x0, 0, CPU_ALL },
+    { "keep", pseudo_keep, 0x0, 0, CPU_ALL },
+    { "cycles_begin", pseudo_cycles, 0x0, 0, CPU_ALL },
+    { "cycles_end", pseudo_cycles, 0x0, 0, CPU_ALL },
 };
 
 typedef struct Register {
@@ -285,13 +321,19 @@ typedef struct Macro {
     int lines;
     int args;
     char *arg_name[10];
+    unsigned long expansions;   /* for --stats */
     struct Macro *prev;
 } Macro;
 
 typedef struct Label {
     char *name;
     unsigned int address;
+    unsigned int prev_address;
+    int stamp;
+    int reloc;
+    int sect;
     int line;
+    const char *file;
     struct Label *prev;
 } Label;
 
@@ -299,7 +341,10 @@ typedef struct LocalDef {
     int lsb_id;
     int number;
     unsigned int address;
+    int reloc;
+    int sect;
     int line;
+    int seq;                /* definition order in the pass, for --instrument */
     struct LocalDef *prev;
 } LocalDef;
 
@@ -309,20 +354,67 @@ typedef struct Proc {
     Label *globals;
     Label *equs;
     int line;
+    unsigned int start;
+    unsigned int size;
+    int live;
+    int keep;
+    struct Proc *run_prev;      /* PROC that ends where this one starts */
+    struct Proc *run_head;      /* first PROC of a reordered run */
+    unsigned int slot;          /* offset in the run after reordering */
+    unsigned int run_base;
+    unsigned int run_size;
+    unsigned long long heat;
+    int instr_save;             /* entry site keeps the PSW, N, Z or V is live */
     struct Proc *prev;
 } Proc;
 
+typedef struct ProcRef {
+    Proc *from;
+    Proc *to;
+    char *name;
+    struct ProcRef *prev;
+} ProcRef;
+
 typedef struct File {
+    const char *in_file_name;
     char *in_file_path;
     FILE *in_file;
     int src_line;
     struct File *prev;
 } File;
 
+static const char *in_file_name;
 static char *in_file_path;
 static FILE *in_file;
 
-static unsigned char output[65536];
+/* Source file names live as long as the labels that point at them. */
+typedef struct FileName {
+    char *name;
+    struct FileName *prev;
+} FileName;
+
+static FileName *file_names = NULL;
+
+static const char *file_intern(const char *name)
+{
+    for (FileName *f = file_names; f; f = f->prev) {
+        if (!strcmp(f->name, name)) {
+            return f->name;
+        }
+    }
+    FileName *f = malloc(sizeof(FileName));
+    if (!f || !(f->name = strdup(name))) {
+        free(f);
+        return "?";
+    }
+    f->prev = file_names;
+    file_names = f;
+    return f->name;
+}
+
+#define MAX_OUTPUT (65536)
+
+static unsigned char output[MAX_OUTPUT];
 static unsigned int start_addr = 0;
 static unsigned int output_addr = 0;
 
@@ -335,6 +427,75 @@ static int src_line = 1;
 static int case_sensitive_symbols = 0;
 static int jmp_label_indirect = 0;
 
+/*
+ * Relocatable output: every expression collects its address terms (labels,
+ * local labels, `*` and, in object mode, undefined symbols) with their signs.
+ * A word whose section terms sum to one holds an absolute address and goes
+ * into the relocation table; PC-relative operands subtract the PC term and
+ * normally sum to zero.
+ */
+#define RELOC_TERMS_MAX 16
+#define RELOC_SECT_MAX  4
+
+typedef struct {
+    int sect;
+    int sym;
+    int sign;
+} RelocTerm;
+
+typedef struct {
+    int invalid;
+    int sym;
+    int nsect;
+    int sect[RELOC_SECT_MAX];
+    int weight[RELOC_SECT_MAX];
+} RelocInfo;
+
+typedef struct {
+    unsigned int addr;
+    RelocInfo info;
+} RelocRec;
+
+static int reloc_mode = 0;
+static int obj_mode = 0;
+static RelocTerm reloc_terms[RELOC_TERMS_MAX];
+static int reloc_nterms = 0;
+static int reloc_complex = 0;
+static RelocRec *relocs = NULL;
+static int relocs_count = 0;
+static int relocs_size = 0;
+static int cur_sect = 0;
+
+/*
+ * .psect sections, each with its own location counter. Pass 1 assigns
+ * section-relative addresses, layout_sections() places the sections after
+ * the default (absolute) section or where a --layout file puts them and
+ * rebases their labels, and pass 2 emits at the final addresses.
+ */
+#define SECT_CODE   1
+#define SECT_DATA   2
+#define SECT_BSS    4
+#define SECT_RO     8
+
+typedef struct Section {
+    char *name;
+    int id;
+    int attrs;
+    unsigned int align;
+    unsigned int base;
+    unsigned int loc;
+    unsigned int size;
+    int placed;
+    struct Section *prev;
+} Section;
+
+static Section *sections = NULL;
+static int sections_count = 0;
+static Section *cur_section = NULL;
+static unsigned int abs_addr = 0;
+static unsigned int abs_start = 0;
+static unsigned int abs_end = 0;
+
 typedef struct {
     int active;
     int seen_else;
@@ -346,14 +507,78 @@ static int if_sp = 0;
 
 static Label *labels = NULL;
 static Label *equs = NULL;
+static Label *externs = NULL;
+static int externs_count = 0;
+static Label *exports = NULL;
 static Proc *procs = NULL;
 static Macro *macros = NULL;
 static File *files = NULL;
 static LocalDef *local_defs = NULL;
 static FILE *list_out = NULL;
 
+static int layout_pass = 0;
+static int watch_fd = -1;       /* --watch: pipe for the included files */
+static FILE *lsp_out = NULL;    /* --lsp: analysis results of a build child */
+static int gc_procs = 0;
+static int gc_active = 0;
+static int gc_skip = 0;
+static ProcRef *proc_refs = NULL;
+static Label *keeps = NULL;
+static Proc *gc_entry = NULL;
+static int gc_entry_seen = 0;
+static const char *reorder_path = NULL;
+static int instrument = 0;
+static int instr_branch = 0;
+static int instr_seq = 0;
+static int reorder_active = 0;
+static Proc *reorder_last = NULL;
+static int reorder_sect = 0;
+
+typedef struct {
+    unsigned char level;
+    unsigned char next;
+    unsigned char is_br;
+    unsigned char thread;
+    int sect;
+    unsigned int addr;
+    unsigned int prev_addr;
+    int target;
+    int thread_disp;
+} RelaxState;
+
+static int relax_enabled = 0;
+static RelaxState *relax = NULL;
+static int relax_count = 0;
+static int relax_size = 0;
+static int relax_seq = 0;
+static int layout_gen = 0;
+static int eval_prev = 0;
+static unsigned int eval_pc = 0;
+static LocalDef *prev_local_defs = NULL;
+
+typedef struct {
+    unsigned char entry;
+    unsigned char exit;
+    unsigned char reads;
+    unsigned char sets;
+    unsigned char kind;
+    unsigned char apply;
+} PeepState;
+
+static int optimize = 0;
+static PeepState *peep = NULL;
+static int peep_count = 0;
+static int peep_size = 0;
+static int peep_seq = 0;
+static int peep_entry = 1;
+static int peep_rewrites = 0;
+static int peep_saved = 0;
+static int peep_cycles = 0;
+static char list_note[96];
+
 static int error = 0;
 static int to_second_pass = 0;
+static int exp_symbolic = 0;
 
 static int in_macro = 0;
 static Proc *in_proc = NULL;
@@ -364,6 +589,608 @@ static int lsb_enabled = 1;
 static int lsb_current = 1;
 static int lsb_next = 1;
 
+/*
+ * Diagnostics are formatted into a memory stream and written to stderr in
+ * one piece by diag_flush(), at exit or when a caller needs them out. A
+ * message above diag_level is dropped before it is formatted.
+ */
+enum {
+    DIAG_ERROR = 0,
+    DIAG_WARNING,
+    DIAG_INFO,          /* reports and summaries, shown by default */
+    DIAG_VERBOSE,       /* include files and other progress, -v */
+};
+
+static int diag_level = DIAG_INFO;
+static FILE *diag_out = NULL;
+static char *diag_buf = NULL;
+static size_t diag_len = 0;
+
+static void diag_flush(void)
+{
+    if (!diag_out) {
+        return;
+    }
+    fclose(diag_out);
+    diag_out = NULL;
+    if (diag_len) {
+        fwrite(diag_buf, 1, diag_len, stderr);
+        fflush(stderr);
+    }
+    free(diag_buf);
+    diag_buf = NULL;
+    diag_len = 0;
+}
+
+/* Returns the stream for a message of this level, or NULL when it is off. */
+static FILE *diag_file(int level)
+{
+    if (level > diag_level) {
+        return NULL;
+    }
+    if (!diag_out) {
+        diag_out = open_memstream(&diag_buf, &diag_len);
+        if (!diag_out) {
+            return stderr;
+        }
+    }
+    return diag_out;
+}
+
+static void diag(int level, const char *fmt, ...)
+{
+    FILE *out = diag_file(level);
+    if (out) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(out, fmt, ap);
+        va_end(ap);
+    }
+}
+
+/*
+ * Source files are opened through source_open(). A --server request can
+ * supply in-memory overrides, and the server keeps the files earlier
+ * requests read, checked against inode, size and the nanosecond mtime and
+ * ctime and shared by content hash, so its build children read them from
+ * memory.
+ */
+typedef struct SourceFile {
+    char *path;
+    char *data;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    uint64_t hash;
+    int override;
+    struct SourceFile *prev;
+} SourceFile;
+
+#define SOURCE_CACHE_MAX    (64 * 1024 * 1024)
+
+static SourceFile *source_files = NULL;
+static size_t source_cached = 0;
+
+/* Returns the absolute form of path, without ./ components, in a static buffer. */
+static const char *source_key(const char *path)
+{
+    static char key[1024];
+    size_t len = 0;
+
+    if (path[0] != '/') {
+        if (!getcwd(key, sizeof(key) - 2)) {
+            key[0] = 0;
+        }
+        len = strlen(key);
+        if (len && key[len - 1] != '/') {
+            key[len++] = '/';
+        }
+    }
+    for (const char *p = path; *p && len < sizeof(key) - 1; ) {
+        if (p[0] == '.' && p[1] == '/' && (p == path || p[-1] == '/')) {
+            p += 2;
+        } else if (p[0] == '/' && len && key[len - 1] == '/') {
+            p++;
+        } else {
+            key[len++] = *p++;
+        }
+    }
+    key[len] = 0;
+    return key;
+}
+
+static uint64_t source_hash(const char *data, size_t size)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static SourceFile *source_find(const char *path)
+{
+    const char *key = source_key(path);
+    for (SourceFile *f = source_files; f; f = f->prev) {
+        if (!strcmp(f->path, key)) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+static SourceFile *source_add(const char *path, char *data, size_t size, const struct stat *st)
+{
+    SourceFile *f = calloc(1, sizeof(SourceFile));
+    if (!f) {
+        free(data);
+        return NULL;
+    }
+    f->path = strdup(source_key(path));
+    f->size = size;
+    if (st) {
+        f->dev = st->st_dev;
+        f->ino = st->st_ino;
+        f->mtime = st->st_mtim;
+        f->ctime = st->st_ctim;
+    }
+    f->hash = source_hash(data, size);
+    f->override = !st;
+    f->data = data;
+    for (SourceFile *o = source_files; o; o = o->prev) {
+        if (o->hash == f->hash && o->size == size && !memcmp(o->data, data, size)) {
+            free(data);
+            f->data = o->data;
+            break;
+        }
+    }
+    if (f->data == data) {
+        source_cached += size;
+    }
+    f->prev = source_files;
+    source_files = f;
+    return f;
+}
+
+static int source_fresh(const SourceFile *f, const struct stat *st)
+{
+    return f->size == (size_t)st->st_size && f->dev == st->st_dev && f->ino == st->st_ino
+        && f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec == st->st_mtim.tv_nsec
+        && f->ctime.tv_sec == st->st_ctim.tv_sec && f->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/* Reads a file into the cache unless an up-to-date copy is there. */
+static void source_cache(const char *path)
+{
+    struct stat st;
+    SourceFile *f = source_find(path);
+    if (stat(path, &st) != 0 || (f && (f->override || source_fresh(f, &st)))) {
+        return;
+    }
+    if (source_cached + st.st_size > SOURCE_CACHE_MAX) {
+        return;
+    }
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        return;
+    }
+    char *data = malloc(st.st_size ? st.st_size : 1);
+    if (data && fread(data, 1, st.st_size, in) == (size_t)st.st_size) {
+        if (f) {
+            /* A stale entry stays behind its replacement; only its path changes. */
+            f->path[0] = 0;
+        }
+        source_add(path, data, st.st_size, &st);
+    } else {
+        free(data);
+    }
+    fclose(in);
+}
+
+static FILE *source_open(const char *path)
+{
+    SourceFile *f = source_find(path);
+    if (f && !f->override) {
+        struct stat st;
+        if (stat(path, &st) != 0 || !source_fresh(f, &st)) {
+            f = NULL;
+        }
+    }
+    if (f) {
+        return f->size ? fmemopen(f->data, f->size, "r") : fopen("/dev/null", "rb");
+    }
+    return fopen(path, "rb");
+}
+
+/*
+ * --cache <dir>: whole-build output cache. The key hashes the assembler
+ * build, the options, the main source and the option input files; an entry
+ * also lists every file the build included with the hash of its content and
+ * is only used while all of them still match.
+ */
+typedef struct CacheHash {
+    uint64_t a;
+    uint64_t b;
+} CacheHash;
+
+static char cache_key[33];      /* hex key while this build is cacheable */
+static FileName *cache_includes = NULL;     /* also used by --pch-out */
+
+static void cache_hash_init(CacheHash *h)
+{
+    h->a = 1469598103934665603ULL;
+    h->b = 0x6a09e667f3bcc908ULL;
+}
+
+/* Two independent 64-bit lanes (FNV-1a and a rotate-multiply mix). */
+static void cache_hash_update(CacheHash *h, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; i++) {
+        h->a = (h->a ^ p[i]) * 1099511628211ULL;
+        h->b = ((h->b << 5) | (h->b >> 59)) ^ p[i];
+        h->b *= 0x9e3779b97f4a7c15ULL;
+    }
+}
+
+static void cache_hash_str(CacheHash *h, const char *s)
+{
+    cache_hash_update(h, s, strlen(s) + 1);
+}
+
+/* Hashes the content of path as a build would read it; 0 if it can't be opened. */
+static int cache_hash_file(CacheHash *h, const char *path)
+{
+    char buf[8192];
+    size_t n;
+    FILE *f = source_open(path);
+    if (!f) {
+        return 0;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        cache_hash_update(h, buf, n);
+    }
+    fclose(f);
+    return 1;
+}
+
+static void cache_hash_hex(const CacheHash *h, char *hex)
+{
+    sprintf(hex, "%016llx%016llx", (unsigned long long)h->a, (unsigned long long)h->b);
+}
+
+static void cache_note(const char *path)
+{
+    const char *key = source_key(path);
+    for (FileName *f = cache_includes; f; f = f->prev) {
+        if (!strcmp(f->name, key)) {
+            return;
+        }
+    }
+    FileName *f = malloc(sizeof(FileName));
+    if (!f || !(f->name = strdup(key))) {
+        free(f);
+        cache_key[0] = 0;
+        return;
+    }
+    f->prev = cache_includes;
+    cache_includes = f;
+}
+
+/*
+ * -MD: make dependencies. The source, each file opened by INCLUDE in pass 1
+ * and the option input files are written as prerequisites of the output.
+ */
+static int dep_mode = 0;
+static int dep_phony = 0;       /* -MP: an empty rule for each included file */
+static FileName *dep_files = NULL;
+
+static void dep_note(const char *path)
+{
+    char name[1024];
+    size_t len = 0;
+
+    /* Drop ./ components, as in source_key. */
+    for (const char *p = path; *p && len < sizeof(name) - 1; ) {
+        if (p[0] == '.' && p[1] == '/' && (p == path || p[-1] == '/')) {
+            p += 2;
+        } else if (p[0] == '/' && len && name[len - 1] == '/') {
+            p++;
+        } else {
+            name[len++] = *p++;
+        }
+    }
+    name[len] = 0;
+    for (FileName *f = dep_files; f; f = f->prev) {
+        if (!strcmp(f->name, name)) {
+            return;
+        }
+    }
+    FileName *f = malloc(sizeof(FileName));
+    if (!f || !(f->name = strdup(name))) {
+        free(f);
+        return;
+    }
+    f->prev = dep_files;
+    dep_files = f;
+}
+
+/*
+ * --stats: wall and CPU time per pass and counters on the lookup paths.
+ * Each counter update sits behind a test of stats_mode, so a build without
+ * --stats pays one predictable branch per lookup.
+ */
+#define STATS_TEXT      1
+#define STATS_JSON      2
+#define STATS_PASSES    32
+
+typedef struct {
+    unsigned long long calls;
+    unsigned long long walked;      /* list entries or table rows compared */
+} StatsLookup;
+
+typedef struct {
+    const char *name;
+    double wall;
+    double cpu;
+    unsigned long lines;
+    unsigned long bytes;
+} StatsPass;
+
+static int stats_mode = 0;
+static StatsPass stats_passes[STATS_PASSES];
+static int stats_npasses = 0;
+static StatsLookup stats_find_label;
+static StatsLookup stats_find_opcode;
+static StatsLookup stats_find_macro;
+static StatsLookup stats_resolve_local;
+static unsigned long stats_lines = 0;
+static unsigned long stats_bytes = 0;
+static unsigned long stats_includes = 0;
+static double stats_start_wall = 0;
+static double stats_start_cpu = 0;
+static double stats_pass_wall = 0;
+static double stats_pass_cpu = 0;
+static unsigned long stats_pass_lines = 0;
+static unsigned long stats_pass_bytes = 0;
+
+#define STATS_ADD(var, n) do { if (stats_mode) { (var) += (n); } } while (0)
+#define STATS_LOOKUP(s, n) do { if (stats_mode) { (s).calls++; (s).walked += (n); } } while (0)
+
+static double stats_wall(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double stats_cpu(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stats_begin(void)
+{
+    if (stats_mode) {
+        stats_start_wall = stats_wall();
+        stats_start_cpu = stats_cpu();
+    }
+}
+
+static void stats_pass_begin(void)
+{
+    if (stats_mode) {
+        stats_pass_wall = stats_wall();
+        stats_pass_cpu = stats_cpu();
+        stats_pass_lines = stats_lines;
+        stats_pass_bytes = stats_bytes;
+    }
+}
+
+static void stats_pass_end(const char *name)
+{
+    if (!stats_mode || stats_npasses >= STATS_PASSES) {
+        return;
+    }
+    StatsPass *p = &stats_passes[stats_npasses++];
+    p->name = name;
+    p->wall = stats_wall() - stats_pass_wall;
+    p->cpu = stats_cpu() - stats_pass_cpu;
+    p->lines = stats_lines - stats_pass_lines;
+    p->bytes = stats_bytes - stats_pass_bytes;
+}
+
+static double stats_avg(const StatsLookup *s)
+{
+    return s->calls ? (double)s->walked / s->calls : 0.0;
+}
+
+static double stats_rate(unsigned long n, double secs)
+{
+    return (secs > 0) ? n / secs : 0.0;
+}
+
+static long stats_peak_kb(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) {
+        return 0;
+    }
+    return ru.ru_maxrss;
+}
+
+static void stats_json_str(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void stats_report(FILE *out)
+{
+    double wall = stats_wall() - stats_start_wall;
+    double cpu = stats_cpu() - stats_start_cpu;
+    unsigned long lines = 0;
+    const char *names[4] = { "find_label", "find_opcode", "find_macro", "resolve_local" };
+    const StatsLookup *lookups[4] = {
+        &stats_find_label, &stats_find_opcode, &stats_find_macro, &stats_resolve_local
+    };
+    int json = (stats_mode == STATS_JSON);
+
+    for (int i = 0; i < stats_npasses; i++) {
+        lines += stats_passes[i].lines;
+    }
+
+    if (json) {
+        fprintf(out, "{\"passes\": [");
+    } else {
+        fprintf(out, "Stats:\n  %-10s %10s %10s %8s %12s %8s\n",
+                "pass", "wall ms", "cpu ms", "lines", "lines/s", "bytes");
+    }
+    for (int i = 0; i < stats_npasses; i++) {
+        const StatsPass *p = &stats_passes[i];
+        if (json) {
+            fprintf(out, "%s{\"name\": ", i ? ", " : "");
+            stats_json_str(out, p->name);
+            fprintf(out, ", \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"lines\": %lu, "
+                    "\"lines_per_sec\": %.0f, \"bytes\": %lu}",
+                    p->wall * 1e3, p->cpu * 1e3, p->lines, stats_rate(p->lines, p->wall), p->bytes);
+        } else {
+            fprintf(out, "  %-10s %10.3f %10.3f %8lu %12.0f %8lu\n", p->name,
+                    p->wall * 1e3, p->cpu * 1e3, p->lines, stats_rate(p->lines, p->wall), p->bytes);
+        }
+    }
+    if (json) {
+        fprintf(out, "], \"total\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"lines\": %lu, "
+                "\"lines_per_sec\": %.0f}, \"lookups\": {",
+                wall * 1e3, cpu * 1e3, lines, stats_rate(lines, wall));
+    } else {
+        fprintf(out, "  %-10s %10.3f %10.3f %8lu %12.0f\n", "total",
+                wall * 1e3, cpu * 1e3, lines, stats_rate(lines, wall));
+        fprintf(out, "  %-14s %12s %10s\n", "lookup", "calls", "avg walk");
+    }
+    for (int i = 0; i < 4; i++) {
+        if (json) {
+            fprintf(out, "%s\"%s\": {\"calls\": %llu, \"avg_walk\": %.2f}",
+                    i ? ", " : "", names[i], lookups[i]->calls, stats_avg(lookups[i]));
+        } else {
+            fprintf(out, "  %-14s %12llu %10.2f\n", names[i], lookups[i]->calls, stats_avg(lookups[i]));
+        }
+    }
+    if (json) {
+        fprintf(out, "}, \"macros\": {");
+    } else {
+        fprintf(out, "  macro expansions:");
+    }
+    int n = 0;
+    for (Macro *mac = macros; mac; mac = mac->prev) {
+        if (!mac->expansions) {
+            continue;
+        }
+        if (json) {
+            fprintf(out, "%s", n ? ", " : "");
+            stats_json_str(out, mac->name);
+            fprintf(out, ": %lu", mac->expansions);
+        } else {
+            fprintf(out, "%s%s %lu", n ? ", " : " ", mac->name, mac->expansions);
+        }
+        n++;
+    }
+    if (json) {
+        fprintf(out, "}, \"include_opens\": %lu, \"peak_rss_kb\": %ld}\n",
+                stats_includes, stats_peak_kb());
+    } else {
+        fprintf(out, "%s\n  include opens: %lu\n  peak memory: %ld KB\n",
+                n ? "" : " none", stats_includes, stats_peak_kb());
+    }
+}
+
+/*
+ * --trace-json: begin/end events for passes, includes, macro expansions
+ * and output writing, kept in memory and written as a Chrome trace-event
+ * file when the program exits.
+ */
+typedef struct {
+    const char *cat;        /* pass, include, macro or output */
+    char *name;             /* include path or macro name, owned */
+    double ts;
+    char ph;                /* 'B' or 'E' */
+    int depth;              /* macro nesting */
+} TraceEvent;
+
+static const char *trace_path = NULL;
+static TraceEvent *trace_events = NULL;
+static int trace_count = 0;
+static int trace_size = 0;
+static double trace_start = 0;
+
+static void trace_add(char ph, const char *cat, const char *name, int depth)
+{
+    if (trace_count >= trace_size) {
+        int size = trace_size ? trace_size * 2 : 1024;
+        TraceEvent *tmp = realloc(trace_events, sizeof(TraceEvent) * size);
+        if (!tmp) {
+            return;
+        }
+        trace_events = tmp;
+        trace_size = size;
+    }
+    TraceEvent *e = &trace_events[trace_count++];
+    e->cat = cat;
+    e->name = (ph == 'B' && name) ? strdup(name) : NULL;
+    e->ts = stats_wall();
+    e->ph = ph;
+    e->depth = depth;
+}
+
+#define TRACE_BEGIN(cat, name, depth) do { if (trace_path) { trace_add('B', (cat), (name), (depth)); } } while (0)
+#define TRACE_END(cat) do { if (trace_path) { trace_add('E', (cat), NULL, 0); } } while (0)
+
+static void trace_flush(void)
+{
+    if (!trace_path) {
+        return;
+    }
+    FILE *out = fopen(trace_path, "wb");
+    if (!out) {
+        diag(DIAG_ERROR, "Can't create trace file: %s\n", trace_path);
+        return;
+    }
+    fprintf(out, "{\"traceEvents\": [\n");
+    for (int i = 0; i < trace_count; i++) {
+        TraceEvent *e = &trace_events[i];
+        fprintf(out, "{\"cat\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": 1",
+                e->cat, e->ph, (e->ts - trace_start) * 1e6);
+        if (e->ph == 'B') {
+            fprintf(out, ", \"name\": ");
+            stats_json_str(out, e->name ? e->name : e->cat);
+        }
+        if (e->depth) {
+            fprintf(out, ", \"args\": {\"depth\": %d}", e->depth);
+        }
+        fprintf(out, "}%s\n", (i + 1 < trace_count) ? "," : "");
+        free(e->name);
+    }
+    fprintf(out, "], \"displayTimeUnit\": \"ms\"}\n");
+    fclose(out);
+    free(trace_events);
+    trace_events = NULL;
+    trace_count = 0;
+}
+
 typedef struct {
     int enabled;
     int id;
@@ -448,7 +1275,7 @@ static int parse_local_label_token(const char *name, int *out_num, int *out_suff
     return 1;
 }
 
-static void add_local_def(int num, unsigned int address, int line)
+static void add_local_def(int num, unsigned int address, int reloc, int line)
 {
     LocalDef *n = malloc(sizeof(LocalDef));
     if (!n) {
@@ -458,47 +1285,190 @@ static void add_local_def(int num, unsigned int address, int line)
     n->lsb_id = lsb_current;
     n->number = num;
     n->address = address;
+    n->reloc = reloc;
+    n->sect = reloc ? cur_sect : 0;
     n->line = line;
+    n->seq = -1;
     n->prev = local_defs;
     local_defs = n;
 }
 
-static int resolve_local(int num, int dir, unsigned int pc, unsigned int *out_addr)
+static LocalDef *resolve_local(LocalDef *list, int num, int dir, unsigned int pc)
 {
-    int found = 0;
-    unsigned int best = 0;
-    for (LocalDef *d = local_defs; d; d = d->prev) {
+    LocalDef *best = NULL;
+    unsigned long walked = 0;
+    for (LocalDef *d = list; d; d = d->prev) {
+        walked++;
         if (d->lsb_id != lsb_current || d->number != num) {
             continue;
         }
         if (dir < 0) {
-            if (d->address < pc && (!found || d->address > best)) {
-                best = d->address;
-                found = 1;
+            if (d->address < pc && (!best || d->address > best->address)) {
+                best = d;
             }
         } else if (dir > 0) {
-            if (d->address > pc && (!found || d->address < best)) {
-                best = d->address;
-                found = 1;
+            if (d->address > pc && (!best || d->address < best->address)) {
+                best = d;
             }
         }
     }
-    if (found && out_addr) {
-        *out_addr = best;
-    }
-    return found;
+    STATS_LOOKUP(stats_resolve_local, walked);
+    return best;
 }
 
-#define MAX_OUTPUT (65536)
+static void reloc_begin(void)
+{
+    reloc_nterms = 0;
+    reloc_complex = 0;
+}
 
-#define SKIP_BLANK(s) { \
-    while (*(s) && isblank(*(s))) { \
-	(s)++; \
-    } \
+static void reloc_add(int sect, int sym, int sign)
+{
+    if (reloc_nterms < RELOC_TERMS_MAX) {
+        reloc_terms[reloc_nterms].sect = sect;
+        reloc_terms[reloc_nterms].sym = sym;
+        reloc_terms[reloc_nterms].sign = sign;
+        reloc_nterms++;
+    } else {
+        reloc_complex = 1;
+    }
 }
 
-#define SKIP_TOKEN(s) { \
-    if (isalpha(*(s)) || isdigit(*(s)) || *(s) == '_' || *(s) == ':' || *(s) == '.') { \
+static void reloc_negate(int from)
+{
+    for (int i = from; i < reloc_nterms; i++) {
+        reloc_terms[i].sign = -reloc_terms[i].sign;
+    }
+}
+
+static void reloc_check_plain(int from)
+{
+    if (reloc_nterms > from) {
+        reloc_complex = 1;
+    }
+}
+
+static void reloc_info_add(RelocInfo *ri, int sect, int weight)
+{
+    for (int i = 0; i < ri->nsect; i++) {
+        if (ri->sect[i] == sect) {
+            ri->weight[i] += weight;
+            return;
+        }
+    }
+    if (ri->nsect >= RELOC_SECT_MAX) {
+        ri->invalid = 1;
+        return;
+    }
+    ri->sect[ri->nsect] = sect;
+    ri->weight[ri->nsect] = weight;
+    ri->nsect++;
+}
+
+static int reloc_info_absolute(const RelocInfo *ri)
+{
+    if (ri->invalid || ri->sym >= 0) {
+        return 0;
+    }
+    for (int i = 0; i < ri->nsect; i++) {
+        if (ri->weight[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int reloc_info_total(const RelocInfo *ri)
+{
+    int total = 0;
+    for (int i = 0; i < ri->nsect; i++) {
+        total += ri->weight[i];
+    }
+    return total;
+}
+
+/*
+ * Needs no relocation record: absolute in object mode; with -reloc all
+ * sections move together, so only the sum of the section weights matters.
+ */
+static int reloc_info_fixed(const RelocInfo *ri)
+{
+    if (obj_mode) {
+        return reloc_info_absolute(ri);
+    }
+    return !ri->invalid && ri->sym < 0 && reloc_info_total(ri) == 0;
+}
+
+/* One plus term in a single section and nothing else: a plain address. */
+static int reloc_info_single(const RelocInfo *ri, int *out_sect)
+{
+    int found = 0;
+    if (ri->invalid || ri->sym >= 0) {
+        return 0;
+    }
+    for (int i = 0; i < ri->nsect; i++) {
+        if (ri->weight[i] == 0) {
+            continue;
+        }
+        if (ri->weight[i] != 1 || found) {
+            return 0;
+        }
+        *out_sect = ri->sect[i];
+        found = 1;
+    }
+    return found;
+}
+
+static void reloc_end(RelocInfo *ri)
+{
+    ri->invalid = reloc_complex;
+    ri->sym = -1;
+    ri->nsect = 0;
+    for (int i = 0; i < reloc_nterms; i++) {
+        RelocTerm *t = &reloc_terms[i];
+        if (t->sym >= 0) {
+            if (t->sign != 1 || ri->sym >= 0) {
+                ri->invalid = 1;
+            }
+            ri->sym = t->sym;
+        } else {
+            reloc_info_add(ri, t->sect, t->sign);
+        }
+    }
+}
+
+static void reloc_word(unsigned int addr, const RelocInfo *ri)
+{
+    if (!reloc_mode || src_pass != 2 || reloc_info_fixed(ri)) {
+        return;
+    }
+    if ((addr & 1) || (!obj_mode && reloc_info_total(ri) != 1) || ri->invalid) {
+        error = NOT_RELOCATABLE;
+        return;
+    }
+    if (relocs_count == relocs_size) {
+        int size = relocs_size ? relocs_size * 2 : 256;
+        RelocRec *tmp = realloc(relocs, sizeof(RelocRec) * size);
+        if (!tmp) {
+            error = NO_MEMORY_FOR_LABEL;
+            return;
+        }
+        relocs = tmp;
+        relocs_size = size;
+    }
+    relocs[relocs_count].addr = addr;
+    relocs[relocs_count].info = *ri;
+    relocs_count++;
+}
+
+#define SKIP_BLANK(s) { \
+    while (*(s) && isblank(*(s))) { \
+	(s)++; \
+    } \
+}
+
+#define SKIP_TOKEN(s) { \
+    if (isalpha(*(s)) || isdigit(*(s)) || *(s) == '_' || *(s) == ':' || *(s) == '.') { \
 	(s)++; \
 	while (*(s) && (isalnum(*(s)) || *(s) == '_' || *(s) == '$')) { \
 	    (s)++; \
@@ -522,171 +1492,834 @@ static int resolve_local(int num, int dir, unsigned int pc, unsigned int *out_ad
 
 #define LIST_WORD_SLOTS 3
 
-static void expand_tabs(const char *src, char *dst, size_t dst_size, int tabstop)
+/*
+ * Instruction timing estimates in CPU clock cycles: a base time per
+ * instruction class plus the cost of reaching each operand by addressing
+ * mode. Branches are counted as taken. The figures are approximations for
+ * comparing code, not cycle-exact emulation.
+ */
+enum {
+    TM_DOUBLE = 0,
+    TM_SINGLE,
+    TM_BRANCH,
+    TM_SOB,
+    TM_JMP,
+    TM_JSR,
+    TM_RTS,
+    TM_MARK,
+    TM_MUL,
+    TM_DIV,
+    TM_ASH,
+    TM_FIS,
+    TM_TRAP,
+    TM_RTI,
+    TM_CC,
+    TM_MISC,
+    TM_COUNT
+};
+
+typedef struct {
+    unsigned int cpu_mask;
+    const char *name;
+    unsigned int khz;
+    unsigned short base[TM_COUNT];
+    unsigned char src[8];
+    unsigned char dst[8];
+} CpuTiming;
+
+static const CpuTiming cpu_timings[] = {
+    /*                               DBL SGL  BR SOB JMP JSR RTS MRK MUL DIV ASH  FIS TRP RTI CC MISC */
+    { CPU_VM1,               "vm1",    3000,
+      { 12, 12, 16, 20, 16, 32, 32, 36,  0,  0,  0,   0, 68, 40, 12, 28 },
+      { 0, 12, 12, 24, 12, 24, 24, 36 }, { 0, 16, 16, 28, 16, 28, 28, 40 } },
+    { CPU_VM1G,              "vm1g",   4000,
+      { 12, 12, 16, 20, 16, 32, 32, 36, 120, 200, 48,  0, 68, 40, 12, 28 },
+      { 0, 12, 12, 24, 12, 24, 24, 36 }, { 0, 16, 16, 28, 16, 28, 28, 40 } },
+    { CPU_DEFAULT | CPU_VM2, "vm2",    8000,
+      {  8,  8,  8, 12, 12, 24, 20, 24,  64, 112, 24, 200, 56, 32,  8, 16 },
+      { 0,  8,  8, 16,  8, 16, 16, 24 }, { 0, 12, 12, 20, 12, 20, 20, 28 } },
+    { CPU_DCJ11,             "dcj-11", 18000,
+      {  4,  4,  4,  6,  4, 12,  8, 12,  24,  48, 10,  80, 28, 16,  4,  8 },
+      { 0,  4,  4,  8,  4,  8,  8, 12 }, { 0,  6,  6, 10,  6, 10, 10, 14 } },
+};
+
+static const CpuTiming *cpu_timing(void)
 {
-    size_t col = 0;
-    size_t i = 0;
-    if (dst_size == 0) {
-        return;
-    }
-    while (*src && i + 1 < dst_size) {
-        if (*src == '\t') {
-            int spaces = tabstop - (int)(col % (size_t)tabstop);
-            while (spaces-- > 0 && i + 1 < dst_size) {
-                dst[i++] = ' ';
-                col++;
-            }
-            src++;
-            continue;
+    for (size_t i = 0; i < sizeof(cpu_timings) / sizeof(cpu_timings[0]); i++) {
+        if (cpu_timings[i].cpu_mask & current_cpu) {
+            return &cpu_timings[i];
         }
-        dst[i++] = *src++;
-        col++;
     }
-    dst[i] = 0;
+    return &cpu_timings[0];
 }
 
-static void list_line_words(int line_no, unsigned int addr,
-                            const unsigned short *words, int nwords,
-                            const char *line)
+typedef struct {
+    int cls;
+    int src;    /* source mode and register, -1 if none */
+    int dst;    /* destination mode and register, -1 if none */
+} InsnShape;
+
+/* Sorts an instruction word into a timing class and its operand fields. */
+static void insn_decode(unsigned short w, InsnShape *s)
 {
-    if (!list_out) {
-        return;
-    }
-    char line_expanded[1024];
-    expand_tabs(line, line_expanded, sizeof(line_expanded), 8);
-    fprintf(list_out, "%4d %06o:", line_no, addr);
-    for (int i = 0; i < nwords; i++) {
-        fprintf(list_out, " %06o", words[i]);
-    }
-    for (int i = nwords; i < LIST_WORD_SLOTS; i++) {
-        fprintf(list_out, "       ");
+    int hi = (w >> 12) & 07;
+
+    s->cls = TM_MISC;
+    s->src = -1;
+    s->dst = -1;
+
+    if (hi != 0 && hi != 07) {
+        s->cls = TM_DOUBLE;
+        s->src = (w >> 6) & 077;
+        s->dst = w & 077;
+    } else if (w <= 0000007) {
+        if (w == 0000002 || w == 0000006) {
+            s->cls = TM_RTI;
+        } else if (w == 0000003 || w == 0000004) {
+            s->cls = TM_TRAP;
+        }
+    } else if ((w & 0177700) == 0000100) {
+        s->cls = TM_JMP;
+        s->dst = w & 077;
+    } else if ((w & 0177770) == 0000200) {
+        s->cls = TM_RTS;
+    } else if ((w & 0177740) == 0000240) {
+        s->cls = TM_CC;
+    } else if ((w & 0177700) == 0000300) {
+        s->cls = TM_SINGLE;
+        s->dst = w & 077;
+    } else if ((w & 0074000) == 0 && ((w & 0100000) || (w & 0003400))) {
+        /* 000400-003777 and 100000-103777 */
+        s->cls = TM_BRANCH;
+    } else if ((w & 0177000) == 0004000) {
+        s->cls = TM_JSR;
+        s->dst = w & 077;
+    } else if ((w & 0177700) == 0006400) {
+        s->cls = TM_MARK;
+    } else if ((w & 0077000) == 0005000 || (w & 0077000) == 0006000
+               || (w & 0177000) == 0007000) {
+        s->cls = TM_SINGLE;
+        s->dst = w & 077;
+    } else if ((w & 0177000) == 0070000) {
+        s->cls = TM_MUL;
+        s->src = w & 077;
+    } else if ((w & 0177000) == 0071000) {
+        s->cls = TM_DIV;
+        s->src = w & 077;
+    } else if ((w & 0176000) == 0072000) {
+        s->cls = TM_ASH;
+        s->src = w & 077;
+    } else if ((w & 0177000) == 0074000) {
+        s->cls = TM_DOUBLE;
+        s->dst = w & 077;
+    } else if ((w & 0177740) == 0075000) {
+        s->cls = TM_FIS;
+    } else if ((w & 0177000) == 0077000) {
+        s->cls = TM_SOB;
+    } else if ((w & 0177000) == 0104000) {
+        s->cls = TM_TRAP;
     }
-    fprintf(list_out, "  %s\n", line_expanded);
 }
 
-static int emit_byte(unsigned char b)
+static int operand_words(int spec)
 {
-    if (output_addr >= MAX_OUTPUT) {
-        error = OUTPUT_BUFFER_OVERFLOW;
-        return 0;
+    int mode = (spec >> 3) & 07;
+    return spec >= 0 && (mode >= 6 || ((spec & 07) == 7 && (mode == 2 || mode == 3)));
+}
+
+/* Number of words taken by the instruction starting with `word`. */
+static int insn_length(unsigned short word)
+{
+    InsnShape s;
+    insn_decode(word, &s);
+    return 1 + operand_words(s.src) + operand_words(s.dst);
+}
+
+/* Estimated cycles for the instruction `word` on the current CPU. */
+static int insn_cycles(unsigned short word)
+{
+    const CpuTiming *t = cpu_timing();
+    InsnShape s;
+    insn_decode(word, &s);
+    int cycles = t->base[s.cls];
+    if (s.src >= 0) {
+        cycles += t->src[(s.src >> 3) & 07];
     }
-    if (emit_is_fill) {
-        if (b == 0) {
-            if (tail_zero_start < 0) {
-                tail_zero_start = (int)output_addr;
-            }
-        } else {
-            tail_zero_start = -1;
-        }
-    } else {
-        tail_zero_start = -1;
+    if (s.dst >= 0) {
+        cycles += t->dst[(s.dst >> 3) & 07];
     }
-    output[output_addr++] = b;
-    return 1;
+    return cycles;
 }
 
-static int emit_word(unsigned short w)
+/*
+ * --cycles: pass 2 keeps one record per emitted instruction with the
+ * registers known to hold a MOV #n constant before it. A branch or SOB back
+ * to an instruction in the same PROC closes a loop; a SOB loop whose counter
+ * was loaded with a constant before the loop counts its body that many times.
+ */
+typedef struct {
+    unsigned int addr;
+    int sect;
+    Proc *proc;
+    unsigned short cycles;
+    unsigned char loop;     /* 1 for a branch, 2 for a SOB */
+    unsigned char reg;
+    unsigned int target;
+    unsigned char known;
+    unsigned short val[8];
+} CycleRec;
+
+static int cycles_enabled = 0;
+static CycleRec *cycle_recs = NULL;
+static int cycle_count = 0;
+static int cycle_size = 0;
+static unsigned char cycle_known = 0;
+static unsigned short cycle_val[8];
+static Proc *cycle_proc = NULL;
+static int list_cycles = -1;
+
+static unsigned short output_word(unsigned int addr)
 {
-    if (!emit_byte(w & 0xff)) {
-        return 0;
+    return (output[(addr + 1) & 0xFFFF] << 8) | output[addr & 0xFFFF];
+}
+
+/* Drops register constants an instruction may change. */
+static void cycles_clobber(const InsnShape *s, unsigned short w)
+{
+    int specs[2] = { s->src, s->dst };
+    for (int i = 0; i < 2; i++) {
+        int mode = (specs[i] >> 3) & 07;
+        if (specs[i] >= 0 && mode >= 2 && mode <= 5) {
+            cycle_known &= ~(1 << (specs[i] & 07));
+        }
     }
-    if (!emit_byte((w >> 8) & 0xff)) {
-        return 0;
+    if (s->dst >= 0 && (s->dst >> 3) == 0) {
+        cycle_known &= ~(1 << (s->dst & 07));
+    }
+    if (s->cls == TM_MUL || s->cls == TM_DIV || s->cls == TM_ASH) {
+        cycle_known &= ~(3 << ((w >> 6) & 06));
+    } else if (s->cls == TM_SOB) {
+        cycle_known &= ~(1 << ((w >> 6) & 07));
+    }
+    if (s->cls == TM_JSR || s->cls == TM_TRAP || s->cls == TM_MARK) {
+        cycle_known = 0;
     }
-    return 1;
 }
 
-static void remove_comment(char *str)
+/* Records the instructions emitted at addr..end; returns their cycles. */
+static int cycles_record(unsigned int addr, unsigned int end)
 {
-    int q = 0, dq = 0;
-    while (*str) {
-        if (*str == '\'') {
-            q = !q;
+    int total = 0;
+
+    if (in_proc != cycle_proc) {
+        cycle_proc = in_proc;
+        cycle_known = 0;
+    }
+    while (addr < end) {
+        unsigned short w = output_word(addr);
+        InsnShape s;
+        insn_decode(w, &s);
+        int len = 1 + operand_words(s.src) + operand_words(s.dst);
+        int cycles = insn_cycles(w);
+
+        if (cycle_count >= cycle_size) {
+            int size = cycle_size ? cycle_size * 2 : 256;
+            CycleRec *tmp = realloc(cycle_recs, sizeof(CycleRec) * size);
+            if (!tmp) {
+                return total;
+            }
+            cycle_recs = tmp;
+            cycle_size = size;
         }
-        if (*str == '"') {
-            dq = !dq;
+        CycleRec *rec = &cycle_recs[cycle_count++];
+        memset(rec, 0, sizeof(*rec));
+        rec->addr = addr;
+        rec->sect = cur_sect;
+        rec->proc = in_proc;
+        rec->cycles = cycles;
+        rec->known = cycle_known;
+        memcpy(rec->val, cycle_val, sizeof(cycle_val));
+        if (s.cls == TM_BRANCH) {
+            rec->loop = 1;
+            rec->target = addr + 2 + 2 * (signed char)(w & 0xFF);
+        } else if (s.cls == TM_SOB) {
+            rec->loop = 2;
+            rec->reg = (w >> 6) & 07;
+            rec->target = addr + 2 - 2 * (w & 077);
         }
 
-        if (*str == ';' && (q == 0 || dq == 0)) {
-            *str = 0;
-            break;
+        if ((w & 0177700) == 0012700 && (s.dst >> 3) == 0) {
+            cycle_known |= 1 << (w & 07);
+            cycle_val[w & 07] = output_word(addr + 2);
+        } else {
+            cycles_clobber(&s, w);
         }
 
-        if (*str == '/' && *(str + 1) && *(str + 1) == '/'
-                && (q == 0 || dq == 0)) {
-            *str = 0;
-            break;
-        }
-        str++;
+        total += cycles;
+        addr += len * 2;
     }
+    return total;
 }
 
-static int exp_(char **str);
-static int match(char **str, char c);
-
-static int symbol_eq(const char *a, const char *b)
+static void print_time(FILE *out, unsigned long long cycles, const CpuTiming *t)
 {
-    return case_sensitive_symbols ? (strcmp(a, b) == 0) : (strcasecmp(a, b) == 0);
+    fprintf(out, "%llu cycles, %.1f us", cycles, (double)cycles * 1000.0 / t->khz);
 }
 
-static Label* find_label(Label **list, char *name)
+/* Per-PROC totals and loops, each PROC in order of its first instruction. */
+typedef struct {
+    unsigned long long *mult;       /* times each record runs */
+    int *start;                     /* first record of the loop closed here */
+    unsigned int *times;            /* constant SOB count, 0 if unknown */
+    unsigned long long *body;       /* cycles of one iteration */
+} CycleLoops;
+
+static void cycles_loops_free(CycleLoops *lp)
 {
-    Label *ptr = *list;
+    free(lp->mult);
+    free(lp->start);
+    free(lp->times);
+    free(lp->body);
+}
 
-    while (ptr) {
-        if (symbol_eq(ptr->name, name)) {
-            return ptr;
+/* Finds the loops among records from..to-1; 0 when out of memory. */
+static int cycles_loops(CycleLoops *lp, int from, int to)
+{
+    int n = to ? to : 1;
+    lp->mult = calloc(n, sizeof(*lp->mult));
+    lp->start = calloc(n, sizeof(*lp->start));
+    lp->times = calloc(n, sizeof(*lp->times));
+    lp->body = calloc(n, sizeof(*lp->body));
+    if (!lp->mult || !lp->start || !lp->times || !lp->body) {
+        cycles_loops_free(lp);
+        return 0;
+    }
+    for (int i = from; i < to; i++) {
+        lp->mult[i] = 1;
+        lp->start[i] = -1;
+    }
+    for (int i = from; i < to; i++) {
+        CycleRec *rec = &cycle_recs[i];
+        if (!rec->loop || rec->target > rec->addr) {
+            continue;
+        }
+        int j = i;
+        while (j > from && cycle_recs[j - 1].addr >= rec->target
+                && cycle_recs[j - 1].addr < cycle_recs[j].addr
+                && cycle_recs[j - 1].proc == rec->proc && cycle_recs[j - 1].sect == rec->sect) {
+            j--;
+        }
+        if (cycle_recs[j].addr != rec->target) {
+            continue;
+        }
+        lp->start[i] = j;
+        for (int k = j; k <= i; k++) {
+            lp->body[i] += cycle_recs[k].cycles * lp->mult[k];
+        }
+        if (rec->loop == 2 && (cycle_recs[j].known & (1 << rec->reg))) {
+            unsigned int count = cycle_recs[j].val[rec->reg];
+            lp->times[i] = count ? count : 65536;
+            for (int k = j; k <= i; k++) {
+                lp->mult[k] *= lp->times[i];
+            }
         }
-        ptr = ptr->prev;
     }
-
-    return NULL;
+    return 1;
 }
 
-static Label* add_label(Label **list, char *name, unsigned int address,
-                        int line)
+static void cycles_summary(FILE *out)
 {
-    if (find_label(list, name)) {
-        error = LABEL_ALREADY_DEFINED;
-        return NULL;
-    }
+    const CpuTiming *t = cpu_timing();
+    CycleLoops lp;
 
-    Label *new = malloc(sizeof(Label));
-    if (!new) {
-        error = NO_MEMORY_FOR_LABEL;
-        return NULL;
-    }
-    new->name = strdup(name);
-    if (!new->name) {
-        free(new);
-        error = NO_MEMORY_FOR_LABEL;
-        return NULL;
+    if (!cycles_loops(&lp, 0, cycle_count)) {
+        return;
     }
-    new->address = address;
-    new->line = line;
-    new->prev = *list;
 
-    *list = new;
+    fprintf(out, "\nTiming (%s, %u kHz):\n", t->name, t->khz);
+    for (int i = 0; i < cycle_count; i++) {
+        Proc *proc = cycle_recs[i].proc;
+        int first = 1;
+        for (int k = 0; k < i; k++) {
+            if (cycle_recs[k].proc == proc) {
+                first = 0;
+                break;
+            }
+        }
+        if (!first) {
+            continue;
+        }
+        unsigned long long once = 0;
+        unsigned long long looped = 0;
+        for (int k = i; k < cycle_count; k++) {
+            if (cycle_recs[k].proc == proc) {
+                once += cycle_recs[k].cycles;
+                looped += cycle_recs[k].cycles * lp.mult[k];
+            }
+        }
+        fprintf(out, "[%s] ", proc ? proc->name : "(top level)");
+        print_time(out, once, t);
+        if (looped != once) {
+            fprintf(out, "; with loops ");
+            print_time(out, looped, t);
+        }
+        fprintf(out, "\n");
+        for (int k = i; k < cycle_count; k++) {
+            if (cycle_recs[k].proc != proc || lp.start[k] < 0) {
+                continue;
+            }
+            unsigned long long body = lp.body[k];
+            fprintf(out, "  loop %06o-%06o: ", cycle_recs[lp.start[k]].addr, cycle_recs[k].addr);
+            if (lp.times[k]) {
+                fprintf(out, "%llu cycles x %u = ", body, lp.times[k]);
+                print_time(out, body * lp.times[k], t);
+            } else {
+                print_time(out, body, t);
+                fprintf(out, " per iteration");
+            }
+            fprintf(out, "\n");
+        }
+    }
 
-    return new;
+    cycles_loops_free(&lp);
 }
 
-static void dump_labels(Label *list)
+/*
+ * --profile: a PC histogram from a simulator or a hardware sampler, either
+ * text lines "address [count]" (octal address, decimal count, one sample when
+ * the count is missing) or raw little-endian 16-bit PCs. Samples are mapped
+ * to instructions through the pass 2 records; the listing shows hits and
+ * percentages per line and ends with the hottest PROCs and loops.
+ */
+static uint32_t *profile_hits = NULL;
+static unsigned long long profile_total = 0;
+static int profile_top = 10;
+static long long list_hits = -1;
+
+static int profile_is_text(const unsigned char *buf, size_t len)
 {
-    FILE *out = list_out ? list_out : stderr;
-    while (list) {
-        fprintf(out, "[%s] %06o\n", list->name, list->address & 0xFFFF);
-        list = list->prev;
+    for (size_t i = 0; i < len; i++) {
+        if (!isprint(buf[i]) && !isspace(buf[i])) {
+            return 0;
+        }
     }
+    return 1;
 }
 
-static OpCode* find_opcode(char *name, int *is_byte)
+static void profile_add(unsigned long addr, unsigned long count)
 {
-    char tmp[64];
-    char *p = name;
+    uint32_t *slot = &profile_hits[(addr & 0xFFFF) >> 1];
+    *slot = (*slot + count < *slot) ? UINT32_MAX : *slot + count;
+    profile_total += count;
+}
 
-    if (*p == '.') {
-        p++;
+/* Returns 0 when the file can't be read or has a bad text line. */
+static int profile_load(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        diag(DIAG_ERROR, "Can't open profile: %s\n", path);
+        return 0;
+    }
+    profile_hits = calloc(32768, sizeof(*profile_hits));
+    if (!profile_hits) {
+        fclose(f);
+        return 0;
+    }
+
+    unsigned char head[512];
+    size_t len = fread(head, 1, sizeof(head), f);
+    rewind(f);
+
+    if (!profile_is_text(head, len)) {
+        unsigned char pc[2];
+        while (fread(pc, 1, 2, f) == 2) {
+            profile_add(pc[0] | (pc[1] << 8), 1);
+        }
+        fclose(f);
+        return 1;
+    }
+
+    char line[256];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line;
+        char *end;
+        line_no++;
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (!*p || *p == ';' || *p == '#') {
+            continue;
+        }
+        unsigned long addr = strtoul(p, &end, 8);
+        unsigned long count = 1;
+        if (end == p || addr > 0177777) {
+            diag(DIAG_ERROR, "%s:%d: bad profile address\n", path, line_no);
+            fclose(f);
+            return 0;
+        }
+        p = end;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (isdigit((unsigned char)*p)) {
+            count = strtoul(p, &end, 10);
+            p = end;
+        }
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (*p && *p != ';' && *p != '#') {
+            diag(DIAG_ERROR, "%s:%d: bad profile line\n", path, line_no);
+            fclose(f);
+            return 0;
+        }
+        profile_add(addr, count);
+    }
+    fclose(f);
+    return 1;
+}
+
+/* Samples that fall on any word of the instruction in record i. */
+static unsigned long long profile_rec_hits(int i)
+{
+    unsigned int addr = cycle_recs[i].addr;
+    int len = insn_length(output_word(addr));
+    unsigned long long hits = 0;
+    for (int k = 0; k < len; k++) {
+        hits += profile_hits[((addr + 2 * k) & 0xFFFF) >> 1];
+    }
+    return hits;
+}
+
+static double profile_percent(unsigned long long hits)
+{
+    return profile_total ? 100.0 * hits / profile_total : 0.0;
+}
+
+typedef struct {
+    const char *name;
+    unsigned int from;
+    unsigned int to;
+    unsigned long long hits;
+} ProfileEntry;
+
+static int profile_entry_cmp(const void *a, const void *b)
+{
+    const ProfileEntry *pa = a;
+    const ProfileEntry *pb = b;
+    if (pa->hits != pb->hits) {
+        return (pa->hits < pb->hits) ? 1 : -1;
+    }
+    return (pa->from > pb->from) - (pa->from < pb->from);
+}
+
+static void profile_summary(FILE *out)
+{
+    ProfileEntry *procs_hot = calloc(cycle_count + 1, sizeof(ProfileEntry));
+    ProfileEntry *loops_hot = calloc(cycle_count + 1, sizeof(ProfileEntry));
+    unsigned long long *hits = calloc(cycle_count + 1, sizeof(*hits));
+    unsigned long long mapped = 0;
+    int nprocs = 0;
+    int nloops = 0;
+    CycleLoops lp;
+
+    if (!procs_hot || !loops_hot || !hits || !cycles_loops(&lp, 0, cycle_count)) {
+        free(procs_hot);
+        free(loops_hot);
+        free(hits);
+        return;
+    }
+
+    for (int i = 0; i < cycle_count; i++) {
+        hits[i] = profile_rec_hits(i);
+        mapped += hits[i];
+    }
+    for (int i = 0; i < cycle_count; i++) {
+        const char *name = cycle_recs[i].proc ? cycle_recs[i].proc->name : "(top level)";
+        int k;
+        for (k = 0; k < nprocs && strcmp(procs_hot[k].name, name); k++) {
+        }
+        if (k == nprocs) {
+            procs_hot[nprocs].name = name;
+            procs_hot[nprocs].from = cycle_recs[i].addr;
+            nprocs++;
+        }
+        procs_hot[k].hits += hits[i];
+        if (lp.start[i] >= 0) {
+            ProfileEntry *e = &loops_hot[nloops++];
+            e->name = name;
+            e->from = cycle_recs[lp.start[i]].addr;
+            e->to = cycle_recs[i].addr;
+            for (int j = lp.start[i]; j <= i; j++) {
+                e->hits += hits[j];
+            }
+        }
+    }
+    qsort(procs_hot, nprocs, sizeof(ProfileEntry), profile_entry_cmp);
+    qsort(loops_hot, nloops, sizeof(ProfileEntry), profile_entry_cmp);
+
+    fprintf(out, "\nProfile: %llu samples, %llu outside the program\n",
+            profile_total, profile_total - mapped);
+    fprintf(out, "Hot PROCs:\n");
+    for (int i = 0; i < nprocs && i < profile_top && procs_hot[i].hits; i++) {
+        fprintf(out, "  [%s] %llu samples, %.1f%%\n", procs_hot[i].name,
+                procs_hot[i].hits, profile_percent(procs_hot[i].hits));
+    }
+    fprintf(out, "Hot loops:\n");
+    for (int i = 0; i < nloops && i < profile_top && loops_hot[i].hits; i++) {
+        fprintf(out, "  [%s] loop %06o-%06o: %llu samples, %.1f%%\n", loops_hot[i].name,
+                loops_hot[i].from, loops_hot[i].to, loops_hot[i].hits,
+                profile_percent(loops_hot[i].hits));
+    }
+
+    cycles_loops_free(&lp);
+    free(procs_hot);
+    free(loops_hot);
+    free(hits);
+}
+
+/* Column where the listing shows the source line. */
+static int list_source_column(void)
+{
+    return 14 + LIST_WORD_SLOTS * 7 + (cycles_enabled ? 6 : 0) + (profile_hits ? 17 : 0);
+}
+
+static void expand_tabs(const char *src, char *dst, size_t dst_size, int tabstop)
+{
+    size_t col = 0;
+    size_t i = 0;
+    if (dst_size == 0) {
+        return;
+    }
+    while (*src && i + 1 < dst_size) {
+        if (*src == '\t') {
+            int spaces = tabstop - (int)(col % (size_t)tabstop);
+            while (spaces-- > 0 && i + 1 < dst_size) {
+                dst[i++] = ' ';
+                col++;
+            }
+            src++;
+            continue;
+        }
+        dst[i++] = *src++;
+        col++;
+    }
+    dst[i] = 0;
+}
+
+static void list_line_words(int line_no, unsigned int addr,
+                            const unsigned short *words, int nwords,
+                            const char *line)
+{
+    if (!list_out) {
+        return;
+    }
+    char line_expanded[1024];
+    expand_tabs(line, line_expanded, sizeof(line_expanded), 8);
+    fprintf(list_out, "%4d %06o:", line_no, addr);
+    for (int i = 0; i < nwords; i++) {
+        fprintf(list_out, " %06o", words[i]);
+    }
+    for (int i = nwords; i < LIST_WORD_SLOTS; i++) {
+        fprintf(list_out, "       ");
+    }
+    if (cycles_enabled) {
+        if (list_cycles >= 0) {
+            fprintf(list_out, " %5d", list_cycles);
+        } else {
+            fprintf(list_out, "      ");
+        }
+        list_cycles = -1;
+    }
+    if (profile_hits) {
+        if (list_hits > 0) {
+            fprintf(list_out, " %9lld %5.1f%%", list_hits, profile_percent(list_hits));
+        } else {
+            fprintf(list_out, "                 ");
+        }
+        list_hits = -1;
+    }
+    fprintf(list_out, "  %s\n", line_expanded);
+}
+
+/* Pass 2: records the instructions at addr..end for the next listing line. */
+static void list_record(unsigned int addr, unsigned int end)
+{
+    int first = cycle_count;
+    int cycles = cycles_record(addr, end);
+    if (cycles_enabled) {
+        list_cycles = cycles;
+    }
+    if (profile_hits) {
+        list_hits = 0;
+        for (int i = first; i < cycle_count; i++) {
+            list_hits += profile_rec_hits(i);
+        }
+    }
+    if (lsp_out) {
+        fprintf(lsp_out, "L\t%s\t%d\t%o\t%d\t", in_file_name, src_line, addr, cycles);
+        for (unsigned int a = addr; a + 1 < end && a + 1 < MAX_OUTPUT; a += 2) {
+            fprintf(lsp_out, "%s%06o", (a == addr) ? "" : " ", output[a] | (output[a + 1] << 8));
+        }
+        fputc('\n', lsp_out);
+    }
+}
+
+static int emit_byte(unsigned char b)
+{
+    if (output_addr >= MAX_OUTPUT) {
+        error = OUTPUT_BUFFER_OVERFLOW;
+        return 0;
+    }
+    if (b && cur_section && (cur_section->attrs & SECT_BSS)) {
+        error = DATA_IN_BSS;
+        return 0;
+    }
+    if (src_pass == 1 && !gc_entry_seen) {
+        gc_entry_seen = 1;
+        gc_entry = in_proc;
+    }
+    if (emit_is_fill) {
+        if (b == 0) {
+            if (tail_zero_start < 0) {
+                tail_zero_start = (int)output_addr;
+            }
+        } else {
+            tail_zero_start = -1;
+        }
+    } else {
+        tail_zero_start = -1;
+    }
+    output[output_addr++] = b;
+    STATS_ADD(stats_bytes, 1);
+    return 1;
+}
+
+static int emit_word(unsigned short w)
+{
+    if (!emit_byte(w & 0xff)) {
+        return 0;
+    }
+    if (!emit_byte((w >> 8) & 0xff)) {
+        return 0;
+    }
+    return 1;
+}
+
+static void remove_comment(char *str)
+{
+    int q = 0, dq = 0;
+    while (*str) {
+        if (*str == '\'') {
+            q = !q;
+        }
+        if (*str == '"') {
+            dq = !dq;
+        }
+
+        if (*str == ';' && (q == 0 || dq == 0)) {
+            *str = 0;
+            break;
+        }
+
+        if (*str == '/' && *(str + 1) && *(str + 1) == '/'
+                && (q == 0 || dq == 0)) {
+            *str = 0;
+            break;
+        }
+        str++;
+    }
+}
+
+static int exp_(char **str);
+static int match(char **str, char c);
+static int is_ident_start(int c);
+
+static int symbol_eq(const char *a, const char *b)
+{
+    return case_sensitive_symbols ? (strcmp(a, b) == 0) : (strcasecmp(a, b) == 0);
+}
+
+static Label* find_label(Label **list, char *name)
+{
+    Label *ptr = *list;
+    unsigned long walked = 0;
+
+    while (ptr) {
+        walked++;
+        if (symbol_eq(ptr->name, name)) {
+            STATS_LOOKUP(stats_find_label, walked);
+            return ptr;
+        }
+        ptr = ptr->prev;
+    }
+
+    STATS_LOOKUP(stats_find_label, walked);
+    return NULL;
+}
+
+static Label* add_label(Label **list, char *name, unsigned int address,
+                        int reloc, int line)
+{
+    Label *old = find_label(list, name);
+    if (old && layout_pass) {
+        if (old->stamp != layout_gen) {
+            old->prev_address = old->address;
+            old->stamp = layout_gen;
+        }
+        old->address = address;
+        old->reloc = reloc;
+        old->sect = reloc ? cur_sect : 0;
+        return old;
+    }
+    if (old) {
+        error = LABEL_ALREADY_DEFINED;
+        return NULL;
+    }
+
+    Label *new = malloc(sizeof(Label));
+    if (!new) {
+        error = NO_MEMORY_FOR_LABEL;
+        return NULL;
+    }
+    new->name = strdup(name);
+    if (!new->name) {
+        free(new);
+        error = NO_MEMORY_FOR_LABEL;
+        return NULL;
+    }
+    new->address = address;
+    new->prev_address = address;
+    new->stamp = layout_gen;
+    new->reloc = reloc;
+    new->sect = reloc ? cur_sect : 0;
+    new->line = line;
+    new->file = in_file_name;
+    new->prev = *list;
+
+    *list = new;
+
+    return new;
+}
+
+static void dump_labels(Label *list)
+{
+    FILE *out = list_out ? list_out : stderr;
+    while (list) {
+        fprintf(out, "[%s] %06o\n", list->name, list->address & 0xFFFF);
+        list = list->prev;
+    }
+}
+
+static OpCode* find_opcode(char *name, int *is_byte)
+{
+    char tmp[64];
+    char *p = name;
+
+    if (*p == '.') {
+        p++;
     }
 
     strncpy(tmp, p, sizeof(tmp) - 1);
@@ -696,6 +2329,7 @@ static OpCode* find_opcode(char *name, int *is_byte)
 
     for (int i = 0; i < sizeof(opcode_table) / sizeof(OpCode); i++) {
         if (!strcasecmp(tmp, opcode_table[i].name)) {
+            STATS_LOOKUP(stats_find_opcode, i + 1);
             return &opcode_table[i];
         }
     }
@@ -705,6 +2339,7 @@ static OpCode* find_opcode(char *name, int *is_byte)
         tmp[len - 1] = 0;
         for (int i = 0; i < sizeof(opcode_table) / sizeof(OpCode); i++) {
             if (!strcasecmp(tmp, opcode_table[i].name)) {
+                STATS_LOOKUP(stats_find_opcode, sizeof(opcode_table) / sizeof(OpCode) + i + 1);
                 if (!opcode_table[i].allow_byte) {
                     return NULL;
                 }
@@ -712,8 +2347,11 @@ static OpCode* find_opcode(char *name, int *is_byte)
                 return &opcode_table[i];
             }
         }
+        STATS_LOOKUP(stats_find_opcode, 2 * (sizeof(opcode_table) / sizeof(OpCode)));
+        return NULL;
     }
 
+    STATS_LOOKUP(stats_find_opcode, sizeof(opcode_table) / sizeof(OpCode));
     return NULL;
 }
 
@@ -791,12 +2429,16 @@ static int is_skipping(void)
 static Macro* find_macro(char *name)
 {
     Macro *tmp = macros;
+    unsigned long walked = 0;
     while (tmp) {
+        walked++;
         if (symbol_eq(tmp->name, name)) {
+            STATS_LOOKUP(stats_find_macro, walked);
             return tmp;
         }
         tmp = tmp->prev;
     }
+    STATS_LOOKUP(stats_find_macro, walked);
     return NULL;
 }
 
@@ -804,8 +2446,9 @@ static int add_macro(FILE *inf, char *name, char *params)
 {
     char str[512];
     Macro *mac;
+    int define = (src_pass == 1 && !layout_pass);
 
-    if (src_pass == 1) {
+    if (define) {
         if (find_macro(name)) {
             error = MACRO_ALREADY_DEFINED;
             return 1;
@@ -826,6 +2469,7 @@ static int add_macro(FILE *inf, char *name, char *params)
         mac->line = NULL;
         mac->lines = 0;
         mac->args = 0;
+        mac->expansions = 0;
         for (int i = 0; i < 10; i++) {
             mac->arg_name[i] = NULL;
         }
@@ -876,7 +2520,7 @@ static int add_macro(FILE *inf, char *name, char *params)
             break;
         }
 
-        if (src_pass == 1) {
+        if (define) {
             char **new_line = realloc(mac->line, sizeof(char*) * (mac->lines + 1));
             if (!new_line) {
                 error = NO_MEMORY_FOR_MACRO;
@@ -902,7 +2546,7 @@ static int add_macro(FILE *inf, char *name, char *params)
 
     src_line += 2;
 
-    if (src_pass == 1) {
+    if (define) {
         macros = mac;
     }
 
@@ -945,6 +2589,17 @@ static Proc* add_proc(Proc **list, char *name, int line)
     new->globals = NULL;
     new->equs = NULL;
     new->line = line;
+    new->start = 0;
+    new->size = 0;
+    new->live = 0;
+    new->keep = 0;
+    new->run_prev = NULL;
+    new->run_head = NULL;
+    new->slot = 0;
+    new->run_base = 0;
+    new->run_size = 0;
+    new->heat = 0;
+    new->instr_save = 0;
     new->prev = *list;
 
     *list = new;
@@ -952,1218 +2607,3686 @@ static Proc* add_proc(Proc **list, char *name, int line)
     return new;
 }
 
-static int match(char **str, char c)
-{
-    SKIP_BLANK(*str);
+/*
+ * Precompiled headers. --pch-out <file> assembles a header that only
+ * defines macros, equates and GLOBAL/KEEP names and saves that state with
+ * the CPU and LSB settings it leaves. --pch-in <file> maps the saved state
+ * once; an INCLUDE of the same header then applies it instead of reading
+ * the file, defining the macros and names in pass 1 and the equates in
+ * pass 2 as the include would. The header and the files it included are
+ * checked against their hashes on load. The symbols its IF/IFDEF/IFNDEF
+ * lines tested are saved with what each pass saw; an INCLUDE where one of
+ * them reads differently is assembled from the file instead.
+ */
+#define PCH_MAGIC   "microasm11 pch 2"
 
-    if (*(*str) != c) {
-        return 0;
-    }
+typedef struct PchCond {
+    char *name;
+    int pass;                   /* 1 or 2 */
+    int defined;
+    unsigned int value;
+} PchCond;
 
-    (*str)++;
-    return 1;
+typedef struct PchEqu {
+    char *name;
+    unsigned int value;
+    int line;
+    const char *file;
+} PchEqu;
+
+typedef struct Pch {
+    char *data;
+    size_t size;
+    const char *path;
+    const char *header;         /* source_key of the header */
+    int cpu;                    /* CPU selected by the header, or -1 */
+    int lsb_enabled;
+    int lsb_delta;              /* LSB blocks the header started */
+    int lsb_offset;             /* current block from the last one, or -1 */
+    PchEqu *equs;
+    int nequs;
+    Macro *macros;              /* in definition order */
+    int nmacros;
+    char **names;               /* GLOBAL names, then KEEP names */
+    int nglobals;
+    int nkeeps;
+    const char **files;         /* the header and its includes */
+    int nfiles;
+    PchCond *conds;
+    int nconds;
+    int warned;
+} Pch;
+
+static Pch *pch = NULL;
+static const char *pch_out_path = NULL;
+static PchCond *pch_conds = NULL;   /* symbols tested while building --pch-out */
+static int pch_nconds = 0;
+static int cpu_directive = 0;   /* a CPU directive was seen */
+
+/* Whether `name` is defined where a conditional stands, and its value. */
+static int pch_symbol(char *name, unsigned int *value)
+{
+    Label *l = find_label(&equs, name);
+    if (!l) {
+        l = find_label(&labels, name);
+    }
+    if (!l && in_proc) {
+        l = find_label(&in_proc->labels, name);
+        if (!l) {
+            l = find_label(&in_proc->equs, name);
+        }
+        if (!l) {
+            l = find_label(&in_proc->globals, name);
+        }
+    }
+    *value = l ? (l->address & 0xFFFF) : 0;
+    return l != NULL;
 }
 
-static int exp2_(char **str);
+/* Records, for --pch-out, a symbol a conditional tests in this pass. */
+static void pch_note_cond(char *name)
+{
+    int pass = (src_pass == 2) ? 2 : 1;
 
-static int toint(char c)
+    if (!pch_out_path || layout_pass) {
+        return;
+    }
+    for (int i = 0; i < pch_nconds; i++) {
+        if (pch_conds[i].pass == pass && symbol_eq(pch_conds[i].name, name)) {
+            return;
+        }
+    }
+    PchCond *tmp = realloc(pch_conds, sizeof(PchCond) * (pch_nconds + 1));
+    if (!tmp || !(tmp[pch_nconds].name = strdup(name))) {
+        if (tmp) {
+            pch_conds = tmp;
+        }
+        error = NO_MEMORY_FOR_LABEL;
+        return;
+    }
+    pch_conds = tmp;
+    pch_conds[pch_nconds].pass = pass;
+    pch_conds[pch_nconds].defined = pch_symbol(name, &pch_conds[pch_nconds].value);
+    pch_nconds++;
+}
+
+/* Records each symbol of an IF expression, skipping numbers and local labels. */
+static void pch_note_expr(const char *p)
 {
-    if (isdigit(c)) {
-        return (c - '0');
-    } else if (isxdigit(c)) {
-        if (isupper(c)) {
-            return (c - 'A' + 10);
+    char name[256];
+
+    while (*p) {
+        if (isalpha((unsigned char)*p) || *p == '_' || *p == '.' || *p == '$') {
+            size_t n = 0;
+            while (isalnum((unsigned char)*p) || *p == '_' || *p == '.' || *p == '$') {
+                if (n < sizeof(name) - 1) {
+                    name[n++] = *p;
+                }
+                p++;
+            }
+            name[n] = 0;
+            pch_note_cond(name);
+        } else if (isdigit((unsigned char)*p)) {
+            while (isalnum((unsigned char)*p) || *p == '$' || *p == '.') {
+                p++;
+            }
         } else {
-            return (c - 'a' + 10);
+            p++;
         }
-    } else {
-        error = INVALID_NUMBER;
-        return 0;
     }
 }
 
-static int hexnum(char **str)
+/*
+ * Whether the symbols the header's conditionals tested read as they did in
+ * the same pass of the --pch-out build; warns the first time they do not.
+ */
+static int pch_usable(void)
 {
-    int n = 0;
-    if (!isxdigit(*(*str))) {
-        error = INVALID_HEX_NUMBER;
-        return 0;
-    }
-    while (isxdigit(*(*str))) {
-        n = n * 16 + toint(*(*str)++);
+    int pass = (src_pass == 2) ? 2 : 1;
+
+    for (int i = 0; i < pch->nconds; i++) {
+        PchCond *c = &pch->conds[i];
+        unsigned int value;
+        if (c->pass != pass) {
+            continue;
+        }
+        int defined = pch_symbol(c->name, &value);
+        if (defined != c->defined || (defined && value != c->value)) {
+            if (!pch->warned) {
+                diag(DIAG_WARNING, "PCH %s was built with %s %s, %s is included instead\n", pch->path, c->name,
+                     c->defined ? "defined" : "undefined", pch->header);
+                pch->warned = 1;
+            }
+            return 0;
+        }
     }
-    return n;
+    return 1;
 }
 
-static int binary(char **str)
+/* Defines the header's state where the INCLUDE of it stands. */
+static int pch_apply(void)
 {
-    int n = 0;
-    if (*(*str) != '0' && *(*str) != '1') {
-        error = INVALID_BINARY_NUMBER;
-        return 0;
+    if (src_pass == 1 && !layout_pass) {
+        for (int i = 0; i < pch->nmacros; i++) {
+            if (find_macro(pch->macros[i].name)) {
+                error = MACRO_ALREADY_DEFINED;
+                return 1;
+            }
+            pch->macros[i].prev = macros;
+            macros = &pch->macros[i];
+        }
+        for (int i = 0; i < pch->nglobals + pch->nkeeps; i++) {
+            Label **list = (i < pch->nglobals) ? &exports : &keeps;
+            if (!find_label(list, pch->names[i])) {
+                add_label(list, pch->names[i], 0, 0, src_line);
+            }
+        }
+        for (int i = 0; i < pch->nfiles; i++) {
+            if (watch_fd >= 0) {
+                dprintf(watch_fd, "%s\n", pch->files[i]);
+            }
+            if (cache_key[0]) {
+                cache_note(pch->files[i]);
+            }
+            if (dep_mode) {
+                dep_note(pch->files[i]);
+            }
+        }
     }
-    while (*(*str) == '0' || *(*str) == '1') {
-        n = n * 2 + *(*str)++ - '0';
+    if (pch->cpu >= 0) {
+        current_cpu = pch->cpu;
     }
-    return n;
+    lsb_enabled = pch->lsb_enabled;
+    lsb_next += pch->lsb_delta;
+    if (pch->lsb_offset >= 0) {
+        lsb_current = lsb_next - pch->lsb_offset;
+    }
+    if (src_pass == 2 && !equs && pch->nequs) {
+        /* Nothing to clash with: link the equates in one block. */
+        Label *block = calloc(pch->nequs, sizeof(Label));
+        if (!block) {
+            error = NO_MEMORY_FOR_LABEL;
+            return 1;
+        }
+        for (int i = 0; i < pch->nequs; i++) {
+            block[i].name = pch->equs[i].name;
+            block[i].address = block[i].prev_address = pch->equs[i].value;
+            block[i].stamp = layout_gen;
+            block[i].line = pch->equs[i].line;
+            block[i].file = pch->equs[i].file;
+            block[i].prev = equs;
+            equs = &block[i];
+        }
+    } else if (src_pass == 2) {
+        const char *name = in_file_name;
+        for (int i = 0; i < pch->nequs; i++) {
+            in_file_name = pch->equs[i].file;
+            Label *equ = add_label(&equs, pch->equs[i].name, pch->equs[i].value, 0, pch->equs[i].line);
+            if (!equ) {
+                in_file_name = name;
+                return 1;
+            }
+        }
+        in_file_name = name;
+    }
+    return 0;
 }
 
-static int decimal_with_dot(char **str)
+static int pch_file_index(const char **files, int nfiles, const char *name)
 {
-    int n = 0;
-    if (!isdigit(*(*str))) {
-        error = INVALID_DECIMAL_NUMBER;
-        return 0;
-    }
-    while (isdigit(*(*str))) {
-        n = n * 10 + *(*str)++ - '0';
+    const char *key = source_key(name ? name : "");
+    for (int i = 0; i < nfiles; i++) {
+        if (!strcmp(files[i], key)) {
+            return i;
+        }
     }
-    if (*(*str) == '.') {
-        (*str)++;
-        return n;
+    return 0;
+}
+
+static void pch_write_labels(FILE *out, const char *tag, Label *l)
+{
+    if (l) {
+        pch_write_labels(out, tag, l->prev);
+        fprintf(out, "%s %s\n", tag, l->name);
     }
-    return n;
 }
 
-static int octal_default(char **str)
+/* Saves the state the header left; 0 after reporting an error. */
+static int pch_write(const char *path, const char *header)
 {
-    int n = 0;
-    if (*(*str) < '0' || *(*str) > '7') {
-        error = INVALID_OCTAL_NUMBER;
+    const char *files[256];
+    int nfiles = 0;
+    int nmacros = 0;
+    int nequs = 0;
+
+    if (labels || procs || sections || output_addr != start_addr) {
+        diag(DIAG_ERROR, "%s: a precompiled header may only define macros, equates and GLOBAL/KEEP names\n", header);
         return 0;
     }
-    while (*(*str) >= '0' && *(*str) <= '7') {
-        n = n * 8 + *(*str)++ - '0';
+    files[nfiles++] = file_intern(source_key(header));
+    for (FileName *f = cache_includes; f && nfiles < 256; f = f->prev) {
+        files[nfiles++] = f->name;
+    }
+    for (Macro *m = macros; m; m = m->prev) {
+        nmacros++;
+    }
+    for (Label *l = equs; l; l = l->prev) {
+        if (l->reloc) {
+            diag(DIAG_ERROR, "%s: relocatable equate %s in a precompiled header\n", header, l->name);
+            return 0;
+        }
+        nequs++;
+    }
+    Macro **mlist = malloc((nmacros + 1) * sizeof(Macro *));
+    Label **elist = malloc((nequs + 1) * sizeof(Label *));
+    FILE *out = fopen(path, "wb");
+    if (!mlist || !elist || !out) {
+        diag(DIAG_ERROR, "Can't create precompiled header %s\n", path);
+        free(mlist);
+        free(elist);
+        if (out) {
+            fclose(out);
+        }
+        return 0;
+    }
+    nmacros = nequs = 0;
+    for (Macro *m = macros; m; m = m->prev) {
+        mlist[nmacros++] = m;
+    }
+    for (Label *l = equs; l; l = l->prev) {
+        elist[nequs++] = l;
     }
-    return n;
-}
 
-static int number(char **str)
-{
-    if (*(*str) == '0' && (*(*str + 1) == 'd' || *(*str + 1) == 'D')) {
-        *str += 2;
-        return decimal_with_dot(str);
+    fprintf(out, "%s\n", PCH_MAGIC);
+    fprintf(out, "header %s\n", files[0]);
+    for (int i = 0; i < nfiles; i++) {
+        CacheHash h;
+        char hex[33];
+        cache_hash_init(&h);
+        cache_hash_file(&h, files[i]);
+        cache_hash_hex(&h, hex);
+        fprintf(out, "file %s %s\n", hex, files[i]);
     }
-    if (*(*str) == '0' && (*(*str + 1) == 'x' || *(*str + 1) == 'X')) {
-        *str += 2;
-        return hexnum(str);
+    fprintf(out, "case %d\n", case_sensitive_symbols);
+    fprintf(out, "cpu %d\n", cpu_directive ? (int)current_cpu : -1);
+    fprintf(out, "lsb %d %d %d\n", lsb_enabled, lsb_next - 1, (lsb_current == 1) ? -1 : lsb_next - lsb_current);
+    for (int i = nequs - 1; i >= 0; i--) {
+        fprintf(out, "equ %o %d %d %s\n", elist[i]->address & 0xFFFF, elist[i]->line,
+                pch_file_index(files, nfiles, elist[i]->file), elist[i]->name);
     }
-    if (*(*str) == '0' && (*(*str + 1) == 'b' || *(*str + 1) == 'B')) {
-        *str += 2;
-        return binary(str);
+    pch_write_labels(out, "global", exports);
+    pch_write_labels(out, "keep", keeps);
+    for (int i = 0; i < pch_nconds; i++) {
+        fprintf(out, "cond %d %d %o %s\n", pch_conds[i].pass, pch_conds[i].defined,
+                pch_conds[i].value, pch_conds[i].name);
     }
-    return octal_default(str);
+    for (int i = nmacros - 1; i >= 0; i--) {
+        Macro *m = mlist[i];
+        fprintf(out, "macro %s %d %d", m->name, m->lines, m->args);
+        for (int k = 0; k < m->args; k++) {
+            fprintf(out, " %s", m->arg_name[k]);
+        }
+        fputc('\n', out);
+        for (int k = 0; k < m->lines; k++) {
+            fprintf(out, "%s\n", m->line[k]);
+        }
+    }
+    fprintf(out, "end\n");
+    free(mlist);
+    free(elist);
+    if (fclose(out) != 0) {
+        diag(DIAG_ERROR, "Can't write precompiled header %s\n", path);
+        return 0;
+    }
+    diag(DIAG_INFO, "PCH: %d macros, %d equates from %s\n", nmacros, nequs, header);
+    return 1;
 }
 
-static int character(char **str)
+/* Splits the next line off *p in place. */
+static char *pch_line(char **p, char *end)
 {
-    char c;
-
-    c = *(*str)++;
-    if (*(*str) == '\'') {
-        (*str)++;
+    char *line = *p;
+    if (line >= end) {
+        return NULL;
     }
-    return c;
+    char *nl = memchr(line, '\n', end - line);
+    if (!nl) {
+        return NULL;
+    }
+    *nl = 0;
+    *p = nl + 1;
+    return line;
 }
 
-static int operand(char **str)
+/* Splits off the next space-separated word of a line. */
+static char *pch_word(char **p)
 {
-    char *ptr = *str;
-    char tmp[256];
-    char *ptr1 = tmp;
+    char *word = *p;
+    char *sp = strchr(word, ' ');
+    if (sp) {
+        *sp = 0;
+        *p = sp + 1;
+    } else {
+        *p = word + strlen(word);
+    }
+    return word;
+}
 
-    while (*ptr && (isalnum(*ptr) || *ptr == '_' || *ptr == ':' || *ptr == '.' || *ptr == '$')) {
-        if (ptr1 - tmp >= 255) {
-            error = SYNTAX_ERROR;
-            return 0;
+#define PCH_GROW(ptr, n) \
+    do { \
+        void *grown = realloc((ptr), ((n) + 1) * sizeof(*(ptr))); \
+        if (!grown) { \
+            goto bad; \
+        } \
+        (ptr) = grown; \
+    } while (0)
+
+/*
+ * Maps a precompiled header. Returns 0 after an error; an out of date one
+ * is dropped with a warning, so the header is included normally.
+ */
+static int pch_load(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    Pch *p = calloc(1, sizeof(Pch));
+
+    if (fd < 0 || !p || fstat(fd, &st) != 0 || st.st_size == 0) {
+        diag(DIAG_ERROR, "Can't read precompiled header %s\n", path);
+        if (fd >= 0) {
+            close(fd);
         }
-        *ptr1++ = *ptr++;
+        free(p);
+        return 0;
     }
-    *ptr1 = 0;
-
-    int local_num = 0;
-    int local_suffix = 0;
-    int local_parse = parse_local_label_token(tmp, &local_num, &local_suffix);
-    if (local_parse < 0) {
-        error = SYNTAX_ERROR;
+    p->size = st.st_size;
+    p->path = path;
+    p->data = mmap(NULL, p->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p->data == MAP_FAILED) {
+        diag(DIAG_ERROR, "Can't map precompiled header %s\n", path);
+        free(p);
         return 0;
     }
 
-    if (local_parse > 0 && lsb_enabled) {
-        int dir = (local_suffix == 'f') ? 1 : -1;
-        if (local_suffix == 0) {
-            dir = -1;
-        }
-        if (src_pass == 2) {
-            unsigned int addr = 0;
-            if (!resolve_local(local_num, dir, output_addr, &addr)) {
-                error = SYNTAX_ERROR;
-                return 0;
+    char *pos = p->data;
+    char *end = p->data + p->size;
+    char *line = pch_line(&pos, end);
+    int stale = 0;
+
+    p->cpu = -1;
+    p->lsb_enabled = 1;
+    p->lsb_offset = -1;
+    if (!line || strcmp(line, PCH_MAGIC)) {
+        goto bad;
+    }
+    while ((line = pch_line(&pos, end))) {
+        char *tag = pch_word(&line);
+        if (!strcmp(tag, "end")) {
+            break;
+        } else if (!strcmp(tag, "header")) {
+            p->header = line;
+        } else if (!strcmp(tag, "file")) {
+            CacheHash h;
+            char hex[33];
+            char *want = pch_word(&line);
+            cache_hash_init(&h);
+            if (!cache_hash_file(&h, line)) {
+                stale = 1;
+            }
+            cache_hash_hex(&h, hex);
+            stale |= strcmp(hex, want) != 0;
+            PCH_GROW(p->files, p->nfiles);
+            p->files[p->nfiles++] = line;
+        } else if (!strcmp(tag, "case")) {
+            stale |= atoi(line) != case_sensitive_symbols;
+        } else if (!strcmp(tag, "cpu")) {
+            p->cpu = atoi(line);
+        } else if (!strcmp(tag, "lsb")) {
+            if (sscanf(line, "%d %d %d", &p->lsb_enabled, &p->lsb_delta, &p->lsb_offset) != 3) {
+                goto bad;
+            }
+        } else if (!strcmp(tag, "equ")) {
+            PchEqu *e;
+            int file;
+            PCH_GROW(p->equs, p->nequs);
+            e = &p->equs[p->nequs++];
+            e->value = strtoul(pch_word(&line), NULL, 8);
+            e->line = atoi(pch_word(&line));
+            file = atoi(pch_word(&line));
+            e->file = (file >= 0 && file < p->nfiles) ? p->files[file] : p->header;
+            e->name = line;
+        } else if (!strcmp(tag, "global") || !strcmp(tag, "keep")) {
+            if (tag[0] == 'g' && p->nkeeps) {
+                goto bad;
+            }
+            PCH_GROW(p->names, p->nglobals + p->nkeeps);
+            p->names[p->nglobals + p->nkeeps] = line;
+            if (tag[0] == 'g') {
+                p->nglobals++;
+            } else {
+                p->nkeeps++;
+            }
+        } else if (!strcmp(tag, "cond")) {
+            PchCond *c;
+            PCH_GROW(p->conds, p->nconds);
+            c = &p->conds[p->nconds++];
+            c->pass = atoi(pch_word(&line));
+            c->defined = atoi(pch_word(&line));
+            c->value = strtoul(pch_word(&line), NULL, 8);
+            c->name = line;
+        } else if (!strcmp(tag, "macro")) {
+            Macro *m;
+            PCH_GROW(p->macros, p->nmacros);
+            m = &p->macros[p->nmacros++];
+            memset(m, 0, sizeof(Macro));
+            m->name = pch_word(&line);
+            m->lines = atoi(pch_word(&line));
+            m->args = atoi(pch_word(&line));
+            if (m->lines < 0 || m->args < 0 || m->args > 10) {
+                goto bad;
+            }
+            for (int k = 0; k < m->args; k++) {
+                m->arg_name[k] = pch_word(&line);
+            }
+            m->line = malloc((m->lines + 1) * sizeof(char *));
+            if (!m->line) {
+                goto bad;
+            }
+            for (int k = 0; k < m->lines; k++) {
+                if (!(m->line[k] = pch_line(&pos, end))) {
+                    goto bad;
+                }
             }
-            *str = ptr;
-            return addr;
         } else {
-            to_second_pass = 1;
-            *str = ptr;
-            return 0;
+            goto bad;
         }
-    } else if (local_parse > 0 && !lsb_enabled && local_suffix != 0) {
-        error = SYNTAX_ERROR;
-        return 0;
     }
+    if (!line || !p->header) {
+        goto bad;
+    }
+    if (stale) {
+        diag(DIAG_WARNING, "PCH %s is out of date, %s is included instead\n", path, p->header);
+        return 1;
+    }
+    pch = p;
+    return 1;
 
-    Label *label = NULL;
-
-    if (in_proc) {
-        label = find_label(&in_proc->labels, tmp);
+bad:
+    diag(DIAG_ERROR, "Bad precompiled header %s\n", path);
+    return 0;
+}
 
-        if (!label) {
-            label = find_label(&in_proc->equs, tmp);
+/*
+ * --gc-procs: pass 1 records every symbol use with the PROC it appears in.
+ * PROCs not reachable from code outside any PROC, the entry PROC, exported
+ * or .keep symbols are then skipped by a layout pass and by pass 2.
+ */
+static Proc *proc_owning(Proc *from, char *name)
+{
+    if (from && (find_label(&from->labels, name) || find_label(&from->equs, name))) {
+        return from;
+    }
+    Proc *proc = find_proc(&procs, name);
+    if (proc) {
+        return proc;
+    }
+    for (proc = procs; proc; proc = proc->prev) {
+        if (find_label(&proc->globals, name)) {
+            return proc;
         }
     }
+    return NULL;
+}
 
-    if (!label) {
-        label = find_label(&labels, tmp);
+static void gc_note_ref(char *name)
+{
+    if ((!gc_procs && !reorder_path) || src_pass != 1 || layout_pass
+            || !is_ident_start((unsigned char)name[0])) {
+        return;
     }
-
-    if (!label) {
-        label = find_label(&equs, tmp);
+    ProcRef *ref = malloc(sizeof(ProcRef));
+    if (!ref || !(ref->name = strdup(name))) {
+        free(ref);
+        error = NO_MEMORY_FOR_LABEL;
+        return;
     }
+    ref->from = in_proc;
+    ref->to = NULL;
+    ref->prev = proc_refs;
+    proc_refs = ref;
+}
 
-    if (label) {
-        *str = ptr;
-        return label->address;
-    } else if (match(str, '%')) {
-        return binary(str);
-    } else if (match(str, '\'')) {
-        return character(str);
-    } else if (match(str, '*')) {
-        return output_addr;
-    } else if (isdigit(*(*str))) {
-        char *tmp = *str;
-        if (*tmp == '0' && (*(tmp + 1) == 'x' || *(tmp + 1) == 'X' ||
-                            *(tmp + 1) == 'b' || *(tmp + 1) == 'B' ||
-                            *(tmp + 1) == 'd' || *(tmp + 1) == 'D')) {
-            return number(str);
-        }
-        while (isdigit(*tmp)) {
-            tmp++;
-        }
-        if (*tmp == '.') {
-            return decimal_with_dot(str);
-        }
-        return octal_default(str);
-    } else {
-        *str = ptr;
-        if (src_pass == 2) {
-            error = CANNOT_RESOLVE_REF;
-        } else {
-            to_second_pass = 1;
+static void gc_mark_names(Label *list)
+{
+    for (Label *l = list; l; l = l->prev) {
+        Proc *proc = proc_owning(NULL, l->name);
+        if (proc) {
+            proc->live = 1;
         }
-        return 0;
     }
 }
 
-static int exp8(char **str)
+static void drop_label(Label **list, char *name)
 {
-    int n;
-    if (match(str, '(')) {
-        n = exp2_(str);
-        if (match(str, ')')) {
-            return n;
-        } else {
-            error = MISSED_BRACKET;
-            return 0;
+    for (Label **l = list; *l; l = &(*l)->prev) {
+        if (symbol_eq((*l)->name, name)) {
+            *l = (*l)->prev;
+            return;
         }
     }
-    return operand(str);
 }
 
-static int exp7(char **str)
+/* Returns the number of PROCs that are no longer reachable. */
+static int gc_collect(void)
 {
-    if (match(str, '~')) {
-        return 0xFFFF ^ exp8(str);
+    int changed;
+    int removed = 0;
+    unsigned int saved = 0;
+
+    for (ProcRef *ref = proc_refs; ref; ref = ref->prev) {
+        ref->to = proc_owning(ref->from, ref->name);
     }
-    if (match(str, '-')) {
-        return -exp8(str);
+    if (gc_entry) {
+        gc_entry->live = 1;
     }
-    return exp8(str);
+    for (Proc *proc = procs; proc; proc = proc->prev) {
+        if (proc->keep) {
+            proc->live = 1;
+        }
+    }
+    gc_mark_names(keeps);
+    gc_mark_names(exports);
+
+    do {
+        changed = 0;
+        for (ProcRef *ref = proc_refs; ref; ref = ref->prev) {
+            if ((!ref->from || ref->from->live) && ref->to && !ref->to->live) {
+                ref->to->live = 1;
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    for (Proc *proc = procs; proc; proc = proc->prev) {
+        if (proc->live) {
+            continue;
+        }
+        diag(DIAG_INFO, "Removed PROC %s, %u bytes\n", proc->name, proc->size);
+        removed++;
+        saved += proc->size;
+        drop_label(&labels, proc->name);
+        for (Label *global = proc->globals; global; global = global->prev) {
+            drop_label(&labels, global->name);
+        }
+    }
+    if (removed) {
+        diag(DIAG_INFO, "Removed %d PROCs, %u bytes saved\n", removed, saved);
+    }
+    return removed;
 }
 
-static int exp6(char **str)
+/*
+ * --proc-profile: reorders runs of PROCs that follow each other with nothing
+ * in between, so the hottest callers and callees end up next to each other
+ * and cold PROCs at the end of the run. The profile holds "name count" PROC
+ * weights (the Hits lines of a --run report work as they are) and optional
+ * "caller callee count" call edges; without edges the PROC references seen
+ * in pass 1 are weighted by the smaller count of their two ends.
+ */
+typedef struct {
+    Proc *from;
+    Proc *to;
+    unsigned long long weight;
+} ReorderEdge;
+
+static Proc **reorder_order = NULL;
+static int reorder_count = 0;
+static ReorderEdge *reorder_edges = NULL;
+static int reorder_nedges = 0;
+static unsigned long long reorder_dist[2];
+static unsigned long long reorder_near[2];
+static unsigned long long reorder_calls = 0;
+
+/* Called for each line outside a PROC. */
+static void reorder_line(char *label, OpCode *opcode, Macro *mac)
 {
-    int n;
-    n = exp7(str);
-    while (*(*str)) {
-        if (match(str, '*')) {
-            n = n * exp7(str);
-        } else if (match(str, '/')) {
-            int divisor = exp7(str);
-            if (divisor == 0) {
-                error = SYNTAX_ERROR;
-                return 0;
+    if (label && opcode && !strcmp(opcode->name, "proc")) {
+        Proc *proc = find_proc(&procs, label);
+        if (reorder_active && proc && proc->run_head) {
+            if (proc == proc->run_head) {
+                proc->run_base = output_addr;
             }
-            n = n / divisor;
-        } else if (match(str, '%')) {
-            int divisor = exp7(str);
-            if (divisor == 0) {
-                error = SYNTAX_ERROR;
-                return 0;
-            }
-            n = n % divisor;
-        } else {
-            break;
+            output_addr = proc->run_head->run_base + proc->slot;
         }
+    } else if ((label || opcode || mac) && src_pass == 1 && !reorder_active) {
+        reorder_last = NULL;
     }
-    return n;
 }
 
-static int exp5(char **str)
+/*
+ * Lays each run out in reorder_order with the current PROC sizes. Each slot
+ * starts on a word boundary, so an odd-sized data PROC moved ahead of code
+ * leaves a padding byte rather than misaligning the code after it.
+ */
+static void reorder_assign(void)
 {
-    int n;
-    n = exp6(str);
-    while (*(*str)) {
-        if (match(str, '+')) {
-            n = n + exp6(str);
-        } else if (match(str, '-')) {
-            n = n - exp6(str);
-        } else {
-            break;
+    for (int i = 0; i < reorder_count; i++) {
+        Proc *proc = reorder_order[i];
+        Proc *head = proc->run_head;
+        if (i == 0 || reorder_order[i - 1]->run_head != head) {
+            head->run_size = 0;
         }
+        proc->slot = (head->run_size + 1) & ~1u;
+        head->run_size = proc->slot + proc->size;
     }
-    return n;
 }
 
-static int exp4(char **str)
+static int reorder_add_edge(Proc *from, Proc *to, unsigned long long weight)
 {
-    int n;
-    n = exp5(str);
-    while (*(*str)) {
-        if (match(str, '&')) {
-            n = n & exp5(str);
-        } else {
-            break;
-        }
+    if (!from || !to || from == to || !weight) {
+        return 1;
     }
-    return n;
+    ReorderEdge *tmp = realloc(reorder_edges, sizeof(ReorderEdge) * (reorder_nedges + 1));
+    if (!tmp) {
+        return 0;
+    }
+    reorder_edges = tmp;
+    reorder_edges[reorder_nedges].from = from;
+    reorder_edges[reorder_nedges].to = to;
+    reorder_edges[reorder_nedges].weight = weight;
+    reorder_nedges++;
+    return 1;
 }
 
-static int exp3(char **str)
+static Proc *reorder_find(const char *name)
 {
-    int n;
-    n = exp4(str);
-    while (*(*str)) {
-        if (match(str, '^')) {
-            n = n ^ exp4(str);
-        } else {
-            break;
-        }
-    }
-    return n;
+    Proc *proc = find_proc(&procs, (char *)name);
+    return (proc && (proc->live || !gc_active)) ? proc : NULL;
 }
 
-static int exp2_(char **str)
+/* Lines that are neither PROC counts nor call edges are skipped. */
+static int reorder_load(void)
 {
-    int n;
-    n = exp3(str);
-    while (*(*str)) {
-        if (match(str, '|')) {
-            n = n | exp3(str);
-        } else {
-            break;
+    FILE *f = fopen(reorder_path, "rb");
+    char line[256];
+    char a[64];
+    char b[64];
+    unsigned long long count;
+    int file_edges = 0;
+
+    if (!f) {
+        diag(DIAG_ERROR, "Can't open PROC profile: %s\n", reorder_path);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, ";#")] = 0;
+        if (sscanf(line, " [%63[^]]] %llu", a, &count) == 2
+                || (sscanf(line, " %63s %63s %llu", a, b, &count) != 3
+                    && sscanf(line, " %63s %llu", a, &count) == 2)) {
+            Proc *proc = reorder_find(a);
+            if (proc) {
+                proc->heat += count;
+            }
+        } else if (sscanf(line, " %63s %63s %llu", a, b, &count) == 3) {
+            Proc *from = reorder_find(a);
+            Proc *to = reorder_find(b);
+            if (from && to && from != to) {
+                from->heat += count;
+                to->heat += count;
+                if (!reorder_add_edge(from, to, count)) {
+                    fclose(f);
+                    return 0;
+                }
+            }
+            file_edges = 1;
         }
     }
-    return n;
-}
+    fclose(f);
 
-static int exp_(char **str)
-{
-    if (match(str, '/')) {
-        return (exp2_(str) >> 8);
-    } else {
-        return (exp2_(str));
+    if (!file_edges) {
+        for (ProcRef *ref = proc_refs; ref; ref = ref->prev) {
+            Proc *to = proc_owning(ref->from, ref->name);
+            if (!ref->from || !to || (gc_active && (!ref->from->live || !to->live))) {
+                continue;
+            }
+            unsigned long long weight = ref->from->heat < to->heat ? ref->from->heat : to->heat;
+            if (!reorder_add_edge(ref->from, to, weight)) {
+                return 0;
+            }
+        }
     }
+    return 1;
 }
 
-typedef struct Operand {
-    int mode;
-    int reg;
-    int has_ext;
-    int ext;
-    int pc_relative;
-} Operand;
+static int reorder_edge_cmp(const void *a, const void *b)
+{
+    const ReorderEdge *ea = a;
+    const ReorderEdge *eb = b;
+    return (ea->weight < eb->weight) - (ea->weight > eb->weight);
+}
 
-static int operand_spec(Operand *op)
+static int reorder_index(Proc **members, int n, Proc *proc)
 {
-    return ((op->mode & 0x07) << 3) | (op->reg & 0x07);
+    for (int i = 0; i < n; i++) {
+        if (members[i] == proc) {
+            return i;
+        }
+    }
+    return -1;
 }
 
-static int parse_register(char **str, int *out_reg)
+/* Sums call distances between PROC centers; `moved` uses the new slots. */
+static void reorder_measure(int moved, unsigned long long *dist, unsigned long long *near)
 {
-    Register *reg = find_register_in_string(str);
-    if (!reg) {
-        return 0;
+    *dist = 0;
+    *near = 0;
+    for (int i = 0; i < reorder_nedges; i++) {
+        long long center[2];
+        Proc *ends[2] = { reorder_edges[i].from, reorder_edges[i].to };
+        for (int k = 0; k < 2; k++) {
+            unsigned int start = ends[k]->start;
+            if (moved && ends[k]->run_head) {
+                start = ends[k]->run_head->start + ends[k]->slot;
+            }
+            center[k] = start + ends[k]->size / 2;
+        }
+        unsigned long long d = llabs(center[0] - center[1]);
+        *dist += d * reorder_edges[i].weight;
+        if (d < 256) {
+            *near += reorder_edges[i].weight;
+        }
     }
-    *out_reg = reg->n;
-    return 1;
 }
 
-static int parse_operand(char **str, Operand *op)
+static void reorder_report(FILE *out)
 {
-    int deferred = 0;
-    char *ptr = *str;
+    for (int i = 0; i < reorder_count; i++) {
+        Proc *proc = reorder_order[i];
+        if (i == 0 || reorder_order[i - 1]->run_head != proc->run_head) {
+            fprintf(out, "PROC order at %06o:", reorder_active ? proc->run_head->run_base : proc->run_head->start);
+        }
+        fprintf(out, " [%s]%s", proc->name, proc->heat ? "" : " (cold)");
+        if (i + 1 == reorder_count || reorder_order[i + 1]->run_head != proc->run_head) {
+            fprintf(out, "\n");
+        }
+    }
+    if (reorder_calls) {
+        fprintf(out, "PROC layout: mean call distance %llu -> %llu bytes, "
+                "%.1f%% -> %.1f%% of calls within branch range\n",
+                reorder_dist[0] / reorder_calls, reorder_dist[1] / reorder_calls,
+                100.0 * reorder_near[0] / reorder_calls, 100.0 * reorder_near[1] / reorder_calls);
+    }
+}
 
-    SKIP_BLANK(ptr);
+/*
+ * Greedy chain merging over the call edges, heaviest first, then the chains
+ * of each run by weight. A PROC that holds the first byte of the image stays
+ * at the front of its run. Returns 0 when the profile can't be read.
+ */
+static int reorder_plan(void)
+{
+    int n = 0;
+    int moved = 0;
 
-    if (match(&ptr, '@')) {
-        deferred = 1;
+    for (Proc *proc = procs; proc; proc = proc->prev) {
+        proc->heat = 0;
+        proc->run_head = NULL;
+        if (proc->run_prev && gc_active && (!proc->live || !proc->run_prev->live)) {
+            proc->run_prev = NULL;
+        }
+        n++;
+    }
+    if (!reorder_load()) {
+        return 0;
     }
 
-    if (match(&ptr, '#')) {
-        op->mode = deferred ? 3 : 2;
-        op->reg = 7;
-        op->has_ext = 1;
-        op->ext = exp_(&ptr);
-        op->pc_relative = 0;
-        *str = ptr;
-        return 1;
+    Proc **members = calloc(n + 1, sizeof(Proc *));
+    int *next = calloc(n + 1, sizeof(int));
+    int *chain = calloc(n + 1, sizeof(int));
+    int *tail = calloc(n + 1, sizeof(int));
+    unsigned long long *heat = calloc(n + 1, sizeof(*heat));
+    reorder_order = calloc(n + 1, sizeof(Proc *));
+    if (!members || !next || !chain || !tail || !heat || !reorder_order) {
+        free(members);
+        free(next);
+        free(chain);
+        free(tail);
+        free(heat);
+        return 0;
     }
 
-    if (match(&ptr, '-')) {
-        if (!match(&ptr, '(')) {
-            error = SYNTAX_ERROR;
-            return 0;
-        }
-        if (!parse_register(&ptr, &op->reg)) {
-            error = MISSED_REGISTER_ARG_2;
-            return 0;
+    /* Runs of two or more PROCs, in source order. */
+    int count = 0;
+    for (Proc *proc = procs; proc; proc = proc->prev) {
+        members[count++] = proc;
+    }
+    for (int i = 0; i < count / 2; i++) {
+        Proc *tmp = members[i];
+        members[i] = members[count - 1 - i];
+        members[count - 1 - i] = tmp;
+    }
+    n = 0;
+    for (int i = 0; i < count; i++) {
+        Proc *proc = members[i];
+        int in_run = proc->run_prev != NULL;
+        for (int k = i + 1; k < count && !in_run; k++) {
+            in_run = members[k]->run_prev == proc;
         }
-        if (!match(&ptr, ')')) {
-            error = MISSED_BRACKET;
-            return 0;
+        if (in_run && (proc->live || !gc_active)) {
+            proc->run_head = proc->run_prev ? proc->run_prev->run_head : proc;
+            members[n++] = proc;
         }
-        op->mode = deferred ? 5 : 4;
-        op->has_ext = 0;
-        op->pc_relative = 0;
-        *str = ptr;
-        return 1;
+    }
+    for (int i = 0; i < n; i++) {
+        next[i] = -1;
+        chain[i] = i;
+        tail[i] = i;
     }
 
-    if (match(&ptr, '(')) {
-        if (!parse_register(&ptr, &op->reg)) {
-            error = MISSED_REGISTER_ARG_2;
-            return 0;
+    int pin = (gc_entry && gc_entry->run_head == gc_entry) ? reorder_index(members, n, gc_entry) : -1;
+
+    if (reorder_nedges) {
+        qsort(reorder_edges, reorder_nedges, sizeof(ReorderEdge), reorder_edge_cmp);
+    }
+    for (int e = 0; e < reorder_nedges; e++) {
+        int a = reorder_index(members, n, reorder_edges[e].from);
+        int b = reorder_index(members, n, reorder_edges[e].to);
+        if (a < 0 || b < 0 || members[a]->run_head != members[b]->run_head
+                || chain[a] == chain[b]) {
+            continue;
         }
-        if (!match(&ptr, ')')) {
-            error = MISSED_BRACKET;
-            return 0;
+        int ha = chain[a];
+        int hb = chain[b];
+        int pinned_a = pin >= 0 && chain[pin] == ha;
+        int pinned_b = pin >= 0 && chain[pin] == hb;
+        int first = ha;
+        int second = hb;
+        if (pinned_b || (!pinned_a && b == tail[hb] && a == ha && !(a == tail[ha] && b == hb))) {
+            first = hb;
+            second = ha;
         }
-        if (match(&ptr, '+')) {
-            op->mode = deferred ? 3 : 2;
-        } else {
-            op->mode = 1;
+        next[tail[first]] = second;
+        tail[first] = tail[second];
+        for (int k = second; k >= 0; k = next[k]) {
+            chain[k] = first;
         }
-        op->has_ext = 0;
-        op->pc_relative = 0;
-        *str = ptr;
-        return 1;
     }
 
-    if (deferred) {
-        int reg;
-        char *tmp = ptr;
-        if (parse_register(&tmp, &reg)) {
-            op->mode = 1;
-            op->reg = reg;
-            op->has_ext = 0;
-            op->pc_relative = 0;
-            *str = tmp;
-            return 1;
-        }
+    for (int i = 0; i < n; i++) {
+        heat[chain[i]] += members[i]->heat;
     }
 
-    {
-        char *tmp = ptr;
-        int reg;
-        if (parse_register(&tmp, &reg)) {
-            op->mode = 0;
-            op->reg = reg;
-            op->has_ext = 0;
-            op->pc_relative = 0;
-            *str = tmp;
-            return 1;
+    /* Chains of each run: the pinned one first, then the hotter ones. */
+    int run = 0;
+    while (run < n) {
+        int end = run;
+        while (end < n && members[end]->run_head == members[run]->run_head) {
+            end++;
         }
-    }
-
-    {
-        char *tmp = ptr;
-        int val = exp_(&tmp);
-        int has_symbol = 0;
-        for (char *p = ptr; p < tmp; p++) {
-            if (isalpha(*p) || *p == '_' || *p == '.' || *p == ':' || *p == '$') {
-                has_symbol = 1;
-                break;
+        for (;;) {
+            int best = -1;
+            for (int i = run; i < end; i++) {
+                if (chain[i] != i) {
+                    continue;
+                }
+                if (pin >= 0 && chain[pin] == i) {
+                    best = i;
+                    break;
+                }
+                if (best < 0 || heat[i] > heat[best]) {
+                    best = i;
+                }
             }
-        }
-        SKIP_BLANK(tmp);
-        if (match(&tmp, '(')) {
-            if (!parse_register(&tmp, &op->reg)) {
-                error = MISSED_REGISTER_ARG_2;
-                return 0;
+            if (best < 0) {
+                break;
             }
-            if (!match(&tmp, ')')) {
-                error = MISSED_BRACKET;
-                return 0;
+            for (int k = best; k >= 0; k = next[k]) {
+                moved |= members[k] != members[reorder_count];
+                reorder_order[reorder_count++] = members[k];
             }
-            op->mode = deferred ? 7 : 6;
-            op->has_ext = 1;
-            op->ext = val;
-            op->pc_relative = (op->reg == 7) ? has_symbol : 0;
-            *str = tmp;
-            return 1;
+            chain[best] = -1;
         }
+        run = end;
+    }
 
-        op->mode = deferred ? 7 : 6;
-        op->reg = 7;
-        op->has_ext = 1;
-        op->ext = val;
-        op->pc_relative = 1;
-        *str = tmp;
-        return 1;
+    reorder_assign();
+    reorder_measure(0, &reorder_dist[0], &reorder_near[0]);
+    reorder_measure(1, &reorder_dist[1], &reorder_near[1]);
+    for (int i = 0; i < reorder_nedges; i++) {
+        reorder_calls += reorder_edges[i].weight;
     }
+    reorder_active = moved;
+
+    free(members);
+    free(next);
+    free(chain);
+    free(tail);
+    free(heat);
+    return 1;
 }
 
-static int get_bytes(char *str)
+static Section *find_section(const char *name)
 {
-    char delim = 0;
-    int old_addr = output_addr;
+    for (Section *s = sections; s; s = s->prev) {
+        if (symbol_eq(s->name, name)) {
+            return s;
+        }
+    }
+    return NULL;
+}
 
-    SKIP_BLANK(str);
-    while (*str) {
-        if (delim) {
-            if (*str == 0 || *str == '\n' || *str == '\r') {
-                break;
-            }
-            if (*str != delim) {
-                if (delim == '\'') {
-                    emit_byte(0);
-                    str++;
-                } else if (*str == '\\') {
-                    str++;
-                    if (*str == 'n') {
-                        emit_byte('\n');
-                    } else if (*str == 'r') {
-                        emit_byte('\r');
-                    } else if (*str == 't') {
-                        emit_byte('\t');
-                    } else if (*str == '0') {
-                        emit_byte('\0');
-                    } else if (*str == '\\') {
-                        emit_byte('\\');
-                    } else if (*str == '\"') {
-                        emit_byte('\"');
-                    } else if (*str == '\'') {
-                        emit_byte('\'');
-                    } else if (*str) {
-                        emit_byte(*str);
-                    }
-                    if (*str) {
-                        str++;
-                    }
-                } else {
-                    emit_byte(*str++);
-                }
-                continue;
-            }
-            delim = 0;
-            str++;
-        } else if (*str == '"' || *str == '\'') {
-            delim = *str++;
-            continue;
-        } else {
-            emit_byte(exp_(&str) & 0xFF);
-        }
-        if (match(&str, ',') == 0) {
-            break;
+static Section *section_by_id(int id)
+{
+    for (Section *s = sections; s; s = s->prev) {
+        if (s->id == id) {
+            return s;
         }
-        SKIP_BLANK(str);
-    }
-    if (delim) {
-        error = EXPECTED_CLOSE_QUOTE;
     }
+    return NULL;
+}
 
-    return output_addr - old_addr;
+static const char *section_name(int id)
+{
+    Section *s = section_by_id(id);
+    return s ? s->name : ".text";
 }
 
-static int get_words(char *str)
+/* Pass 1 counts from zero in every section, pass 2 from the laid out base. */
+static unsigned int section_origin(const Section *s)
 {
-    int old_addr = output_addr;
+    return (src_pass == 1) ? 0 : s->base;
+}
 
-    while (*str) {
-        char *tmp = str;
-        int word = exp_(&str);
-        if (src_pass == 2 && !pad_tail_words) {
-            int has_minus = 0;
-            int has_alpha = 0;
-            for (char *p = tmp; p < str; p++) {
-                if (*p == '-') {
-                    has_minus = 1;
-                } else if (isalpha((unsigned char)*p) || *p == '_' || *p == '.' || *p == '$' || *p == ':') {
-                    has_alpha = 1;
-                }
-            }
-            if (has_minus && has_alpha) {
-                pad_tail_words = 1;
-            }
-        }
-        emit_word(word & 0xFFFF);
-        if (match(&str, ',') == 0) {
-            break;
+static void section_leave(void)
+{
+    if (cur_section) {
+        cur_section->loc = output_addr - section_origin(cur_section);
+        if (cur_section->loc > cur_section->size) {
+            cur_section->size = cur_section->loc;
         }
-        SKIP_BLANK(str);
+    } else {
+        abs_addr = output_addr;
     }
+}
 
-    return output_addr - old_addr;
+static void section_enter(Section *s)
+{
+    section_leave();
+    cur_section = s;
+    cur_sect = s ? s->id : 0;
+    output_addr = s ? section_origin(s) + s->loc : abs_addr;
 }
 
-static int do_asm(FILE *inf, char *str);
+static void sections_begin_pass(void)
+{
+    for (Section *s = sections; s; s = s->prev) {
+        s->loc = 0;
+    }
+    cur_section = NULL;
+    cur_sect = 0;
+}
 
-static int is_ident_start(int c)
+/*
+ * --instrument=procs|loops: each PROC entry, and with "loops" each local
+ * label a branch or SOB jumps back to, gets INC @#$PROF+2*n, or with
+ * --instrument-hook a JSR R5,@#hook followed by the counter index n. The
+ * $PROF counter table follows the absolute image. Loop heads found in one
+ * pass 1 are instrumented from the next pass on. INC sets N, Z and V, so
+ * pass 1 follows the code after each site until N, Z and V are all set again;
+ * if one can be read first, or control leaves before that, the site is
+ * wrapped in MFPS -(SP) / MTPS (SP)+ from the next pass on.
+ */
+#define INSTR_PROCS 1
+#define INSTR_LOOPS 2
+
+#define INSTR_HEAD 1        /* a branch or SOB jumps back to the label */
+#define INSTR_SAVE 2        /* N, Z or V is live after the label */
+
+#define INSTR_PENDING_MAX 16
+
+typedef struct {
+    Proc *proc;
+    int local;              /* local label number, -1 for the PROC entry */
+    unsigned int addr;
+    int words;
+    unsigned int cycles;
+} InstrSite;
+
+typedef struct {
+    int seq;                /* local label, or -1 for the entry of proc */
+    Proc *proc;
+    int live;               /* N, Z and V not yet set again */
+} InstrPending;
+
+static const char *instr_hook = NULL;
+static const char *instr_map_path = NULL;
+static unsigned char *instr_heads = NULL;   /* loop heads seen in this pass 1 */
+static unsigned char *instr_used = NULL;    /* loop heads instrumented in this pass */
+static int instr_heads_size = 0;
+static InstrPending instr_pending[INSTR_PENDING_MAX];  /* sites whose N, Z or V may still be read */
+static int instr_npending = 0;
+static int instr_replan = 0;                /* a PROC entry site grew after pass 1 emitted it */
+static int instr_count = 0;
+static unsigned int instr_base = 0;
+static InstrSite *instr_sites = NULL;
+static int instr_nsites = 0;
+
+static void instrument_mark(int seq, int flag)
 {
-    return isalpha(c) || c == '_' || c == '.' || c == '$';
+    if (seq < 0) {
+        return;
+    }
+    if (seq >= instr_heads_size) {
+        int size = instr_heads_size ? instr_heads_size : 64;
+        while (size <= seq) {
+            size *= 2;
+        }
+        unsigned char *heads = realloc(instr_heads, size);
+        unsigned char *used = heads ? realloc(instr_used, size) : NULL;
+        if (heads) {
+            instr_heads = heads;
+        }
+        if (!heads || !used) {
+            error = NO_MEMORY_FOR_LABEL;
+            return;
+        }
+        instr_used = used;
+        memset(instr_heads + instr_heads_size, 0, size - instr_heads_size);
+        memset(instr_used + instr_heads_size, 0, size - instr_heads_size);
+        instr_heads_size = size;
+    }
+    instr_heads[seq] |= flag;
 }
 
-static int is_ident_char(int c)
+static int instrument_is_head(int seq)
 {
-    return isalnum(c) || c == '_' || c == '$';
+    return (instrument & INSTR_LOOPS) && seq < instr_heads_size && (instr_used[seq] & INSTR_HEAD);
 }
 
-static void expand_named_params(const Macro *mac, char **arg, const char *src, char *dst, size_t dst_size)
+static int instrument_saves(int seq)
 {
-    const char *p = src;
-    char *d = dst;
-    size_t left = dst_size ? dst_size - 1 : 0;
+    return seq < instr_heads_size && (instr_used[seq] & INSTR_SAVE);
+}
 
-    while (*p && left > 0) {
-        if (is_ident_start((unsigned char)*p)) {
-            char tok[64];
-            size_t tlen = 0;
-            const char *start = p;
-            while (*p && is_ident_char((unsigned char)*p) && tlen < sizeof(tok) - 1) {
-                tok[tlen++] = *p++;
-            }
-            tok[tlen] = 0;
-            int replaced = 0;
-            for (int i = 0; i < mac->args; i++) {
-                if (mac->arg_name[i] && !strcasecmp(tok, mac->arg_name[i]) && arg[i]) {
-                    size_t alen = strlen(arg[i]);
-                    if (alen > left) {
-                        alen = left;
-                    }
-                    memcpy(d, arg[i], alen);
-                    d += alen;
-                    left -= alen;
-                    replaced = 1;
-                    break;
-                }
-            }
-            if (!replaced) {
-                size_t copy = (size_t)(p - start);
-                if (copy > left) {
-                    copy = left;
-                }
-                memcpy(d, start, copy);
-                d += copy;
-                left -= copy;
-            }
-        } else {
-            *d++ = *p++;
-            left--;
+/* The site for label `seq` or for the entry of `proc` must keep the PSW. */
+static void instrument_live(int seq, Proc *proc)
+{
+    if (proc) {
+        if (!proc->instr_save) {
+            proc->instr_save = 1;
+            instr_replan = 1;
         }
+    } else {
+        instrument_mark(seq, INSTR_SAVE);
     }
-    *d = 0;
 }
 
-static int expand_macro(FILE *inf, Macro *mac, char *args)
+static void instrument_begin_pass(void)
 {
-    int i = 0;
-    char *arg[10];
+    instr_seq = 0;
+    instr_npending = 0;
+    instr_count = 0;
+    if (src_pass == 1 && instr_heads_size) {
+        memcpy(instr_used, instr_heads, instr_heads_size);
+        memset(instr_heads, 0, instr_heads_size);
+    }
+}
 
-    src_line++;
+/* Emits the counter update for `proc`, or for its loop at local label `local`. */
+static void instrument_site(Proc *proc, int local, int save)
+{
+    unsigned int addr = output_addr;
+    int index = instr_count++;
+    char text[128];
 
-    in_macro++;
-    if (!lsb_push_new()) {
-        error = SYNTAX_ERROR;
-        return 1;
+    if (save) {
+        emit_word(0106746);
     }
-
-    // parse args
-    while (args && *args) {
-        SKIP_BLANK(args);
-        arg[i++] = args;
-        while (*args && *args != ',') {
-            args++;
+    unsigned int count_addr = output_addr;
+    if (instr_hook) {
+        unsigned int hook = 0;
+        if (src_pass == 2) {
+            Label *l = find_label(&labels, (char *)instr_hook);
+            if (!l) {
+                error = CANNOT_RESOLVE_REF;
+                return;
+            }
+            hook = l->address;
         }
+        emit_word(0004537);
+        emit_word(hook);
+        emit_word(index);
+        snprintf(text, sizeof(text), "        jsr     r5,@#%s         ; counter %d", instr_hook, index);
+    } else {
+        emit_word(0005237);
+        emit_word(instr_base + 2 * index);
+        snprintf(text, sizeof(text), "        inc     @#$PROF+%d.       ; counter %d", 2 * index, index);
+    }
+    if (save) {
+        emit_word(0106426);
+    }
+    if (src_pass != 2) {
+        return;
+    }
 
-        if (*args == ',') {
-            *args++ = 0;
-            continue;
-        }
+    InstrSite *tmp = realloc(instr_sites, sizeof(InstrSite) * (instr_nsites + 1));
+    if (!tmp) {
+        error = NO_MEMORY_FOR_LABEL;
+        return;
+    }
+    instr_sites = tmp;
+    InstrSite *site = &instr_sites[instr_nsites++];
+    site->proc = proc;
+    site->local = local;
+    site->addr = addr;
+    site->words = (output_addr - addr) / 2;
+    site->cycles = insn_cycles(output_word(count_addr));
+    if (save) {
+        site->cycles += insn_cycles(0106746) + insn_cycles(0106426);
+    }
+    if (save) {
+        diag(DIAG_VERBOSE, "%s:%d: counter %d keeps the PSW, N, Z or V is read after it\n",
+             in_file_name, src_line, index);
     }
 
-    arg[i] = NULL;
+    unsigned short words[3];
+    int nwords = instr_hook ? 3 : 2;
+    list_record(addr, output_addr);
+    if (save) {
+        words[0] = output_word(addr);
+        list_line_words(src_line, addr, words, 1, "        mfps    -(sp)");
+    }
+    for (int i = 0; i < nwords; i++) {
+        words[i] = output_word(count_addr + 2 * i);
+    }
+    list_line_words(src_line, count_addr, words, nwords, text);
+    if (save) {
+        words[0] = output_word(output_addr - 2);
+        list_line_words(src_line, output_addr - 2, words, 1, "        mtps    (sp)+");
+    }
+}
 
-//	for (i = 0; arg[i]; i++) {
-//	    fprintf(stderr, "[%s]\n", arg[i]);
-//	}
+/* Places the counter table after the absolute image. */
+static void instrument_table(void)
+{
+    char name[] = "$PROF";
 
-    for (i = 0; i < mac->lines; i++) {
-        char line[1024];
-        char line2[1024];
-        char *ptr_tmp;
-        char *ptr_src = mac->line[i];
-        char *ptr_dst = line;
+    section_enter(NULL);
+    if (output_addr & 1) {
+        emit_byte(0);
+    }
+    if (src_pass == 1) {
+        add_label(&labels, name, output_addr, 1, src_line);
+    }
+    instr_base = output_addr;
+    for (int i = 0; i < instr_count; i++) {
+        emit_word(0);
+    }
+    if (src_pass == 2 && list_out) {
+        char text[64];
+        snprintf(text, sizeof(text), "$PROF:  .blkw   %d.", instr_count);
+        list_line_words(src_line, instr_base, NULL, 0, text);
+    }
+}
 
-        if (!strchr(ptr_src, '#')) {
-            strcpy(line, ptr_src);
-        } else {
-            while ((ptr_tmp = strchr(ptr_src, '#'))) {
-                if (isdigit(*(ptr_tmp + 1))) {
-                    int len = (ptr_tmp - ptr_src);
-                    int n = *(ptr_tmp + 1) - '0' - 1;
+static void instrument_report(FILE *out)
+{
+    unsigned int site_cycles = insn_cycles(instr_hook ? 0004537 : 0005237);
+    unsigned int save_cycles = insn_cycles(0106746) + insn_cycles(0106426);
+    int saves = 0;
 
-                    strncpy(ptr_dst, ptr_src, len);
-                    strcpy(ptr_dst + len, arg[n]);
-                    ptr_dst += strlen(ptr_dst);
-                    ptr_src = ptr_tmp + 2;
-                } else {
-                    break;
-                }
+    for (int i = 0; i < instr_nsites; i++) {
+        saves += instr_sites[i].words > (instr_hook ? 3 : 2);
+    }
+    fprintf(out, "\nInstrumentation: %d counters at %06o\n", instr_nsites, instr_base);
+    for (int i = 0; i < instr_nsites; i++) {
+        InstrSite *site = &instr_sites[i];
+        fprintf(out, "%4d %06o [%s]", i, instr_base + 2 * i,
+                site->proc ? site->proc->name : "(top level)");
+        if (site->local >= 0) {
+            fprintf(out, " %d$ at %06o", site->local, site->addr);
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "Overhead (%u cycles per counter%s", site_cycles, instr_hook ? " plus the hook" : "");
+    if (saves) {
+        fprintf(out, ", %u more at %d site%s keeping the PSW", save_cycles, saves, (saves == 1) ? "" : "s");
+    }
+    fprintf(out, "):\n");
+    for (int i = 0; i < instr_nsites; i++) {
+        Proc *proc = instr_sites[i].proc;
+        int words = 0;
+        unsigned int entry = 0;
+        unsigned int loop_min = 0;
+        unsigned int loop_max = 0;
+        int loops = 0;
+        int first = 1;
+        for (int k = 0; k < instr_nsites; k++) {
+            InstrSite *site = &instr_sites[k];
+            if (site->proc != proc) {
+                continue;
             }
-            if (*ptr_src) {
-                strcpy(ptr_dst, ptr_src);
+            if (k < i) {
+                first = 0;
+                break;
+            }
+            words += site->words;
+            if (site->local < 0) {
+                entry = site->cycles;
+            } else {
+                if (!loops || site->cycles < loop_min) {
+                    loop_min = site->cycles;
+                }
+                if (site->cycles > loop_max) {
+                    loop_max = site->cycles;
+                }
+                loops++;
             }
         }
-
-        if (mac->args > 0) {
-            expand_named_params(mac, arg, line, line2, sizeof(line2));
-        } else {
-            strcpy(line2, line);
+        if (!first) {
+            continue;
         }
-
-        if (src_pass == 2) {
-            fprintf(stderr, "[%s]:%d ", mac->name, i + 1);
+        fprintf(out, "[%s] +%d words", proc ? proc->name : "(top level)", words);
+        if (entry) {
+            fprintf(out, ", +%u cycles per call", entry);
         }
-
-        int ret = do_asm(inf, line2);
-        if (ret) {
-            if (src_pass == 1) {
-                fprintf(stderr, "[%s]:%d %s\n", mac->name, i + 1, line2);
+        if (loops) {
+            fprintf(out, ", +%u", loop_min);
+            if (loop_max != loop_min) {
+                fprintf(out, "..%u", loop_max);
             }
-            return ret;
+            fprintf(out, " cycles per iteration of %d loop%s", loops, (loops == 1) ? "" : "s");
         }
+        fprintf(out, "\n");
     }
-
-    in_macro--;
-    lsb_pop();
-
-    return 0;
 }
 
-static char *get_file_path(char *name)
+/* Writes "index counter site name [N$]" lines. */
+static int instrument_write_map(const char *path)
 {
-    char *tmp;
-    if ((tmp = strrchr(name, '/'))) {
-        *tmp = 0;
-    } else {
-        strcpy(name, ".");
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        diag(DIAG_ERROR, "Can't create instrumentation map: %s\n", path);
+        return 0;
     }
-    return name;
+    for (int i = 0; i < instr_nsites; i++) {
+        InstrSite *site = &instr_sites[i];
+        fprintf(f, "%d %06o %06o %s", i, instr_base + 2 * i, site->addr,
+                site->proc ? site->proc->name : "(top level)");
+        if (site->local >= 0) {
+            fprintf(f, " %d$", site->local);
+        }
+        fprintf(f, "\n");
+    }
+    fclose(f);
+    return 1;
 }
 
-static int do_asm(FILE *inf, char *line)
-{
-    char last;
-    char *ptr, *ptr1;
-    char linetmp[strlen(line) + 1];
-    char *str = linetmp;
-    int list_line = src_line;
-
-    strcpy(linetmp, line);
-
-    remove_comment(str);
+/*
+ * .psect <name>[, code|data|bss|ro|rw|align=<n>]...
+ * .asect, or .psect without a name, returns to the default section.
+ */
+static int select_section(const char *directive, char *str)
+{
+    char name[64];
+    int attrs = 0;
+    unsigned int align = 0;
+    int i = 0;
 
     SKIP_BLANK(str);
-
-    {
-        char *scan = str;
-        SKIP_BLANK(scan);
-        if (*scan) {
-            char *tok_start = scan;
-            SKIP_TOKEN(scan);
-            char saved = *scan;
-            *scan = 0;
-            char *tok = tok_start;
-            if (*tok == '.') {
-                tok++;
-            }
-            int is_conditional = (!strcasecmp(tok, "if") ||
-                                  !strcasecmp(tok, "ifdef") ||
-                                  !strcasecmp(tok, "ifndef") ||
-                                  !strcasecmp(tok, "else") ||
-                                  !strcasecmp(tok, "endif"));
-            if (is_conditional) {
-                char *args = saved ? (scan + 1) : scan;
-                if (!strcasecmp(tok, "if")) {
-                    int parent_active = is_skipping() ? 0 : 1;
-                    int cond = parent_active ? (exp_(&args) != 0) : 0;
-                    if (if_sp >= IF_STACK_MAX) {
-                        error = SYNTAX_ERROR;
-                        return 1;
-                    }
-                    if_stack[if_sp].active = cond;
-                    if_stack[if_sp].seen_else = 0;
-                    if_sp++;
-                } else if (!strcasecmp(tok, "ifdef") || !strcasecmp(tok, "ifndef")) {
-                    int parent_active = is_skipping() ? 0 : 1;
-                    char *p = args;
-                    SKIP_BLANK(p);
-                    char *name = p;
-                    SKIP_TOKEN(p);
-                    *p = 0;
-                    int defined = symbol_defined(name);
-                    int cond = parent_active ? (strcasecmp(tok, "ifdef") == 0 ? defined : !defined) : 0;
-                    if (if_sp >= IF_STACK_MAX) {
-                        error = SYNTAX_ERROR;
-                        return 1;
-                    }
-                    if_stack[if_sp].active = cond;
-                    if_stack[if_sp].seen_else = 0;
-                    if_sp++;
-                } else if (!strcasecmp(tok, "else")) {
-                    if (if_sp == 0) {
-                        error = SYNTAX_ERROR;
-                        return 1;
-                    }
-                    if (if_stack[if_sp - 1].seen_else) {
-                        error = SYNTAX_ERROR;
-                        return 1;
-                    }
-                    int parent_active = 1;
-                    for (int i = 0; i < if_sp - 1; i++) {
-                        if (!if_stack[i].active) {
-                            parent_active = 0;
-                            break;
-                        }
-                    }
-                    if_stack[if_sp - 1].active = parent_active ? !if_stack[if_sp - 1].active : 0;
-                    if_stack[if_sp - 1].seen_else = 1;
-                } else if (!strcasecmp(tok, "endif")) {
-                    if (if_sp == 0) {
-                        error = SYNTAX_ERROR;
-                        return 1;
-                    }
-                    if_sp--;
-                }
+    if (!strcmp(directive, "asect") || !*str) {
+        if (*str) {
+            error = EXTRA_SYMBOLS;
+            return 0;
+        }
+        section_enter(NULL);
+        return 1;
+    }
+    while (*str && !isblank((unsigned char)*str) && *str != ',' && i < (int)sizeof(name) - 1) {
+        name[i++] = *str++;
+    }
+    name[i] = 0;
+    SKIP_BLANK(str);
+    while (match(&str, ',')) {
+        SKIP_BLANK(str);
+        char *attr = str;
+        while (isalpha((unsigned char)*str)) {
+            str++;
+        }
+        int len = str - attr;
+        if (len == 4 && !strncasecmp(attr, "code", 4)) {
+            attrs |= SECT_CODE;
+        } else if (len == 4 && !strncasecmp(attr, "data", 4)) {
+            attrs |= SECT_DATA;
+        } else if (len == 3 && !strncasecmp(attr, "bss", 3)) {
+            attrs |= SECT_DATA | SECT_BSS;
+        } else if (len == 2 && !strncasecmp(attr, "ro", 2)) {
+            attrs |= SECT_RO;
+        } else if (len == 2 && !strncasecmp(attr, "rw", 2)) {
+            attrs &= ~SECT_RO;
+        } else if (len == 5 && !strncasecmp(attr, "align", 5) && match(&str, '=')) {
+            align = exp_(&str);
+            if (align < 2 || (align & (align - 1))) {
+                error = SYNTAX_ERROR;
                 return 0;
-            } else {
-                *scan = saved;
             }
+        } else {
+            error = SYNTAX_ERROR;
+            return 0;
         }
+        SKIP_BLANK(str);
     }
-
-    if (is_skipping()) {
-        if (!in_macro) {
-            src_line++;
-        }
+    if (*str) {
+        error = EXTRA_SYMBOLS;
         return 0;
     }
-
-    ptr = str;
-    SKIP_TOKEN(str);
-    ptr1 = str;
-
-    if ((last = *ptr1)) {
-        str++;
+    if ((attrs & SECT_CODE) && (attrs & SECT_DATA)) {
+        error = SECTION_ATTR_CONFLICT;
+        return 0;
     }
-    *ptr1 = 0;
 
-    if (ptr1 - ptr > 0) {
-        char *label = NULL;
-        char *first_tok = ptr;
+    if (!name[0] || symbol_eq(name, ".text")) {
+        section_enter(NULL);
+        return 1;
+    }
 
-        OpCode *opcode = NULL;
-        int is_byte = 0;
-        Macro *mac = NULL;
+    Section *s = find_section(name);
+    if (!s) {
+        s = calloc(1, sizeof(Section));
+        if (!s || !(s->name = strdup(name))) {
+            free(s);
+            error = NO_MEMORY_FOR_LABEL;
+            return 0;
+        }
+        s->id = ++sections_count;
+        s->attrs = attrs ? attrs : SECT_CODE;
+        s->align = 2;
+        s->prev = sections;
+        sections = s;
+    } else if (attrs && attrs != s->attrs) {
+        error = SECTION_ATTR_CONFLICT;
+        return 0;
+    }
+    if (align > s->align) {
+        s->align = align;
+    }
+    section_enter(s);
+    return 1;
+}
 
-        if (last == ':') {
-            label = first_tok;
-            SKIP_BLANK(str);
-            ptr = str;
-            SKIP_TOKEN(str);
-            ptr1 = str;
+static void rebase_labels(Label *list)
+{
+    for (Label *l = list; l; l = l->prev) {
+        Section *s = (l->reloc && l->sect) ? section_by_id(l->sect) : NULL;
+        if (s) {
+            l->address += s->base;
+        }
+    }
+}
 
-            if ((last = *ptr1)) {
-                str++;
-            }
-            *ptr1 = 0;
+static unsigned int place_section(Section *s, unsigned int addr)
+{
+    addr = (addr + s->align - 1) & ~(s->align - 1);
+    s->base = addr;
+    s->placed = 1;
+    return addr + s->size;
+}
 
-            if (ptr1 - ptr > 0) {
-                mac = find_macro(ptr);
-                if (!mac) {
-                    opcode = find_opcode(ptr, &is_byte);
-                }
+/*
+ * Runs between the passes. A layout file has one "<section> [<address>]"
+ * line per section; sections without an address follow the previous one.
+ * Sections it does not name go after everything else in order of first
+ * use, BSS last.
+ */
+static int layout_sections(const char *layout_path)
+{
+    unsigned int addr = abs_addr;
+
+    if (layout_path) {
+        char str[256];
+        int line = 0;
+        FILE *inf = fopen(layout_path, "rb");
+        if (!inf) {
+            diag(DIAG_ERROR, "Can't open layout file: %s\n", layout_path);
+            return 0;
+        }
+        while (fgets(str, sizeof(str), inf)) {
+            char name[64];
+            char where[32];
+            line++;
+            remove_comment(str);
+            int n = sscanf(str, "%63s %31s", name, where);
+            if (n < 1) {
+                continue;
             }
-        } else {
-            mac = find_macro(first_tok);
-            if (!mac) {
-                opcode = find_opcode(first_tok, &is_byte);
+            Section *s = find_section(name);
+            if (!s || s->placed) {
+                diag(DIAG_ERROR, "%s:%d: %s section %s\n", layout_path, line,
+                        s ? "duplicate" : "unknown", name);
+                fclose(inf);
+                return 0;
             }
-
-            if (!mac && !opcode) {
-                label = first_tok;
-                if (last) {
-                    SKIP_BLANK(str);
-
-                    ptr = str;
-                    SKIP_TOKEN(str);
-                    ptr1 = str;
-
-                    if ((last = *ptr1)) {
-                        str++;
-                    }
-                    *ptr1 = 0;
-
-                    mac = find_macro(ptr);
-                    if (!mac) {
-                        opcode = find_opcode(ptr, &is_byte);
-                    }
-                } else {
-                    ptr = str;
-                }
+            if (n == 2) {
+                int hex = (where[0] == '0' && tolower((unsigned char)where[1]) == 'x');
+                addr = strtoul(where, NULL, hex ? 16 : 8);
             }
+            addr = place_section(s, addr);
         }
+        fclose(inf);
+    }
 
-        if (opcode && !opcode_supported(opcode) && opcode->type < pseudo_db) {
-            error = UNSUPPORTED_INSTRUCTION;
-            return 1;
+    addr = abs_addr;
+    for (Section *s = sections; s; s = s->prev) {
+        if (s->placed && s->base + s->size > addr) {
+            addr = s->base + s->size;
         }
-
-        int local_num = 0;
-        int local_suffix = 0;
-        int local_parse = 0;
-        if (label) {
-            local_parse = parse_local_label_token(label, &local_num, &local_suffix);
-            if (local_parse < 0 || local_suffix != 0) {
-                error = SYNTAX_ERROR;
-                return 1;
-            }
-            if (local_parse == 0 && isdigit((unsigned char)label[0])) {
-                error = SYNTAX_ERROR;
-                return 1;
+    }
+    for (int bss = 0; bss <= 1; bss++) {
+        for (int id = 1; id <= sections_count; id++) {
+            Section *s = section_by_id(id);
+            if (!s->placed && !(s->attrs & SECT_BSS) == !bss) {
+                addr = place_section(s, addr);
             }
         }
+    }
 
-        if (label && lsb_enabled && local_parse == 0) {
-            if (!(opcode && opcode->type == pseudo_proc)) {
-                lsb_start_new();
+    for (Section *s = sections; s; s = s->prev) {
+        if (s->base + s->size > MAX_OUTPUT) {
+            diag(DIAG_ERROR, "Section %s does not fit in memory\n", s->name);
+            return 0;
+        }
+        if (s->size && abs_addr > start_addr && s->base < abs_addr && start_addr < s->base + s->size) {
+            diag(DIAG_ERROR, "Section %s overlaps the default section\n", s->name);
+            return 0;
+        }
+        for (Section *o = s->prev; o; o = o->prev) {
+            if (s->size && o->size && s->base < o->base + o->size && o->base < s->base + s->size) {
+                diag(DIAG_ERROR, "Section %s overlaps %s\n", s->name, o->name);
+                return 0;
             }
         }
+    }
 
-        if (label && src_pass == 1 &&
-                (mac || !(opcode && !strcasecmp(opcode->name, "equ")))) {
-            if (local_parse > 0 && lsb_enabled) {
-                add_local_def(local_num, output_addr, src_line);
-            } else {
-                if (in_proc) {
-                    Label *global = find_label(&in_proc->globals, label);
-                    if (global) {
-                        add_label(&labels, label, output_addr, src_line);
-                    } else {
-                        add_label(&in_proc->labels, label, output_addr, src_line);
-                    }
-                } else {
-                    add_label(&labels, label, output_addr, src_line);
-                }
-            }
+    rebase_labels(labels);
+    for (Proc *proc = procs; proc; proc = proc->prev) {
+        rebase_labels(proc->labels);
+    }
+    for (LocalDef *d = local_defs; d; d = d->prev) {
+        Section *s = (d->reloc && d->sect) ? section_by_id(d->sect) : NULL;
+        if (s) {
+            d->address += s->base;
         }
+    }
+    return 1;
+}
 
-        if (mac) {
-            if (src_pass == 2) {
-                list_line_words(list_line, output_addr, NULL, 0, line);
-            }
-            SKIP_BLANK(str);
-            return expand_macro(inf, mac, last ? str : NULL);
+/*
+ * After pass 2: the image runs from the default section through the last
+ * initialized section; BSS sections only reserve addresses past its end.
+ */
+static unsigned int output_end(void);
+
+static void sections_finish(void)
+{
+    section_enter(NULL);
+    abs_start = start_addr;
+    if (!sections) {
+        abs_end = output_end();
+        return;
+    }
+    abs_end = abs_addr;
+
+    unsigned int start = (abs_end > abs_start) ? abs_start : MAX_OUTPUT;
+    unsigned int end = (abs_end > abs_start) ? abs_end : 0;
+    for (Section *s = sections; s; s = s->prev) {
+        if ((s->attrs & SECT_BSS) || !s->size) {
+            continue;
+        }
+        if (s->base < start) {
+            start = s->base;
         }
+        if (s->base + s->size > end) {
+            end = s->base + s->size;
+        }
+    }
+    if (start < end) {
+        start_addr = start;
+        output_addr = end;
+    } else {
+        output_addr = start_addr;
+    }
+    tail_zero_start = -1;
+}
 
-//fprintf(stderr, ">>>%s\n", line);
-//fprintf(stderr, "OPCODE: %s %d %X %X\n", opcode->name, opcode->type, opcode->op, opcode->ext_op);
+static int match(char **str, char c)
+{
+    SKIP_BLANK(*str);
 
-        if (opcode && !strcmp(opcode->name, "include")) {
-            char name[512];
-            if (label) {
-                error = SYNTAX_ERROR;
-                return 1;
+    if (*(*str) != c) {
+        return 0;
+    }
+
+    (*str)++;
+    return 1;
+}
+
+static int exp2_(char **str);
+
+static int toint(char c)
+{
+    if (isdigit(c)) {
+        return (c - '0');
+    } else if (isxdigit(c)) {
+        if (isupper(c)) {
+            return (c - 'A' + 10);
+        } else {
+            return (c - 'a' + 10);
+        }
+    } else {
+        error = INVALID_NUMBER;
+        return 0;
+    }
+}
+
+static int hexnum(char **str)
+{
+    int n = 0;
+    if (!isxdigit(*(*str))) {
+        error = INVALID_HEX_NUMBER;
+        return 0;
+    }
+    while (isxdigit(*(*str))) {
+        n = n * 16 + toint(*(*str)++);
+    }
+    return n;
+}
+
+static int binary(char **str)
+{
+    int n = 0;
+    if (*(*str) != '0' && *(*str) != '1') {
+        error = INVALID_BINARY_NUMBER;
+        return 0;
+    }
+    while (*(*str) == '0' || *(*str) == '1') {
+        n = n * 2 + *(*str)++ - '0';
+    }
+    return n;
+}
+
+static int decimal_with_dot(char **str)
+{
+    int n = 0;
+    if (!isdigit(*(*str))) {
+        error = INVALID_DECIMAL_NUMBER;
+        return 0;
+    }
+    while (isdigit(*(*str))) {
+        n = n * 10 + *(*str)++ - '0';
+    }
+    if (*(*str) == '.') {
+        (*str)++;
+        return n;
+    }
+    return n;
+}
+
+static int octal_default(char **str)
+{
+    int n = 0;
+    if (*(*str) < '0' || *(*str) > '7') {
+        error = INVALID_OCTAL_NUMBER;
+        return 0;
+    }
+    while (*(*str) >= '0' && *(*str) <= '7') {
+        n = n * 8 + *(*str)++ - '0';
+    }
+    return n;
+}
+
+static int number(char **str)
+{
+    if (*(*str) == '0' && (*(*str + 1) == 'd' || *(*str + 1) == 'D')) {
+        *str += 2;
+        return decimal_with_dot(str);
+    }
+    if (*(*str) == '0' && (*(*str + 1) == 'x' || *(*str + 1) == 'X')) {
+        *str += 2;
+        return hexnum(str);
+    }
+    if (*(*str) == '0' && (*(*str + 1) == 'b' || *(*str + 1) == 'B')) {
+        *str += 2;
+        return binary(str);
+    }
+    return octal_default(str);
+}
+
+static int character(char **str)
+{
+    char c;
+
+    c = *(*str)++;
+    if (*(*str) == '\'') {
+        (*str)++;
+    }
+    return c;
+}
+
+static int operand(char **str)
+{
+    char *ptr = *str;
+    char tmp[256];
+    char *ptr1 = tmp;
+
+    while (*ptr && (isalnum(*ptr) || *ptr == '_' || *ptr == ':' || *ptr == '.' || *ptr == '$')) {
+        if (ptr1 - tmp >= 255) {
+            error = SYNTAX_ERROR;
+            return 0;
+        }
+        *ptr1++ = *ptr++;
+    }
+    *ptr1 = 0;
+
+    int local_num = 0;
+    int local_suffix = 0;
+    int local_parse = parse_local_label_token(tmp, &local_num, &local_suffix);
+    if (local_parse < 0) {
+        error = SYNTAX_ERROR;
+        return 0;
+    }
+
+    if (local_parse > 0 && lsb_enabled) {
+        int dir = (local_suffix == 'f') ? 1 : -1;
+        exp_symbolic = 1;
+        if (local_suffix == 0) {
+            dir = -1;
+        }
+        if (instr_branch && src_pass == 1 && dir < 0) {
+            LocalDef *def = resolve_local(local_defs, local_num, -1, output_addr + 1);
+            if (def) {
+                instrument_mark(def->seq, INSTR_HEAD);
             }
-            File *file = malloc(sizeof(File));
-            file->src_line = src_line + 1;
-            file->in_file_path = in_file_path;
-            file->in_file = in_file;
-            file->prev = files;
-            files = file;
-            src_line = 1;
-            SKIP_BLANK(str);
-            if (*str == '\"' || *str == '\'') {
-                char quote = *str++;
-                char *end = strrchr(str, quote);
-                if (end) {
-                    *end = 0;
-                }
+        }
+        if (src_pass == 2) {
+            LocalDef *def = resolve_local(local_defs, local_num, dir, output_addr);
+            if (!def) {
+                error = SYNTAX_ERROR;
+                return 0;
             }
-            snprintf(name, sizeof(name), "%s/%s", in_file_path, str);
-            fprintf(stderr, "\r%s\n", name);
-            in_file = fopen(name, "rb");
-            if (!in_file) {
-                error = CANNOT_OPEN_FILE;
-                return 1;
+            *str = ptr;
+            if (def->reloc) {
+                reloc_add(def->sect, -1, 1);
             }
-            {
-                char dirbuf[512];
-                strncpy(dirbuf, name, sizeof(dirbuf) - 1);
-                dirbuf[sizeof(dirbuf) - 1] = 0;
-                get_file_path(dirbuf);
-                in_file_path = strdup(dirbuf);
+            return def->address;
+        } else if (eval_prev && resolve_local(prev_local_defs, local_num, dir, eval_pc)) {
+            LocalDef *def = resolve_local(prev_local_defs, local_num, dir, eval_pc);
+            *str = ptr;
+            if (def->reloc) {
+                reloc_add(def->sect, -1, 1);
             }
+            return def->address;
+        } else {
+            to_second_pass = 1;
+            *str = ptr;
             return 0;
-        } else if (opcode && !strcmp(opcode->name, "equ")) {
-            if (!label) {
-                error = MISSED_NAME_FOR_EQU;
-            } else {
-                SKIP_BLANK(str);
-                unsigned int val = exp_(&str);
-                if (src_pass == 2) {
-                    int local_num = 0;
-                    int local_suffix = 0;
-                    int local_parse = parse_local_label_token(label, &local_num, &local_suffix);
-                    if (local_parse < 0 || local_suffix != 0) {
-                        error = SYNTAX_ERROR;
-                        return 1;
-                    }
-                    if (local_parse > 0 && lsb_enabled) {
-                        add_local_def(local_num, val, src_line);
-                    } else {
-                        if (in_proc) {
-                            add_label(&in_proc->equs, label, val, src_line);
-                        } else {
-                            add_label(&equs, label, val, src_line);
-                        }
-                    }
-                }
+        }
+    } else if (local_parse > 0 && !lsb_enabled && local_suffix != 0) {
+        error = SYNTAX_ERROR;
+        return 0;
+    }
 
-                if (src_pass == 2) {
-                    unsigned short w = val & 0xFFFF;
-                    list_line_words(list_line, output_addr, &w, 1, line);
-                }
-            }
-        } else if (opcode && !strcmp(opcode->name, "proc")) {
-            if (!label) {
-                error = MISSED_NAME_FOR_PROC;
-            } else {
-                if (in_proc) {
-                    error = NESTED_PROC_UNSUPPORTED;
-                } else {
-                    if (!lsb_push_new()) {
-                        error = SYNTAX_ERROR;
-                        return 1;
-                    }
-                    in_proc = find_proc(&procs, label);
-                    if (!in_proc) {
-                        in_proc = add_proc(&procs, label, src_line);
-                    }
-                }
-                if (src_pass == 2) {
-                    list_line_words(list_line, output_addr, NULL, 0, line);
-                }
-            }
-        } else if (opcode && !strcmp(opcode->name, "endp")) {
-            in_proc = NULL;
-            lsb_pop();
+    Label *label = NULL;
 
-            if (src_pass == 2) {
-                list_line_words(list_line, output_addr, NULL, 0, line);
-            }
-        } else if (opcode && !strcmp(opcode->name, "global")) {
-            if (!in_proc) {
-                error = ONLY_INSIDE_PROC;
-            } else if (src_pass == 1) {
-                do {
-                    SKIP_BLANK(str);
-                    char *name = str;
-                    SKIP_TOKEN(str);
-                    if ((last = *str)) {
-                        *str++ = 0;
-                    }
-                    add_label(&in_proc->globals, name, output_addr, src_line);
-                } while (*str && (last == ',' || match(&str, ',') == 1));
+    gc_note_ref(tmp);
 
-                if (src_pass == 2) {
-                    list_line_words(list_line, output_addr, NULL, 0, line);
-                }
-            }
-        } else if (opcode && !strcmp(opcode->name, "macro")) {
-            SKIP_BLANK(str);
-            char *name = str;
-            SKIP_TOKEN(str);
-            char *params = NULL;
-            if (*str) {
-                *str++ = 0;
-                params = str;
-            } else {
-                *str = 0;
-            }
-            if (src_pass == 2) {
-                list_line_words(list_line, output_addr, NULL, 0, line);
-            }
-            return add_macro(inf, name, params);
-        } else if (opcode && !strcmp(opcode->name, "org")) {
-            SKIP_BLANK(str);
-            start_addr = exp_(&str);
-            output_addr = start_addr;
-            if (src_pass == 2) {
-                list_line_words(list_line, output_addr, NULL, 0, line);
-            }
-        } else if (opcode && opcode->type == pseudo_cpu) {
-            if (label) {
-                error = SYNTAX_ERROR;
-                return 1;
-            }
-            SKIP_BLANK(str);
-            if (!*str) {
-                error = SYNTAX_ERROR;
-                return 1;
-            }
-            char name_buf[64];
-            if (*str == '\"' || *str == '\'') {
-                char quote = *str++;
-                char *end = strrchr(str, quote);
-                if (!end) {
-                    error = EXPECTED_CLOSE_QUOTE;
-                    return 1;
-                }
-                *end = 0;
-                strncpy(name_buf, str, sizeof(name_buf) - 1);
-                name_buf[sizeof(name_buf) - 1] = 0;
-            } else {
-                char *p = str;
-                int i = 0;
-                while (*p && !isblank((unsigned char)*p) && *p != ',' && i < (int)sizeof(name_buf) - 1) {
-                    name_buf[i++] = *p++;
-                }
-                name_buf[i] = 0;
-            }
-            if (!set_cpu_by_name(name_buf)) {
-                error = SYNTAX_ERROR;
-                return 1;
-            }
-            if (src_pass == 2) {
-                list_line_words(list_line, output_addr, NULL, 0, line);
-            }
-        } else if (opcode && opcode->type == pseudo_enabl) {
-            if (label) {
-                error = SYNTAX_ERROR;
-                return 1;
-            }
-            SKIP_BLANK(str);
-            char *p = str;
-            SKIP_TOKEN(p);
-            char saved = *p;
-            *p = 0;
-            int ok = (!strcasecmp(str, "lsb"));
-            *p = saved;
-            if (!ok) {
-                error = SYNTAX_ERROR;
-                return 1;
+    if (in_proc) {
+        label = find_label(&in_proc->labels, tmp);
+
+        if (!label) {
+            label = find_label(&in_proc->equs, tmp);
+        }
+    }
+
+    if (!label) {
+        label = find_label(&labels, tmp);
+    }
+
+    if (!label) {
+        label = find_label(&equs, tmp);
+    }
+
+    if (label) {
+        *str = ptr;
+        exp_symbolic = 1;
+        if (label->reloc) {
+            reloc_add(label->sect, -1, label->reloc);
+        }
+        return (eval_prev && label->stamp == layout_gen) ? label->prev_address : label->address;
+    } else if (match(str, '%')) {
+        return binary(str);
+    } else if (match(str, '\'')) {
+        return character(str);
+    } else if (match(str, '*')) {
+        exp_symbolic = 1;
+        reloc_add(cur_sect, -1, 1);
+        return eval_prev ? eval_pc : output_addr;
+    } else if (isdigit(*(*str))) {
+        char *tmp = *str;
+        if (*tmp == '0' && (*(tmp + 1) == 'x' || *(tmp + 1) == 'X' ||
+                            *(tmp + 1) == 'b' || *(tmp + 1) == 'B' ||
+                            *(tmp + 1) == 'd' || *(tmp + 1) == 'D')) {
+            return number(str);
+        }
+        while (isdigit(*tmp)) {
+            tmp++;
+        }
+        if (*tmp == '.') {
+            return decimal_with_dot(str);
+        }
+        return octal_default(str);
+    } else {
+        *str = ptr;
+        exp_symbolic = 1;
+        if (src_pass == 2 && obj_mode && is_ident_start((unsigned char)tmp[0])) {
+            Label *ext = find_label(&externs, tmp);
+            if (!ext) {
+                ext = add_label(&externs, tmp, externs_count++, 0, src_line);
             }
-            lsb_enabled = 1;
-            lsb_start_new();
-            if (src_pass == 2) {
-                list_line_words(list_line, output_addr, NULL, 0, line);
+            if (ext) {
+                reloc_add(-1, ext->address, 1);
             }
-        } else if (opcode && opcode->type == pseudo_dsabl) {
-            if (label) {
+        } else if (src_pass == 2) {
+            error = CANNOT_RESOLVE_REF;
+        } else {
+            to_second_pass = 1;
+        }
+        return 0;
+    }
+}
+
+static int exp8(char **str)
+{
+    int n;
+    if (match(str, '(')) {
+        n = exp2_(str);
+        if (match(str, ')')) {
+            return n;
+        } else {
+            error = MISSED_BRACKET;
+            return 0;
+        }
+    }
+    return operand(str);
+}
+
+static int exp7(char **str)
+{
+    int t0 = reloc_nterms;
+    if (match(str, '~')) {
+        int n = 0xFFFF ^ exp8(str);
+        reloc_check_plain(t0);
+        return n;
+    }
+    if (match(str, '-')) {
+        int n = -exp8(str);
+        reloc_negate(t0);
+        return n;
+    }
+    return exp8(str);
+}
+
+static int exp6(char **str)
+{
+    int n;
+    int t0 = reloc_nterms;
+    n = exp7(str);
+    while (*(*str)) {
+        if (match(str, '*')) {
+            n = n * exp7(str);
+            reloc_check_plain(t0);
+        } else if (match(str, '/')) {
+            int divisor = exp7(str);
+            reloc_check_plain(t0);
+            if (divisor == 0) {
                 error = SYNTAX_ERROR;
-                return 1;
+                return 0;
             }
-            SKIP_BLANK(str);
-            char *p = str;
-            SKIP_TOKEN(p);
-            char saved = *p;
-            *p = 0;
-            int ok = (!strcasecmp(str, "lsb"));
-            *p = saved;
-            if (!ok) {
+            n = n / divisor;
+        } else if (match(str, '%')) {
+            int divisor = exp7(str);
+            reloc_check_plain(t0);
+            if (divisor == 0) {
                 error = SYNTAX_ERROR;
-                return 1;
-            }
-            lsb_enabled = 0;
-            if (src_pass == 2) {
-                list_line_words(list_line, output_addr, NULL, 0, line);
-            }
-        } else if (opcode && opcode->type == pseudo_chksum) {
-            use_chksum = 1;
-            chksum_addr = output_addr;
-            emit_word(0);
-            if (src_pass == 2) {
-                unsigned short w = 0;
-                list_line_words(list_line, output_addr - 2, &w, 1, line);
+                return 0;
             }
-        } else if (opcode) {
-            unsigned int old_addr = output_addr;
-            unsigned short word = 0;
-            Operand src_op;
-            Operand dst_op;
-
-            if (opcode->type == pseudo_db) {
-                get_bytes(str);
-            } else if (opcode->type == pseudo_dw) {
-                get_words(str);
-            } else if (opcode->type == pseudo_ds
-                       || opcode->type == pseudo_dsw
-                       || opcode->type == pseudo_align) {
-                int count;
-                int fill = 0;
-
-                if (opcode->type == pseudo_align && !strcmp(opcode->name, "even")) {
-                    SKIP_BLANK(str);
-                    if (*str) {
-                        error = EXTRA_SYMBOLS;
-                        return 1;
-                    }
-                    count = 1;
-                } else {
-                    count = exp_(&str);
-                }
+            n = n % divisor;
+        } else {
+            break;
+        }
+    }
+    return n;
+}
 
-                if (match(&str, ',')) {
-                    int val = exp_(&str) & 0xFFFF;
-                    if (opcode->type == pseudo_ds) {
-                        fill = val & 0xFF;
-                    } else if (opcode->type == pseudo_dsw) {
-                        fill = val & 0xFFFF;
-                    } else {
-                        fill = val & 0xFF;
-                    }
-                }
+static int exp5(char **str)
+{
+    int n;
+    n = exp6(str);
+    while (*(*str)) {
+        if (match(str, '+')) {
+            n = n + exp6(str);
+        } else if (match(str, '-')) {
+            int t1 = reloc_nterms;
+            n = n - exp6(str);
+            reloc_negate(t1);
+        } else {
+            break;
+        }
+    }
+    return n;
+}
 
-                if (opcode->type == pseudo_align) {
-                    int n = 1 << count;
-                    if (n > 1) {
-                        n = n - 1;
-                    }
-                    count = ((output_addr + n) & ~n) - output_addr;
-                }
+static int exp4(char **str)
+{
+    int n;
+    int t0 = reloc_nterms;
+    n = exp5(str);
+    while (*(*str)) {
+        if (match(str, '&')) {
+            n = n & exp5(str);
+            reloc_check_plain(t0);
+        } else {
+            break;
+        }
+    }
+    return n;
+}
 
-                if (opcode->type == pseudo_dsw) {
+static int exp3(char **str)
+{
+    int n;
+    int t0 = reloc_nterms;
+    n = exp4(str);
+    while (*(*str)) {
+        if (match(str, '^')) {
+            n = n ^ exp4(str);
+            reloc_check_plain(t0);
+        } else {
+            break;
+        }
+    }
+    return n;
+}
+
+static int exp2_(char **str)
+{
+    int n;
+    int t0 = reloc_nterms;
+    n = exp3(str);
+    while (*(*str)) {
+        if (match(str, '|')) {
+            n = n | exp3(str);
+            reloc_check_plain(t0);
+        } else {
+            break;
+        }
+    }
+    return n;
+}
+
+static int exp_(char **str)
+{
+    if (match(str, '/')) {
+        int t0 = reloc_nterms;
+        int n = exp2_(str) >> 8;
+        reloc_check_plain(t0);
+        return n;
+    } else {
+        return (exp2_(str));
+    }
+}
+
+typedef struct Operand {
+    int mode;
+    int reg;
+    int has_ext;
+    int ext;
+    int pc_relative;
+    int literal;
+    RelocInfo reloc;
+} Operand;
+
+static int operand_spec(Operand *op)
+{
+    return ((op->mode & 0x07) << 3) | (op->reg & 0x07);
+}
+
+static int parse_register(char **str, int *out_reg)
+{
+    Register *reg = find_register_in_string(str);
+    if (!reg) {
+        return 0;
+    }
+    *out_reg = reg->n;
+    return 1;
+}
+
+static int parse_operand(char **str, Operand *op)
+{
+    int deferred = 0;
+    char *ptr = *str;
+
+    SKIP_BLANK(ptr);
+
+    op->reloc.invalid = 0;
+    op->reloc.sym = -1;
+    op->reloc.nsect = 0;
+    op->literal = 0;
+
+    if (match(&ptr, '@')) {
+        deferred = 1;
+    }
+
+    if (match(&ptr, '#')) {
+        op->mode = deferred ? 3 : 2;
+        op->reg = 7;
+        op->has_ext = 1;
+        reloc_begin();
+        exp_symbolic = 0;
+        op->ext = exp_(&ptr);
+        reloc_end(&op->reloc);
+        op->literal = !exp_symbolic && reloc_info_absolute(&op->reloc);
+        op->pc_relative = 0;
+        *str = ptr;
+        return 1;
+    }
+
+    if (match(&ptr, '-')) {
+        if (!match(&ptr, '(')) {
+            error = SYNTAX_ERROR;
+            return 0;
+        }
+        if (!parse_register(&ptr, &op->reg)) {
+            error = MISSED_REGISTER_ARG_2;
+            return 0;
+        }
+        if (!match(&ptr, ')')) {
+            error = MISSED_BRACKET;
+            return 0;
+        }
+        op->mode = deferred ? 5 : 4;
+        op->has_ext = 0;
+        op->pc_relative = 0;
+        *str = ptr;
+        return 1;
+    }
+
+    if (match(&ptr, '(')) {
+        if (!parse_register(&ptr, &op->reg)) {
+            error = MISSED_REGISTER_ARG_2;
+            return 0;
+        }
+        if (!match(&ptr, ')')) {
+            error = MISSED_BRACKET;
+            return 0;
+        }
+        if (match(&ptr, '+')) {
+            op->mode = deferred ? 3 : 2;
+        } else {
+            op->mode = 1;
+        }
+        op->has_ext = 0;
+        op->pc_relative = 0;
+        *str = ptr;
+        return 1;
+    }
+
+    if (deferred) {
+        int reg;
+        char *tmp = ptr;
+        if (parse_register(&tmp, &reg)) {
+            op->mode = 1;
+            op->reg = reg;
+            op->has_ext = 0;
+            op->pc_relative = 0;
+            *str = tmp;
+            return 1;
+        }
+    }
+
+    {
+        char *tmp = ptr;
+        int reg;
+        if (parse_register(&tmp, &reg)) {
+            op->mode = 0;
+            op->reg = reg;
+            op->has_ext = 0;
+            op->pc_relative = 0;
+            *str = tmp;
+            return 1;
+        }
+    }
+
+    {
+        char *tmp = ptr;
+        reloc_begin();
+        int val = exp_(&tmp);
+        reloc_end(&op->reloc);
+        int has_symbol = 0;
+        for (char *p = ptr; p < tmp; p++) {
+            if (isalpha(*p) || *p == '_' || *p == '.' || *p == ':' || *p == '$') {
+                has_symbol = 1;
+                break;
+            }
+        }
+        SKIP_BLANK(tmp);
+        if (match(&tmp, '(')) {
+            if (!parse_register(&tmp, &op->reg)) {
+                error = MISSED_REGISTER_ARG_2;
+                return 0;
+            }
+            if (!match(&tmp, ')')) {
+                error = MISSED_BRACKET;
+                return 0;
+            }
+            op->mode = deferred ? 7 : 6;
+            op->has_ext = 1;
+            op->ext = val;
+            op->pc_relative = (op->reg == 7) ? has_symbol : 0;
+            *str = tmp;
+            return 1;
+        }
+
+        op->mode = deferred ? 7 : 6;
+        op->reg = 7;
+        op->has_ext = 1;
+        op->ext = val;
+        op->pc_relative = 1;
+        *str = tmp;
+        return 1;
+    }
+}
+
+/* Branch targets are PC-relative and must stay in the current section. */
+static void reloc_check_branch(void)
+{
+    RelocInfo ri;
+    if (!reloc_mode || src_pass != 2) {
+        return;
+    }
+    reloc_end(&ri);
+    reloc_info_add(&ri, cur_sect, -1);
+    if (!reloc_info_fixed(&ri)) {
+        error = NOT_RELOCATABLE;
+    }
+}
+
+static void emit_operand_ext(Operand *op)
+{
+    if (!op->has_ext) {
+        return;
+    }
+    unsigned int ext_addr = output_addr;
+    int ext_val = op->ext;
+    RelocInfo reloc = op->reloc;
+    if (op->pc_relative) {
+        ext_val = op->ext - (int)(ext_addr + 2);
+        reloc_info_add(&reloc, cur_sect, -1);
+    }
+    reloc_word(ext_addr, &reloc);
+    emit_word(ext_val & 0xFFFF);
+}
+
+/*
+ * .cycles_begin name, max / .cycles_end: pass 2 sums the records emitted
+ * in between, with constant-count SOB loops multiplied out, and fails when
+ * the total is over `max` or a loop inside has no constant count.
+ */
+typedef struct {
+    char name[32];
+    unsigned long max;
+    int first;
+    const char *file;
+    int line;
+} CycleBudget;
+
+#define CYCLE_BUDGET_MAX 16
+static CycleBudget budgets[CYCLE_BUDGET_MAX];
+static int budget_sp = 0;
+
+static int cycles_begin(char *str)
+{
+    if (budget_sp >= CYCLE_BUDGET_MAX) {
+        error = CYCLES_NESTING;
+        return 0;
+    }
+    CycleBudget *b = &budgets[budget_sp];
+    SKIP_BLANK(str);
+    char *name = str;
+    SKIP_TOKEN(str);
+    if (str == name) {
+        error = SYNTAX_ERROR;
+        return 0;
+    }
+    snprintf(b->name, sizeof(b->name), "%.*s", (int)(str - name), name);
+    if (!match(&str, ',')) {
+        error = EXPECTED_ARG_2;
+        return 0;
+    }
+    SKIP_BLANK(str);
+    b->max = (unsigned long)exp_(&str);
+    b->first = cycle_count;
+    b->file = in_file_name;
+    b->line = src_line;
+    if (src_pass == 2) {
+        budget_sp++;
+    }
+    return 1;
+}
+
+/* Closes the innermost budget; returns its worst-case cycles or -1. */
+static long cycles_end(void)
+{
+    const CpuTiming *t = cpu_timing();
+    CycleLoops lp;
+
+    if (budget_sp == 0) {
+        error = CYCLES_NO_BEGIN;
+        return -1;
+    }
+    CycleBudget *b = &budgets[--budget_sp];
+    if (!cycles_loops(&lp, b->first, cycle_count)) {
+        error = NO_MEMORY_FOR_LABEL;
+        return -1;
+    }
+    unsigned long long total = 0;
+    for (int i = b->first; i < cycle_count; i++) {
+        if (lp.start[i] >= 0 && !lp.times[i]) {
+            diag(DIAG_ERROR, "%s:%d: Cycle budget %s: loop %06o-%06o has no constant count\n",
+                    b->file, b->line, b->name, cycle_recs[lp.start[i]].addr, cycle_recs[i].addr);
+            cycles_loops_free(&lp);
+            error = CYCLES_UNBOUNDED;
+            return -1;
+        }
+        total += cycle_recs[i].cycles * lp.mult[i];
+    }
+    cycles_loops_free(&lp);
+    if (total > b->max) {
+        diag(DIAG_ERROR, "%s:%d: Cycle budget %s: %llu cycles on %s, limit %lu\n",
+                b->file, b->line, b->name, total, t->name, b->max);
+        error = CYCLES_EXCEEDED;
+        return -1;
+    }
+    snprintf(list_note, sizeof(list_note), "; cycles %s: %llu of %lu", b->name, total, b->max);
+    return (long)total;
+}
+
+/*
+ * --optimize: every instruction is numbered in source order. Pass 1 records
+ * the condition codes it reads and sets, whether control can enter at it
+ * (a label, data or a directive before it) or leave at it, and whether it
+ * matches a rewrite. peephole_decide() keeps a rewrite only when each flag
+ * it would leave different is set again before anything can read it; the
+ * layout passes and pass 2 then emit the shorter form.
+ */
+#define CC_C 001
+#define CC_V 002
+#define CC_Z 004
+#define CC_N 010
+#define CC_ALL (CC_N | CC_Z | CC_V | CC_C)
+
+static const struct {
+    const char *name;
+    unsigned char reads;
+    unsigned char sets;
+} cc_table[] = {
+    { "mov",  0,    CC_N | CC_Z | CC_V },
+    { "cmp",  0,    CC_ALL },
+    { "bit",  0,    CC_N | CC_Z | CC_V },
+    { "bic",  0,    CC_N | CC_Z | CC_V },
+    { "bis",  0,    CC_N | CC_Z | CC_V },
+    { "add",  0,    CC_ALL },
+    { "sub",  0,    CC_ALL },
+    { "clr",  0,    CC_ALL },
+    { "com",  0,    CC_ALL },
+    { "inc",  0,    CC_N | CC_Z | CC_V },
+    { "dec",  0,    CC_N | CC_Z | CC_V },
+    { "neg",  0,    CC_ALL },
+    { "adc",  CC_C, CC_ALL },
+    { "sbc",  CC_C, CC_ALL },
+    { "tst",  0,    CC_ALL },
+    { "ror",  CC_C, CC_ALL },
+    { "rol",  CC_C, CC_ALL },
+    { "asr",  0,    CC_ALL },
+    { "asl",  0,    CC_ALL },
+    { "swab", 0,    CC_ALL },
+    { "sxt",  CC_N, CC_Z | CC_V },
+    { "mul",  0,    CC_ALL },
+    { "div",  0,    CC_ALL },
+    { "ash",  0,    CC_ALL },
+    { "ashc", 0,    CC_ALL },
+    { "xor",  0,    CC_N | CC_Z | CC_V },
+};
+
+/* Flags read by a conditional branch, by (base >> 9) & 3 plus 4 for 0100000. */
+static const unsigned char cc_branch_reads[8] = {
+    0, CC_Z, CC_N | CC_V, CC_N | CC_Z | CC_V, CC_N, CC_C | CC_Z, CC_V, CC_C
+};
+
+/* Condition codes an instruction reads; all of them when it is not known. */
+static int cc_reads(const OpCode *opcode)
+{
+    switch (opcode->type) {
+    case op_ccode:
+    case op_jmp:
+    case op_jsr:
+    case op_rts:
+    case op_sob:
+        return 0;
+    case op_branch:
+        return cc_branch_reads[((opcode->base >> 9) & 3) | ((opcode->base & 0100000) ? 4 : 0)];
+    default:
+        break;
+    }
+    for (size_t i = 0; i < sizeof(cc_table) / sizeof(cc_table[0]); i++) {
+        if (!strcmp(cc_table[i].name, opcode->name)) {
+            return cc_table[i].reads;
+        }
+    }
+    return CC_ALL;
+}
+
+/* Condition codes an instruction sets whatever they were before. */
+static int cc_sets(const OpCode *opcode)
+{
+    if (opcode->type == op_ccode) {
+        return opcode->base & CC_ALL;
+    }
+    for (size_t i = 0; i < sizeof(cc_table) / sizeof(cc_table[0]); i++) {
+        if (!strcmp(cc_table[i].name, opcode->name)) {
+            return cc_table[i].sets;
+        }
+    }
+    return 0;
+}
+
+/* Starts following N, Z and V from a possible site in pass 1. */
+static void instrument_watch(int seq, Proc *proc)
+{
+    if (src_pass != 1) {
+        return;
+    }
+    if (instr_npending == INSTR_PENDING_MAX) {
+        instrument_live(seq, proc);
+        return;
+    }
+    instr_pending[instr_npending].seq = seq;
+    instr_pending[instr_npending].proc = proc;
+    instr_pending[instr_npending].live = CC_N | CC_Z | CC_V;
+    instr_npending++;
+}
+
+/*
+ * Advances the pending sites over an instruction that reads and sets these
+ * flags; `leaves` when control may go elsewhere after it (a branch, a jump,
+ * a write to PC, or data the code would run into).
+ */
+static void instrument_flow(int reads, int sets, int leaves)
+{
+    int n = 0;
+
+    for (int i = 0; i < instr_npending; i++) {
+        InstrPending *p = &instr_pending[i];
+        if (p->live & reads) {
+            instrument_live(p->seq, p->proc);
+            continue;
+        }
+        p->live &= ~sets;
+        if (!p->live) {
+            continue;
+        }
+        if (leaves) {
+            instrument_live(p->seq, p->proc);
+            continue;
+        }
+        instr_pending[n++] = *p;
+    }
+    instr_npending = n;
+}
+
+enum {
+    PEEP_NONE = 0,
+    PEEP_CLR,       /* MOV #0,dst    -> CLR dst */
+    PEEP_INC,       /* ADD #1,dst    -> INC dst */
+    PEEP_DEC,       /* SUB #1,dst    -> DEC dst */
+    PEEP_TST,       /* CMP src,#0    -> TST src */
+    PEEP_DROP,      /* MOV Rn,Rn     -> nothing */
+    PEEP_PUSH,      /* SUB #2,SP     -> TST -(SP) */
+    PEEP_POP,       /* ADD #2,SP     -> TST (SP)+ */
+    PEEP_POP2,      /* ADD #4,SP     -> CMP (SP)+,(SP)+ */
+};
+
+static const struct {
+    const char *to;
+    unsigned char differs;  /* flags the rewrite may leave different */
+    unsigned char sets;     /* flags the rewritten form sets */
+} peep_forms[] = {
+    [PEEP_CLR]  = { "clr",             CC_C,                CC_ALL },
+    [PEEP_INC]  = { "inc",             CC_C,                CC_N | CC_Z | CC_V },
+    [PEEP_DEC]  = { "dec",             CC_C,                CC_N | CC_Z | CC_V },
+    [PEEP_TST]  = { "tst",             0,                   CC_ALL },
+    [PEEP_DROP] = { "nothing",         CC_N | CC_Z | CC_V,  0 },
+    [PEEP_PUSH] = { "tst -(sp)",       CC_ALL,              CC_ALL },
+    [PEEP_POP]  = { "tst (sp)+",       CC_ALL,              CC_ALL },
+    [PEEP_POP2] = { "cmp (sp)+,(sp)+", CC_ALL,              CC_ALL },
+};
+
+static PeepState *peep_state(int seq)
+{
+    if (seq >= peep_size) {
+        int size = peep_size ? peep_size * 2 : 256;
+        while (size <= seq) {
+            size *= 2;
+        }
+        PeepState *tmp = realloc(peep, sizeof(PeepState) * size);
+        if (!tmp) {
+            error = NO_MEMORY_FOR_LABEL;
+            return NULL;
+        }
+        memset(tmp + peep_size, 0, sizeof(PeepState) * (size - peep_size));
+        peep = tmp;
+        peep_size = size;
+    }
+    if (seq >= peep_count) {
+        peep_count = seq + 1;
+    }
+    return &peep[seq];
+}
+
+static int is_literal(const Operand *op, int val)
+{
+    return op->mode == 2 && op->reg == 7 && op->literal && (op->ext & 0xFFFF) == val;
+}
+
+static int peephole_match(const OpCode *opcode, int is_byte, const Operand *src, const Operand *dst)
+{
+    int is_sp = (dst->mode == 0 && dst->reg == 6);
+
+    if (!strcmp(opcode->name, "mov")) {
+        if (is_literal(src, 0)) {
+            return PEEP_CLR;
+        }
+        if (!is_byte && src->mode == 0 && dst->mode == 0 && src->reg == dst->reg && src->reg != 7) {
+            return PEEP_DROP;
+        }
+    } else if (!strcmp(opcode->name, "cmp")) {
+        if (is_literal(dst, 0)) {
+            return PEEP_TST;
+        }
+    } else if (!strcmp(opcode->name, "add")) {
+        if (is_sp && is_literal(src, 2)) {
+            return PEEP_POP;
+        }
+        if (is_sp && is_literal(src, 4)) {
+            return PEEP_POP2;
+        }
+        if (is_literal(src, 1)) {
+            return PEEP_INC;
+        }
+        if (is_literal(src, 0177777)) {
+            return PEEP_DEC;
+        }
+    } else if (!strcmp(opcode->name, "sub")) {
+        if (is_sp && is_literal(src, 2)) {
+            return PEEP_PUSH;
+        }
+        if (is_literal(src, 1)) {
+            return PEEP_DEC;
+        }
+        if (is_literal(src, 0177777)) {
+            return PEEP_INC;
+        }
+    }
+    return PEEP_NONE;
+}
+
+/* Emits the rewrite decided for this instruction; 0 to emit it as written. */
+static int peephole_emit(int kind, const OpCode *opcode, int is_byte, Operand *src, Operand *dst)
+{
+    if (!kind || peep_seq >= peep_count || peep[peep_seq].apply != kind) {
+        return 0;
+    }
+
+    unsigned int start = output_addr;
+    int byte = is_byte ? 0100000 : 0;
+    switch (kind) {
+    case PEEP_CLR:
+        /* MOVB sign-extends into a register, so only word CLR matches it */
+        emit_word(005000 | (dst->mode ? byte : 0) | operand_spec(dst));
+        emit_operand_ext(dst);
+        break;
+    case PEEP_INC:
+        emit_word(005200 | operand_spec(dst));
+        emit_operand_ext(dst);
+        break;
+    case PEEP_DEC:
+        emit_word(005300 | operand_spec(dst));
+        emit_operand_ext(dst);
+        break;
+    case PEEP_TST:
+        emit_word(005700 | byte | operand_spec(src));
+        emit_operand_ext(src);
+        break;
+    case PEEP_PUSH:
+        emit_word(005746);
+        break;
+    case PEEP_POP:
+        emit_word(005726);
+        break;
+    case PEEP_POP2:
+        emit_word(022626);
+        break;
+    }
+
+    if (src_pass == 2) {
+        int saved = 1 + src->has_ext + dst->has_ext - (int)(output_addr - start) / 2;
+        int cycles = insn_cycles(opcode->base | (is_byte ? 0100000 : 0)
+                                 | (operand_spec(src) << 6) | operand_spec(dst));
+        for (unsigned int addr = start; addr < output_addr; addr += insn_length(output_word(addr)) * 2) {
+            cycles -= insn_cycles(output_word(addr));
+        }
+        snprintf(list_note, sizeof(list_note), "; peephole: %s%s -> %s%s, saved %d word%s, %d cycles",
+                 opcode->name, is_byte ? "b" : "", peep_forms[kind].to,
+                 (is_byte && ((kind == PEEP_CLR && dst->mode) || kind == PEEP_TST)) ? "b" : "",
+                 saved, (saved == 1) ? "" : "s", cycles);
+        peep_rewrites++;
+        peep_saved += saved;
+        peep_cycles += cycles;
+    }
+    return 1;
+}
+
+/* Records the instruction just assembled for peephole_decide(). */
+static void peephole_record(const OpCode *opcode, int kind, int to_pc)
+{
+    PeepState *st = peep_state(peep_seq++);
+    if (!st) {
+        return;
+    }
+    st->entry = peep_entry;
+    st->kind = kind;
+    st->exit = 1;
+    st->reads = CC_ALL;
+    st->sets = 0;
+    if (opcode->type == op_ccode) {
+        st->exit = 0;
+        st->reads = 0;
+        st->sets = opcode->base & CC_ALL;
+    } else {
+        for (size_t i = 0; i < sizeof(cc_table) / sizeof(cc_table[0]); i++) {
+            if (!strcmp(cc_table[i].name, opcode->name)) {
+                st->exit = 0;
+                st->reads = cc_table[i].reads;
+                st->sets = cc_table[i].sets;
+                break;
+            }
+        }
+    }
+    st->exit |= to_pc;
+    peep_entry = 0;
+}
+
+/*
+ * Walks the recorded stream backwards so that each candidate sees the flags
+ * set by the already decided (possibly rewritten) instructions after it.
+ * Control entering or leaving before the differing flags are set again
+ * keeps the instruction as written.
+ */
+static int peephole_decide(void)
+{
+    int count = 0;
+
+    for (int i = peep_count - 1; i >= 0; i--) {
+        int kind = peep[i].kind;
+        peep[i].apply = 0;
+        if (!kind) {
+            continue;
+        }
+        int live = peep_forms[kind].differs;
+        for (int j = i + 1; live && j < peep_count; j++) {
+            if (peep[j].entry || peep[j].exit || (peep[j].reads & live)) {
+                break;
+            }
+            live &= ~(peep[j].apply ? peep_forms[peep[j].apply].sets : peep[j].sets);
+        }
+        if (!live) {
+            peep[i].apply = kind;
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * --relax: branches and SOBs are numbered in source order and start short.
+ * Each layout pass measures them on the previous pass's layout (eval_prev)
+ * and promotes the ones out of range for the next pass, until a pass that
+ * started from an unchanged layout changes nothing. Short branches whose
+ * target is a short BR are threaded to that BR's target when it is in reach.
+ */
+static RelaxState *relax_state(int seq)
+{
+    if (seq >= relax_size) {
+        int size = relax_size ? relax_size * 2 : 256;
+        while (size <= seq) {
+            size *= 2;
+        }
+        RelaxState *tmp = realloc(relax, sizeof(RelaxState) * size);
+        if (!tmp) {
+            error = NO_MEMORY_FOR_LABEL;
+            return NULL;
+        }
+        memset(tmp + relax_size, 0, sizeof(RelaxState) * (size - relax_size));
+        relax = tmp;
+        relax_size = size;
+    }
+    if (seq >= relax_count) {
+        relax_count = seq + 1;
+    }
+    return &relax[seq];
+}
+
+static void relax_begin_pass(void)
+{
+    relax_seq = 0;
+    for (int i = 0; i < relax_count; i++) {
+        relax[i].prev_addr = relax[i].addr;
+    }
+}
+
+static int relax_apply(void)
+{
+    int changed = 0;
+    for (int i = 0; i < relax_count; i++) {
+        if (relax[i].next > relax[i].level) {
+            relax[i].level = relax[i].next;
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+static RelaxState *relax_find_br(int addr, int sect)
+{
+    for (int i = 0; i < relax_count; i++) {
+        if (relax[i].is_br && relax[i].level == 0 && relax[i].sect == sect &&
+                (int)relax[i].prev_addr == addr) {
+            return &relax[i];
+        }
+    }
+    return NULL;
+}
+
+/* Smallest form that reaches `val` from a branch or SOB at `pc`. */
+static int relax_need(int is_sob, int val, unsigned int pc)
+{
+    int disp = (val - (int)(pc + 2)) / 2;
+    if (is_sob) {
+        if (disp <= 0 && disp >= -63) {
+            return 0;
+        }
+        disp = (val - (int)(pc + 4)) / 2;
+        return (disp >= -128 && disp <= 127) ? 1 : 2;
+    }
+    return (disp >= -128 && disp <= 127) ? 0 : 1;
+}
+
+static void relax_measure(RelaxState *st, int is_sob, int is_br, int val, int far, int unresolved)
+{
+    int need = st->level;
+
+    st->thread = 0;
+    if (far) {
+        need = is_sob ? 2 : 1;
+    } else if (!unresolved) {
+        int n = relax_need(is_sob, val, st->prev_addr);
+        if (n > need) {
+            need = n;
+        }
+        if (need == 0) {
+            int target = val;
+            int hops = 0;
+            RelaxState *link;
+            while (hops <= 8 && (link = relax_find_br(target, cur_sect))) {
+                if (link == st || link->target == target) {
+                    hops = 9;
+                    break;
+                }
+                target = link->target;
+                hops++;
+            }
+            if (hops && hops <= 8 && target != (int)st->prev_addr &&
+                    relax_need(is_sob, target, st->prev_addr) == 0) {
+                st->thread = 1;
+                st->thread_disp = target - (int)(st->prev_addr + 2);
+            }
+        }
+    }
+    st->is_br = is_br;
+    st->target = val;
+    st->sect = cur_sect;
+    if (need > st->next) {
+        st->next = need;
+    }
+}
+
+static void relax_emit_jmp(int val, RelocInfo *ri)
+{
+    unsigned int ext_addr = output_addr + 2;
+    emit_word(0000167);
+    reloc_info_add(ri, cur_sect, -1);
+    reloc_word(ext_addr, ri);
+    emit_word((val - (int)(ext_addr + 2)) & 0xFFFF);
+}
+
+static int relax_branch(OpCode *opcode, int reg, char **str)
+{
+    unsigned int pc = output_addr;
+    int is_sob = (opcode->type == op_sob);
+    int is_br = (opcode->base == 0000400);
+    RelaxState *st = relax_state(relax_seq++);
+    RelocInfo ri;
+    int val;
+
+    if (!st) {
+        return 0;
+    }
+
+    if (layout_pass) {
+        int saved = to_second_pass;
+        to_second_pass = 0;
+        eval_prev = 1;
+        eval_pc = st->prev_addr;
+        reloc_begin();
+        val = exp_(str);
+        reloc_end(&ri);
+        eval_prev = 0;
+        int unresolved = to_second_pass;
+        to_second_pass = saved;
+        reloc_info_add(&ri, cur_sect, -1);
+        int far = unresolved ? obj_mode : !reloc_info_absolute(&ri);
+        relax_measure(st, is_sob, is_br, val, far, unresolved);
+    } else {
+        reloc_begin();
+        val = exp_(str);
+        reloc_end(&ri);
+    }
+    st->addr = pc;
+    if (error) {
+        return 0;
+    }
+
+    if (st->level == 0) {
+        int disp = (st->thread && src_pass == 2) ? st->thread_disp : val - (int)(pc + 2);
+        if (src_pass == 2) {
+            reloc_check_branch();
+        }
+        if (is_sob) {
+            disp = -disp / 2;
+            if (src_pass == 2 && (disp < 0 || disp > 63)) {
+                error = LONG_RELATED_OFFSET;
+                return 0;
+            }
+            emit_word(opcode->base | ((reg & 0x07) << 6) | (disp & 0x3F));
+        } else {
+            disp /= 2;
+            if (src_pass == 2 && (disp < -128 || disp > 127)) {
+                error = LONG_RELATED_OFFSET;
+                return 0;
+            }
+            emit_word(opcode->base | (disp & 0xFF));
+        }
+    } else if (is_sob) {
+        emit_word(0005300 | (reg & 0x07));
+        if (st->level == 1) {
+            int disp = (val - (int)(pc + 4)) / 2;
+            if (src_pass == 2 && (disp < -128 || disp > 127)) {
+                error = LONG_RELATED_OFFSET;
+                return 0;
+            }
+            if (src_pass == 2) {
+                reloc_check_branch();
+            }
+            emit_word(0001000 | (disp & 0xFF));
+        } else {
+            emit_word(0001400 | 2);
+            relax_emit_jmp(val, &ri);
+        }
+    } else {
+        if (!is_br) {
+            emit_word((opcode->base ^ 0000400) | 2);
+        }
+        relax_emit_jmp(val, &ri);
+    }
+    return error == NO_ERROR;
+}
+
+static int get_bytes(char *str)
+{
+    char delim = 0;
+    int old_addr = output_addr;
+
+    SKIP_BLANK(str);
+    while (*str) {
+        if (delim) {
+            if (*str == 0 || *str == '\n' || *str == '\r') {
+                break;
+            }
+            if (*str != delim) {
+                if (delim == '\'') {
+                    emit_byte(0);
+                    str++;
+                } else if (*str == '\\') {
+                    str++;
+                    if (*str == 'n') {
+                        emit_byte('\n');
+                    } else if (*str == 'r') {
+                        emit_byte('\r');
+                    } else if (*str == 't') {
+                        emit_byte('\t');
+                    } else if (*str == '0') {
+                        emit_byte('\0');
+                    } else if (*str == '\\') {
+                        emit_byte('\\');
+                    } else if (*str == '\"') {
+                        emit_byte('\"');
+                    } else if (*str == '\'') {
+                        emit_byte('\'');
+                    } else if (*str) {
+                        emit_byte(*str);
+                    }
+                    if (*str) {
+                        str++;
+                    }
+                } else {
+                    emit_byte(*str++);
+                }
+                continue;
+            }
+            delim = 0;
+            str++;
+        } else if (*str == '"' || *str == '\'') {
+            delim = *str++;
+            continue;
+        } else {
+            RelocInfo ri;
+            reloc_begin();
+            int val = exp_(&str);
+            reloc_end(&ri);
+            if (reloc_mode && src_pass == 2 && !reloc_info_fixed(&ri)) {
+                error = NOT_RELOCATABLE;
+            }
+            emit_byte(val & 0xFF);
+        }
+        if (match(&str, ',') == 0) {
+            break;
+        }
+        SKIP_BLANK(str);
+    }
+    if (delim) {
+        error = EXPECTED_CLOSE_QUOTE;
+    }
+
+    return output_addr - old_addr;
+}
+
+static int get_words(char *str)
+{
+    int old_addr = output_addr;
+
+    while (*str) {
+        char *tmp = str;
+        RelocInfo ri;
+        reloc_begin();
+        int word = exp_(&str);
+        reloc_end(&ri);
+        reloc_word(output_addr, &ri);
+        if (src_pass == 2 && !pad_tail_words) {
+            int has_minus = 0;
+            int has_alpha = 0;
+            for (char *p = tmp; p < str; p++) {
+                if (*p == '-') {
+                    has_minus = 1;
+                } else if (isalpha((unsigned char)*p) || *p == '_' || *p == '.' || *p == '$' || *p == ':') {
+                    has_alpha = 1;
+                }
+            }
+            if (has_minus && has_alpha) {
+                pad_tail_words = 1;
+            }
+        }
+        emit_word(word & 0xFFFF);
+        if (match(&str, ',') == 0) {
+            break;
+        }
+        SKIP_BLANK(str);
+    }
+
+    return output_addr - old_addr;
+}
+
+static int do_asm(FILE *inf, char *str);
+
+static int is_ident_start(int c)
+{
+    return isalpha(c) || c == '_' || c == '.' || c == '$';
+}
+
+static int is_ident_char(int c)
+{
+    return isalnum(c) || c == '_' || c == '$';
+}
+
+static void expand_named_params(const Macro *mac, char **arg, const char *src, char *dst, size_t dst_size)
+{
+    const char *p = src;
+    char *d = dst;
+    size_t left = dst_size ? dst_size - 1 : 0;
+
+    while (*p && left > 0) {
+        if (is_ident_start((unsigned char)*p)) {
+            char tok[64];
+            size_t tlen = 0;
+            const char *start = p;
+            while (*p && is_ident_char((unsigned char)*p) && tlen < sizeof(tok) - 1) {
+                tok[tlen++] = *p++;
+            }
+            tok[tlen] = 0;
+            int replaced = 0;
+            for (int i = 0; i < mac->args; i++) {
+                if (mac->arg_name[i] && !strcasecmp(tok, mac->arg_name[i]) && arg[i]) {
+                    size_t alen = strlen(arg[i]);
+                    if (alen > left) {
+                        alen = left;
+                    }
+                    memcpy(d, arg[i], alen);
+                    d += alen;
+                    left -= alen;
+                    replaced = 1;
+                    break;
+                }
+            }
+            if (!replaced) {
+                size_t copy = (size_t)(p - start);
+                if (copy > left) {
+                    copy = left;
+                }
+                memcpy(d, start, copy);
+                d += copy;
+                left -= copy;
+            }
+        } else {
+            *d++ = *p++;
+            left--;
+        }
+    }
+    *d = 0;
+}
+
+static int expand_macro(FILE *inf, Macro *mac, char *args)
+{
+    int i = 0;
+    char *arg[10];
+
+    in_macro++;
+    if (!lsb_push_new()) {
+        in_macro--;
+        error = SYNTAX_ERROR;
+        return 1;
+    }
+    STATS_ADD(mac->expansions, 1);
+
+    // parse args
+    while (args && *args) {
+        SKIP_BLANK(args);
+        arg[i++] = args;
+        while (*args && *args != ',') {
+            args++;
+        }
+
+        if (*args == ',') {
+            *args++ = 0;
+            continue;
+        }
+    }
+
+    arg[i] = NULL;
+
+//	for (i = 0; arg[i]; i++) {
+//	    fprintf(stderr, "[%s]\n", arg[i]);
+//	}
+
+    for (i = 0; i < mac->lines; i++) {
+        char line[1024];
+        char line2[1024];
+        char *ptr_tmp;
+        char *ptr_src = mac->line[i];
+        char *ptr_dst = line;
+
+        if (!strchr(ptr_src, '#')) {
+            strcpy(line, ptr_src);
+        } else {
+            while ((ptr_tmp = strchr(ptr_src, '#'))) {
+                if (isdigit(*(ptr_tmp + 1))) {
+                    int len = (ptr_tmp - ptr_src);
+                    int n = *(ptr_tmp + 1) - '0' - 1;
+
+                    strncpy(ptr_dst, ptr_src, len);
+                    strcpy(ptr_dst + len, arg[n]);
+                    ptr_dst += strlen(ptr_dst);
+                    ptr_src = ptr_tmp + 2;
+                } else {
+                    break;
+                }
+            }
+            if (*ptr_src) {
+                strcpy(ptr_dst, ptr_src);
+            }
+        }
+
+        if (mac->args > 0) {
+            expand_named_params(mac, arg, line, line2, sizeof(line2));
+        } else {
+            strcpy(line2, line);
+        }
+
+        int ret = do_asm(inf, line2);
+        if (ret || error != NO_ERROR) {
+            diag(DIAG_ERROR, "[%s]:%d %s\n", mac->name, i + 1, line2);
+            in_macro--;
+            lsb_pop();
+            return 1;
+        }
+    }
+
+    in_macro--;
+    lsb_pop();
+    if (!in_macro) {
+        src_line++;
+    }
+
+    return 0;
+}
+
+static char *get_file_path(char *name)
+{
+    char *tmp;
+    if ((tmp = strrchr(name, '/'))) {
+        *tmp = 0;
+    } else {
+        strcpy(name, ".");
+    }
+    return name;
+}
+
+static int do_asm(FILE *inf, char *line)
+{
+    char last;
+    char *ptr, *ptr1;
+    char linetmp[strlen(line) + 1];
+    char *str = linetmp;
+    int list_line = src_line;
+
+    strcpy(linetmp, line);
+
+    remove_comment(str);
+
+    SKIP_BLANK(str);
+
+    {
+        char *scan = str;
+        SKIP_BLANK(scan);
+        if (*scan) {
+            char *tok_start = scan;
+            SKIP_TOKEN(scan);
+            char saved = *scan;
+            *scan = 0;
+            char *tok = tok_start;
+            if (*tok == '.') {
+                tok++;
+            }
+            int is_conditional = (!strcasecmp(tok, "if") ||
+                                  !strcasecmp(tok, "ifdef") ||
+                                  !strcasecmp(tok, "ifndef") ||
+                                  !strcasecmp(tok, "else") ||
+                                  !strcasecmp(tok, "endif"));
+            if (is_conditional) {
+                char *args = saved ? (scan + 1) : scan;
+                if (!strcasecmp(tok, "if")) {
+                    int parent_active = is_skipping() ? 0 : 1;
+                    if (parent_active) {
+                        pch_note_expr(args);
+                    }
+                    int cond = parent_active ? (exp_(&args) != 0) : 0;
+                    if (if_sp >= IF_STACK_MAX) {
+                        error = SYNTAX_ERROR;
+                        return 1;
+                    }
+                    if_stack[if_sp].active = cond;
+                    if_stack[if_sp].seen_else = 0;
+                    if_sp++;
+                } else if (!strcasecmp(tok, "ifdef") || !strcasecmp(tok, "ifndef")) {
+                    int parent_active = is_skipping() ? 0 : 1;
+                    char *p = args;
+                    SKIP_BLANK(p);
+                    char *name = p;
+                    SKIP_TOKEN(p);
+                    *p = 0;
+                    int defined = symbol_defined(name);
+                    if (parent_active) {
+                        pch_note_cond(name);
+                    }
+                    int cond = parent_active ? (strcasecmp(tok, "ifdef") == 0 ? defined : !defined) : 0;
+                    if (if_sp >= IF_STACK_MAX) {
+                        error = SYNTAX_ERROR;
+                        return 1;
+                    }
+                    if_stack[if_sp].active = cond;
+                    if_stack[if_sp].seen_else = 0;
+                    if_sp++;
+                } else if (!strcasecmp(tok, "else")) {
+                    if (if_sp == 0) {
+                        error = SYNTAX_ERROR;
+                        return 1;
+                    }
+                    if (if_stack[if_sp - 1].seen_else) {
+                        error = SYNTAX_ERROR;
+                        return 1;
+                    }
+                    int parent_active = 1;
+                    for (int i = 0; i < if_sp - 1; i++) {
+                        if (!if_stack[i].active) {
+                            parent_active = 0;
+                            break;
+                        }
+                    }
+                    if_stack[if_sp - 1].active = parent_active ? !if_stack[if_sp - 1].active : 0;
+                    if_stack[if_sp - 1].seen_else = 1;
+                } else if (!strcasecmp(tok, "endif")) {
+                    if (if_sp == 0) {
+                        error = SYNTAX_ERROR;
+                        return 1;
+                    }
+                    if_sp--;
+                }
+                return 0;
+            } else {
+                *scan = saved;
+            }
+        }
+    }
+
+    if (is_skipping()) {
+        if (!in_macro) {
+            src_line++;
+        }
+        return 0;
+    }
+
+    ptr = str;
+    SKIP_TOKEN(str);
+    ptr1 = str;
+
+    if ((last = *ptr1)) {
+        str++;
+    }
+    *ptr1 = 0;
+
+    if (ptr1 - ptr > 0) {
+        char *label = NULL;
+        char *first_tok = ptr;
+
+        OpCode *opcode = NULL;
+        int is_byte = 0;
+        Macro *mac = NULL;
+
+        if (last == ':') {
+            label = first_tok;
+            SKIP_BLANK(str);
+            ptr = str;
+            SKIP_TOKEN(str);
+            ptr1 = str;
+
+            if ((last = *ptr1)) {
+                str++;
+            }
+            *ptr1 = 0;
+
+            if (ptr1 - ptr > 0) {
+                mac = find_macro(ptr);
+                if (!mac) {
+                    opcode = find_opcode(ptr, &is_byte);
+                }
+            }
+        } else {
+            mac = find_macro(first_tok);
+            if (!mac) {
+                opcode = find_opcode(first_tok, &is_byte);
+            }
+
+            if (!mac && !opcode) {
+                label = first_tok;
+                if (last) {
+                    SKIP_BLANK(str);
+
+                    ptr = str;
+                    SKIP_TOKEN(str);
+                    ptr1 = str;
+
+                    if ((last = *ptr1)) {
+                        str++;
+                    }
+                    *ptr1 = 0;
+
+                    mac = find_macro(ptr);
+                    if (!mac) {
+                        opcode = find_opcode(ptr, &is_byte);
+                    }
+                } else {
+                    ptr = str;
+                }
+            }
+        }
+
+        if (gc_skip) {
+            if (opcode && !strcmp(opcode->name, "endp")) {
+                gc_skip = 0;
+            }
+            if (!in_macro) {
+                src_line++;
+            }
+            return 0;
+        } else if (gc_active && label && opcode && !strcmp(opcode->name, "proc")) {
+            Proc *proc = find_proc(&procs, label);
+            if (proc && !proc->live) {
+                if (src_pass == 2) {
+                    list_line_words(list_line, output_addr, NULL, 0, line);
+                }
+                gc_skip = 1;
+                if (!in_macro) {
+                    src_line++;
+                }
+                return 0;
+            }
+        }
+
+        if (reorder_path && !in_proc) {
+            reorder_line(label, opcode, mac);
+        }
+
+        if (opcode && !opcode_supported(opcode) && opcode->type < pseudo_db) {
+            error = UNSUPPORTED_INSTRUCTION;
+            return 1;
+        }
+
+        int local_num = 0;
+        int local_suffix = 0;
+        int local_parse = 0;
+        if (label) {
+            local_parse = parse_local_label_token(label, &local_num, &local_suffix);
+            if (local_parse < 0 || local_suffix != 0) {
+                error = SYNTAX_ERROR;
+                return 1;
+            }
+            if (local_parse == 0 && isdigit((unsigned char)label[0])) {
+                error = SYNTAX_ERROR;
+                return 1;
+            }
+        }
+
+        if (label && lsb_enabled && local_parse == 0) {
+            if (!(opcode && opcode->type == pseudo_proc)) {
+                lsb_start_new();
+            }
+        }
+
+        if (label && src_pass == 1 &&
+                (mac || !(opcode && !strcasecmp(opcode->name, "equ")))) {
+            peep_entry = 1;
+            if (local_parse > 0 && lsb_enabled) {
+                add_local_def(local_num, output_addr, 1, src_line);
+                if (error == NO_ERROR) {
+                    local_defs->seq = instr_seq;
+                }
+            } else {
+                if (in_proc) {
+                    Label *global = find_label(&in_proc->globals, label);
+                    if (global) {
+                        add_label(&labels, label, output_addr, 1, src_line);
+                    } else {
+                        add_label(&in_proc->labels, label, output_addr, 1, src_line);
+                    }
+                } else {
+                    add_label(&labels, label, output_addr, 1, src_line);
+                }
+            }
+        }
+
+        if (label && local_parse > 0 && lsb_enabled
+                && (mac || !(opcode && !strcasecmp(opcode->name, "equ")))) {
+            if (instrument_is_head(instr_seq)) {
+                instrument_site(in_proc, local_num, instrument_saves(instr_seq));
+            }
+            if (instrument) {
+                instrument_watch(instr_seq, NULL);
+            }
+            instr_seq++;
+        }
+
+        if (mac) {
+            if (src_pass == 2) {
+                list_line_words(list_line, output_addr, NULL, 0, line);
+            }
+            SKIP_BLANK(str);
+            TRACE_BEGIN("macro", mac->name, in_macro + 1);
+            int ret = expand_macro(inf, mac, last ? str : NULL);
+            TRACE_END("macro");
+            return ret;
+        }
+
+//fprintf(stderr, ">>>%s\n", line);
+//fprintf(stderr, "OPCODE: %s %d %X %X\n", opcode->name, opcode->type, opcode->op, opcode->ext_op);
+
+        if (opcode && !strcmp(opcode->name, "include")) {
+            char name[512];
+            if (label) {
+                error = SYNTAX_ERROR;
+                return 1;
+            }
+            File *file = malloc(sizeof(File));
+            file->src_line = src_line + 1;
+            file->in_file_name = in_file_name;
+            file->in_file_path = in_file_path;
+            file->in_file = in_file;
+            file->prev = files;
+            files = file;
+            src_line = 1;
+            SKIP_BLANK(str);
+            if (*str == '\"' || *str == '\'') {
+                char quote = *str++;
+                char *end = strrchr(str, quote);
+                if (end) {
+                    *end = 0;
+                }
+            }
+            snprintf(name, sizeof(name), "%s/%s", in_file_path, str);
+            diag(DIAG_VERBOSE, "%s\n", name);
+            if (pch && !strcmp(source_key(name), pch->header) && pch_usable()) {
+                /* The precompiled header stands in for the file. */
+                src_line = file->src_line;
+                files = file->prev;
+                free(file);
+                return pch_apply();
+            }
+            in_file = source_open(name);
+            if (!in_file) {
+                /* Report the error at the INCLUDE line. */
+                in_file = file->in_file;
+                src_line = file->src_line - 1;
+                files = file->prev;
+                free(file);
+                error = CANNOT_OPEN_FILE;
+                return 1;
+            }
+            STATS_ADD(stats_includes, 1);
+            TRACE_BEGIN("include", name, 0);
+            if (watch_fd >= 0 && src_pass == 1 && !layout_pass) {
+                dprintf(watch_fd, "%s\n", source_key(name));
+            }
+            if ((cache_key[0] || pch_out_path) && src_pass == 1 && !layout_pass) {
+                cache_note(name);
+            }
+            if (dep_mode && src_pass == 1 && !layout_pass) {
+                dep_note(name);
+            }
+            in_file_name = file_intern(name);
+            {
+                char dirbuf[512];
+                strncpy(dirbuf, name, sizeof(dirbuf) - 1);
+                dirbuf[sizeof(dirbuf) - 1] = 0;
+                get_file_path(dirbuf);
+                in_file_path = strdup(dirbuf);
+            }
+            return 0;
+        } else if (opcode && !strcmp(opcode->name, "equ")) {
+            if (!label) {
+                error = MISSED_NAME_FOR_EQU;
+            } else {
+                SKIP_BLANK(str);
+                RelocInfo ri;
+                reloc_begin();
+                unsigned int val = exp_(&str);
+                reloc_end(&ri);
+                int sect = 0;
+                int reloc = reloc_info_single(&ri, &sect);
+                if (src_pass == 2) {
+                    if (reloc_mode && !reloc_info_fixed(&ri) && !reloc) {
+                        error = NOT_RELOCATABLE;
+                        return 1;
+                    }
+                    int local_num = 0;
+                    int local_suffix = 0;
+                    int local_parse = parse_local_label_token(label, &local_num, &local_suffix);
+                    if (local_parse < 0 || local_suffix != 0) {
+                        error = SYNTAX_ERROR;
+                        return 1;
+                    }
+                    if (local_parse > 0 && lsb_enabled) {
+                        add_local_def(local_num, val, 0, src_line);
+                    } else {
+                        Label *equ = add_label(in_proc ? &in_proc->equs : &equs, label, val, reloc, src_line);
+                        if (equ) {
+                            equ->sect = sect;
+                        }
+                    }
+                }
+
+                if (src_pass == 2) {
+                    unsigned short w = val & 0xFFFF;
+                    list_line_words(list_line, output_addr, &w, 1, line);
+                }
+            }
+        } else if (opcode && !strcmp(opcode->name, "proc")) {
+            if (!label) {
+                error = MISSED_NAME_FOR_PROC;
+            } else {
+                if (in_proc) {
+                    error = NESTED_PROC_UNSUPPORTED;
+                } else {
+                    if (!lsb_push_new()) {
+                        error = SYNTAX_ERROR;
+                        return 1;
+                    }
+                    in_proc = find_proc(&procs, label);
+                    if (!in_proc) {
+                        in_proc = add_proc(&procs, label, src_line);
+                    }
+                    if (in_proc) {
+                        in_proc->start = output_addr;
+                    }
+                    if (in_proc && reorder_path && src_pass == 1 && !reorder_active) {
+                        in_proc->run_prev = (reorder_last && reorder_sect == cur_sect) ? reorder_last : NULL;
+                        reorder_last = NULL;
+                    }
+                }
+                if (src_pass == 2) {
+                    list_line_words(list_line, output_addr, NULL, 0, line);
+                }
+                if (instrument && in_proc && error == NO_ERROR) {
+                    instrument_site(in_proc, -1, in_proc->instr_save);
+                    instrument_watch(-1, in_proc);
+                }
+            }
+        } else if (opcode && !strcmp(opcode->name, "endp")) {
+            if (in_proc && (src_pass == 2 || !layout_pass || reorder_path)) {
+                in_proc->size = output_addr - in_proc->start;
+            }
+            if (src_pass == 2) {
+                list_line_words(list_line, output_addr, NULL, 0, line);
+            }
+            if (in_proc && reorder_active && in_proc->run_head) {
+                output_addr = in_proc->run_head->run_base + in_proc->run_head->run_size;
+            } else if (in_proc && src_pass == 1 && !reorder_active) {
+                reorder_last = in_proc;
+                reorder_sect = cur_sect;
+            }
+            in_proc = NULL;
+            lsb_pop();
+        } else if (opcode && !strcmp(opcode->name, "global")) {
+            if (!in_proc && !obj_mode) {
+                error = ONLY_INSIDE_PROC;
+            } else if (src_pass == 1) {
+                do {
+                    SKIP_BLANK(str);
+                    char *name = str;
+                    SKIP_TOKEN(str);
+                    if ((last = *str)) {
+                        *str++ = 0;
+                    }
+                    if (in_proc) {
+                        add_label(&in_proc->globals, name, output_addr, 1, src_line);
+                    } else {
+                        add_label(&exports, name, 0, 0, src_line);
+                    }
+                } while (*str && (last == ',' || match(&str, ',') == 1));
+
+                if (src_pass == 2) {
+                    list_line_words(list_line, output_addr, NULL, 0, line);
+                }
+            }
+        } else if (opcode && !strcmp(opcode->name, "macro")) {
+            SKIP_BLANK(str);
+            char *name = str;
+            SKIP_TOKEN(str);
+            char *params = NULL;
+            if (*str) {
+                *str++ = 0;
+                params = str;
+            } else {
+                *str = 0;
+            }
+            if (src_pass == 2) {
+                list_line_words(list_line, output_addr, NULL, 0, line);
+            }
+            return add_macro(inf, name, params);
+        } else if (opcode && !strcmp(opcode->name, "org")) {
+            SKIP_BLANK(str);
+            if (cur_section) {
+                unsigned int loc = exp_(&str);
+                section_leave();
+                output_addr = section_origin(cur_section) + loc;
+            } else {
+                start_addr = exp_(&str);
+                output_addr = start_addr;
+            }
+            if (src_pass == 2) {
+                list_line_words(list_line, output_addr, NULL, 0, line);
+            }
+        } else if (opcode && opcode->type == pseudo_cpu) {
+            if (label) {
+                error = SYNTAX_ERROR;
+                return 1;
+            }
+            SKIP_BLANK(str);
+            if (!*str) {
+                error = SYNTAX_ERROR;
+                return 1;
+            }
+            char name_buf[64];
+            if (*str == '\"' || *str == '\'') {
+                char quote = *str++;
+                char *end = strrchr(str, quote);
+                if (!end) {
+                    error = EXPECTED_CLOSE_QUOTE;
+                    return 1;
+                }
+                *end = 0;
+                strncpy(name_buf, str, sizeof(name_buf) - 1);
+                name_buf[sizeof(name_buf) - 1] = 0;
+            } else {
+                char *p = str;
+                int i = 0;
+                while (*p && !isblank((unsigned char)*p) && *p != ',' && i < (int)sizeof(name_buf) - 1) {
+                    name_buf[i++] = *p++;
+                }
+                name_buf[i] = 0;
+            }
+            if (!set_cpu_by_name(name_buf)) {
+                error = SYNTAX_ERROR;
+                return 1;
+            }
+            cpu_directive = 1;
+            if (src_pass == 2) {
+                list_line_words(list_line, output_addr, NULL, 0, line);
+            }
+        } else if (opcode && opcode->type == pseudo_enabl) {
+            if (label) {
+                error = SYNTAX_ERROR;
+                return 1;
+            }
+            SKIP_BLANK(str);
+            char *p = str;
+            SKIP_TOKEN(p);
+            char saved = *p;
+            *p = 0;
+            int ok = (!strcasecmp(str, "lsb"));
+            *p = saved;
+            if (!ok) {
+                error = SYNTAX_ERROR;
+                return 1;
+            }
+            lsb_enabled = 1;
+            lsb_start_new();
+            if (src_pass == 2) {
+                list_line_words(list_line, output_addr, NULL, 0, line);
+            }
+        } else if (opcode && opcode->type == pseudo_dsabl) {
+            if (label) {
+                error = SYNTAX_ERROR;
+                return 1;
+            }
+            SKIP_BLANK(str);
+            char *p = str;
+            SKIP_TOKEN(p);
+            char saved = *p;
+            *p = 0;
+            int ok = (!strcasecmp(str, "lsb"));
+            *p = saved;
+            if (!ok) {
+                error = SYNTAX_ERROR;
+                return 1;
+            }
+            lsb_enabled = 0;
+            if (src_pass == 2) {
+                list_line_words(list_line, output_addr, NULL, 0, line);
+            }
+        } else if (opcode && opcode->type == pseudo_keep) {
+            SKIP_BLANK(str);
+            if (label) {
+                error = SYNTAX_ERROR;
+                return 1;
+            } else if (!*str) {
+                if (!in_proc) {
+                    error = ONLY_INSIDE_PROC;
+                    return 1;
+                }
+                in_proc->keep = 1;
+            } else if (src_pass == 1 && !layout_pass) {
+                do {
+                    SKIP_BLANK(str);
+                    char *name = str;
+                    SKIP_TOKEN(str);
+                    if ((last = *str)) {
+                        *str++ = 0;
+                    }
+                    if (!find_label(&keeps, name)) {
+                        add_label(&keeps, name, 0, 0, src_line);
+                    }
+                } while (*str && (last == ',' || match(&str, ',') == 1));
+            }
+            if (src_pass == 2) {
+                list_line_words(list_line, output_addr, NULL, 0, line);
+            }
+        } else if (opcode && opcode->type == pseudo_cycles) {
+            if (!strcmp(opcode->name, "cycles_begin")) {
+                if (!cycles_begin(str)) {
+                    return 1;
+                }
+            } else if (src_pass == 2) {
+                list_note[0] = 0;
+                if (cycles_end() < 0) {
+                    return 1;
+                }
+            }
+            if (src_pass == 2) {
+                list_line_words(list_line, output_addr, NULL, 0, line);
+                if (list_out && list_note[0]) {
+                    fprintf(list_out, "%*s%s\n", list_source_column(), "", list_note);
+                }
+            }
+        } else if (opcode && opcode->type == pseudo_psect) {
+            if (label) {
+                error = SYNTAX_ERROR;
+                return 1;
+            }
+            if (!select_section(opcode->name, str)) {
+                return 1;
+            }
+            if (src_pass == 2) {
+                list_line_words(list_line, output_addr, NULL, 0, line);
+            }
+        } else if (opcode && opcode->type == pseudo_chksum) {
+            use_chksum = 1;
+            chksum_addr = output_addr;
+            emit_word(0);
+            if (src_pass == 2) {
+                unsigned short w = 0;
+                list_line_words(list_line, output_addr - 2, &w, 1, line);
+            }
+        } else if (opcode) {
+            unsigned int old_addr = output_addr;
+            unsigned short word = 0;
+            int peep_kind = PEEP_NONE;
+            Operand src_op;
+            Operand dst_op;
+
+            list_note[0] = 0;
+            instr_branch = opcode->type == op_branch || opcode->type == op_sob;
+
+            if (opcode->type == pseudo_db) {
+                get_bytes(str);
+            } else if (opcode->type == pseudo_dw) {
+                get_words(str);
+            } else if (opcode->type == pseudo_ds
+                       || opcode->type == pseudo_dsw
+                       || opcode->type == pseudo_align) {
+                int count;
+                int fill = 0;
+
+                if (opcode->type == pseudo_align && !strcmp(opcode->name, "even")) {
+                    SKIP_BLANK(str);
+                    if (*str) {
+                        error = EXTRA_SYMBOLS;
+                        return 1;
+                    }
+                    count = 1;
+                } else {
+                    count = exp_(&str);
+                }
+
+                if (match(&str, ',')) {
+                    int val = exp_(&str) & 0xFFFF;
+                    if (opcode->type == pseudo_ds) {
+                        fill = val & 0xFF;
+                    } else if (opcode->type == pseudo_dsw) {
+                        fill = val & 0xFFFF;
+                    } else {
+                        fill = val & 0xFF;
+                    }
+                }
+
+                if (opcode->type == pseudo_align) {
+                    int n = 1 << count;
+                    if (n > 1) {
+                        n = n - 1;
+                    }
+                    if (cur_section && cur_section->align < (unsigned int)n + 1) {
+                        cur_section->align = n + 1;
+                    }
+                    count = ((output_addr + n) & ~n) - output_addr;
+                }
+
+                if (opcode->type == pseudo_dsw) {
                     emit_is_fill = (fill == 0);
                     while (count-- > 0) {
                         emit_word(fill);
@@ -2184,9 +6307,16 @@ static int do_asm(FILE *inf, char *line)
                 }
                 word = opcode->base;
                 emit_word(word);
+            } else if (opcode->type == op_branch && relax_enabled) {
+                SKIP_BLANK(str);
+                if (!relax_branch(opcode, 0, &str)) {
+                    return 1;
+                }
             } else if (opcode->type == op_branch) {
                 SKIP_BLANK(str);
+                reloc_begin();
                 int val = exp_(&str);
+                reloc_check_branch();
                 int offset = (val - (int)(old_addr + 2)) / 2;
                 if (src_pass == 2 && (offset < -128 || offset > 127)) {
                     error = LONG_RELATED_OFFSET;
@@ -2207,14 +6337,7 @@ static int do_asm(FILE *inf, char *line)
                 }
                 word = opcode->base | operand_spec(&dst_op);
                 emit_word(word);
-                if (dst_op.has_ext) {
-                    unsigned int ext_addr = output_addr;
-                    int ext_val = dst_op.ext;
-                    if (dst_op.pc_relative) {
-                        ext_val = dst_op.ext - (int)(ext_addr + 2);
-                    }
-                    emit_word(ext_val & 0xFFFF);
-                }
+                emit_operand_ext(&dst_op);
             } else if (opcode->type == op_jsr) {
                 int reg;
                 SKIP_BLANK(str);
@@ -2231,14 +6354,7 @@ static int do_asm(FILE *inf, char *line)
                 }
                 word = opcode->base | ((reg & 0x07) << 6) | operand_spec(&dst_op);
                 emit_word(word);
-                if (dst_op.has_ext) {
-                    unsigned int ext_addr = output_addr;
-                    int ext_val = dst_op.ext;
-                    if (dst_op.pc_relative) {
-                        ext_val = dst_op.ext - (int)(ext_addr + 2);
-                    }
-                    emit_word(ext_val & 0xFFFF);
-                }
+                emit_operand_ext(&dst_op);
             } else if (opcode->type == op_rts) {
                 int reg;
                 SKIP_BLANK(str);
@@ -2260,14 +6376,22 @@ static int do_asm(FILE *inf, char *line)
                     error = EXPECTED_ARG_2;
                     return 1;
                 }
-                val = exp_(&str);
-                int offset = ((int)(old_addr + 2) - val) / 2;
-                if (src_pass == 2 && (offset < 0 || offset > 63)) {
-                    error = LONG_RELATED_OFFSET;
-                    return 1;
+                if (relax_enabled) {
+                    if (!relax_branch(opcode, reg, &str)) {
+                        return 1;
+                    }
+                } else {
+                    reloc_begin();
+                    val = exp_(&str);
+                    reloc_check_branch();
+                    int offset = ((int)(old_addr + 2) - val) / 2;
+                    if (src_pass == 2 && (offset < 0 || offset > 63)) {
+                        error = LONG_RELATED_OFFSET;
+                        return 1;
+                    }
+                    word = opcode->base | ((reg & 0x07) << 6) | (offset & 0x3F);
+                    emit_word(word);
                 }
-                word = opcode->base | ((reg & 0x07) << 6) | (offset & 0x3F);
-                emit_word(word);
             } else if (opcode->type == op_mark) {
                 SKIP_BLANK(str);
                 int val = exp_(&str);
@@ -2293,14 +6417,7 @@ static int do_asm(FILE *inf, char *line)
                 }
                 word = opcode->base | ((reg & 0x07) << 6) | operand_spec(&src_op);
                 emit_word(word);
-                if (src_op.has_ext) {
-                    unsigned int ext_addr = output_addr;
-                    int ext_val = src_op.ext;
-                    if (src_op.pc_relative) {
-                        ext_val = src_op.ext - (int)(ext_addr + 2);
-                    }
-                    emit_word(ext_val & 0xFFFF);
-                }
+                emit_operand_ext(&src_op);
             } else if (opcode->type == op_xor) {
                 int reg;
                 SKIP_BLANK(str);
@@ -2317,14 +6434,7 @@ static int do_asm(FILE *inf, char *line)
                 }
                 word = opcode->base | ((reg & 0x07) << 6) | operand_spec(&dst_op);
                 emit_word(word);
-                if (dst_op.has_ext) {
-                    unsigned int ext_addr = output_addr;
-                    int ext_val = dst_op.ext;
-                    if (dst_op.pc_relative) {
-                        ext_val = dst_op.ext - (int)(ext_addr + 2);
-                    }
-                    emit_word(ext_val & 0xFFFF);
-                }
+                emit_operand_ext(&dst_op);
             } else if (opcode->type == op_fis) {
                 int reg;
                 SKIP_BLANK(str);
@@ -2353,402 +6463,4032 @@ static int do_asm(FILE *inf, char *line)
                     word |= 0100000;
                 }
                 emit_word(word);
-                if (dst_op.has_ext) {
-                    unsigned int ext_addr = output_addr;
-                    int ext_val = dst_op.ext;
-                    if (dst_op.pc_relative) {
-                        ext_val = dst_op.ext - (int)(ext_addr + 2);
+                emit_operand_ext(&dst_op);
+            } else if (opcode->type == op_double) {
+                if (!parse_operand(&str, &src_op)) {
+                    return 1;
+                }
+                if (match(&str, ',') == 0) {
+                    error = EXPECTED_ARG_2;
+                    return 1;
+                }
+                if (!parse_operand(&str, &dst_op)) {
+                    return 1;
+                }
+                if (optimize) {
+                    peep_kind = peephole_match(opcode, is_byte, &src_op, &dst_op);
+                }
+                if (!peephole_emit(peep_kind, opcode, is_byte, &src_op, &dst_op)) {
+                    word = opcode->base | (operand_spec(&src_op) << 6) | operand_spec(&dst_op);
+                    if (is_byte) {
+                        word |= 0100000;
+                    }
+                    emit_word(word);
+                    emit_operand_ext(&src_op);
+                    emit_operand_ext(&dst_op);
+                }
+            } else {
+                error = SYNTAX_ERROR;
+                return 1;
+            }
+
+            instr_branch = 0;
+            if (src_pass == 2 && opcode->type < pseudo_db) {
+                list_record(old_addr, output_addr);
+            }
+
+            int to_pc = opcode->type < pseudo_db && (opcode->type == op_single || opcode->type == op_double
+                         || opcode->type == op_xor) && dst_op.mode == 0 && dst_op.reg == 7;
+            if (instrument && opcode->type < pseudo_db) {
+                int leaves = to_pc || opcode->type == op_branch || opcode->type == op_jmp
+                             || opcode->type == op_jsr || opcode->type == op_rts || opcode->type == op_sob
+                             || opcode->type == op_mark || opcode->type == op_trap || opcode->type == op_emt;
+                instrument_flow(cc_reads(opcode), cc_sets(opcode), leaves);
+            } else if (instrument && opcode->type <= pseudo_align) {
+                instrument_flow(0, 0, 1);
+            }
+            if (opcode->type >= pseudo_db) {
+                peep_entry = 1;
+            } else if (optimize) {
+                peephole_record(opcode, peep_kind, to_pc);
+            }
+
+            if (opcode->type == pseudo_db || opcode->type == pseudo_ds
+                    || opcode->type == pseudo_align) {
+                if (src_pass == 2 && list_out) {
+                    int i;
+                    list_line_words(list_line, old_addr, NULL, 0, line);
+                    for (i = 0; i < output_addr - old_addr; i++) {
+                        if ((i % 8) == 0) {
+                            if (i == 0) {
+                                fprintf(list_out, "%4d %06o:", list_line, old_addr + i);
+                            } else {
+                                fprintf(list_out, "            ");
+                            }
+                        }
+
+                        fprintf(list_out, " %03o", output[old_addr + i]);
+
+                        if ((i % 8) == 7) {
+                            fprintf(list_out, "\n");
+                        }
+                    }
+
+                    if ((i % 8) != 0) {
+                        fprintf(list_out, "\n");
+                    }
+                }
+            } else if (opcode->type == pseudo_dw) {
+                if (src_pass == 2 && list_out) {
+                    int i;
+                    list_line_words(list_line, old_addr, NULL, 0, line);
+                    for (i = 0; i < output_addr - old_addr; i += 2) {
+                        if ((i % 8) == 0) {
+                            if (i == 0) {
+                                fprintf(list_out, "%4d %06o:", list_line, old_addr + i);
+                            } else {
+                                fprintf(list_out, "            ");
+                            }
+                        }
+
+                        unsigned short w = (output[old_addr + i + 1] << 8) | output[old_addr + i];
+                        fprintf(list_out, " %06o", w);
+
+                        if ((i % 8) == 6) {
+                            fprintf(list_out, "\n");
+                        }
+                    }
+
+                    if ((i % 8) != 0) {
+                        fprintf(list_out, "\n");
+                    }
+                }
+            } else if (opcode->type == pseudo_dsw) {
+                if (src_pass == 2 && list_out) {
+                    int i;
+                    list_line_words(list_line, old_addr, NULL, 0, line);
+                    for (i = 0; i < output_addr - old_addr; i += 2) {
+                        if ((i % 8) == 0) {
+                            if (i == 0) {
+                                fprintf(list_out, "%4d %06o:", list_line, old_addr + i);
+                            } else {
+                                fprintf(list_out, "            ");
+                            }
+                        }
+
+                        unsigned short w = (output[old_addr + i + 1] << 8) | output[old_addr + i];
+                        fprintf(list_out, " %06o", w);
+
+                        if ((i % 8) == 6) {
+                            fprintf(list_out, "\n");
+                        }
+                    }
+
+                    if ((i % 8) != 0) {
+                        fprintf(list_out, "\n");
+                    }
+                }
+            } else if (opcode->type != pseudo_dw) {
+                if (src_pass == 2 && list_out) {
+                    int nwords = (output_addr - old_addr) / 2;
+                    unsigned short words[8];
+                    if (nwords > (int)(sizeof(words) / sizeof(words[0]))) {
+                        nwords = (int)(sizeof(words) / sizeof(words[0]));
+                    }
+                    for (int i = 0; i < nwords; i++) {
+                        words[i] = (output[old_addr + i * 2 + 1] << 8) | output[old_addr + i * 2];
+                    }
+                    list_line_words(list_line, old_addr, words, nwords, line);
+                    if (list_note[0]) {
+                        fprintf(list_out, "%*s%s\n", list_source_column(), "", list_note);
                     }
-                    emit_word(ext_val & 0xFFFF);
                 }
-            } else if (opcode->type == op_double) {
-                if (!parse_operand(&str, &src_op)) {
-                    return 1;
+            }
+
+            if (opcode->type < pseudo_db) {
+                SKIP_BLANK(str);
+                if (*str) {
+                    error = EXTRA_SYMBOLS;
+                    return 1;
+                }
+            }
+
+        } else {
+            if (strlen(ptr)) {
+                error = SYNTAX_ERROR;
+                return 1;
+            } else if (src_pass == 2) {
+                list_line_words(list_line, output_addr, NULL, 0, line);
+            }
+        }
+    } else {
+        if (src_pass == 2) {
+            list_line_words(list_line, output_addr, NULL, 0, line);
+        }
+    }
+
+    if (!in_macro) {
+        src_line++;
+    }
+
+    return 0;
+}
+
+static unsigned int output_end(void)
+{
+    return (tail_zero_start >= 0) ? (unsigned int)tail_zero_start : output_addr;
+}
+
+static void output_hex(FILE *outf)
+{
+    int i;
+    unsigned int out_end = output_end();
+
+    for (i = start_addr; i < out_end; i++) {
+        if ((i % 16) == 0) {
+            fprintf(outf, "%04X:", i);
+        }
+
+        fprintf(outf, " %02X", output[i]);
+
+        if ((i % 16) == 15) {
+            fprintf(outf, "\n");
+        }
+    }
+
+    if ((i % 16) != 0) {
+        fprintf(outf, "\n");
+    }
+}
+
+static void output_verilog(FILE *outf)
+{
+    fprintf(outf, "module sram(\n"											\
+            "    input  [7:0] ADDR,\n"									\
+            "    input  [7:0] DI,\n"									\
+            "    output [7:0] DO,\n"									\
+            "    input        RW,\n"									\
+            "    input        CS\n"										\
+            ");\n"														\
+            "    parameter  AddressSize = 8;\n"							\
+            "    reg        [7:0]    Mem[(1 << AddressSize) - 1:0];\n"	\
+            "\n"														\
+            "    initial begin\n");
+
+    unsigned int out_end = output_end();
+    for (unsigned int i = start_addr; i < out_end; i++) {
+        fprintf(outf, "        Mem[%d] = 8'h%02x;\n", i, output[i]);
+    }
+
+    fprintf(outf, "    end\n"													\
+            "\n"														\
+            "    assign DO = RW ? Mem[ADDR] : 8'hFF;\n"					\
+            "\n"														\
+            "    always @(CS || RW) begin\n"							\
+            "        if (~CS && ~RW) begin\n"							\
+            "            Mem[ADDR] <= DI;\n"							\
+            "        end\n"												\
+            "    end\n"													\
+            "\n"														\
+            "endmodule\n");
+}
+
+static void output_binary(FILE *outf)
+{
+    unsigned int out_end = output_end();
+    for (unsigned int i = start_addr; i < out_end; i++) {
+        fwrite(&output[i], 1, 1, outf);
+    }
+}
+
+static int count_labels(Label *list)
+{
+    int n = 0;
+    for (; list; list = list->prev) {
+        n++;
+    }
+    return n;
+}
+
+static Shm11Symbol *shm_copy_symbols(Shm11Symbol *sym, Label *list)
+{
+    for (; list; list = list->prev, sym++) {
+        sym->value = list->address & 0xFFFF;
+        strncpy(sym->name, list->name, SHM11_SYM_NAME_MAX - 1);
+        sym->name[SHM11_SYM_NAME_MAX - 1] = 0;
+    }
+    return sym;
+}
+
+static int output_shm(const char *shm_name, int with_symbols)
+{
+    char name[256];
+    struct stat st;
+    unsigned int out_end = output_end();
+    int nsyms = with_symbols ? count_labels(equs) + count_labels(labels) : 0;
+    size_t size = SHM11_SEGMENT_SIZE(nsyms);
+
+    snprintf(name, sizeof(name), "%s%s", (shm_name[0] == '/') ? "" : "/", shm_name);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        diag(DIAG_ERROR, "Can't open shared memory segment %s\n", name);
+        return 0;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    /* Never shrink: a consumer may still have the old size mapped. */
+    int fresh = (size_t)st.st_size < sizeof(Shm11Header);
+    if ((size_t)st.st_size < size && ftruncate(fd, size) != 0) {
+        diag(DIAG_ERROR, "Can't resize shared memory segment %s\n", name);
+        close(fd);
+        return 0;
+    }
+    if ((size_t)st.st_size > size) {
+        size = st.st_size;
+    }
+    Shm11Header *hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        diag(DIAG_ERROR, "Can't map shared memory segment %s\n", name);
+        return 0;
+    }
+
+    if (fresh || hdr->magic != SHM11_MAGIC || hdr->version != SHM11_VERSION) {
+        memset(hdr, 0, sizeof(Shm11Header));
+        hdr->magic = SHM11_MAGIC;
+        hdr->version = SHM11_VERSION;
+        fresh = 1;
+    }
+
+    unsigned int lo = start_addr;
+    unsigned int hi = out_end;
+    if (!fresh) {
+        if (hdr->start < lo) {
+            lo = hdr->start;
+        }
+        if (hdr->end > hi && hdr->end <= SHM11_IMAGE_SIZE) {
+            hi = hdr->end;
+        }
+    }
+
+    /*
+     * Odd while writing. A writer that died mid-update left it odd and the
+     * image half written, so the whole image counts as dirty then.
+     */
+    uint32_t gen = hdr->generation;
+    int torn = !fresh && (gen & 1);
+    hdr->generation = gen | 1;
+    __sync_synchronize();
+
+    /* Dirty ranges are merged when closer than 16 bytes; too many of them collapse into one. */
+    int nranges = 0;
+    int overflow = 0;
+    for (unsigned int i = lo; i < hi; i++) {
+        if (!fresh && !torn && hdr->image[i] == output[i]) {
+            continue;
+        }
+        hdr->image[i] = output[i];
+        if (nranges > 0 && i - hdr->ranges[nranges - 1].end < 16) {
+            hdr->ranges[nranges - 1].end = i + 1;
+        } else if (nranges < SHM11_MAX_RANGES) {
+            hdr->ranges[nranges].start = i;
+            hdr->ranges[nranges].end = i + 1;
+            nranges++;
+        } else {
+            overflow = 1;
+        }
+    }
+    if (overflow) {
+        hdr->ranges[0].start = lo;
+        hdr->ranges[0].end = hi;
+        nranges = 1;
+    }
+    hdr->nranges = nranges;
+    hdr->start = start_addr;
+    hdr->end = out_end;
+
+    hdr->nsyms = nsyms;
+    if (nsyms) {
+        shm_copy_symbols(shm_copy_symbols(hdr->syms, equs), labels);
+    }
+
+    __sync_synchronize();
+    hdr->generation = (gen | 1) + 1;
+
+    munmap(hdr, size);
+    return 1;
+}
+
+static int reloc_rec_cmp(const void *a, const void *b)
+{
+    const RelocRec *ra = a;
+    const RelocRec *rb = b;
+    return (ra->addr > rb->addr) - (ra->addr < rb->addr);
+}
+
+/*
+ * -reloc image: header words (magic "RL", link base, image length, table
+ * length), the image and the relocation table. Each table byte advances a
+ * cursor that starts one word before the image: 1..254 words and relocate
+ * the word there, 255 advances 254 words without relocating, 0 ends the table.
+ */
+static void output_reloc(FILE *outf)
+{
+    unsigned int out_end = output_end();
+    unsigned int image_len = (out_end - start_addr + 1) & ~1;
+    unsigned char *table = malloc(MAX_OUTPUT / 2 + 2);
+    unsigned int table_len = 0;
+    unsigned int cursor = start_addr - 2;
+
+    if (!table) {
+        return;
+    }
+    if (relocs_count) {
+        qsort(relocs, relocs_count, sizeof(RelocRec), reloc_rec_cmp);
+    }
+    for (int i = 0; i < relocs_count; i++) {
+        unsigned int a = relocs[i].addr;
+        if ((i > 0 && a == relocs[i - 1].addr) || a < start_addr || a >= start_addr + image_len) {
+            continue;
+        }
+        unsigned int d = (a - cursor) / 2;
+        while (d > 254) {
+            table[table_len++] = 255;
+            d -= 254;
+        }
+        table[table_len++] = d;
+        cursor = a;
+    }
+    table[table_len++] = 0;
+    if (table_len & 1) {
+        table[table_len++] = 0;
+    }
+
+    unsigned short hdr[4] = { 0x4C52, start_addr, image_len, table_len };
+    for (int i = 0; i < 4; i++) {
+        fputc(hdr[i] & 0xff, outf);
+        fputc(hdr[i] >> 8, outf);
+    }
+    for (unsigned int i = start_addr; i < start_addr + image_len; i++) {
+        fputc((i < out_end) ? output[i] : 0, outf);
+    }
+    fwrite(table, 1, table_len, outf);
+    free(table);
+}
+
+static Label *find_symbol_value(char *name)
+{
+    Label *label = find_label(&labels, name);
+    return label ? label : find_label(&equs, name);
+}
+
+static void output_object_symbol(FILE *outf, char *name)
+{
+    Label *label = find_symbol_value(name);
+    if (!label) {
+        return;
+    }
+    if (label->reloc) {
+        fprintf(outf, "SYM %s %s %X\n", label->name, section_name(label->sect), label->address & 0xFFFF);
+    } else {
+        fprintf(outf, "SYM %s ABS %X\n", label->name, label->address & 0xFFFF);
+    }
+}
+
+/*
+ * -c object file, one record per line (numbers in hex):
+ *   MICROOBJ11 1
+ *   SECT <name> <base> <size> [code|data|bss|ro|align=<n>]...
+ *   D <addr> <byte>...
+ *   SYM <name> <section|ABS> <value>
+ *   EXT <index> <name>
+ *   REL <addr> <ext index|-> <section>:<weight>...
+ *   END
+ */
+static void output_object_data(FILE *outf, unsigned int start, unsigned int end)
+{
+    for (unsigned int i = start; i < end; i++) {
+        if (((i - start) % 16) == 0) {
+            fprintf(outf, "%sD %X", (i == start) ? "" : "\n", i);
+        }
+        fprintf(outf, " %02X", output[i]);
+    }
+    if (end > start) {
+        fprintf(outf, "\n");
+    }
+}
+
+static void output_object(FILE *outf)
+{
+    fprintf(outf, "MICROOBJ11 1\n");
+    fprintf(outf, "SECT .text %X %X\n", abs_start, abs_end - abs_start);
+    output_object_data(outf, abs_start, abs_end);
+    for (int id = 1; id <= sections_count; id++) {
+        Section *s = section_by_id(id);
+        fprintf(outf, "SECT %s %X %X %s%s align=%X\n", s->name, s->base, s->size,
+                (s->attrs & SECT_BSS) ? "bss" : (s->attrs & SECT_DATA) ? "data" : "code",
+                (s->attrs & SECT_RO) ? " ro" : "", s->align);
+        if (!(s->attrs & SECT_BSS)) {
+            output_object_data(outf, s->base, s->base + s->size);
+        }
+    }
+
+    for (Proc *proc = procs; proc; proc = proc->prev) {
+        output_object_symbol(outf, proc->name);
+        for (Label *global = proc->globals; global; global = global->prev) {
+            output_object_symbol(outf, global->name);
+        }
+    }
+    for (Label *exp = exports; exp; exp = exp->prev) {
+        if (!proc_owning(NULL, exp->name)) {
+            output_object_symbol(outf, exp->name);
+        }
+    }
+
+    for (Label *ext = externs; ext; ext = ext->prev) {
+        fprintf(outf, "EXT %X %s\n", ext->address, ext->name);
+    }
+
+    if (relocs_count) {
+        qsort(relocs, relocs_count, sizeof(RelocRec), reloc_rec_cmp);
+    }
+    for (int i = 0; i < relocs_count; i++) {
+        RelocInfo *ri = &relocs[i].info;
+        if (ri->sym >= 0) {
+            fprintf(outf, "REL %X %X", relocs[i].addr, ri->sym);
+        } else {
+            fprintf(outf, "REL %X -", relocs[i].addr);
+        }
+        for (int j = 0; j < ri->nsect; j++) {
+            if (ri->weight[j]) {
+                fprintf(outf, " %s:%d", section_name(ri->sect[j]), ri->weight[j]);
+            }
+        }
+        fprintf(outf, "\n");
+    }
+    fprintf(outf, "END\n");
+}
+
+static void calculate_chksum(void)
+{
+    unsigned short chksum = 0;
+    for (unsigned int i = start_addr; i < output_addr; i += 2) {
+        unsigned short tmp = (output[i + 1] << 8) | output[i];
+        chksum += tmp;
+    }
+    chksum ^= 0xffff;
+    output[chksum_addr    ] = chksum & 0xff;
+    output[chksum_addr + 1] = chksum >> 8;
+}
+
+static char *get_error_string(int error)
+{
+    switch(error) {
+    case NO_MEMORY_FOR_LABEL:
+        return "No memory for labels";
+    case CANNOT_RESOLVE_REF:
+        return "Cannot resolve reference";
+    case NO_MEMORY_FOR_MACRO:
+        return "No memory for macro";
+    case NO_MEMORY_FOR_PROC:
+        return "No memory for proc";
+    case INVALID_NUMBER:
+        return "Invalid number";
+    case INVALID_HEX_NUMBER:
+        return "Invalid hex number";
+    case INVALID_DECIMAL_NUMBER:
+        return "Invalid decimal number";
+    case INVALID_OCTAL_NUMBER:
+        return "Invalid octal number";
+    case INVALID_BINARY_NUMBER:
+        return "Invalid binary number";
+    case MISSED_BRACKET:
+        return "Missed bracket";
+    case EXPECTED_CLOSE_QUOTE:
+        return "Expected close quote";
+    case MISSED_OPCODE_PARAM_1:
+        return "Missed parameter";
+    case LONG_RELATED_OFFSET:
+        return "Related offset too long";
+    case MISSED_OPCODE_ARG_1:
+        return "Missed argument 1";
+    case EXPECTED_ARG_2:
+        return "Expected argument 2";
+    case MISSED_REGISTER_ARG_2:
+        return "Missed register 2";
+    case EXPECTED_ARG_3:
+        return "Expected argument 3";
+    case CONSTANT_VALUE_TOO_BIG:
+        return "Constant value too big (> 16)";
+    case MISSED_NAME_FOR_EQU:
+        return "Missed name for equ";
+    case MISSED_NAME_FOR_PROC:
+        return "Missed name for procedure";
+    case NESTED_PROC_UNSUPPORTED:
+        return "Nested procedures are not supported";
+    case ONLY_INSIDE_PROC:
+        return "Only onside procedure";
+    case LABEL_ALREADY_DEFINED:
+        return "Label name already used";
+    case MACRO_ALREADY_DEFINED:
+        return "Macro name already used";
+    case PROC_ALREADY_DEFINED:
+        return "Procedure name already used";
+    case EXTRA_SYMBOLS:
+        return "Extra symbols";
+    case SYNTAX_ERROR:
+        return "Syntax error";
+    case CANNOT_OPEN_FILE:
+        return "Cannot open file";
+    case UNSUPPORTED_INSTRUCTION:
+        return "Unsupported instruction for CPU";
+    case NOT_RELOCATABLE:
+        return "Expression is not relocatable";
+    case DATA_IN_BSS:
+        return "Initialized data in BSS section";
+    case SECTION_ATTR_CONFLICT:
+        return "Section attributes conflict";
+    case CYCLES_NESTING:
+        return "Cycle budgets nested too deep";
+    case CYCLES_NO_BEGIN:
+        return "CYCLES_END without CYCLES_BEGIN";
+    case CYCLES_UNBOUNDED:
+        return "Loop without a constant count in cycle budget";
+    case CYCLES_EXCEEDED:
+        return "Cycle budget exceeded";
+    default:
+        return "No error";
+    }
+}
+
+static char *get_out_name(char *in_str, char *ext)
+{
+    if (!in_str) {
+        return NULL;
+    }
+
+    char *ptr = strrchr(in_str, '.');
+    if (ptr) {
+        *ptr = 0;
+    }
+
+    char *str = malloc(strlen(in_str) + strlen(ext) + 1);
+    strcpy(str, in_str);
+    strcat(str, ext);
+
+    return str;
+}
+
+/* Reads the source once, following includes; 0 after reporting an error. */
+static int assemble_pass(void)
+{
+    char str[512];
+
+    const char *pass = (src_pass == 2) ? "pass 2" : layout_pass ? "layout" : "pass 1";
+
+    stats_pass_begin();
+    TRACE_BEGIN("pass", pass, 0);
+    do {
+        if (files) {
+            TRACE_END("include");
+            fclose(in_file);
+            free(in_file_path);
+            in_file = files->in_file;
+            in_file_name = files->in_file_name;
+            in_file_path = files->in_file_path;
+            src_line = files->src_line;
+            File *tmp = files->prev;
+            free(files);
+            files = tmp;
+        }
+
+        while(fgets(str, sizeof(str), in_file)) {
+            char *ptr = str;
+            int line = src_line;
+            STATS_ADD(stats_lines, 1);
+            REMOVE_ENDLINE(ptr);
+            int stopped = do_asm(in_file, str);
+            if (stopped || error != NO_ERROR) {
+                if (lsp_out) {
+                    /* --lsp collects every error and goes on with the next line. */
+                    fprintf(lsp_out, "E\t%s\t%d\t%s\n", in_file_name, line, get_error_string(error));
+                    error = NO_ERROR;
+                    src_line = line + 1;
+                    continue;
+                }
+                /* A line that ran to its end (errors found in pass 2) has already counted itself. */
+                diag(DIAG_ERROR, "%s:%d: %s\n", in_file_name, stopped ? src_line : line, str);
+                diag(DIAG_ERROR, "Compilation failed: %s\n\n", get_error_string(error));
+                return 0;
+            }
+        }
+    } while(files);
+
+    if (instrument) {
+        instrument_flow(0, 0, 1);
+        instrument_table();
+    }
+    stats_pass_end(pass);
+    TRACE_END("pass");
+    return 1;
+}
+
+/*
+ * Repeats pass 1 with every symbol already known, after a decision made on
+ * the previous layout (such as dropping PROCs) changed the code size.
+ */
+static int layout_again(void)
+{
+    if (fseek(in_file, 0, SEEK_SET) != 0) {
+        diag(DIAG_ERROR, "Error rewinding file for layout pass\n");
+        return 0;
+    }
+    output_addr = start_addr;
+    src_pass = 1;
+    layout_pass = 1;
+    src_line = 1;
+    in_macro = 0;
+    in_proc = NULL;
+    emit_is_fill = 0;
+    tail_zero_start = -1;
+    lsb_reset();
+    prev_local_defs = local_defs;
+    local_defs = NULL;
+    layout_gen++;
+    instrument_begin_pass();
+    relax_begin_pass();
+    peep_seq = 0;
+    peep_entry = 1;
+    sections_begin_pass();
+    for (Section *s = sections; s; s = s->prev) {
+        s->size = 0;
+    }
+
+    int ok = assemble_pass();
+    section_enter(NULL);
+    if (reorder_active) {
+        reorder_assign();
+    }
+    return ok;
+}
+
+/*
+ * Lays the source out again until every branch and SOB has a form that
+ * reaches its target. A pass that started from the same forms as the pass
+ * before it measured its own layout, so nothing changing there is final.
+ */
+static int relax_layout(void)
+{
+    int exact = 1;
+
+    for (;;) {
+        if (!layout_again()) {
+            return 0;
+        }
+        int changed = relax_apply();
+        if (!changed && exact) {
+            return 1;
+        }
+        exact = !changed;
+    }
+}
+
+/*
+ * --run: executes the finished image in the built-in simulator (sim11.c)
+ * with the instruction groups and timing of the current CPU, then reports
+ * where it stopped, the registers, per-PROC hits and an optional memory dump.
+ */
+static int run_enabled = 0;
+static const char *run_entry = NULL;
+static unsigned long long run_max_cycles = 100000000ULL;
+static const char *run_dump = NULL;
+static uint8_t run_mem[SIM11_MEM_SIZE];
+static uint16_t run_cycles[65536];
+static uint32_t run_hits[SIM11_MEM_SIZE / 2];
+
+static int cpu_has(const char *name)
+{
+    int is_byte;
+    return opcode_supported(find_opcode((char *)name, &is_byte));
+}
+
+static unsigned int run_features(void)
+{
+    unsigned int features = 0;
+    if (cpu_has("mul")) {
+        features |= SIM11_EIS;
+    }
+    if (cpu_has("fadd")) {
+        features |= SIM11_FIS;
+    }
+    if (cpu_has("rcpc")) {
+        features |= SIM11_VM2;
+    }
+    if (cpu_has("tstset")) {
+        features |= SIM11_J11;
+    }
+    if (cpu_has("mfpi")) {
+        features |= SIM11_MFP;
+    }
+    return features;
+}
+
+/* A label or an octal address. */
+static int run_address(const char *str, unsigned int *addr)
+{
+    Label *label = find_label(&labels, (char *)str);
+    if (label) {
+        *addr = label->address;
+        return 1;
+    }
+    char *end;
+    unsigned long val = strtoul(str, &end, 8);
+    if (!*str || *end || val > 0177777) {
+        return 0;
+    }
+    *addr = val;
+    return 1;
+}
+
+static void run_report(const Sim11 *sim)
+{
+    const CpuTiming *t = cpu_timing();
+    static const char *reg_names[8] = { "R0", "R1", "R2", "R3", "R4", "R5", "SP", "PC" };
+
+    fflush(stdout);
+    printf("\nRun: %s at %06o, %llu instructions, ", sim11_state_string(sim->state),
+           sim->stop_pc, (unsigned long long)sim->insns);
+    print_time(stdout, sim->cycles, t);
+    printf(" on %s\n", t->name);
+    for (int i = 0; i < 8; i++) {
+        printf("%s %06o%s", reg_names[i], sim->r[i], (i % 4 == 3) ? "\n" : "  ");
+    }
+    printf("PSW %06o  %c%c%c%c\n", sim->psw,
+           (sim->psw & CC_N) ? 'N' : 'n', (sim->psw & CC_Z) ? 'Z' : 'z',
+           (sim->psw & CC_V) ? 'V' : 'v', (sim->psw & CC_C) ? 'C' : 'c');
+
+    printf("Hits:\n");
+    for (int i = 0; i < cycle_count; i++) {
+        Proc *proc = cycle_recs[i].proc;
+        int first = 1;
+        for (int k = 0; k < i; k++) {
+            if (cycle_recs[k].proc == proc) {
+                first = 0;
+                break;
+            }
+        }
+        if (!first) {
+            continue;
+        }
+        unsigned long long insns = 0;
+        unsigned long long cycles = 0;
+        for (int k = i; k < cycle_count; k++) {
+            if (cycle_recs[k].proc == proc) {
+                uint32_t hits = run_hits[(cycle_recs[k].addr & 0xFFFF) >> 1];
+                insns += hits;
+                cycles += (unsigned long long)hits * cycle_recs[k].cycles;
+            }
+        }
+        if (insns) {
+            printf("[%s] %llu instructions, ", proc ? proc->name : "(top level)", insns);
+            print_time(stdout, cycles, t);
+            printf("\n");
+        }
+    }
+
+    if (run_dump) {
+        char from[64];
+        const char *sep = strchr(run_dump, ':');
+        unsigned int start;
+        unsigned int end;
+        snprintf(from, sizeof(from), "%.*s", sep ? (int)(sep - run_dump) : 0, run_dump);
+        if (!sep || !run_address(from, &start) || !run_address(sep + 1, &end)) {
+            diag(DIAG_ERROR, "Bad --run-dump range: %s\n", run_dump);
+            return;
+        }
+        printf("Memory:\n");
+        for (unsigned int addr = start & ~1; addr < end && addr < SIM11_MEM_SIZE; addr += 2) {
+            if (((addr - (start & ~1)) % 16) == 0) {
+                printf("%s%06o:", (addr == (start & ~1)) ? "" : "\n", addr);
+            }
+            printf(" %06o", run_mem[addr] | (run_mem[addr + 1] << 8));
+        }
+        printf("\n");
+    }
+}
+
+/* Returns 0 when the program did not stop on HALT. */
+static int run_image(void)
+{
+    Sim11 sim;
+    unsigned int entry = start_addr;
+
+    if (reloc_mode) {
+        diag(DIAG_ERROR, "--run needs an absolute image\n");
+        return 0;
+    }
+    if (run_entry && !run_address(run_entry, &entry)) {
+        diag(DIAG_ERROR, "Unknown --run-entry: %s\n", run_entry);
+        return 0;
+    }
+
+    memcpy(run_mem, output, sizeof(run_mem));
+    for (unsigned int w = 0; w < 65536; w++) {
+        run_cycles[w] = insn_cycles(w);
+    }
+    memset(run_hits, 0, sizeof(run_hits));
+
+    sim11_init(&sim, run_mem, run_features());
+    sim.mfpt = (current_cpu & CPU_DCJ11) ? 5 : 0;
+    sim.cycle_table = run_cycles;
+    sim.hits = run_hits;
+    sim.max_cycles = run_max_cycles;
+    sim.r[7] = entry;
+    sim.r[6] = entry & ~1;
+
+    sim11_run(&sim);
+    run_report(&sim);
+    return sim.state == SIM11_HALT;
+}
+
+/*
+ * --disassemble: decodes a binary image back to source this assembler takes.
+ * A 65536-entry table built from opcode_table for the current CPU maps every
+ * word to its mnemonic; words it has no entry for become DW. Branch, SOB, JMP
+ * and JSR targets that start an instruction get L<address> labels unless the
+ * --symbols file names them. PC-relative operands without a label are written
+ * as *+offset so they assemble to the same words. Images larger than the
+ * 64 KB address space are decoded in 64 KB windows, each with its own ORG.
+ */
+#define DISASM_NONE     0xFFFF
+
+static unsigned short disasm_table[65536];  /* opcode_table index * 2 + byte */
+static const char *disasm_syms_path = NULL;
+static unsigned int disasm_org = 0;
+static char *disasm_names[65536];           /* names from --symbols */
+static unsigned char disasm_flags[65536];
+static char disasm_prefix[16];
+
+#define DIS_START   1   /* an instruction or data item starts here */
+#define DIS_TARGET  2   /* branch or jump target */
+
+static unsigned short disasm_operand_mask(int type)
+{
+    switch (type) {
+    case op_double:
+        return 07777;
+    case op_single:
+    case op_jmp:
+    case op_mark:
+        return 077;
+    case op_branch:
+    case op_trap:
+    case op_emt:
+        return 0377;
+    case op_jsr:
+    case op_sob:
+    case op_eis:
+    case op_xor:
+        return 0777;
+    case op_rts:
+    case op_spl:
+    case op_fis:
+        return 07;
+    default:
+        return 0;
+    }
+}
+
+/* Later opcode_table entries win, so CFCC overrides FADD R4. */
+static void disasm_build(void)
+{
+    for (unsigned int w = 0; w < 65536; w++) {
+        disasm_table[w] = DISASM_NONE;
+    }
+    for (int i = 0; i < (int)(sizeof(opcode_table) / sizeof(OpCode)); i++) {
+        const OpCode *op = &opcode_table[i];
+        if (op->type >= pseudo_db || !opcode_supported(op)) {
+            continue;
+        }
+        unsigned short mask = disasm_operand_mask(op->type);
+        for (int byte = 0; byte <= op->allow_byte; byte++) {
+            unsigned short base = op->base | (byte ? 0100000 : 0);
+            for (unsigned int w = 0; w <= mask; w++) {
+                disasm_table[base | w] = i * 2 + byte;
+            }
+        }
+    }
+}
+
+/*
+ * "[name] address" (the Labels section of a listing) or "name address"
+ * lines with octal addresses; anything else, and a name seen before, is
+ * skipped.
+ */
+static int disasm_load_symbols(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    char line[256];
+    char name[64];
+    unsigned int addr;
+
+    if (!f) {
+        diag(DIAG_ERROR, "Can't open symbol file: %s\n", path);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, " [%63[^]]] %o", name, &addr) == 2
+                || sscanf(line, " %63[A-Za-z0-9_.$] %o", name, &addr) == 2) {
+            int seen = !is_ident_start((unsigned char)name[0]);
+            for (unsigned int a = 0; a < 65536 && !seen; a++) {
+                seen = disasm_names[a] && !strcmp(disasm_names[a], name);
+            }
+            if (seen) {
+                continue;
+            }
+            addr &= 0xFFFF;
+            free(disasm_names[addr]);
+            disasm_names[addr] = strdup(name);
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+typedef struct {
+    const unsigned char *img;
+    unsigned int org;
+    unsigned int end;       /* org + window length */
+} DisWindow;
+
+static int disasm_word(const DisWindow *win, unsigned int addr, unsigned short *w)
+{
+    if (addr + 2 > win->end) {
+        return 0;
+    }
+    *w = win->img[addr - win->org] | (win->img[addr - win->org + 1] << 8);
+    return 1;
+}
+
+static const char *disasm_reg(int reg)
+{
+    static const char *names[8] = { "r0", "r1", "r2", "r3", "r4", "r5", "sp", "pc" };
+    return names[reg & 07];
+}
+
+/*
+ * The text is built with these instead of snprintf, which was most of the
+ * run time on large dumps. Each returns the new end of the string.
+ */
+static char *disasm_str(char *p, const char *s)
+{
+    while (*s) {
+        *p++ = *s++;
+    }
+    *p = 0;
+    return p;
+}
+
+static char *disasm_oct(char *p, unsigned long v, int width)
+{
+    char tmp[24];
+    int n = 0;
+    do {
+        tmp[n++] = '0' + (v & 07);
+        v >>= 3;
+    } while (v);
+    while (n < width) {
+        tmp[n++] = '0';
+    }
+    while (n) {
+        *p++ = tmp[--n];
+    }
+    *p = 0;
+    return p;
+}
+
+/* Appends the name of a PC-relative or branch target; NULL if it has none. */
+static char *disasm_label(char *p, long target)
+{
+    if (target < 0 || target > 0177777 || !(disasm_flags[target] & DIS_START)) {
+        return NULL;
+    }
+    if (disasm_names[target]) {
+        return disasm_str(p, disasm_names[target]);
+    }
+    if (disasm_flags[target] & DIS_TARGET) {
+        return disasm_oct(disasm_str(p, disasm_prefix), target, 6);
+    }
+    return NULL;
+}
+
+/* Branch targets may lie past either end of the address space. */
+static char *disasm_target(char *p, long target, unsigned int insn)
+{
+    char *end = disasm_label(p, target);
+    if (end) {
+        return end;
+    }
+    long delta = target - insn;
+    *p++ = '*';
+    *p++ = (delta < 0) ? '-' : '+';
+    return disasm_oct(p, (delta < 0) ? -delta : delta, 0);
+}
+
+/*
+ * Appends operand `spec` whose extension word (if any) is at *ext_addr,
+ * advancing *ext_addr; NULL when the extension word is missing.
+ */
+static char *disasm_operand(const DisWindow *win, int spec, unsigned int insn,
+                            unsigned int *ext_addr, char *p)
+{
+    static const char *pre[8] = { "", "(", "(", "@(", "-(", "@-(", "", "@" };
+    static const char *post[8] = { "", ")", ")+", ")+", ")", ")", ")", ")" };
+    int mode = (spec >> 3) & 07;
+    int reg = spec & 07;
+    unsigned short ext = 0;
+
+    if (mode >= 6 || (reg == 7 && (mode == 2 || mode == 3))) {
+        if (!disasm_word(win, *ext_addr, &ext)) {
+            return NULL;
+        }
+        *ext_addr += 2;
+    }
+    if (reg == 7 && mode >= 6) {
+        if (mode == 7) {
+            *p++ = '@';
+        }
+        return disasm_target(p, (*ext_addr + ext) & 0xFFFF, insn);
+    }
+    if (reg == 7 && mode == 2) {
+        *p++ = '#';
+        return disasm_oct(p, ext, 0);
+    }
+    if (reg == 7 && mode == 3) {
+        p = disasm_str(p, "@#");
+        return disasm_names[ext] ? disasm_str(p, disasm_names[ext]) : disasm_oct(p, ext, 0);
+    }
+    if (mode == 0) {
+        return disasm_str(p, disasm_reg(reg));
+    }
+    p = disasm_str(p, pre[mode]);
+    if (mode >= 6) {
+        p = disasm_oct(p, ext, 0);
+        *p++ = '(';
+    }
+    p = disasm_str(p, disasm_reg(reg));
+    return disasm_str(p, post[mode]);
+}
+
+static char *disasm_op(char *p, const char *name, const char *suffix)
+{
+    p = disasm_str(disasm_str(p, name), suffix);
+    *p++ = '\t';
+    *p = 0;
+    return p;
+}
+
+/*
+ * Decodes the instruction at addr into text; returns its length in bytes,
+ * 2 for a data word. `target` receives a branch or jump destination or -1.
+ */
+static int disasm_insn(const DisWindow *win, unsigned int addr, char *text, long *target)
+{
+    unsigned short w;
+    unsigned int ext = addr + 2;
+    char *p = text;
+
+    *target = -1;
+    disasm_word(win, addr, &w);
+    if (disasm_table[w] == DISASM_NONE) {
+        disasm_oct(disasm_str(text, "dw\t"), w, 0);
+        return 2;
+    }
+    const OpCode *op = &opcode_table[disasm_table[w] >> 1];
+    const char *suffix = (disasm_table[w] & 1) ? "b" : "";
+
+    switch (op->type) {
+    case op_double:
+        p = disasm_operand(win, (w >> 6) & 077, addr, &ext, disasm_op(p, op->name, suffix));
+        if (p) {
+            *p++ = ',';
+            p = disasm_operand(win, w & 077, addr, &ext, p);
+        }
+        break;
+    case op_single:
+        p = disasm_operand(win, w & 077, addr, &ext, disasm_op(p, op->name, suffix));
+        break;
+    case op_jmp:
+    case op_jsr:
+        if ((w & 077) == 067 || (w & 077) == 037) {
+            unsigned short x;
+            if (disasm_word(win, ext, &x)) {
+                *target = ((w & 077) == 067) ? ((ext + 2 + x) & 0xFFFF) : x;
+            }
+        }
+        p = disasm_op(p, op->name, "");
+        if (op->type == op_jsr) {
+            p = disasm_str(p, disasm_reg(w >> 6));
+            *p++ = ',';
+        }
+        p = ((w & 070) || op->type == op_jsr) ? disasm_operand(win, w & 077, addr, &ext, p) : NULL;
+        break;
+    case op_branch:
+        *target = (long)addr + 2 + 2 * (signed char)(w & 0377);
+        p = disasm_target(disasm_op(p, op->name, ""), *target, addr);
+        break;
+    case op_sob:
+        *target = (long)addr + 2 - 2 * (w & 077);
+        p = disasm_str(disasm_op(p, op->name, ""), disasm_reg(w >> 6));
+        *p++ = ',';
+        p = disasm_target(p, *target, addr);
+        break;
+    case op_rts:
+    case op_fis:
+        p = disasm_str(disasm_op(p, op->name, ""), disasm_reg(w));
+        break;
+    case op_eis:
+        p = disasm_operand(win, w & 077, addr, &ext, disasm_op(p, op->name, ""));
+        if (p) {
+            *p++ = ',';
+            p = disasm_str(p, disasm_reg(w >> 6));
+        }
+        break;
+    case op_xor:
+        p = disasm_str(disasm_op(p, op->name, ""), disasm_reg(w >> 6));
+        *p++ = ',';
+        p = disasm_operand(win, w & 077, addr, &ext, p);
+        break;
+    case op_mark:
+    case op_spl:
+    case op_trap:
+    case op_emt:
+        p = disasm_oct(disasm_op(p, op->name, ""), w & disasm_operand_mask(op->type), 0);
+        break;
+    default:
+        p = disasm_str(p, op->name);
+        break;
+    }
+    if (!p) {
+        *target = -1;
+        disasm_oct(disasm_str(text, "dw\t"), w, 0);
+        return 2;
+    }
+    return ext - addr;
+}
+
+/* Walks one window: marks starts and targets, or writes the source. */
+static void disasm_window(const DisWindow *win, FILE *out, int print)
+{
+    char line[512];
+    unsigned int addr = win->org;
+
+    while (addr < win->end) {
+        long target = -1;
+        char *p = line;
+        int len;
+        if (print) {
+            char *end = disasm_label(p, addr);
+            if (end) {
+                p = end;
+                *p++ = ':';
+            }
+            *p++ = '\t';
+        }
+        if (addr + 1 == win->end) {
+            p = disasm_oct(disasm_str(p, "db\t"), win->img[addr - win->org], 0);
+            len = 1;
+        } else {
+            len = disasm_insn(win, addr, p, &target);
+        }
+        if (!print) {
+            disasm_flags[addr] |= DIS_START;
+            if (target >= 0 && target <= 0177777) {
+                disasm_flags[target] |= DIS_TARGET;
+            }
+        } else {
+            p = disasm_oct(disasm_str(p + strlen(p), "\t; "), addr, 6);
+            *p++ = ':';
+            for (int i = 0; i + 1 < len; i += 2) {
+                *p++ = ' ';
+                p = disasm_oct(p, win->img[addr - win->org + i] | (win->img[addr - win->org + i + 1] << 8), 6);
+            }
+            *p++ = '\n';
+            fwrite(line, 1, p - line, out);
+        }
+        addr += len;
+    }
+}
+
+static int disassemble_image(const char *input_path, const char *output_path, const char *cpu_name)
+{
+    FILE *in = fopen(input_path, "rb");
+    if (!in) {
+        diag(DIAG_ERROR, "Cannot open input file!\n");
+        return 0;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    unsigned char *img = malloc(size > 0 ? size : 1);
+    if (!img || fread(img, 1, size, in) != (size_t)size) {
+        diag(DIAG_ERROR, "Can't read %s\n", input_path);
+        fclose(in);
+        free(img);
+        return 0;
+    }
+    fclose(in);
+
+    FILE *out = output_path ? fopen(output_path, "wb") : stdout;
+    if (!out) {
+        diag(DIAG_ERROR, "Can't create output file!\n");
+        free(img);
+        return 0;
+    }
+    if (disasm_syms_path && !disasm_load_symbols(disasm_syms_path)) {
+        free(img);
+        return 0;
+    }
+
+    disasm_build();
+    fprintf(out, "; %s disassembled by microasm11\n\n", input_path);
+    if (cpu_name) {
+        fprintf(out, "\tcpu\t%s\n", cpu_name);
+    }
+
+    unsigned int window = MAX_OUTPUT - disasm_org;
+    int n = 0;
+    for (long pos = 0; pos < size || (pos == 0 && size == 0); pos += window, n++) {
+        DisWindow win;
+        win.img = img + pos;
+        win.org = disasm_org;
+        win.end = disasm_org + ((size - pos < (long)window) ? (unsigned int)(size - pos) : window);
+        if (n) {
+            snprintf(disasm_prefix, sizeof(disasm_prefix), "L%d_", n);
+            fprintf(out, "\n; window %d, file offset %ld\n", n, pos);
+        } else {
+            snprintf(disasm_prefix, sizeof(disasm_prefix), "L");
+        }
+        memset(disasm_flags, 0, sizeof(disasm_flags));
+        disasm_window(&win, out, 0);
+        fprintf(out, "\torg\t%o\n", disasm_org);
+        for (unsigned int a = 0; a < 65536; a++) {
+            if (disasm_names[a] && !(disasm_flags[a] & DIS_START)) {
+                fprintf(out, "%s\tequ\t%o\n", disasm_names[a], a);
+            }
+        }
+        disasm_window(&win, out, 1);
+        if (size == 0) {
+            break;
+        }
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    free(img);
+    return 1;
+}
+
+/*
+ * --map: symbols by address, PROC sizes and the instruction mix of the
+ * final image. The mix comes from the per-instruction records of pass 2;
+ * bytes of a PROC not covered by an instruction are counted as data.
+ */
+enum {
+    MAP_RN = 0, MAP_DEF, MAP_INC, MAP_INCDEF, MAP_DEC, MAP_DECDEF, MAP_IDX, MAP_IDXDEF,
+    MAP_IMM, MAP_ABS, MAP_REL, MAP_RELDEF,
+    MAP_MODES
+};
+
+static const char *map_mode_names[MAP_MODES] = {
+    "Rn", "(Rn)", "(Rn)+", "@(Rn)+", "-(Rn)", "@-(Rn)", "X(Rn)", "@X(Rn)",
+    "#n", "@#a", "rel", "@rel"
+};
+
+static const char *map_class_names[TM_COUNT] = {
+    "double", "single", "branch", "sob", "jmp", "jsr", "rts", "mark",
+    "mul", "div", "ash", "fis", "trap", "rti", "cc", "misc"
+};
+
+typedef struct {
+    Proc *proc;
+    unsigned int insns;
+    unsigned int bytes;         /* covered by instructions */
+    unsigned int len[3];        /* 1-, 2- and 3-word instructions */
+    unsigned int cls[TM_COUNT];
+    unsigned int modes[MAP_MODES];
+} MapMix;
+
+typedef struct {
+    const char *name;
+    Proc *proc;
+    unsigned int addr;
+} MapSym;
+
+#define MAP_TOP 10
+
+static const char *map_path = NULL;
+
+static int map_mode(int spec)
+{
+    int mode = (spec >> 3) & 07;
+    if ((spec & 07) == 7) {
+        if (mode == 2) {
+            return MAP_IMM;
+        } else if (mode == 3) {
+            return MAP_ABS;
+        } else if (mode == 6) {
+            return MAP_REL;
+        } else if (mode == 7) {
+            return MAP_RELDEF;
+        }
+    }
+    return MAP_RN + mode;
+}
+
+static void map_mix_add(MapMix *mix, const CycleRec *rec)
+{
+    unsigned short w = output_word(rec->addr);
+    InsnShape s;
+    insn_decode(w, &s);
+    int len = 1 + operand_words(s.src) + operand_words(s.dst);
+
+    mix->insns++;
+    mix->bytes += 2 * len;
+    mix->len[(len > 3 ? 3 : len) - 1]++;
+    mix->cls[s.cls]++;
+    if (s.src >= 0) {
+        mix->modes[map_mode(s.src)]++;
+    }
+    if (s.dst >= 0) {
+        mix->modes[map_mode(s.dst)]++;
+    }
+}
+
+static void map_mix_print(FILE *out, const char *name, const MapMix *mix, unsigned int size)
+{
+    fprintf(out, "[%s] %u instructions: 1w %u, 2w %u, 3w %u", name,
+            mix->insns, mix->len[0], mix->len[1], mix->len[2]);
+    if (size > mix->bytes) {
+        fprintf(out, ", %u data words", (size - mix->bytes) / 2);
+    }
+    fprintf(out, "\n  types:");
+    const char *sep = " ";
+    for (int i = 0; i < TM_COUNT; i++) {
+        if (mix->cls[i]) {
+            fprintf(out, "%s%s %u", sep, map_class_names[i], mix->cls[i]);
+            sep = ", ";
+        }
+    }
+    sep = "\n  modes: ";
+    for (int i = 0; i < MAP_MODES; i++) {
+        if (mix->modes[i]) {
+            fprintf(out, "%s%s %u", sep, map_mode_names[i], mix->modes[i]);
+            sep = ", ";
+        }
+    }
+    fprintf(out, "\n");
+}
+
+static int map_sym_cmp(const void *a, const void *b)
+{
+    const MapSym *x = a;
+    const MapSym *y = b;
+    if (x->addr != y->addr) {
+        return (x->addr < y->addr) ? -1 : 1;
+    }
+    if (!x->proc != !y->proc) {
+        return x->proc ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static int map_proc_cmp(const void *a, const void *b)
+{
+    const Proc *x = *(Proc * const *)a;
+    const Proc *y = *(Proc * const *)b;
+    if (x->start != y->start) {
+        return (x->start < y->start) ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+static int map_size_cmp(const void *a, const void *b)
+{
+    const Proc *x = *(Proc * const *)a;
+    const Proc *y = *(Proc * const *)b;
+    if (x->size != y->size) {
+        return (x->size > y->size) ? -1 : 1;
+    }
+    return map_proc_cmp(a, b);
+}
+
+static int map_live(Proc *proc)
+{
+    return proc->live || !gc_active;
+}
+
+static int map_add_syms(MapSym **syms, int *n, Label *list, Proc *proc)
+{
+    for (; list; list = list->prev) {
+        if (!proc) {
+            Proc *own = find_proc(&procs, list->name);
+            if (own && !map_live(own)) {
+                continue;
+            }
+        }
+        MapSym *tmp = realloc(*syms, sizeof(MapSym) * (*n + 1));
+        if (!tmp) {
+            return 0;
+        }
+        *syms = tmp;
+        tmp[*n].name = list->name;
+        tmp[*n].proc = proc;
+        tmp[*n].addr = list->address & 0xFFFF;
+        (*n)++;
+    }
+    return 1;
+}
+
+static int write_map(const char *path)
+{
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        diag(DIAG_ERROR, "Can't create map file: %s\n", path);
+        return 0;
+    }
+
+    MapSym *syms = NULL;
+    Proc **order = NULL;
+    MapMix *mixes = NULL;
+    int nsyms = 0;
+    int nprocs = 0;
+    int ok = map_add_syms(&syms, &nsyms, labels, NULL);
+
+    for (Proc *proc = procs; proc && ok; proc = proc->prev) {
+        if (map_live(proc)) {
+            ok = map_add_syms(&syms, &nsyms, proc->labels, proc);
+            nprocs++;
+        }
+    }
+    order = malloc(sizeof(Proc *) * (nprocs + 1));
+    mixes = calloc(nprocs + 1, sizeof(MapMix));
+    if (!ok || !order || !mixes) {
+        diag(DIAG_ERROR, "Out of memory writing map file\n");
+        free(syms);
+        free(order);
+        free(mixes);
+        fclose(out);
+        return 0;
+    }
+
+    /* Reserved space past the last stored byte still counts as used. */
+    unsigned int start = start_addr;
+    unsigned int file_end = output_end();
+    unsigned int end = (output_addr > file_end) ? output_addr : file_end;
+    unsigned int used = (end > start) ? end - start : 0;
+    fprintf(out, "Image %06o-%06o: %u bytes (%u words), %u in the output file, %u bytes free\n",
+            start & 0xFFFF, end & 0xFFFF, used, used / 2,
+            (file_end > start) ? file_end - start : 0, MAX_OUTPUT - used);
+
+    if (sections) {
+        fprintf(out, "\nSections:\n");
+        for (int id = 1; id <= sections_count; id++) {
+            for (Section *s = sections; s; s = s->prev) {
+                if (s->id == id) {
+                    fprintf(out, "  %06o %6u bytes  %s%s\n", s->base & 0xFFFF, s->size, s->name,
+                            (s->attrs & SECT_BSS) ? " (bss)" : "");
                 }
-                if (match(&str, ',') == 0) {
-                    error = EXPECTED_ARG_2;
-                    return 1;
+            }
+        }
+    }
+
+    if (nsyms) {
+        qsort(syms, nsyms, sizeof(MapSym), map_sym_cmp);
+    }
+    fprintf(out, "\nSymbols:\n");
+    for (int i = 0; i < nsyms; i++) {
+        if (syms[i].proc) {
+            fprintf(out, "  %06o  %s (%s)\n", syms[i].addr, syms[i].name, syms[i].proc->name);
+        } else {
+            fprintf(out, "  %06o  %s\n", syms[i].addr, syms[i].name);
+        }
+    }
+
+    int n = 0;
+    for (Proc *proc = procs; proc; proc = proc->prev) {
+        if (map_live(proc)) {
+            order[n++] = proc;
+        }
+    }
+    qsort(order, nprocs, sizeof(Proc *), map_proc_cmp);
+    for (int i = 0; i < nprocs; i++) {
+        mixes[i].proc = order[i];
+    }
+    MapMix total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < cycle_count; i++) {
+        int k = nprocs;
+        for (int j = 0; j < nprocs && cycle_recs[i].proc; j++) {
+            if (order[j] == cycle_recs[i].proc) {
+                k = j;
+                break;
+            }
+        }
+        map_mix_add(&mixes[k], &cycle_recs[i]);
+        map_mix_add(&total, &cycle_recs[i]);
+    }
+
+    unsigned int proc_bytes = 0;
+    if (nprocs) {
+        fprintf(out, "\nPROCs:\n");
+        fprintf(out, "  Start    Bytes  Words  Insns  Name\n");
+        for (int i = 0; i < nprocs; i++) {
+            fprintf(out, "  %06o %6u %6u %6u  %s\n", order[i]->start & 0xFFFF,
+                    order[i]->size, order[i]->size / 2, mixes[i].insns, order[i]->name);
+            proc_bytes += order[i]->size;
+        }
+        fprintf(out, "  %u bytes in %d PROCs, %u bytes outside\n", proc_bytes, nprocs,
+                (used > proc_bytes) ? used - proc_bytes : 0);
+
+        Proc **sized = malloc(sizeof(Proc *) * nprocs);
+        if (sized) {
+            memcpy(sized, order, sizeof(Proc *) * nprocs);
+            qsort(sized, nprocs, sizeof(Proc *), map_size_cmp);
+            fprintf(out, "\nLargest PROCs:\n");
+            for (int i = 0; i < nprocs && i < MAP_TOP; i++) {
+                fprintf(out, "  %6u bytes %5.1f%%  %s\n", sized[i]->size,
+                        used ? 100.0 * sized[i]->size / used : 0.0, sized[i]->name);
+            }
+            free(sized);
+        }
+    }
+
+    fprintf(out, "\nInstruction mix:\n");
+    for (int i = 0; i < nprocs; i++) {
+        map_mix_print(out, order[i]->name, &mixes[i], order[i]->size);
+    }
+    if (mixes[nprocs].insns) {
+        map_mix_print(out, "(top level)", &mixes[nprocs], mixes[nprocs].bytes);
+    }
+    map_mix_print(out, "Total", &total, used);
+
+    free(syms);
+    free(order);
+    free(mixes);
+    fclose(out);
+    return 1;
+}
+
+/*
+ * --watch: every build runs in a forked child, so each one starts from the
+ * state the command line set up, and the child sends the files it included
+ * back through a pipe. The parent waits for one of the input files to change
+ * (inotify on Linux, mtime polling elsewhere) and builds again. The files
+ * are watched from before each build starts, so a save made while it runs
+ * triggers the next one.
+ */
+#define WATCH_MAX_FILES 256
+#define WATCH_SETTLE_MS 30
+
+static char *watch_files[WATCH_MAX_FILES];
+static int watch_nfiles = 0;
+
+static void watch_add(const char *path)
+{
+    if (!path || watch_nfiles >= WATCH_MAX_FILES) {
+        return;
+    }
+    path = source_key(path);
+    for (int i = 0; i < watch_nfiles; i++) {
+        if (!strcmp(watch_files[i], path)) {
+            return;
+        }
+    }
+    watch_files[watch_nfiles++] = strdup(path);
+}
+
+static void watch_clear(void)
+{
+    for (int i = 0; i < watch_nfiles; i++) {
+        free(watch_files[i]);
+    }
+    watch_nfiles = 0;
+}
+
+static const char *watch_base(const char *path)
+{
+    const char *p = strrchr(path, '/');
+    return p ? p + 1 : path;
+}
+
+#ifdef __linux__
+static int watch_inotify = -1;
+
+/*
+ * Directories are watched rather than files, so editors that save by
+ * renaming are seen. The instance lives for the whole run; adding a
+ * directory again is a no-op.
+ */
+static int watch_begin(void)
+{
+    if (watch_inotify < 0) {
+        watch_inotify = inotify_init1(IN_CLOEXEC);
+        if (watch_inotify < 0) {
+            diag(DIAG_ERROR, "Can't start inotify\n");
+            return 0;
+        }
+    }
+    for (int i = 0; i < watch_nfiles; i++) {
+        char dir[512];
+        strncpy(dir, watch_files[i], sizeof(dir) - 1);
+        dir[sizeof(dir) - 1] = 0;
+        char *slash = strrchr(dir, '/');
+        if (slash) {
+            *slash = 0;
+        } else {
+            strcpy(dir, ".");
+        }
+        inotify_add_watch(watch_inotify, dir[0] ? dir : "/", IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+    }
+    return 1;
+}
+
+/* Events queued while the build ran are matched against the files it included. */
+static int watch_wait(void)
+{
+    if (!watch_begin()) {
+        return 0;
+    }
+    int fd = watch_inotify;
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    while (!changed) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len <= 0) {
+            return 0;
+        }
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            for (int i = 0; ev->len && i < watch_nfiles; i++) {
+                if (!strcmp(ev->name, watch_base(watch_files[i]))) {
+                    changed = 1;
                 }
-                if (!parse_operand(&str, &dst_op)) {
-                    return 1;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    /* Let the rest of a multi-file save land before building. */
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (poll(&pfd, 1, WATCH_SETTLE_MS) > 0) {
+        if (read(fd, buf, sizeof(buf)) <= 0) {
+            break;
+        }
+    }
+    return 1;
+}
+
+static void watch_end(void)
+{
+    if (watch_inotify >= 0) {
+        close(watch_inotify);
+        watch_inotify = -1;
+    }
+}
+#else
+static char *watch_snap_files[WATCH_MAX_FILES];
+static time_t watch_snap_mtimes[WATCH_MAX_FILES];
+static int watch_snap_nfiles = 0;
+
+/* Records the modification times the build is about to read. */
+static int watch_begin(void)
+{
+    struct stat st;
+
+    for (int i = 0; i < watch_snap_nfiles; i++) {
+        free(watch_snap_files[i]);
+    }
+    for (int i = 0; i < watch_nfiles; i++) {
+        watch_snap_files[i] = strdup(watch_files[i]);
+        watch_snap_mtimes[i] = (stat(watch_files[i], &st) == 0) ? st.st_mtime : 0;
+    }
+    watch_snap_nfiles = watch_nfiles;
+    return 1;
+}
+
+static int watch_wait(void)
+{
+    time_t mtimes[WATCH_MAX_FILES];
+    struct stat st;
+
+    for (int i = 0; i < watch_nfiles; i++) {
+        mtimes[i] = (stat(watch_files[i], &st) == 0) ? st.st_mtime : 0;
+        for (int j = 0; j < watch_snap_nfiles; j++) {
+            if (!strcmp(watch_snap_files[j], watch_files[i])) {
+                mtimes[i] = watch_snap_mtimes[j];
+            }
+        }
+    }
+    for (;;) {
+        usleep(100000);
+        for (int i = 0; i < watch_nfiles; i++) {
+            time_t t = (stat(watch_files[i], &st) == 0) ? st.st_mtime : 0;
+            if (t != mtimes[i]) {
+                usleep(WATCH_SETTLE_MS * 1000);
+                return 1;
+            }
+        }
+    }
+}
+
+static void watch_end(void)
+{
+}
+#endif
+
+static void watch_close_child(void)
+{
+    if (watch_fd >= 0) {
+        close(watch_fd);
+        watch_fd = -1;
+    }
+}
+
+/*
+ * Returns -1 in each build child, which goes on to assemble as usual, and
+ * the exit status in the parent if watching fails.
+ */
+static int watch_run(const char *input_path, const char *extra[], int nextra)
+{
+    for (;;) {
+        /* The files of the last build stay watched until this one reports its own. */
+        watch_add(input_path);
+        for (int i = 0; i < nextra; i++) {
+            watch_add(extra[i]);
+        }
+        if (!watch_begin()) {
+            return 1;
+        }
+        int fds[2];
+        if (pipe(fds) != 0) {
+            diag(DIAG_ERROR, "Can't create pipe for --watch\n");
+            return 1;
+        }
+        double start = stats_wall();
+        diag_flush();
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            diag(DIAG_ERROR, "Can't fork for --watch\n");
+            return 1;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            watch_end();
+            watch_fd = fds[1];
+            atexit(watch_close_child);
+            return -1;
+        }
+        close(fds[1]);
+
+        watch_clear();
+        watch_add(input_path);
+        for (int i = 0; i < nextra; i++) {
+            watch_add(extra[i]);
+        }
+        FILE *deps = fdopen(fds[0], "r");
+        char line[512];
+        while (deps && fgets(line, sizeof(line), deps)) {
+            char *p = line;
+            REMOVE_ENDLINE(p);
+            watch_add(line);
+        }
+        if (deps) {
+            fclose(deps);
+        } else {
+            close(fds[0]);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        diag(DIAG_INFO, "Watch: %s in %.1f ms, watching %d files\n",
+             ok ? "built" : "failed", (stats_wall() - start) * 1e3, watch_nfiles);
+        diag_flush();
+
+        if (!watch_wait()) {
+            return 1;
+        }
+    }
+}
+
+/*
+ * An entry is a text header (the include list and the size of each stored
+ * output) followed by the outputs. Hits refresh the entry's modification
+ * time, and eviction removes the least recently used entries once the
+ * directory grows past --cache-size.
+ */
+#define CACHE_MAGIC     "microasm11 cache 1"
+#define CACHE_BUILD     __DATE__ " " __TIME__
+#define CACHE_BLOBS     4       /* output file, listing, map, dependencies */
+
+typedef struct CacheEntry {
+    char name[33];
+    off_t size;
+    time_t mtime;
+} CacheEntry;
+
+static const char *cache_dir = NULL;
+static unsigned long cache_limit = 256;     /* --cache-size, in MiB */
+static const char *cache_dests[CACHE_BLOBS];
+
+/* The output file name main writes when no output file is given. */
+static char *output_name(const char *input_path, const char *output_path, int out_type)
+{
+    if (output_path) {
+        return strdup(output_path);
+    }
+    char *copy = strdup(input_path);
+    char *name = get_out_name(copy, (out_type == 4) ? ".obj" : (out_type == 3) ? ".rel" : (out_type == 2) ? ".bin" : (out_type == 1) ? ".v" : ".mem");
+    free(copy);
+    return name;
+}
+
+/*
+ * Sets cache_key from the options and input contents. The outputs are the
+ * arguments naming output files, which only count as present; inputs are
+ * those naming files whose content counts. A name written into an output
+ * (the -MD target) is passed as target.
+ */
+static void cache_begin(int argc, char *argv[], const char **outputs, const char **inputs, int ninputs,
+                        const char *target)
+{
+    CacheHash h;
+
+    cache_hash_init(&h);
+    cache_hash_str(&h, CACHE_MAGIC);
+    cache_hash_str(&h, CACHE_BUILD);
+    cache_hash_str(&h, target ? target : "");
+    for (int i = 1; i < argc; i++) {
+        int dest = 0;
+        if (!strcmp(argv[i], "--cache") || !strcmp(argv[i], "--cache-size")) {
+            i++;
+            continue;
+        }
+        if (!strcmp(argv[i], "-q") || !strcmp(argv[i], "-v")) {
+            continue;
+        }
+        for (int k = 0; k < CACHE_BLOBS; k++) {
+            dest |= (argv[i] == outputs[k]);
+        }
+        cache_hash_str(&h, dest ? "-" : argv[i]);
+        for (int k = 0; k < ninputs; k++) {
+            if (argv[i] == inputs[k] && !cache_hash_file(&h, argv[i])) {
+                return;
+            }
+        }
+    }
+    cache_hash_hex(&h, cache_key);
+}
+
+static void cache_path(char *buf, size_t size, const char *name)
+{
+    snprintf(buf, size, "%s/%s", cache_dir, name);
+}
+
+/* Adds a hit or a miss to the counters kept in the cache directory. */
+static void cache_count(int hit, unsigned long *hits, unsigned long *misses)
+{
+    char path[1024];
+    char tmp[1040];
+
+    *hits = *misses = 0;
+    cache_path(path, sizeof(path), "stats");
+    FILE *f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%lu %lu", hits, misses) != 2) {
+            *hits = *misses = 0;
+        }
+        fclose(f);
+    }
+    (*(hit ? hits : misses))++;
+    snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+    f = fopen(tmp, "w");
+    if (f) {
+        fprintf(f, "%lu %lu\n", *hits, *misses);
+        fclose(f);
+        rename(tmp, path);
+    }
+}
+
+static int cache_copy(FILE *from, FILE *to, long long size)
+{
+    char buf[8192];
+    while (size > 0) {
+        size_t n = fread(buf, 1, size < (long long)sizeof(buf) ? (size_t)size : sizeof(buf), from);
+        if (n == 0 || fwrite(buf, 1, n, to) != n) {
+            return 0;
+        }
+        size -= n;
+    }
+    return 1;
+}
+
+/* Restores the outputs from the entry for cache_key; 0 on a miss. */
+static int cache_lookup(void)
+{
+    char path[1024];
+    char line[1200];
+    long long sizes[CACHE_BLOBS] = { -1, -1, -1, -1 };
+    int ok = 0;
+
+    cache_path(path, sizeof(path), cache_key);
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+    if (!fgets(line, sizeof(line), f) || strcmp(line, CACHE_MAGIC "\n")) {
+        fclose(f);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *ptr = line;
+        int k;
+        long long size;
+        REMOVE_ENDLINE(ptr);
+        if (!strcmp(line, "data")) {
+            ok = 1;
+            break;
+        }
+        if (!strncmp(line, "include ", 8) && strlen(line) > 8 + 33) {
+            CacheHash h;
+            char hex[33];
+            cache_hash_init(&h);
+            if (!cache_hash_file(&h, line + 8 + 33)) {
+                break;
+            }
+            cache_hash_hex(&h, hex);
+            if (strncmp(hex, line + 8, 32)) {
+                break;
+            }
+        } else if (sscanf(line, "blob %d %lld", &k, &size) == 2 && k >= 0 && k < CACHE_BLOBS) {
+            sizes[k] = size;
+        } else {
+            break;
+        }
+    }
+    for (int k = 0; ok && k < CACHE_BLOBS; k++) {
+        ok = ((sizes[k] >= 0) == (cache_dests[k] != NULL));
+    }
+    for (int k = 0; ok && k < CACHE_BLOBS; k++) {
+        if (cache_dests[k]) {
+            FILE *out = fopen(cache_dests[k], "wb");
+            ok = out && cache_copy(f, out, sizes[k]);
+            if (out && fclose(out) != 0) {
+                ok = 0;
+            }
+        }
+    }
+    fclose(f);
+    if (ok) {
+        utime(path, NULL);
+    }
+    return ok;
+}
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+    const CacheEntry *x = a;
+    const CacheEntry *y = b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/* Removes the least recently used entries over the size limit. */
+static int cache_evict(void)
+{
+    CacheEntry *entries = NULL;
+    int count = 0;
+    int removed = 0;
+    long long total = 0;
+    struct dirent *de;
+    DIR *dir = opendir(cache_dir);
+
+    if (!dir) {
+        return 0;
+    }
+    while ((de = readdir(dir))) {
+        char path[1024];
+        struct stat st;
+        if (strlen(de->d_name) != 32 || strspn(de->d_name, "0123456789abcdef") != 32) {
+            continue;
+        }
+        cache_path(path, sizeof(path), de->d_name);
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        CacheEntry *tmp = realloc(entries, (count + 1) * sizeof(CacheEntry));
+        if (!tmp) {
+            break;
+        }
+        entries = tmp;
+        strcpy(entries[count].name, de->d_name);
+        entries[count].size = st.st_size;
+        entries[count].mtime = st.st_mtime;
+        total += st.st_size;
+        count++;
+    }
+    closedir(dir);
+    if (count) {
+        qsort(entries, count, sizeof(CacheEntry), cache_entry_cmp);
+    }
+    for (int i = 0; i < count && total > (long long)cache_limit << 20; i++) {
+        char path[1024];
+        if (!strcmp(entries[i].name, cache_key)) {
+            continue;
+        }
+        cache_path(path, sizeof(path), entries[i].name);
+        if (unlink(path) == 0) {
+            total -= entries[i].size;
+            removed++;
+        }
+    }
+    free(entries);
+    return removed;
+}
+
+/* Stores the outputs of a successful build under cache_key. */
+static void cache_store(void)
+{
+    char path[1024];
+    char tmp[1024];
+    long long sizes[CACHE_BLOBS];
+    long long stored = 0;
+    unsigned long hits, misses;
+    int ok = 1;
+
+    snprintf(tmp, sizeof(tmp), "%s/tmp.%ld", cache_dir, (long)getpid());
+    cache_path(path, sizeof(path), cache_key);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        diag(DIAG_WARNING, "Cache: can't write to %s\n", cache_dir);
+        return;
+    }
+    fprintf(f, "%s\n", CACHE_MAGIC);
+    for (FileName *inc = cache_includes; inc; inc = inc->prev) {
+        CacheHash h;
+        char hex[33];
+        cache_hash_init(&h);
+        ok &= cache_hash_file(&h, inc->name);
+        cache_hash_hex(&h, hex);
+        fprintf(f, "include %s %s\n", hex, inc->name);
+    }
+    for (int k = 0; k < CACHE_BLOBS; k++) {
+        struct stat st;
+        sizes[k] = -1;
+        if (cache_dests[k]) {
+            ok &= (stat(cache_dests[k], &st) == 0);
+            sizes[k] = ok ? st.st_size : 0;
+            stored += sizes[k];
+            fprintf(f, "blob %d %lld\n", k, sizes[k]);
+        }
+    }
+    fprintf(f, "data\n");
+    for (int k = 0; ok && k < CACHE_BLOBS; k++) {
+        if (cache_dests[k]) {
+            FILE *in = fopen(cache_dests[k], "rb");
+            ok = in && cache_copy(in, f, sizes[k]);
+            if (in) {
+                fclose(in);
+            }
+        }
+    }
+    if (fclose(f) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        diag(DIAG_WARNING, "Cache: can't store %s\n", cache_key);
+        return;
+    }
+    int evicted = cache_evict();
+    cache_count(0, &hits, &misses);
+    diag(DIAG_INFO, "Cache: miss %s, stored %lld bytes, evicted %d (%lu hits, %lu misses)\n",
+         cache_key, stored, evicted, hits, misses);
+}
+
+/* Escapes a file name for make. */
+static void dep_write_name(FILE *out, const char *name)
+{
+    for (; *name; name++) {
+        if (*name == ' ' || *name == '#') {
+            fputc('\\', out);
+        } else if (*name == '$') {
+            fputc('$', out);
+        }
+        fputc(*name, out);
+    }
+}
+
+/* Writes the -MD rule for target to path; 0 after reporting an error. */
+static int dep_write(const char *path, const char *target)
+{
+    FileName **order;
+    int count = 0;
+
+    for (FileName *f = dep_files; f; f = f->prev) {
+        count++;
+    }
+    FILE *out = fopen(path, "w");
+    if (!out || !(order = malloc((count + 1) * sizeof(FileName *)))) {
+        diag(DIAG_ERROR, "Can't create dependency file %s\n", path);
+        if (out) {
+            fclose(out);
+        }
+        return 0;
+    }
+    int n = count;
+    for (FileName *f = dep_files; f; f = f->prev) {
+        order[--n] = f;
+    }
+    dep_write_name(out, target);
+    fputc(':', out);
+    for (int i = 0; i < count; i++) {
+        fputs(i ? " \\\n " : " ", out);
+        dep_write_name(out, order[i]->name);
+    }
+    fputc('\n', out);
+    /* The source itself comes first and gets no empty rule. */
+    for (int i = 1; dep_phony && i < count; i++) {
+        fputc('\n', out);
+        dep_write_name(out, order[i]->name);
+        fputs(":\n", out);
+    }
+    free(order);
+    if (fclose(out) != 0) {
+        diag(DIAG_ERROR, "Can't write dependency file %s\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]);
+
+/*
+ * --server <socket>: assembles requests from --client over a Unix socket.
+ * Each request runs in its own forked child, so requests are served
+ * concurrently and each starts from a clean state. A message is a one-byte
+ * tag, a 32-bit big-endian length and the data. A request is C (working
+ * directory), A (one per argument, argv[0] first), P and D pairs (path and
+ * content of an in-memory override) and E; the reply is O (stdout), R
+ * (stderr) and S (exit status as text). Children report the files they
+ * read, which the server then keeps in its source cache for later children.
+ */
+#define SRV_CWD     'C'
+#define SRV_ARG     'A'
+#define SRV_PATH    'P'
+#define SRV_DATA    'D'
+#define SRV_END     'E'
+#define SRV_STDOUT  'O'
+#define SRV_STDERR  'R'
+#define SRV_STATUS  'S'
+
+#define SRV_ARGS_MAX    128
+#define SRV_CONNS_MAX   64
+#define SRV_MSG_MAX     (64u << 20)     /* largest message data accepted */
+
+typedef struct {
+    int fd;
+    size_t len;
+    char buf[1024];
+} SrvReport;
+
+static int server_child = 0;
+static int server_conn = -1;
+static int server_status = 1;
+
+static int io_write(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int io_read(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) {
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int srv_send(int fd, char tag, const void *data, size_t len)
+{
+    unsigned char hdr[5] = { tag, len >> 24, len >> 16, len >> 8, len };
+    return io_write(fd, hdr, 5) && io_write(fd, data, len);
+}
+
+/* Returns the NUL-terminated data of the next message, or NULL (also for one over SRV_MSG_MAX). */
+static char *srv_recv(int fd, char *tag, size_t *len)
+{
+    unsigned char hdr[5];
+    if (!io_read(fd, hdr, 5)) {
+        return NULL;
+    }
+    *tag = hdr[0];
+    *len = ((size_t)hdr[1] << 24) | (hdr[2] << 16) | (hdr[3] << 8) | hdr[4];
+    if (*len > SRV_MSG_MAX) {
+        return NULL;
+    }
+    char *data = malloc(*len + 1);
+    if (!data || !io_read(fd, data, *len)) {
+        free(data);
+        return NULL;
+    }
+    data[*len] = 0;
+    return data;
+}
+
+static int srv_send_fd(int conn, char tag, int fd)
+{
+    char buf[8192];
+    size_t size = 0;
+    char *data = NULL;
+    ssize_t n;
+
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        char *tmp = realloc(data, size + n);
+        if (!tmp) {
+            break;
+        }
+        data = tmp;
+        memcpy(data + size, buf, n);
+        size += n;
+    }
+    int ok = srv_send(conn, tag, data ? data : "", size);
+    free(data);
+    return ok;
+}
+
+/* Runs at exit of a request child, after the build flushed its output. */
+static void server_respond(void)
+{
+    char status[16];
+
+    diag_flush();
+    fflush(stdout);
+    fflush(stderr);
+    snprintf(status, sizeof(status), "%d", server_status);
+    srv_send_fd(server_conn, SRV_STDOUT, STDOUT_FILENO);
+    srv_send_fd(server_conn, SRV_STDERR, STDERR_FILENO);
+    srv_send(server_conn, SRV_STATUS, status, strlen(status));
+    close(server_conn);
+}
+
+static void server_request(int conn, int report_fd)
+{
+    char *argv[SRV_ARGS_MAX + 1];
+    int argc = 0;
+    char *path = NULL;
+    char tag;
+    size_t len;
+    char *data;
+
+    while ((data = srv_recv(conn, &tag, &len)) && tag != SRV_END) {
+        if (tag == SRV_CWD) {
+            if (chdir(data) != 0) {
+                break;
+            }
+            free(data);
+        } else if (tag == SRV_ARG && argc < SRV_ARGS_MAX) {
+            argv[argc++] = data;
+        } else if (tag == SRV_PATH) {
+            free(path);
+            path = data;
+        } else if (tag == SRV_DATA && path) {
+            source_add(path, data, len, NULL);
+        } else {
+            free(data);
+        }
+    }
+    if (!data || argc == 0) {
+        _exit(1);
+    }
+    argv[argc] = NULL;
+
+    FILE *out = tmpfile();
+    FILE *err = tmpfile();
+    if (!out || !err) {
+        _exit(1);
+    }
+    fflush(stdout);
+    dup2(fileno(out), STDOUT_FILENO);
+    dup2(fileno(err), STDERR_FILENO);
+    server_child = 1;
+    server_conn = conn;
+    watch_fd = report_fd;
+    atexit(server_respond);
+    server_status = main(argc, argv);
+    exit(server_status);
+}
+
+static void server_report_lines(SrvReport *r)
+{
+    char *start = r->buf;
+    char *nl;
+    while ((nl = memchr(start, '\n', r->buf + r->len - start))) {
+        *nl = 0;
+        source_cache(start);
+        start = nl + 1;
+    }
+    r->len -= start - r->buf;
+    memmove(r->buf, start, r->len);
+    if (r->len == sizeof(r->buf)) {
+        r->len = 0;
+    }
+}
+
+static int server_run(const char *sock_path)
+{
+    struct sockaddr_un addr;
+    struct pollfd fds[SRV_CONNS_MAX + 1];
+    SrvReport reports[SRV_CONNS_MAX];
+    int nreports = 0;
+
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        diag(DIAG_ERROR, "Socket path too long: %s\n", sock_path);
+        return 1;
+    }
+    /* Only a stale socket is replaced; any other file at the path is left alone. */
+    struct stat st;
+    if (lstat(sock_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            diag(DIAG_ERROR, "%s exists and is not a socket\n", sock_path);
+            return 1;
+        }
+        unlink(sock_path);
+    }
+    int srv = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path);
+    if (srv < 0 || bind(srv, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(srv, 16) != 0) {
+        diag(DIAG_ERROR, "Can't listen on %s\n", sock_path);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    diag(DIAG_INFO, "Server: listening on %s\n", sock_path);
+    diag_flush();
+
+    for (;;) {
+        while (waitpid(-1, NULL, WNOHANG) > 0) {
+        }
+        fds[0].fd = srv;
+        fds[0].events = (nreports < SRV_CONNS_MAX) ? POLLIN : 0;
+        for (int i = 0; i < nreports; i++) {
+            fds[i + 1].fd = reports[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        if (poll(fds, nreports + 1, -1) < 0) {
+            continue;
+        }
+
+        for (int i = nreports - 1; i >= 0; i--) {
+            if (!fds[i + 1].revents) {
+                continue;
+            }
+            SrvReport *r = &reports[i];
+            ssize_t n = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+            if (n > 0) {
+                r->len += n;
+                server_report_lines(r);
+            } else {
+                close(r->fd);
+                reports[i] = reports[--nreports];
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int conn = accept(srv, NULL, NULL);
+            int p[2];
+            if (conn < 0) {
+                continue;
+            }
+            if (pipe(p) != 0) {
+                close(conn);
+                continue;
+            }
+            diag_flush();
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(srv);
+                close(p[0]);
+                for (int i = 0; i < nreports; i++) {
+                    close(reports[i].fd);
                 }
-                word = opcode->base | (operand_spec(&src_op) << 6) | operand_spec(&dst_op);
-                if (is_byte) {
-                    word |= 0100000;
+                server_request(conn, p[1]);
+            }
+            close(conn);
+            close(p[1]);
+            if (pid < 0) {
+                close(p[0]);
+                continue;
+            }
+            reports[nreports].fd = p[0];
+            reports[nreports].len = 0;
+            nreports++;
+        }
+    }
+}
+
+/*
+ * --client <socket> [--override <path> <file|->]... <arguments>: sends the
+ * arguments to a server as a normal command line and prints its reply.
+ */
+static int client_run(const char *sock_path, int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    char cwd[1024];
+
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        diag(DIAG_ERROR, "Socket path too long: %s\n", sock_path);
+        return 1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        diag(DIAG_ERROR, "Can't connect to %s\n", sock_path);
+        return 1;
+    }
+    if (!getcwd(cwd, sizeof(cwd))) {
+        diag(DIAG_ERROR, "Can't get the working directory\n");
+        return 1;
+    }
+
+    int ok = srv_send(fd, SRV_CWD, cwd, strlen(cwd))
+             && srv_send(fd, SRV_ARG, "microasm11", 10);
+    for (int i = 0; ok && i < argc; i++) {
+        if (!strcmp(argv[i], "--override") && i + 2 < argc) {
+            FILE *in = strcmp(argv[i + 2], "-") ? fopen(argv[i + 2], "rb") : stdin;
+            char *data = NULL;
+            size_t size = 0;
+            char buf[8192];
+            size_t n;
+            if (!in) {
+                diag(DIAG_ERROR, "Can't open override: %s\n", argv[i + 2]);
+                return 1;
+            }
+            while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+                char *tmp = realloc(data, size + n);
+                if (!tmp) {
+                    break;
                 }
-                emit_word(word);
-                if (src_op.has_ext) {
-                    unsigned int ext_addr = output_addr;
-                    int ext_val = src_op.ext;
-                    if (src_op.pc_relative) {
-                        ext_val = src_op.ext - (int)(ext_addr + 2);
-                    }
-                    emit_word(ext_val & 0xFFFF);
+                data = tmp;
+                memcpy(data + size, buf, n);
+                size += n;
+            }
+            if (in != stdin) {
+                fclose(in);
+            }
+            ok = srv_send(fd, SRV_PATH, argv[i + 1], strlen(argv[i + 1]))
+                 && srv_send(fd, SRV_DATA, data ? data : "", size);
+            free(data);
+            i += 2;
+        } else {
+            ok = srv_send(fd, SRV_ARG, argv[i], strlen(argv[i]));
+        }
+    }
+    if (!ok || !srv_send(fd, SRV_END, "", 0)) {
+        diag(DIAG_ERROR, "Can't send the request to %s\n", sock_path);
+        return 1;
+    }
+
+    int status = 1;
+    int got_status = 0;
+    char tag;
+    size_t len;
+    char *data;
+    while ((data = srv_recv(fd, &tag, &len))) {
+        if (tag == SRV_STDOUT) {
+            fwrite(data, 1, len, stdout);
+        } else if (tag == SRV_STDERR) {
+            diag_flush();
+            fwrite(data, 1, len, stderr);
+        } else if (tag == SRV_STATUS) {
+            status = atoi(data);
+            got_status = 1;
+        }
+        free(data);
+    }
+    close(fd);
+    if (!got_status) {
+        diag(DIAG_ERROR, "No reply from %s\n", sock_path);
+        return 1;
+    }
+    return status;
+}
+
+/*
+ * Minimal JSON reader for --lsp requests. Object members keep their key in
+ * key; strings are decoded to UTF-8.
+ */
+enum {
+    JSON_NULL = 0,
+    JSON_BOOL,
+    JSON_NUM,
+    JSON_STR,
+    JSON_ARR,
+    JSON_OBJ,
+};
+
+typedef struct Json {
+    int type;
+    double num;
+    char *str;
+    char *key;
+    struct Json *child;
+    struct Json *next;
+} Json;
+
+static void json_free(Json *j)
+{
+    while (j) {
+        Json *next = j->next;
+        json_free(j->child);
+        free(j->str);
+        free(j->key);
+        free(j);
+        j = next;
+    }
+}
+
+static void json_skip(const char **p)
+{
+    while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n') {
+        (*p)++;
+    }
+}
+
+/* Reads four hex digits of a \u escape; 0 when they are not all there. */
+static int json_hex4(const char *s, unsigned int *c)
+{
+    *c = 0;
+    for (int i = 0; i < 4; i++) {
+        if (!isxdigit((unsigned char)s[i])) {
+            return 0;
+        }
+        *c = *c * 16 + (isdigit((unsigned char)s[i]) ? s[i] - '0' : (tolower((unsigned char)s[i]) - 'a' + 10));
+    }
+    return 1;
+}
+
+/*
+ * Surrogate pairs are combined; a lone surrogate and U+0000, which would end
+ * the C string, become U+FFFD.
+ */
+static char *json_parse_str(const char **p)
+{
+    const char *s = *p + 1;
+    char *out = malloc(strlen(s) + 1);
+    char *o = out;
+
+    if (!out) {
+        return NULL;
+    }
+    while (*s && *s != '"') {
+        if (*s != '\\') {
+            *o++ = *s++;
+            continue;
+        }
+        s++;
+        switch (*s) {
+        case 'n': *o++ = '\n'; break;
+        case 't': *o++ = '\t'; break;
+        case 'r': *o++ = '\r'; break;
+        case 'b': *o++ = '\b'; break;
+        case 'f': *o++ = '\f'; break;
+        case 'u': {
+            unsigned int c;
+            unsigned int low;
+            if (!json_hex4(s + 1, &c)) {
+                /* Malformed: keep the text as it is. */
+                *o++ = 'u';
+                break;
+            }
+            s += 4;
+            if (c >= 0xD800 && c < 0xDC00 && s[1] == '\\' && s[2] == 'u'
+                    && json_hex4(s + 3, &low) && low >= 0xDC00 && low < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                s += 6;
+            } else if (c == 0 || (c >= 0xD800 && c < 0xE000)) {
+                c = 0xFFFD;
+            }
+            if (c < 0x80) {
+                *o++ = c;
+            } else if (c < 0x800) {
+                *o++ = 0xC0 | (c >> 6);
+                *o++ = 0x80 | (c & 0x3F);
+            } else if (c < 0x10000) {
+                *o++ = 0xE0 | (c >> 12);
+                *o++ = 0x80 | ((c >> 6) & 0x3F);
+                *o++ = 0x80 | (c & 0x3F);
+            } else {
+                *o++ = 0xF0 | (c >> 18);
+                *o++ = 0x80 | ((c >> 12) & 0x3F);
+                *o++ = 0x80 | ((c >> 6) & 0x3F);
+                *o++ = 0x80 | (c & 0x3F);
+            }
+            break;
+        }
+        default:
+            if (*s) {
+                *o++ = *s;
+            }
+            break;
+        }
+        if (*s) {
+            s++;
+        }
+    }
+    *o = 0;
+    *p = *s ? s + 1 : s;
+    return out;
+}
+
+static Json *json_parse(const char **p)
+{
+    Json *j = calloc(1, sizeof(Json));
+    if (!j) {
+        return NULL;
+    }
+    json_skip(p);
+    if (**p == '{' || **p == '[') {
+        int obj = (**p == '{');
+        Json **tail = &j->child;
+        j->type = obj ? JSON_OBJ : JSON_ARR;
+        (*p)++;
+        json_skip(p);
+        while (**p && **p != (obj ? '}' : ']')) {
+            char *key = NULL;
+            if (obj) {
+                if (**p != '"') {
+                    break;
                 }
-                if (dst_op.has_ext) {
-                    unsigned int ext_addr = output_addr;
-                    int ext_val = dst_op.ext;
-                    if (dst_op.pc_relative) {
-                        ext_val = dst_op.ext - (int)(ext_addr + 2);
-                    }
-                    emit_word(ext_val & 0xFFFF);
+                key = json_parse_str(p);
+                json_skip(p);
+                if (**p == ':') {
+                    (*p)++;
                 }
-            } else {
-                error = SYNTAX_ERROR;
-                return 1;
             }
+            Json *item = json_parse(p);
+            if (!item) {
+                free(key);
+                break;
+            }
+            item->key = key;
+            *tail = item;
+            tail = &item->next;
+            json_skip(p);
+            if (**p == ',') {
+                (*p)++;
+                json_skip(p);
+            }
+        }
+        if (**p) {
+            (*p)++;
+        }
+    } else if (**p == '"') {
+        j->type = JSON_STR;
+        j->str = json_parse_str(p);
+    } else if (!strncmp(*p, "true", 4) || !strncmp(*p, "false", 5)) {
+        j->type = JSON_BOOL;
+        j->num = (**p == 't');
+        *p += (**p == 't') ? 4 : 5;
+    } else if (!strncmp(*p, "null", 4)) {
+        *p += 4;
+    } else {
+        char *end;
+        j->type = JSON_NUM;
+        j->num = strtod(*p, &end);
+        if (end == *p) {
+            free(j);
+            return NULL;
+        }
+        *p = end;
+    }
+    return j;
+}
 
-            if (opcode->type == pseudo_db || opcode->type == pseudo_ds
-                    || opcode->type == pseudo_align) {
-                if (src_pass == 2 && list_out) {
-                    int i;
-                    list_line_words(list_line, old_addr, NULL, 0, line);
-                    for (i = 0; i < output_addr - old_addr; i++) {
-                        if ((i % 8) == 0) {
-                            if (i == 0) {
-                                fprintf(list_out, "%4d %06o:", list_line, old_addr + i);
-                            } else {
-                                fprintf(list_out, "            ");
-                            }
-                        }
+static Json *json_get(const Json *j, const char *key)
+{
+    for (Json *c = j ? j->child : NULL; c; c = c->next) {
+        if (c->key && !strcmp(c->key, key)) {
+            return c;
+        }
+    }
+    return NULL;
+}
 
-                        fprintf(list_out, " %03o", output[old_addr + i]);
+/* Follows a path of keys separated by dots. */
+static Json *json_path(const Json *j, const char *path)
+{
+    char key[64];
+    while (j && *path) {
+        size_t n = strcspn(path, ".");
+        if (n >= sizeof(key)) {
+            return NULL;
+        }
+        memcpy(key, path, n);
+        key[n] = 0;
+        j = json_get(j, key);
+        path += n + (path[n] == '.');
+    }
+    return (Json *)j;
+}
 
-                        if ((i % 8) == 7) {
-                            fprintf(list_out, "\n");
-                        }
-                    }
+static const char *json_text(const Json *j, const char *path)
+{
+    Json *v = json_path(j, path);
+    return (v && v->type == JSON_STR) ? v->str : NULL;
+}
+
+static int json_int(const Json *j, const char *path, int def)
+{
+    Json *v = json_path(j, path);
+    return (v && v->type == JSON_NUM) ? (int)v->num : def;
+}
+
+/* Writes a value back out, for the id of a request. */
+static void json_write(FILE *out, const Json *j)
+{
+    if (!j || j->type == JSON_NULL) {
+        fprintf(out, "null");
+    } else if (j->type == JSON_BOOL) {
+        fprintf(out, j->num ? "true" : "false");
+    } else if (j->type == JSON_NUM) {
+        fprintf(out, "%.17g", j->num);
+    } else if (j->type == JSON_STR) {
+        stats_json_str(out, j->str);
+    } else {
+        int obj = (j->type == JSON_OBJ);
+        fputc(obj ? '{' : '[', out);
+        for (Json *c = j->child; c; c = c->next) {
+            if (obj) {
+                stats_json_str(out, c->key ? c->key : "");
+                fputc(':', out);
+            }
+            json_write(out, c);
+            if (c->next) {
+                fputc(',', out);
+            }
+        }
+        fputc(obj ? '}' : ']', out);
+    }
+}
+
+/*
+ * --lsp: a language server over stdin/stdout. Open documents are kept in
+ * memory and edited in place. After a burst of edits every open source that
+ * is not an .inc file is assembled in a forked child with the documents as
+ * overrides; the child goes on after each error and reports the errors, the
+ * symbols and the address, code and cycles of each line through a pipe.
+ */
+#define LSP_MAX_ERRORS  200
+#define LSP_MAX_RESULTS 1000
+#define LSP_TIMEOUT     5       /* seconds per analysis */
+
+typedef struct LspDoc {
+    char *uri;
+    const char *path;
+    char *text;
+    size_t len;
+    struct LspDoc *prev;
+} LspDoc;
+
+typedef struct LspSym {
+    char *name;
+    unsigned int value;
+    const char *file;
+    int line;
+    char kind;                  /* P (PROC), L (label) or E (equ) */
+    struct LspSym *prev;
+} LspSym;
+
+typedef struct LspLine {
+    const char *file;
+    int line;
+    unsigned int addr;
+    int cycles;
+    char *code;
+    struct LspLine *prev;
+} LspLine;
+
+typedef struct LspError {
+    const char *file;
+    int line;
+    char *msg;
+    struct LspError *prev;
+} LspError;
+
+typedef struct LspFile {
+    const char *file;
+    struct LspFile *prev;
+} LspFile;
+
+static LspDoc *lsp_docs = NULL;
+static LspSym *lsp_syms = NULL;
+static LspLine *lsp_lines = NULL;
+static LspError *lsp_errors = NULL;
+static LspFile *lsp_published = NULL;
+static char **lsp_args = NULL;
+static int lsp_nargs = 0;
+static int lsp_dirty = 0;
+
+static char lsp_in[65536];
+static size_t lsp_in_pos = 0;
+static size_t lsp_in_len = 0;
+
+/* Child: writes the symbol table once the build is over. */
+static void lsp_report_symbols(void)
+{
+    Label *lists[2] = { labels, equs };
+
+    for (int i = 0; i < 2; i++) {
+        for (Label *l = lists[i]; l; l = l->prev) {
+            char kind = i ? 'E' : find_proc(&procs, l->name) ? 'P' : 'L';
+            fprintf(lsp_out, "S\t%s\t%o\t%s\t%d\t%c\n", l->name, l->address & 0xFFFF,
+                    l->file ? l->file : "", l->line, kind);
+        }
+    }
+    for (Proc *p = procs; p; p = p->prev) {
+        for (int i = 0; i < 2; i++) {
+            for (Label *l = i ? p->equs : p->labels; l; l = l->prev) {
+                fprintf(lsp_out, "S\t%s\t%o\t%s\t%d\t%c\n", l->name, l->address & 0xFFFF,
+                        l->file ? l->file : "", l->line, i ? 'E' : 'L');
+            }
+        }
+    }
+    fclose(lsp_out);
+    lsp_out = NULL;
+}
+
+static void lsp_child(const char *path, int fd)
+{
+    char *argv[SRV_ARGS_MAX + 4];
+    int argc = 0;
+
+    for (LspDoc *d = lsp_docs; d; d = d->prev) {
+        char *data = malloc(d->len + 1);
+        if (data) {
+            memcpy(data, d->text, d->len);
+            source_add(d->path, data, d->len, NULL);
+        }
+    }
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    lsp_out = fdopen(fd, "w");
+    if (!lsp_out) {
+        _exit(1);
+    }
+    server_child = 1;
+    alarm(LSP_TIMEOUT);
+    atexit(lsp_report_symbols);
+
+    argv[argc++] = "microasm11";
+    argv[argc++] = "-q";
+    for (int i = 0; i < lsp_nargs && argc < SRV_ARGS_MAX; i++) {
+        argv[argc++] = lsp_args[i];
+    }
+    argv[argc++] = (char *)path;
+    argv[argc++] = "/dev/null";
+    argv[argc] = NULL;
+    exit(main(argc, argv));
+}
+
+static void lsp_clear(void)
+{
+    while (lsp_syms) {
+        LspSym *s = lsp_syms->prev;
+        free(lsp_syms->name);
+        free(lsp_syms);
+        lsp_syms = s;
+    }
+    while (lsp_lines) {
+        LspLine *l = lsp_lines->prev;
+        free(lsp_lines->code);
+        free(lsp_lines);
+        lsp_lines = l;
+    }
+    while (lsp_errors) {
+        LspError *e = lsp_errors->prev;
+        free(lsp_errors->msg);
+        free(lsp_errors);
+        lsp_errors = e;
+    }
+}
+
+/* Splits a tab-separated report line in place. */
+static int lsp_fields(char *line, char **field, int max)
+{
+    int n = 0;
+    char *nl = strchr(line, '\n');
+    if (nl) {
+        *nl = 0;
+    }
+    while (n < max) {
+        field[n++] = line;
+        line = strchr(line, '\t');
+        if (!line) {
+            break;
+        }
+        *line++ = 0;
+    }
+    return n;
+}
+
+static const char *lsp_file(const char *name)
+{
+    return file_intern(source_key(name));
+}
+
+static void lsp_result(char *line, int *nerrors)
+{
+    char *f[6];
+    int n = lsp_fields(line, f, 6);
+
+    if (f[0][0] == 'E' && n == 4 && *nerrors < LSP_MAX_ERRORS) {
+        const char *file = lsp_file(f[1]);
+        int lnum = atoi(f[2]);
+        for (LspError *e = lsp_errors; e; e = e->prev) {
+            if (e->file == file && e->line == lnum && !strcmp(e->msg, f[3])) {
+                return;
+            }
+        }
+        LspError *e = calloc(1, sizeof(LspError));
+        if (e && (e->msg = strdup(f[3]))) {
+            e->file = file;
+            e->line = lnum;
+            e->prev = lsp_errors;
+            lsp_errors = e;
+            (*nerrors)++;
+        } else {
+            free(e);
+        }
+    } else if (f[0][0] == 'S' && n == 6) {
+        LspSym *s = calloc(1, sizeof(LspSym));
+        if (s && (s->name = strdup(f[1]))) {
+            s->value = strtoul(f[2], NULL, 8);
+            s->file = f[3][0] ? lsp_file(f[3]) : NULL;
+            s->line = atoi(f[4]);
+            s->kind = f[5][0];
+            s->prev = lsp_syms;
+            lsp_syms = s;
+        } else {
+            free(s);
+        }
+    } else if (f[0][0] == 'L' && n == 6) {
+        LspLine *l = calloc(1, sizeof(LspLine));
+        if (l && (l->code = strdup(f[5]))) {
+            l->file = lsp_file(f[1]);
+            l->line = atoi(f[2]);
+            l->addr = strtoul(f[3], NULL, 8);
+            l->cycles = atoi(f[4]);
+            l->prev = lsp_lines;
+            lsp_lines = l;
+        } else {
+            free(l);
+        }
+    }
+}
+
+static int lsp_is_include(const char *path)
+{
+    size_t len = strlen(path);
+    return len > 4 && !strcasecmp(path + len - 4, ".inc");
+}
+
+static void lsp_uri_write(FILE *out, const char *path)
+{
+    fputs("\"file://", out);
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        if (isalnum(*p) || strchr("/._-~", *p)) {
+            fputc(*p, out);
+        } else {
+            fprintf(out, "%%%02X", *p);
+        }
+    }
+    fputc('"', out);
+}
+
+static char *lsp_uri_path(const char *uri)
+{
+    char *path = malloc(strlen(uri) + 1);
+    char *o = path;
+
+    if (!path) {
+        return NULL;
+    }
+    if (!strncmp(uri, "file://", 7)) {
+        uri += 7;
+    }
+    while (*uri) {
+        if (uri[0] == '%' && isxdigit((unsigned char)uri[1]) && isxdigit((unsigned char)uri[2])) {
+            char hex[3] = { uri[1], uri[2], 0 };
+            *o++ = strtol(hex, NULL, 16);
+            uri += 3;
+        } else {
+            *o++ = *uri++;
+        }
+    }
+    *o = 0;
+    return path;
+}
 
-                    if ((i % 8) != 0) {
-                        fprintf(list_out, "\n");
-                    }
-                }
-            } else if (opcode->type == pseudo_dw) {
-                if (src_pass == 2 && list_out) {
-                    int i;
-                    list_line_words(list_line, old_addr, NULL, 0, line);
-                    for (i = 0; i < output_addr - old_addr; i += 2) {
-                        if ((i % 8) == 0) {
-                            if (i == 0) {
-                                fprintf(list_out, "%4d %06o:", list_line, old_addr + i);
-                            } else {
-                                fprintf(list_out, "            ");
-                            }
-                        }
+/* Closes a message built in a memstream and sends it. */
+static void lsp_send(FILE *msg, char **buf, size_t *len)
+{
+    fclose(msg);
+    printf("Content-Length: %zu\r\n\r\n", *len);
+    fwrite(*buf, 1, *len, stdout);
+    fflush(stdout);
+    free(*buf);
+}
 
-                        unsigned short w = (output[old_addr + i + 1] << 8) | output[old_addr + i];
-                        fprintf(list_out, " %06o", w);
+static void lsp_range_write(FILE *out, int line, int end_line)
+{
+    fprintf(out, "{\"start\":{\"line\":%d,\"character\":0},\"end\":{\"line\":%d,\"character\":0}}",
+            line > 0 ? line - 1 : 0, end_line > 0 ? end_line - 1 : 0);
+}
 
-                        if ((i % 8) == 6) {
-                            fprintf(list_out, "\n");
-                        }
-                    }
+static void lsp_location_write(FILE *out, const char *file, int line)
+{
+    fputs("{\"uri\":", out);
+    lsp_uri_write(out, file);
+    fputs(",\"range\":", out);
+    lsp_range_write(out, line, line);
+    fputc('}', out);
+}
 
-                    if ((i % 8) != 0) {
-                        fprintf(list_out, "\n");
-                    }
-                }
-            } else if (opcode->type == pseudo_dsw) {
-                if (src_pass == 2 && list_out) {
-                    int i;
-                    list_line_words(list_line, old_addr, NULL, 0, line);
-                    for (i = 0; i < output_addr - old_addr; i += 2) {
-                        if ((i % 8) == 0) {
-                            if (i == 0) {
-                                fprintf(list_out, "%4d %06o:", list_line, old_addr + i);
-                            } else {
-                                fprintf(list_out, "            ");
-                            }
-                        }
+static int lsp_file_listed(LspFile *list, const char *file)
+{
+    for (; list; list = list->prev) {
+        if (list->file == file) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-                        unsigned short w = (output[old_addr + i + 1] << 8) | output[old_addr + i];
-                        fprintf(list_out, " %06o", w);
+static void lsp_file_add(LspFile **list, const char *file)
+{
+    LspFile *f;
+    if (!lsp_file_listed(*list, file) && (f = malloc(sizeof(LspFile)))) {
+        f->file = file;
+        f->prev = *list;
+        *list = f;
+    }
+}
 
-                        if ((i % 8) == 6) {
-                            fprintf(list_out, "\n");
-                        }
-                    }
+/*
+ * Publishes the diagnostics of every file that has errors, is open or had
+ * errors last time, so that fixed files are cleared.
+ */
+static void lsp_publish(void)
+{
+    LspFile *files = NULL;
+    LspFile *now = NULL;
 
-                    if ((i % 8) != 0) {
-                        fprintf(list_out, "\n");
-                    }
-                }
-            } else if (opcode->type != pseudo_dw) {
-                if (src_pass == 2 && list_out) {
-                    int nwords = (output_addr - old_addr) / 2;
-                    unsigned short words[8];
-                    if (nwords > (int)(sizeof(words) / sizeof(words[0]))) {
-                        nwords = (int)(sizeof(words) / sizeof(words[0]));
-                    }
-                    for (int i = 0; i < nwords; i++) {
-                        words[i] = (output[old_addr + i * 2 + 1] << 8) | output[old_addr + i * 2];
-                    }
-                    list_line_words(list_line, old_addr, words, nwords, line);
-                }
+    for (LspError *e = lsp_errors; e; e = e->prev) {
+        lsp_file_add(&now, e->file);
+        lsp_file_add(&files, e->file);
+    }
+    for (LspDoc *d = lsp_docs; d; d = d->prev) {
+        lsp_file_add(&files, d->path);
+    }
+    for (LspFile *f = lsp_published; f; f = f->prev) {
+        lsp_file_add(&files, f->file);
+    }
+    for (LspFile *f = files; f; f = f->prev) {
+        char *buf;
+        size_t len;
+        FILE *msg = open_memstream(&buf, &len);
+        int first = 1;
+
+        fputs("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":", msg);
+        lsp_uri_write(msg, f->file);
+        fputs(",\"diagnostics\":[", msg);
+        for (LspError *e = lsp_errors; e; e = e->prev) {
+            if (e->file != f->file) {
+                continue;
             }
+            fputs(first ? "{\"range\":" : ",{\"range\":", msg);
+            lsp_range_write(msg, e->line, e->line + 1);
+            fputs(",\"severity\":1,\"source\":\"microasm11\",\"message\":", msg);
+            stats_json_str(msg, e->msg);
+            fputc('}', msg);
+            first = 0;
+        }
+        fputs("]}}", msg);
+        lsp_send(msg, &buf, &len);
+    }
+    while (files) {
+        LspFile *f = files->prev;
+        free(files);
+        files = f;
+    }
+    while (lsp_published) {
+        LspFile *f = lsp_published->prev;
+        free(lsp_published);
+        lsp_published = f;
+    }
+    lsp_published = now;
+}
 
-            if (opcode->type < pseudo_db) {
-                SKIP_BLANK(str);
-                if (*str) {
-                    error = EXTRA_SYMBOLS;
-                    return 1;
-                }
+static void lsp_analyze(void)
+{
+    lsp_clear();
+    fflush(stdout);
+    diag_flush();
+    for (LspDoc *d = lsp_docs; d; d = d->prev) {
+        int fds[2];
+        int nerrors = 0;
+        if (lsp_is_include(d->path) || pipe(fds) != 0) {
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            lsp_child(d->path, fds[1]);
+        }
+        close(fds[1]);
+        FILE *in = fdopen(fds[0], "r");
+        if (in) {
+            char *line = NULL;
+            size_t cap = 0;
+            while (getline(&line, &cap, in) > 0) {
+                lsp_result(line, &nerrors);
             }
-
+            free(line);
+            fclose(in);
         } else {
-            if (strlen(ptr)) {
-                error = SYNTAX_ERROR;
-                return 1;
-            } else if (src_pass == 2) {
-                list_line_words(list_line, output_addr, NULL, 0, line);
-            }
+            close(fds[0]);
         }
-    } else {
-        if (src_pass == 2) {
-            list_line_words(list_line, output_addr, NULL, 0, line);
+        if (pid > 0) {
+            waitpid(pid, NULL, 0);
         }
     }
+    lsp_dirty = 0;
+    lsp_publish();
+}
 
-    if (!in_macro) {
-        src_line++;
+static LspDoc *lsp_doc(const char *uri)
+{
+    for (LspDoc *d = lsp_docs; d; d = d->prev) {
+        if (uri && !strcmp(d->uri, uri)) {
+            return d;
+        }
     }
+    return NULL;
+}
 
-    return 0;
+/* Byte offset of a position; LSP counts characters in UTF-16 code units. */
+static size_t lsp_offset(const LspDoc *d, int line, int character)
+{
+    size_t pos = 0;
+    while (line > 0 && pos < d->len) {
+        if (d->text[pos++] == '\n') {
+            line--;
+        }
+    }
+    while (character > 0 && pos < d->len && d->text[pos] != '\n') {
+        unsigned char c = d->text[pos++];
+        character -= (c >= 0xF0) ? 2 : 1;
+        while (pos < d->len && (d->text[pos] & 0xC0) == 0x80) {
+            pos++;
+        }
+    }
+    return pos;
 }
 
-static void output_hex(FILE *outf)
+static void lsp_edit(LspDoc *d, const Json *change)
 {
-    int i;
-    unsigned int out_end = (tail_zero_start >= 0) ? (unsigned int)tail_zero_start : output_addr;
+    const char *text = json_text(change, "text");
+    Json *range = json_get(change, "range");
+    size_t start = 0;
+    size_t end = d->len;
 
-    for (i = start_addr; i < out_end; i++) {
-        if ((i % 16) == 0) {
-            fprintf(outf, "%04X:", i);
+    if (!text) {
+        return;
+    }
+    if (range) {
+        start = lsp_offset(d, json_int(range, "start.line", 0), json_int(range, "start.character", 0));
+        end = lsp_offset(d, json_int(range, "end.line", 0), json_int(range, "end.character", 0));
+        if (end < start) {
+            end = start;
         }
+    }
+    size_t tlen = strlen(text);
+    char *buf = malloc(d->len - (end - start) + tlen + 1);
+    if (!buf) {
+        return;
+    }
+    memcpy(buf, d->text, start);
+    memcpy(buf + start, text, tlen);
+    memcpy(buf + start + tlen, d->text + end, d->len - end);
+    d->len = d->len - (end - start) + tlen;
+    buf[d->len] = 0;
+    free(d->text);
+    d->text = buf;
+    lsp_dirty = 1;
+}
 
-        fprintf(outf, " %02X", output[i]);
+static void lsp_open(const Json *doc)
+{
+    const char *uri = json_text(doc, "uri");
+    const char *text = json_text(doc, "text");
+    LspDoc *d = lsp_doc(uri);
+    char *path;
 
-        if ((i % 16) == 15) {
-            fprintf(outf, "\n");
+    if (!uri || !text) {
+        return;
+    }
+    if (!d) {
+        if (!(d = calloc(1, sizeof(LspDoc))) || !(path = lsp_uri_path(uri))) {
+            free(d);
+            return;
         }
+        d->uri = strdup(uri);
+        d->path = lsp_file(path);
+        free(path);
+        d->prev = lsp_docs;
+        lsp_docs = d;
     }
+    free(d->text);
+    d->text = strdup(text);
+    d->len = d->text ? strlen(d->text) : 0;
+    lsp_dirty = 1;
+}
 
-    if ((i % 16) != 0) {
-        fprintf(outf, "\n");
+static void lsp_close(const char *uri)
+{
+    for (LspDoc **pd = &lsp_docs; *pd; pd = &(*pd)->prev) {
+        LspDoc *d = *pd;
+        if (uri && !strcmp(d->uri, uri)) {
+            *pd = d->prev;
+            free(d->uri);
+            free(d->text);
+            free(d);
+            lsp_dirty = 1;
+            return;
+        }
     }
 }
 
-static void output_verilog(FILE *outf)
+/* Copies the symbol name under the cursor to name. */
+static int lsp_word(const Json *params, char *name, size_t size, LspDoc **doc)
 {
-    fprintf(outf, "module sram(\n"											\
-            "    input  [7:0] ADDR,\n"									\
-            "    input  [7:0] DI,\n"									\
-            "    output [7:0] DO,\n"									\
-            "    input        RW,\n"									\
-            "    input        CS\n"										\
-            ");\n"														\
-            "    parameter  AddressSize = 8;\n"							\
-            "    reg        [7:0]    Mem[(1 << AddressSize) - 1:0];\n"	\
-            "\n"														\
-            "    initial begin\n");
+    LspDoc *d = lsp_doc(json_text(params, "textDocument.uri"));
+    int line = json_int(params, "position.line", 0);
 
-    unsigned int out_end = (tail_zero_start >= 0) ? (unsigned int)tail_zero_start : output_addr;
-    for (unsigned int i = start_addr; i < out_end; i++) {
-        fprintf(outf, "        Mem[%d] = 8'h%02x;\n", i, output[i]);
+    *doc = d;
+    if (!d) {
+        return 0;
     }
-
-    fprintf(outf, "    end\n"													\
-            "\n"														\
-            "    assign DO = RW ? Mem[ADDR] : 8'hFF;\n"					\
-            "\n"														\
-            "    always @(CS || RW) begin\n"							\
-            "        if (~CS && ~RW) begin\n"							\
-            "            Mem[ADDR] <= DI;\n"							\
-            "        end\n"												\
-            "    end\n"													\
-            "\n"														\
-            "endmodule\n");
+    size_t pos = lsp_offset(d, line, json_int(params, "position.character", 0));
+    size_t start = pos;
+    size_t end = pos;
+#define LSP_SYMCHAR(c) (is_ident_char((unsigned char)(c)) || (c) == '.')
+    while (start > 0 && LSP_SYMCHAR(d->text[start - 1])) {
+        start--;
+    }
+    while (end < d->len && LSP_SYMCHAR(d->text[end])) {
+        end++;
+    }
+#undef LSP_SYMCHAR
+    if (end == start || end - start >= size) {
+        return 0;
+    }
+    memcpy(name, d->text + start, end - start);
+    name[end - start] = 0;
+    return 1;
 }
 
-static void output_binary(FILE *outf)
+static int lsp_sym_match(const LspSym *s, const char *name)
 {
-    unsigned int out_end = (tail_zero_start >= 0) ? (unsigned int)tail_zero_start : output_addr;
-    for (unsigned int i = start_addr; i < out_end; i++) {
-        fwrite(&output[i], 1, 1, outf);
-    }
+    return symbol_eq(s->name, name);
 }
 
-static void calculate_chksum(void)
+/* Returns 1 if an earlier symbol in the list has the same definition. */
+static int lsp_sym_seen(const LspSym *s, const char *name)
 {
-    unsigned short chksum = 0;
-    for (unsigned int i = start_addr; i < output_addr; i += 2) {
-        unsigned short tmp = (output[i + 1] << 8) | output[i];
-        chksum += tmp;
+    for (LspSym *o = lsp_syms; o && o != s; o = o->prev) {
+        if (o->file == s->file && o->line == s->line && !strcmp(o->name, s->name) &&
+            (!name || lsp_sym_match(o, name))) {
+            return 1;
+        }
     }
-    chksum ^= 0xffff;
-    output[chksum_addr    ] = chksum & 0xff;
-    output[chksum_addr + 1] = chksum >> 8;
+    return 0;
 }
 
-static char *get_error_string(int error)
+static int lsp_sym_kind(const LspSym *s)
 {
-    switch(error) {
-    case NO_MEMORY_FOR_LABEL:
-        return "No memory for labels";
-    case CANNOT_RESOLVE_REF:
-        return "Cannot resolve reference";
-    case NO_MEMORY_FOR_MACRO:
-        return "No memory for macro";
-    case NO_MEMORY_FOR_PROC:
-        return "No memory for proc";
-    case INVALID_NUMBER:
-        return "Invalid number";
-    case INVALID_HEX_NUMBER:
-        return "Invalid hex number";
-    case INVALID_DECIMAL_NUMBER:
-        return "Invalid decimal number";
-    case INVALID_OCTAL_NUMBER:
-        return "Invalid octal number";
-    case INVALID_BINARY_NUMBER:
-        return "Invalid binary number";
-    case MISSED_BRACKET:
-        return "Missed bracket";
-    case EXPECTED_CLOSE_QUOTE:
-        return "Expected close quote";
-    case MISSED_OPCODE_PARAM_1:
-        return "Missed parameter";
-    case LONG_RELATED_OFFSET:
-        return "Related offset too long";
-    case MISSED_OPCODE_ARG_1:
-        return "Missed argument 1";
-    case EXPECTED_ARG_2:
-        return "Expected argument 2";
-    case MISSED_REGISTER_ARG_2:
-        return "Missed register 2";
-    case EXPECTED_ARG_3:
-        return "Expected argument 3";
-    case CONSTANT_VALUE_TOO_BIG:
-        return "Constant value too big (> 16)";
-    case MISSED_NAME_FOR_EQU:
-        return "Missed name for equ";
-    case MISSED_NAME_FOR_PROC:
-        return "Missed name for procedure";
-    case NESTED_PROC_UNSUPPORTED:
-        return "Nested procedures are not supported";
-    case ONLY_INSIDE_PROC:
-        return "Only onside procedure";
-    case LABEL_ALREADY_DEFINED:
-        return "Label name already used";
-    case MACRO_ALREADY_DEFINED:
-        return "Macro name already used";
-    case PROC_ALREADY_DEFINED:
-        return "Procedure name already used";
-    case EXTRA_SYMBOLS:
-        return "Extra symbols";
-    case SYNTAX_ERROR:
-        return "Syntax error";
-    case CANNOT_OPEN_FILE:
-        return "Cannot open file";
-    case UNSUPPORTED_INSTRUCTION:
-        return "Unsupported instruction for CPU";
-    default:
-        return "No error";
+    return s->kind == 'P' ? 12 : s->kind == 'E' ? 14 : 13;
+}
+
+static FILE *lsp_reply(const Json *id, char **buf, size_t *len)
+{
+    FILE *msg = open_memstream(buf, len);
+    fputs("{\"jsonrpc\":\"2.0\",\"id\":", msg);
+    json_write(msg, id);
+    fputs(",\"result\":", msg);
+    return msg;
+}
+
+static void lsp_definition(FILE *msg, const Json *params)
+{
+    char name[256];
+    LspDoc *d;
+    int first = 1;
+
+    fputc('[', msg);
+    if (lsp_word(params, name, sizeof(name), &d)) {
+        for (LspSym *s = lsp_syms; s; s = s->prev) {
+            if (s->file && lsp_sym_match(s, name) && !lsp_sym_seen(s, name)) {
+                if (!first) {
+                    fputc(',', msg);
+                }
+                lsp_location_write(msg, s->file, s->line);
+                first = 0;
+            }
+        }
     }
+    fputc(']', msg);
 }
 
-static char *get_out_name(char *in_str, char *ext)
+static void lsp_hover(FILE *msg, const Json *params)
 {
-    if (!in_str) {
-        return NULL;
+    char name[256];
+    char *buf;
+    size_t len;
+    LspDoc *d;
+    FILE *text = open_memstream(&buf, &len);
+    int line = json_int(params, "position.line", 0) + 1;
+    int n = 0;
+
+    if (lsp_word(params, name, sizeof(name), &d)) {
+        for (LspSym *s = lsp_syms; s; s = s->prev) {
+            if (lsp_sym_match(s, name) && !lsp_sym_seen(s, name)) {
+                fprintf(text, "%s**%s** = %06o (%u.)%s", n++ ? "\n\n" : "", s->name, s->value, s->value,
+                        s->kind == 'P' ? " PROC" : s->kind == 'E' ? " equ" : "");
+            }
+        }
+    }
+    for (LspLine *l = lsp_lines; d && l; l = l->prev) {
+        if (l->file == d->path && l->line == line) {
+            fprintf(text, "%s`%06o: %s`", n++ ? "\n\n" : "", l->addr, l->code);
+            if (l->cycles > 0) {
+                fprintf(text, " %d cycles", l->cycles);
+            }
+        }
+    }
+    fclose(text);
+    if (n) {
+        fputs("{\"contents\":{\"kind\":\"markdown\",\"value\":", msg);
+        stats_json_str(msg, buf);
+        fputs("}}", msg);
+    } else {
+        fputs("null", msg);
     }
+    free(buf);
+}
 
-    char *ptr = strrchr(in_str, '.');
-    if (ptr) {
-        *ptr = 0;
+static int lsp_contains(const char *name, const char *query)
+{
+    size_t n = strlen(query);
+    for (; *name; name++) {
+        if (!strncasecmp(name, query, n)) {
+            return 1;
+        }
     }
+    return !n;
+}
 
-    char *str = malloc(strlen(in_str) + strlen(ext) + 1);
-    strcpy(str, in_str);
-    strcat(str, ext);
+/* Writes SymbolInformation for the symbols of file, or those matching query. */
+static void lsp_symbols(FILE *msg, const char *file, const char *query)
+{
+    int n = 0;
 
-    return str;
+    fputc('[', msg);
+    for (LspSym *s = lsp_syms; s && n < LSP_MAX_RESULTS; s = s->prev) {
+        if (!s->file || (file && s->file != file) || (query && !lsp_contains(s->name, query)) ||
+            lsp_sym_seen(s, NULL)) {
+            continue;
+        }
+        fputs(n ? ",{\"name\":" : "{\"name\":", msg);
+        stats_json_str(msg, s->name);
+        fprintf(msg, ",\"kind\":%d,\"location\":", lsp_sym_kind(s));
+        lsp_location_write(msg, s->file, s->line);
+        fputc('}', msg);
+        n++;
+    }
+    fputc(']', msg);
+}
+
+static int lsp_getc(void)
+{
+    if (lsp_in_pos == lsp_in_len) {
+        ssize_t n = read(STDIN_FILENO, lsp_in, sizeof(lsp_in));
+        if (n <= 0) {
+            return EOF;
+        }
+        lsp_in_len = n;
+        lsp_in_pos = 0;
+    }
+    return (unsigned char)lsp_in[lsp_in_pos++];
+}
+
+static int lsp_pending(void)
+{
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return lsp_in_pos < lsp_in_len || poll(&pfd, 1, 0) > 0;
+}
+
+/* Reads one message body, or returns NULL at the end of input. */
+static char *lsp_read(void)
+{
+    char header[256];
+    long length = -1;
+
+    for (;;) {
+        size_t n = 0;
+        int c;
+        while ((c = lsp_getc()) != EOF && c != '\n') {
+            if (n < sizeof(header) - 1 && c != '\r') {
+                header[n++] = c;
+            }
+        }
+        if (c == EOF) {
+            return NULL;
+        }
+        header[n] = 0;
+        if (!n) {
+            if (length >= 0) {
+                break;
+            }
+            continue;
+        }
+        if (!strncasecmp(header, "Content-Length:", 15)) {
+            length = strtol(header + 15, NULL, 10);
+        }
+    }
+    char *body = malloc(length + 1);
+    if (!body) {
+        return NULL;
+    }
+    for (long i = 0; i < length; i++) {
+        int c = lsp_getc();
+        if (c == EOF) {
+            free(body);
+            return NULL;
+        }
+        body[i] = c;
+    }
+    body[length] = 0;
+    return body;
+}
+
+static int lsp_run(int argc, char *argv[])
+{
+    int shutdown = 0;
+    char *body;
+
+    lsp_args = argv;
+    lsp_nargs = argc;
+    signal(SIGPIPE, SIG_IGN);
+    while ((body = lsp_read())) {
+        const char *p = body;
+        Json *req = json_parse(&p);
+        const char *method = json_text(req, "method");
+        Json *id = json_get(req, "id");
+        Json *params = json_get(req, "params");
+        char *buf;
+        size_t len;
+        FILE *msg;
+
+        free(body);
+        if (!method) {
+            json_free(req);
+            continue;
+        }
+        if (!strcmp(method, "exit")) {
+            json_free(req);
+            break;
+        }
+        if (lsp_dirty && id && strcmp(method, "shutdown")) {
+            lsp_analyze();
+        }
+        if (!strcmp(method, "initialize")) {
+            Json *args = json_path(params, "initializationOptions.args");
+            if (args && args->type == JSON_ARR) {
+                int n = 0;
+                for (Json *a = args->child; a; a = a->next) {
+                    n++;
+                }
+                lsp_args = malloc((argc + n) * sizeof(char *));
+                if (lsp_args) {
+                    memcpy(lsp_args, argv, argc * sizeof(char *));
+                    lsp_nargs = argc;
+                    for (Json *a = args->child; a; a = a->next) {
+                        if (a->type == JSON_STR) {
+                            lsp_args[lsp_nargs++] = strdup(a->str);
+                        }
+                    }
+                } else {
+                    lsp_args = argv;
+                }
+            }
+            msg = lsp_reply(id, &buf, &len);
+            fputs("{\"capabilities\":{\"textDocumentSync\":{\"openClose\":true,\"change\":2,\"save\":true},"
+                  "\"definitionProvider\":true,\"hoverProvider\":true,\"documentSymbolProvider\":true,"
+                  "\"workspaceSymbolProvider\":true},\"serverInfo\":{\"name\":\"microasm11\"}}}", msg);
+            lsp_send(msg, &buf, &len);
+        } else if (!strcmp(method, "textDocument/didOpen")) {
+            lsp_open(json_get(params, "textDocument"));
+        } else if (!strcmp(method, "textDocument/didChange")) {
+            LspDoc *d = lsp_doc(json_text(params, "textDocument.uri"));
+            Json *changes = json_get(params, "contentChanges");
+            for (Json *c = changes ? changes->child : NULL; d && c; c = c->next) {
+                lsp_edit(d, c);
+            }
+        } else if (!strcmp(method, "textDocument/didSave")) {
+            lsp_dirty = 1;
+        } else if (!strcmp(method, "textDocument/didClose")) {
+            lsp_close(json_text(params, "textDocument.uri"));
+        } else if (!strcmp(method, "textDocument/definition")) {
+            msg = lsp_reply(id, &buf, &len);
+            lsp_definition(msg, params);
+            fputc('}', msg);
+            lsp_send(msg, &buf, &len);
+        } else if (!strcmp(method, "textDocument/hover")) {
+            msg = lsp_reply(id, &buf, &len);
+            lsp_hover(msg, params);
+            fputc('}', msg);
+            lsp_send(msg, &buf, &len);
+        } else if (!strcmp(method, "textDocument/documentSymbol")) {
+            LspDoc *d = lsp_doc(json_text(params, "textDocument.uri"));
+            msg = lsp_reply(id, &buf, &len);
+            if (d) {
+                lsp_symbols(msg, d->path, NULL);
+            } else {
+                fputs("[]", msg);
+            }
+            fputc('}', msg);
+            lsp_send(msg, &buf, &len);
+        } else if (!strcmp(method, "workspace/symbol")) {
+            msg = lsp_reply(id, &buf, &len);
+            lsp_symbols(msg, NULL, json_text(params, "query"));
+            fputc('}', msg);
+            lsp_send(msg, &buf, &len);
+        } else if (!strcmp(method, "shutdown")) {
+            shutdown = 1;
+            msg = lsp_reply(id, &buf, &len);
+            fputs("null}", msg);
+            lsp_send(msg, &buf, &len);
+        } else if (id) {
+            msg = open_memstream(&buf, &len);
+            fputs("{\"jsonrpc\":\"2.0\",\"id\":", msg);
+            json_write(msg, id);
+            fputs(",\"error\":{\"code\":-32601,\"message\":\"Method not found\"}}", msg);
+            lsp_send(msg, &buf, &len);
+        }
+        json_free(req);
+        /* Edits that arrive together are analyzed once. */
+        if (lsp_dirty && !lsp_pending()) {
+            lsp_analyze();
+        }
+    }
+    return shutdown ? 0 : 1;
+}
+
+static void usage(const char *prog)
+{
+    diag(DIAG_ERROR, "Usage: %s [-verilog|-binary|-reloc|-c] [-q|-v] [--case-sensitive-symbols] [--jmp-label-indirect] [--cpu <name>] [--gc-procs] [--proc-profile <file>] [--relax] [--optimize] [--instrument=procs|loops [--instrument-hook <label>] [--instrument-map <file>]] [--cycles] [--profile <file> [--profile-top <n>]] [--run [--run-entry <addr>] [--run-cycles <n>] [--run-dump <from>:<to>]] [--layout <file>] [--list <file|-] [--map <file>] [--stats[=json]] [--trace-json <file>] [--cache <dir> [--cache-size <MiB>]] [--pch-out <file>|--pch-in <file>] [-MD [-MF <file>] [-MT <target>] [-MP]] [--watch] [--shm <name> [--shm-symbols]] <input_file> [output_file]\n", prog);
+    diag(DIAG_ERROR, "       %s --disassemble [--cpu <name>] [--disasm-org <addr>] [--symbols <file>] <image_file> [output_file]\n", prog);
+    diag(DIAG_ERROR, "       %s --server <socket> | --client <socket> [--override <path> <file|->]... <arguments>\n", prog);
+    diag(DIAG_ERROR, "       %s --lsp [options]\n", prog);
 }
 
 int main(int argc, char *argv[])
 {
     int out_type = 0;
+    const char *shm_name = NULL;
+    int shm_symbols = 0;
     char *input_path = NULL;
     char *output_path = NULL;
     char *list_path = NULL;
+    const char *layout_path = NULL;
     const char *cpu_name = NULL;
+    const char *profile_path = NULL;
+    const char *pch_in_path = NULL;
+    const char *dep_path = NULL;
+    const char *dep_target = NULL;
+    int disassemble = 0;
+    int watch = 0;
+    const char *server_path = NULL;
+
+    atexit(diag_flush);
 
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s [-verilog|-binary] [--case-sensitive-symbols] [--jmp-label-indirect] [--cpu <name>] [--list <file|-] <input_file> [output_file]\n", argv[0]);
+        usage(argv[0]);
         return 1;
     }
 
+    if (!strcmp(argv[1], "--client")) {
+        if (argc < 3 || server_child) {
+            usage(argv[0]);
+            return 1;
+        }
+        return client_run(argv[2], argc - 3, argv + 3);
+    }
+
+    if (!strcmp(argv[1], "--lsp")) {
+        if (server_child) {
+            usage(argv[0]);
+            return 1;
+        }
+        return lsp_run(argc - 2, argv + 2);
+    }
+
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-verilog")) {
             out_type = 1;
         } else if (!strcmp(argv[i], "-binary")) {
             out_type = 2;
+        } else if (!strcmp(argv[i], "-reloc")) {
+            out_type = 3;
+            reloc_mode = 1;
+        } else if (!strcmp(argv[i], "-c")) {
+            out_type = 4;
+            reloc_mode = 1;
+            obj_mode = 1;
         } else if (!strcmp(argv[i], "--case-sensitive-symbols")) {
             case_sensitive_symbols = 1;
         } else if (!strcmp(argv[i], "--jmp-label-indirect")) {
             jmp_label_indirect = 1;
         } else if (!strcmp(argv[i], "--cpu")) {
             if (i + 1 >= argc) {
-                fprintf(stderr, "--cpu requires a name\n");
+                diag(DIAG_ERROR, "--cpu requires a name\n");
                 return 1;
             }
             cpu_name = argv[++i];
+        } else if (!strcmp(argv[i], "--shm")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--shm requires a segment name\n");
+                return 1;
+            }
+            shm_name = argv[++i];
+        } else if (!strcmp(argv[i], "--shm-symbols")) {
+            shm_symbols = 1;
+        } else if (!strcmp(argv[i], "--relax")) {
+            relax_enabled = 1;
+        } else if (!strcmp(argv[i], "--gc-procs")) {
+            gc_procs = 1;
+        } else if (!strcmp(argv[i], "--proc-profile")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--proc-profile requires a file path\n");
+                return 1;
+            }
+            reorder_path = argv[++i];
+        } else if (!strncmp(argv[i], "--instrument=", 13)) {
+            if (!strcmp(argv[i] + 13, "procs")) {
+                instrument = INSTR_PROCS;
+            } else if (!strcmp(argv[i] + 13, "loops")) {
+                instrument = INSTR_PROCS | INSTR_LOOPS;
+            } else {
+                diag(DIAG_ERROR, "Unknown --instrument mode: %s\n", argv[i] + 13);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--instrument-hook")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--instrument-hook requires a label\n");
+                return 1;
+            }
+            instr_hook = argv[++i];
+        } else if (!strcmp(argv[i], "--instrument-map")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--instrument-map requires a file path\n");
+                return 1;
+            }
+            instr_map_path = argv[++i];
+        } else if (!strcmp(argv[i], "--disassemble")) {
+            disassemble = 1;
+        } else if (!strcmp(argv[i], "--disasm-org")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--disasm-org requires an address\n");
+                return 1;
+            }
+            disasm_org = strtoul(argv[++i], NULL, 8);
+        } else if (!strcmp(argv[i], "--symbols")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--symbols requires a file path\n");
+                return 1;
+            }
+            disasm_syms_path = argv[++i];
+        } else if (!strcmp(argv[i], "--optimize")) {
+            optimize = 1;
+        } else if (!strcmp(argv[i], "--cycles")) {
+            cycles_enabled = 1;
+        } else if (!strcmp(argv[i], "--profile")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--profile requires a file path\n");
+                return 1;
+            }
+            profile_path = argv[++i];
+        } else if (!strcmp(argv[i], "--profile-top")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--profile-top requires a count\n");
+                return 1;
+            }
+            profile_top = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--run")) {
+            run_enabled = 1;
+        } else if (!strcmp(argv[i], "--run-entry")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--run-entry requires an address\n");
+                return 1;
+            }
+            run_entry = argv[++i];
+        } else if (!strcmp(argv[i], "--run-cycles")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--run-cycles requires a count\n");
+                return 1;
+            }
+            run_max_cycles = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--run-dump")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--run-dump requires a range\n");
+                return 1;
+            }
+            run_dump = argv[++i];
+        } else if (!strcmp(argv[i], "--layout")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--layout requires a file path\n");
+                return 1;
+            }
+            layout_path = argv[++i];
         } else if (!strcmp(argv[i], "--list")) {
             if (i + 1 >= argc) {
-                fprintf(stderr, "--list requires a file path\n");
+                diag(DIAG_ERROR, "--list requires a file path\n");
                 return 1;
             }
             list_path = argv[++i];
+        } else if (!strcmp(argv[i], "--watch") && !server_child) {
+            watch = 1;
+        } else if (!strcmp(argv[i], "--server") && !server_child) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--server requires a socket path\n");
+                return 1;
+            }
+            server_path = argv[++i];
+        } else if (!strcmp(argv[i], "-q")) {
+            diag_level = DIAG_WARNING;
+        } else if (!strcmp(argv[i], "-v")) {
+            diag_level = DIAG_VERBOSE;
+        } else if (!strcmp(argv[i], "--stats")) {
+            stats_mode = STATS_TEXT;
+        } else if (!strcmp(argv[i], "--stats=json")) {
+            stats_mode = STATS_JSON;
+        } else if (!strcmp(argv[i], "--trace-json")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--trace-json requires a file path\n");
+                return 1;
+            }
+            trace_path = argv[++i];
+        } else if (!strcmp(argv[i], "-MD")) {
+            dep_mode = 1;
+        } else if (!strcmp(argv[i], "-MP")) {
+            dep_phony = 1;
+        } else if (!strcmp(argv[i], "-MF")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "-MF requires a file path\n");
+                return 1;
+            }
+            dep_path = argv[++i];
+        } else if (!strcmp(argv[i], "-MT")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "-MT requires a target\n");
+                return 1;
+            }
+            dep_target = argv[++i];
+        } else if (!strcmp(argv[i], "--pch-out")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--pch-out requires a file path\n");
+                return 1;
+            }
+            pch_out_path = argv[++i];
+        } else if (!strcmp(argv[i], "--pch-in")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--pch-in requires a file path\n");
+                return 1;
+            }
+            pch_in_path = argv[++i];
+        } else if (!strcmp(argv[i], "--cache")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--cache requires a directory\n");
+                return 1;
+            }
+            cache_dir = argv[++i];
+        } else if (!strcmp(argv[i], "--cache-size")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--cache-size requires a size in MiB\n");
+                return 1;
+            }
+            cache_limit = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--map")) {
+            if (i + 1 >= argc) {
+                diag(DIAG_ERROR, "--map requires a file path\n");
+                return 1;
+            }
+            map_path = argv[++i];
         } else if (!input_path) {
             input_path = argv[i];
         } else if (!output_path) {
             output_path = argv[i];
         } else {
-            fprintf(stderr, "Too many arguments\n");
+            diag(DIAG_ERROR, "Too many arguments\n");
             return 1;
         }
     }
 
+    if (server_path) {
+        return server_run(server_path);
+    }
+
     if (!input_path) {
-        fprintf(stderr, "Usage: %s [-verilog|-binary] [--case-sensitive-symbols] [--jmp-label-indirect] [--cpu <name>] [--list <file|-] <input_file> [output_file]\n", argv[0]);
+        usage(argv[0]);
         return 1;
     }
 
     if (cpu_name) {
         if (!set_cpu_by_name(cpu_name)) {
-            fprintf(stderr, "Unknown CPU: %s\n", cpu_name);
+            diag(DIAG_ERROR, "Unknown CPU: %s\n", cpu_name);
             return 1;
         }
     }
 
+    if (watch && !disassemble) {
+        const char *extra[3] = { layout_path, profile_path, reorder_path };
+        int rc = watch_run(input_path, extra, 3);
+        if (rc >= 0) {
+            return rc;
+        }
+    }
+
+    if (dep_mode && !disassemble) {
+        if (!dep_target) {
+            dep_target = pch_out_path ? pch_out_path : output_name(input_path, output_path, out_type);
+        }
+        if (!dep_path) {
+            char *copy = strdup(dep_target);
+            dep_path = get_out_name(copy, ".d");
+            free(copy);
+        }
+        dep_note(input_path);
+        const char *inputs[] = { layout_path, profile_path, reorder_path, pch_in_path };
+        for (int i = 0; i < 4; i++) {
+            if (inputs[i]) {
+                dep_note(inputs[i]);
+            }
+        }
+    }
+
+    if (cache_dir && !disassemble) {
+        if (run_enabled || shm_name || stats_mode || trace_path || instr_map_path || watch_fd >= 0 || lsp_out || pch_out_path ||
+            (list_path && !strcmp(list_path, "-"))) {
+            diag(DIAG_VERBOSE, "Cache: not used with these options\n");
+        } else {
+            const char *outputs[CACHE_BLOBS] = { output_path, list_path, map_path, dep_path };
+            const char *inputs[] = { input_path, layout_path, profile_path, reorder_path, pch_in_path };
+            cache_dests[0] = output_name(input_path, output_path, out_type);
+            cache_dests[1] = list_path;
+            cache_dests[2] = map_path;
+            cache_dests[3] = dep_mode ? dep_path : NULL;
+            mkdir(cache_dir, 0777);
+            cache_begin(argc, argv, outputs, inputs, 5, dep_mode ? dep_target : NULL);
+            if (cache_key[0] && cache_lookup()) {
+                unsigned long hits, misses;
+                cache_count(1, &hits, &misses);
+                diag(DIAG_INFO, "Cache: hit %s (%lu hits, %lu misses)\n", cache_key, hits, misses);
+                return 0;
+            }
+        }
+    }
+
     if (list_path) {
         if (!strcmp(list_path, "-")) {
             list_out = stdout;
         } else {
             list_out = fopen(list_path, "wb");
             if (!list_out) {
-                fprintf(stderr, "Can't open listing file: %s\n", list_path);
+                diag(DIAG_ERROR, "Can't open listing file: %s\n", list_path);
                 return 1;
             }
         }
     }
 
+    if (disassemble) {
+        if (disasm_org >= MAX_OUTPUT || (disasm_org & 1)) {
+            diag(DIAG_ERROR, "Bad --disasm-org address\n");
+            return 1;
+        }
+        return disassemble_image(input_path, output_path, cpu_name) ? 0 : 1;
+    }
+
+    if (instrument && reloc_mode) {
+        diag(DIAG_ERROR, "--instrument needs an absolute image\n");
+        return 1;
+    }
+
+    if (profile_path && !profile_load(profile_path)) {
+        return 1;
+    }
+
+    if (pch_in_path && !pch_load(pch_in_path)) {
+        return 1;
+    }
+
     start_addr = 0;
+    stats_begin();
+    if (trace_path) {
+        trace_start = stats_wall();
+        atexit(trace_flush);
+    }
 
-    in_file = fopen(input_path, "rb");
+    in_file = source_open(input_path);
+    if (watch_fd >= 0) {
+        dprintf(watch_fd, "%s\n", source_key(input_path));
+    }
     if (in_file) {
-        int err;
-        char str[512];
-
+        in_file_name = file_intern(input_path);
         in_file_path = strdup(input_path);
         get_file_path(in_file_path);
 
@@ -2762,70 +10502,99 @@ int main(int argc, char *argv[])
         tail_zero_start = -1;
         lsb_reset();
         local_defs = NULL;
+        sections_begin_pass();
+        instrument_begin_pass();
 
         // Pass 1
 
-        do {
-            if (files) {
-                fclose(in_file);
-                free(in_file_path);
-                in_file = files->in_file;
-                in_file_path = files->in_file_path;
-                src_line = files->src_line;
-                File *tmp = files->prev;
-                free(files);
-                files = tmp;
-            }
-
-            while(fgets(str, sizeof(str), in_file)) {
-                char *ptr = str;
-                REMOVE_ENDLINE(ptr);
-                if ((err = do_asm(in_file, str)) || error != NO_ERROR) {
-                    fprintf(stderr, "Line %d: %s\n", src_line, str);
-                    fprintf(stderr, "Compilation failed: %s\n\n", get_error_string(error));
-                    return 1;
-                }
+        if (!assemble_pass()) {
+            return 1;
+        }
+        section_enter(NULL);
+
+        if (gc_procs && gc_collect() > 0) {
+            gc_active = 1;
+            if (!layout_again()) {
+                return 1;
+            }
+        }
+        if (optimize && peephole_decide() > 0) {
+            if (!layout_again()) {
+                return 1;
+            }
+        }
+        if (((instrument & INSTR_LOOPS) || instr_replan) && !layout_again()) {
+            return 1;
+        }
+        if (reorder_path) {
+            if (!reorder_plan()) {
+                return 1;
+            }
+            if (reorder_active && !layout_again()) {
+                return 1;
             }
-        } while(files);
+        }
+        if (relax_enabled && !relax_layout()) {
+            return 1;
+        }
+
+        if (!layout_sections(layout_path)) {
+            return 1;
+        }
+        if (sections) {
+            memset(output, 0, sizeof(output));
+        }
 
         output_addr = start_addr;
         src_pass = 2;
+        layout_pass = 0;
         src_line = 1;
         in_macro = 0;
         in_proc = NULL;
         emit_is_fill = 0;
         tail_zero_start = -1;
         lsb_reset();
+        sections_begin_pass();
+        relax_seq = 0;
+        peep_seq = 0;
+        peep_entry = 1;
+        instrument_begin_pass();
 
         if (fseek(in_file, 0, SEEK_SET) != 0) {
-            fprintf(stderr, "Error rewinding file for pass 2\n");
+            diag(DIAG_ERROR, "Error rewinding file for pass 2\n");
             return 1;
         }
 
         // Pass 2
 
-        do {
-            if (files) {
-                fclose(in_file);
-                free(in_file_path);
-                in_file = files->in_file;
-                in_file_path = files->in_file_path;
-                src_line = files->src_line;
-                File *tmp = files->prev;
-                free(files);
-                files = tmp;
-            }
-
-            while(fgets(str, sizeof(str), in_file)) {
-                char *ptr = str;
-                REMOVE_ENDLINE(ptr);
-                if ((err = do_asm(in_file, str)) || error != NO_ERROR) {
-                    fprintf(stderr, "Line %d: %s\n", src_line, str);
-                    fprintf(stderr, "Compilation failed: %s\n\n", get_error_string(error));
-                    return 1;
-                }
-            }
-        } while(files);
+        if (!assemble_pass()) {
+            return 1;
+        }
+
+        if (budget_sp > 0) {
+            CycleBudget *b = &budgets[budget_sp - 1];
+            diag(DIAG_ERROR, "%s:%d: .cycles_begin %s\n", b->file, b->line, b->name);
+            diag(DIAG_ERROR, "Compilation failed: Cycle budget is not closed\n\n");
+            return 1;
+        }
+
+        sections_finish();
+
+        if (peep_rewrites) {
+            diag(DIAG_INFO, "Peephole: %d rewrites, %d words saved, %d cycles saved\n",
+                    peep_rewrites, peep_saved, peep_cycles);
+        }
+        if (reorder_path && diag_file(DIAG_INFO)) {
+            /* After the last layout, so the run starts match the listing. */
+            reorder_report(diag_file(DIAG_INFO));
+        }
+        FILE *report = list_out ? NULL : diag_file(DIAG_INFO);
+        if (cycles_enabled && report) {
+            cycles_summary(report);
+        }
+        if (profile_hits && report) {
+            profile_summary(report);
+        }
 
         if (use_chksum) {
             calculate_chksum();
@@ -2841,19 +10610,53 @@ int main(int argc, char *argv[])
             dump_labels(equs);
             fprintf(list_out, "\nLabels:\n");
             dump_labels(labels);
+            if (gc_active) {
+                fprintf(list_out, "\nRemoved PROCs:\n");
+                for (Proc *proc = procs; proc; proc = proc->prev) {
+                    if (!proc->live) {
+                        fprintf(list_out, "[%s] %u bytes\n", proc->name, proc->size);
+                    }
+                }
+            }
+            if (reorder_path) {
+                fprintf(list_out, "\n");
+                reorder_report(list_out);
+            }
+            if (instrument) {
+                instrument_report(list_out);
+            }
+            if (optimize) {
+                fprintf(list_out, "\nPeephole: %d rewrites, %d words saved, %d cycles saved\n",
+                        peep_rewrites, peep_saved, peep_cycles);
+            }
+            if (cycles_enabled) {
+                cycles_summary(list_out);
+            }
+            if (profile_hits) {
+                profile_summary(list_out);
+            }
             fprintf(list_out, "\nErrors: %s\n\n", get_error_string(error));
         }
 
-        if (error == NO_ERROR) {
-            char *name;
-            if (output_path) {
-                name = strdup(output_path);
-            } else {
-                name = get_out_name(input_path, (out_type == 2) ? ".bin" : (out_type == 1) ? ".v" : ".mem");
+        stats_pass_begin();
+        TRACE_BEGIN("output", NULL, 0);
+        if (error == NO_ERROR && pch_out_path) {
+            if (!pch_write(pch_out_path, input_path)) {
+                error = 1;
+            }
+        } else if (error == NO_ERROR && shm_name) {
+            if (!output_shm(shm_name, shm_symbols)) {
+                error = 1;
             }
+        } else if (error == NO_ERROR) {
+            char *name = output_name(input_path, output_path, out_type);
             FILE *outf = fopen(name, "wb");
             if (outf) {
-                if (out_type == 2) {
+                if (out_type == 4) {
+                    output_object(outf);
+                } else if (out_type == 3) {
+                    output_reloc(outf);
+                } else if (out_type == 2) {
                     output_binary(outf);
                 } else if (out_type) {
                     output_verilog(outf);
@@ -2863,15 +10666,47 @@ int main(int argc, char *argv[])
                 fclose(outf);
             } else {
                 error = 1;
-                fprintf(stderr, "Can't create output file!\n");
+                diag(DIAG_ERROR, "Can't create output file!\n");
             }
             free(name);
         }
+        stats_pass_end("output");
+        TRACE_END("output");
+
+        if (error == NO_ERROR && instr_map_path && !instrument_write_map(instr_map_path)) {
+            error = 1;
+        }
+
+        if (error == NO_ERROR && map_path && !write_map(map_path)) {
+            error = 1;
+        }
+
+        if (error == NO_ERROR && dep_mode && !dep_write(dep_path, dep_target)) {
+            error = 1;
+        }
+
+        if (error == NO_ERROR && cache_key[0]) {
+            if (list_out) {
+                fflush(list_out);
+            }
+            cache_store();
+        }
+
+        if (error == NO_ERROR && run_enabled) {
+            diag_flush();
+            if (!run_image()) {
+                error = 1;
+            }
+        }
+
+        if (stats_mode) {
+            stats_report(diag_file(DIAG_ERROR));
+        }
 
         fclose(in_file);
         free(in_file_path);
     } else {
-        fprintf(stderr, "Cannot open input file!\n");
+        diag(DIAG_ERROR, "Cannot open input file!\n");
         return -1;
     }
 
@@ -0,0 +1,504 @@
+/*
+ * Linker for microasm11 object files (-c)
+ * (c) sashz by pdaXrom.org, 2026
+ *
+ * Sections with the same name are concatenated in command line order,
+ * sections are laid out in order of first appearance, exported symbols
+ * resolve external references and relocation records are applied. The
+ * result is written in the same .mem/.v/.bin formats as microasm11.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <strings.h>
+
+#define MAX_OUTPUT (65536)
+#define NAME_MAX_LEN 64
+
+typedef struct Section {
+    char name[NAME_MAX_LEN];
+    unsigned int base;
+    unsigned int size;
+    unsigned int new_base;
+    unsigned int align;
+    int bss;
+    unsigned char *data;
+    struct Section *next;
+} Section;
+
+typedef struct Symbol {
+    char name[NAME_MAX_LEN];
+    char sect[NAME_MAX_LEN];
+    unsigned int value;
+    struct Module *mod;
+    struct Symbol *next;
+} Symbol;
+
+typedef struct Extern {
+    unsigned int index;
+    char name[NAME_MAX_LEN];
+    Symbol *def;
+    struct Extern *next;
+} Extern;
+
+typedef struct Reloc {
+    unsigned int addr;
+    int ext;
+    int nsect;
+    char sect[4][NAME_MAX_LEN];
+    int weight[4];
+    struct Reloc *next;
+} Reloc;
+
+typedef struct Module {
+    char *path;
+    Section *sects;
+    Symbol *syms;
+    Extern *exts;
+    Reloc *rels;
+    struct Module *next;
+} Module;
+
+static unsigned char output[MAX_OUTPUT];
+static unsigned int start_addr = 0;
+static unsigned int end_addr = 0;
+
+static Module *modules = NULL;
+
+static int case_sensitive_symbols = 0;
+
+static int symbol_eq(const char *a, const char *b)
+{
+    return case_sensitive_symbols ? (strcmp(a, b) == 0) : (strcasecmp(a, b) == 0);
+}
+
+static Section *find_section(Module *mod, const char *name)
+{
+    for (Section *s = mod->sects; s; s = s->next) {
+        if (!strcmp(s->name, name)) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static Section *section_at(Module *mod, unsigned int addr)
+{
+    for (Section *s = mod->sects; s; s = s->next) {
+        if (addr >= s->base && addr < s->base + s->size) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static int section_delta(Module *mod, const char *name, int *delta)
+{
+    Section *s = find_section(mod, name);
+    if (!s) {
+        return 0;
+    }
+    *delta = (int)s->new_base - (int)s->base;
+    return 1;
+}
+
+static void *xcalloc(size_t size)
+{
+    void *p = calloc(1, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static int load_object(const char *path)
+{
+    char str[1024];
+    int line = 0;
+    FILE *inf = fopen(path, "rb");
+
+    if (!inf) {
+        fprintf(stderr, "Cannot open object file %s\n", path);
+        return 0;
+    }
+
+    Module *mod = xcalloc(sizeof(Module));
+    mod->path = strdup(path);
+
+    Section **sect_tail = &mod->sects;
+    Reloc **rel_tail = &mod->rels;
+
+    while (fgets(str, sizeof(str), inf)) {
+        char name[NAME_MAX_LEN];
+        char sect[NAME_MAX_LEN];
+        unsigned int a, b;
+        int n = 0;
+        line++;
+
+        if (line == 1) {
+            if (strncmp(str, "MICROOBJ11 1", 12)) {
+                fprintf(stderr, "%s: not a microasm11 object file\n", path);
+                fclose(inf);
+                return 0;
+            }
+            continue;
+        }
+
+        if (!strncmp(str, "SECT ", 5) && sscanf(str + 5, "%63s %X %X%n", name, &a, &b, &n) == 3) {
+            char *p = str + 5 + n;
+            char attr[NAME_MAX_LEN];
+            Section *s = xcalloc(sizeof(Section));
+            strcpy(s->name, name);
+            s->base = a;
+            s->size = b;
+            s->align = 2;
+            while (sscanf(p, "%63s%n", attr, &n) == 1) {
+                if (!strcmp(attr, "bss")) {
+                    s->bss = 1;
+                } else if (!strncmp(attr, "align=", 6)) {
+                    s->align = strtoul(attr + 6, NULL, 16);
+                    if (s->align < 2 || (s->align & (s->align - 1))) {
+                        s->align = 2;
+                    }
+                }
+                p += n;
+            }
+            s->data = xcalloc(b ? b : 1);
+            *sect_tail = s;
+            sect_tail = &s->next;
+        } else if (!strncmp(str, "D ", 2) && sscanf(str + 2, "%X%n", &a, &n) == 1) {
+            char *p = str + 2 + n;
+            Section *s = section_at(mod, a);
+            unsigned int byte;
+            while (sscanf(p, "%X%n", &byte, &n) == 1) {
+                if (!s || a >= s->base + s->size) {
+                    s = section_at(mod, a);
+                }
+                if (!s) {
+                    fprintf(stderr, "%s:%d: data outside of sections\n", path, line);
+                    fclose(inf);
+                    return 0;
+                }
+                s->data[a - s->base] = byte;
+                a++;
+                p += n;
+            }
+        } else if (!strncmp(str, "SYM ", 4) && sscanf(str + 4, "%63s %63s %X", name, sect, &a) == 3) {
+            Symbol *sym = xcalloc(sizeof(Symbol));
+            strcpy(sym->name, name);
+            strcpy(sym->sect, sect);
+            sym->value = a;
+            sym->mod = mod;
+            sym->next = mod->syms;
+            mod->syms = sym;
+        } else if (!strncmp(str, "EXT ", 4) && sscanf(str + 4, "%X %63s", &a, name) == 2) {
+            Extern *ext = xcalloc(sizeof(Extern));
+            ext->index = a;
+            strcpy(ext->name, name);
+            ext->next = mod->exts;
+            mod->exts = ext;
+        } else if (!strncmp(str, "REL ", 4) && sscanf(str + 4, "%X %63s%n", &a, name, &n) == 2) {
+            char *p = str + 4 + n;
+            Reloc *rel = xcalloc(sizeof(Reloc));
+            rel->addr = a;
+            rel->ext = strcmp(name, "-") ? (int)strtoul(name, NULL, 16) : -1;
+            while (rel->nsect < 4 && sscanf(p, " %63[^:]:%d%n", sect, &rel->weight[rel->nsect], &n) == 2) {
+                strcpy(rel->sect[rel->nsect++], sect);
+                p += n;
+            }
+            *rel_tail = rel;
+            rel_tail = &rel->next;
+        } else if (!strncmp(str, "END", 3)) {
+            break;
+        } else if (*str != '\n' && *str != '#') {
+            fprintf(stderr, "%s:%d: bad record\n", path, line);
+            fclose(inf);
+            return 0;
+        }
+    }
+    fclose(inf);
+
+    Module **tail = &modules;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = mod;
+    return 1;
+}
+
+static void layout(int have_base, unsigned int base)
+{
+    unsigned int addr;
+
+    if (!have_base) {
+        base = (modules && modules->sects) ? modules->sects->base : 0;
+    }
+    start_addr = base;
+    addr = base;
+
+    /*
+     * Section names in order of first appearance, each one concatenated
+     * across modules; BSS sections go after the image and are not output.
+     */
+    for (int bss = 0; bss <= 1; bss++) {
+        if (bss) {
+            end_addr = addr;
+        }
+        for (Module *first = modules; first; first = first->next) {
+            for (Section *s = first->sects; s; s = s->next) {
+                int seen = 0;
+                for (Module *m = modules; m != first && !seen; m = m->next) {
+                    seen = find_section(m, s->name) != NULL;
+                }
+                if (seen || s->bss != bss) {
+                    continue;
+                }
+                for (Module *m = first; m; m = m->next) {
+                    Section *piece = find_section(m, s->name);
+                    if (piece) {
+                        addr = (addr + piece->align - 1) & ~(piece->align - 1);
+                        piece->new_base = addr;
+                        addr += piece->size;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static Symbol *find_global(const char *name)
+{
+    for (Module *m = modules; m; m = m->next) {
+        for (Symbol *sym = m->syms; sym; sym = sym->next) {
+            if (symbol_eq(sym->name, name)) {
+                return sym;
+            }
+        }
+    }
+    return NULL;
+}
+
+static unsigned int symbol_value(Symbol *sym)
+{
+    int delta = 0;
+    if (strcmp(sym->sect, "ABS")) {
+        section_delta(sym->mod, sym->sect, &delta);
+    }
+    return sym->value + delta;
+}
+
+static int resolve(void)
+{
+    int ok = 1;
+
+    for (Module *m = modules; m; m = m->next) {
+        for (Symbol *sym = m->syms; sym; sym = sym->next) {
+            Symbol *first = find_global(sym->name);
+            if (first != sym) {
+                fprintf(stderr, "%s: symbol %s already defined in %s\n", m->path, sym->name, first->mod->path);
+                ok = 0;
+            }
+        }
+    }
+
+    for (Module *m = modules; m; m = m->next) {
+        for (Extern *ext = m->exts; ext; ext = ext->next) {
+            ext->def = find_global(ext->name);
+            if (!ext->def) {
+                fprintf(stderr, "%s: undefined symbol %s\n", m->path, ext->name);
+                ok = 0;
+            }
+        }
+    }
+
+    return ok;
+}
+
+static int relocate(void)
+{
+    for (Module *m = modules; m; m = m->next) {
+        for (Section *s = m->sects; s; s = s->next) {
+            if (s->new_base + s->size > MAX_OUTPUT) {
+                fprintf(stderr, "%s: section %s does not fit in memory\n", m->path, s->name);
+                return 0;
+            }
+            memcpy(&output[s->new_base], s->data, s->size);
+        }
+    }
+
+    for (Module *m = modules; m; m = m->next) {
+        for (Reloc *rel = m->rels; rel; rel = rel->next) {
+            Section *own = section_at(m, rel->addr);
+            if (!own || rel->addr + 2 > own->base + own->size) {
+                fprintf(stderr, "%s: relocation at %06o outside of sections\n", m->path, rel->addr);
+                return 0;
+            }
+            int value = 0;
+            for (int i = 0; i < rel->nsect; i++) {
+                int delta;
+                if (!section_delta(m, rel->sect[i], &delta)) {
+                    fprintf(stderr, "%s: unknown section %s\n", m->path, rel->sect[i]);
+                    return 0;
+                }
+                value += rel->weight[i] * delta;
+            }
+            if (rel->ext >= 0) {
+                Extern *ext = m->exts;
+                while (ext && ext->index != (unsigned int)rel->ext) {
+                    ext = ext->next;
+                }
+                if (!ext || !ext->def) {
+                    fprintf(stderr, "%s: bad external reference\n", m->path);
+                    return 0;
+                }
+                value += symbol_value(ext->def);
+            }
+            unsigned int addr = rel->addr - own->base + own->new_base;
+            unsigned short w = (output[addr + 1] << 8) | output[addr];
+            w += value;
+            output[addr] = w & 0xff;
+            output[addr + 1] = w >> 8;
+        }
+    }
+
+    return 1;
+}
+
+static void output_hex(FILE *outf)
+{
+    unsigned int i;
+
+    for (i = start_addr; i < end_addr; i++) {
+        if ((i % 16) == 0) {
+            fprintf(outf, "%04X:", i);
+        }
+
+        fprintf(outf, " %02X", output[i]);
+
+        if ((i % 16) == 15) {
+            fprintf(outf, "\n");
+        }
+    }
+
+    if ((i % 16) != 0) {
+        fprintf(outf, "\n");
+    }
+}
+
+static void output_verilog(FILE *outf)
+{
+    fprintf(outf, "module sram(\n"
+            "    input  [7:0] ADDR,\n"
+            "    input  [7:0] DI,\n"
+            "    output [7:0] DO,\n"
+            "    input        RW,\n"
+            "    input        CS\n"
+            ");\n"
+            "    parameter  AddressSize = 8;\n"
+            "    reg        [7:0]    Mem[(1 << AddressSize) - 1:0];\n"
+            "\n"
+            "    initial begin\n");
+
+    for (unsigned int i = start_addr; i < end_addr; i++) {
+        fprintf(outf, "        Mem[%d] = 8'h%02x;\n", i, output[i]);
+    }
+
+    fprintf(outf, "    end\n"
+            "\n"
+            "    assign DO = RW ? Mem[ADDR] : 8'hFF;\n"
+            "\n"
+            "    always @(CS || RW) begin\n"
+            "        if (~CS && ~RW) begin\n"
+            "            Mem[ADDR] <= DI;\n"
+            "        end\n"
+            "    end\n"
+            "\n"
+            "endmodule\n");
+}
+
+static void output_binary(FILE *outf)
+{
+    if (end_addr > start_addr) {
+        fwrite(&output[start_addr], 1, end_addr - start_addr, outf);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-verilog|-binary] [--case-sensitive-symbols] [-b <base>] -o <output_file> <object_file>...\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int out_type = 0;
+    int have_base = 0;
+    unsigned int base = 0;
+    const char *output_path = NULL;
+    int nobjs = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-verilog")) {
+            out_type = 1;
+        } else if (!strcmp(argv[i], "-binary")) {
+            out_type = 2;
+        } else if (!strcmp(argv[i], "--case-sensitive-symbols")) {
+            case_sensitive_symbols = 1;
+        } else if (!strcmp(argv[i], "-b")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "-b requires an address\n");
+                return 1;
+            }
+            /* Octal by default, like the assembler. */
+            const char *arg = argv[++i];
+            base = strtoul(arg, NULL, (arg[0] == '0' && tolower((unsigned char)arg[1]) == 'x') ? 16 : 8);
+            have_base = 1;
+        } else if (!strcmp(argv[i], "-o")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "-o requires a file path\n");
+                return 1;
+            }
+            output_path = argv[++i];
+        } else {
+            if (!load_object(argv[i])) {
+                return 1;
+            }
+            nobjs++;
+        }
+    }
+
+    if (!nobjs || !output_path) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    layout(have_base, base);
+
+    if (end_addr > MAX_OUTPUT) {
+        fprintf(stderr, "Program does not fit in memory\n");
+        return 1;
+    }
+
+    if (!resolve() || !relocate()) {
+        fprintf(stderr, "Link failed\n");
+        return 1;
+    }
+
+    FILE *outf = fopen(output_path, "wb");
+    if (!outf) {
+        fprintf(stderr, "Can't create output file!\n");
+        return 1;
+    }
+    if (out_type == 2) {
+        output_binary(outf);
+    } else if (out_type) {
+        output_verilog(outf);
+    } else {
+        output_hex(outf);
+    }
+    fclose(outf);
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * Shared-memory image layout for microasm11 --shm
+ * (c) sashz by pdaXrom.org, 2026
+ *
+ * The segment starts with Shm11Header, followed by the 64 KB image and an
+ * optional symbol table. The writer makes `generation` odd while it updates
+ * the segment and even once the update is complete, so a consumer can copy
+ * the dirty ranges and retry if the generation changed underneath it.
+ */
+
+#ifndef SHM11_H
+#define SHM11_H
+
+#include <stdint.h>
+
+#define SHM11_MAGIC         0x31314D53u    /* "SM11" */
+#define SHM11_VERSION       1
+#define SHM11_MAX_RANGES    64
+#define SHM11_IMAGE_SIZE    65536
+#define SHM11_SYM_NAME_MAX  60
+
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} Shm11Range;
+
+typedef struct {
+    uint32_t value;
+    char name[SHM11_SYM_NAME_MAX];
+} Shm11Symbol;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    volatile uint32_t generation;
+    uint32_t start;
+    uint32_t end;
+    uint32_t nranges;
+    Shm11Range ranges[SHM11_MAX_RANGES];
+    uint32_t nsyms;
+    uint32_t reserved;
+    uint8_t image[SHM11_IMAGE_SIZE];
+    Shm11Symbol syms[];
+} Shm11Header;
+
+#define SHM11_SEGMENT_SIZE(nsyms) (sizeof(Shm11Header) + (size_t)(nsyms) * sizeof(Shm11Symbol))
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * Reference consumer for microasm11 --shm segments
+ * (c) sashz by pdaXrom.org, 2026
+ *
+ * Prints the segment header and dirty ranges, optionally the symbol table,
+ * and can save the current image (start..end) to a file.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm11.h"
+
+/* How long an update in progress may keep the generation odd. */
+#define WRITER_TIMEOUT_MS   1000
+
+static uint8_t image[SHM11_IMAGE_SIZE];
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [--symbols] [--wait <generation>] [-o <image_file>] <name>\n", prog);
+    fprintf(stderr, "  --wait <n>  wait until build n (as printed by \"generation\") has completed\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *shm_name = NULL;
+    const char *out_path = NULL;
+    int show_symbols = 0;
+    unsigned long wait_gen = 0;
+    char name[256];
+    struct stat st;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--symbols")) {
+            show_symbols = 1;
+        } else if (!strcmp(argv[i], "--wait") && i + 1 < argc) {
+            wait_gen = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (!shm_name) {
+            shm_name = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!shm_name) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    snprintf(name, sizeof(name), "%s%s", (shm_name[0] == '/') ? "" : "/", shm_name);
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Shm11Header)) {
+        fprintf(stderr, "Can't open shared memory segment %s\n", name);
+        return 1;
+    }
+    const Shm11Header *hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        fprintf(stderr, "Can't map shared memory segment %s\n", name);
+        return 1;
+    }
+    if (hdr->magic != SHM11_MAGIC || hdr->version != SHM11_VERSION) {
+        fprintf(stderr, "Bad segment header\n");
+        return 1;
+    }
+
+    /* Build n leaves the counter at 2 * n; it is 2 * n - 1 while n is written. */
+    while (hdr->generation < 2 * (uint64_t)wait_gen) {
+        usleep(10000);
+    }
+
+    /* Copy until the generation is even and unchanged across the copy. */
+    uint32_t gen, start, end, nranges;
+    Shm11Range ranges[SHM11_MAX_RANGES];
+    do {
+        int waited = 0;
+        while ((gen = hdr->generation) & 1) {
+            if (waited++ >= WRITER_TIMEOUT_MS) {
+                fprintf(stderr, "Writer did not finish generation %u\n", (gen + 1) / 2);
+                return 1;
+            }
+            usleep(1000);
+        }
+        __sync_synchronize();
+        start = hdr->start;
+        end = hdr->end;
+        nranges = hdr->nranges;
+        if (nranges > SHM11_MAX_RANGES) {
+            nranges = SHM11_MAX_RANGES;
+        }
+        memcpy(ranges, hdr->ranges, nranges * sizeof(Shm11Range));
+        for (uint32_t i = 0; i < nranges; i++) {
+            if (ranges[i].end <= SHM11_IMAGE_SIZE && ranges[i].start < ranges[i].end) {
+                memcpy(&image[ranges[i].start], &hdr->image[ranges[i].start],
+                       ranges[i].end - ranges[i].start);
+            }
+        }
+        if (start < end && end <= SHM11_IMAGE_SIZE) {
+            memcpy(&image[start], &hdr->image[start], end - start);
+        }
+        __sync_synchronize();
+    } while (gen != hdr->generation);
+
+    printf("generation %u\n", gen / 2);
+    printf("image %06o-%06o\n", start, end);
+    for (uint32_t i = 0; i < nranges; i++) {
+        printf("dirty %06o-%06o\n", ranges[i].start, ranges[i].end);
+    }
+
+    if (show_symbols) {
+        uint32_t nsyms = hdr->nsyms;
+        if (SHM11_SEGMENT_SIZE(nsyms) > (size_t)st.st_size) {
+            nsyms = 0;
+        }
+        for (uint32_t i = 0; i < nsyms; i++) {
+            printf("[%.*s] %06o\n", SHM11_SYM_NAME_MAX, hdr->syms[i].name, hdr->syms[i].value);
+        }
+    }
+
+    if (out_path) {
+        FILE *outf = fopen(out_path, "wb");
+        if (!outf) {
+            fprintf(stderr, "Can't create output file!\n");
+            return 1;
+        }
+        if (start < end && end <= SHM11_IMAGE_SIZE) {
+            fwrite(&image[start], 1, end - start, outf);
+        }
+        fclose(outf);
+    }
+
+    return 0;
+}
@@ -0,0 +1,943 @@
+/*
+ * Instruction-level PDP-11 simulator for microasm11 --run
+ * (c) sashz by pdaXrom.org, 2026
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "sim11.h"
+
+#define CC_C 001
+#define CC_V 002
+#define CC_Z 004
+#define CC_N 010
+
+#define PSW_ADDR    0177776
+#define XCSR_ADDR   0177564
+#define XBUF_ADDR   0177566
+
+typedef void (*Sim11Op)(Sim11 *s, uint16_t w);
+
+static Sim11Op dispatch[65536];
+
+static void fault(Sim11 *s, int vec)
+{
+    if (!s->fault) {
+        s->fault = vec;
+    }
+}
+
+static uint16_t rd_word(Sim11 *s, uint16_t addr)
+{
+    if (addr & 1) {
+        fault(s, 004);
+        return 0;
+    }
+    if (addr == PSW_ADDR) {
+        return s->psw;
+    }
+    if (addr == XCSR_ADDR) {
+        return 0200;
+    }
+    return s->mem[addr] | (s->mem[addr + 1] << 8);
+}
+
+static uint16_t rd_byte(Sim11 *s, uint16_t addr)
+{
+    if ((addr & ~1) == PSW_ADDR) {
+        return (addr & 1) ? (s->psw >> 8) : (s->psw & 0xFF);
+    }
+    if (addr == XCSR_ADDR) {
+        return 0200;
+    }
+    return s->mem[addr];
+}
+
+static void wr_word(Sim11 *s, uint16_t addr, uint16_t v)
+{
+    if (s->fault) {
+        return;
+    }
+    if (addr & 1) {
+        fault(s, 004);
+        return;
+    }
+    if (addr == PSW_ADDR) {
+        s->psw = v;
+    } else if (addr == XBUF_ADDR) {
+        if (s->console) {
+            fputc(v & 0xFF, s->console);
+        }
+    } else {
+        s->mem[addr] = v & 0xFF;
+        s->mem[addr + 1] = v >> 8;
+    }
+}
+
+static void wr_byte(Sim11 *s, uint16_t addr, uint16_t v)
+{
+    if (s->fault) {
+        return;
+    }
+    if ((addr & ~1) == PSW_ADDR) {
+        s->psw = (addr & 1) ? ((s->psw & 0xFF) | ((v & 0xFF) << 8)) : ((s->psw & 0xFF00) | (v & 0xFF));
+    } else if (addr == XBUF_ADDR) {
+        if (s->console) {
+            fputc(v & 0xFF, s->console);
+        }
+    } else {
+        s->mem[addr] = v & 0xFF;
+    }
+}
+
+static uint16_t fetch(Sim11 *s)
+{
+    uint16_t w = rd_word(s, s->r[7]);
+    s->r[7] += 2;
+    return w;
+}
+
+static void push(Sim11 *s, uint16_t v)
+{
+    s->r[6] -= 2;
+    wr_word(s, s->r[6], v);
+}
+
+static uint16_t pop(Sim11 *s)
+{
+    uint16_t v = rd_word(s, s->r[6]);
+    s->r[6] += 2;
+    return v;
+}
+
+/*
+ * Operand locations: a memory address, or -1 - n for register n. Computing
+ * the location applies the addressing mode's side effects.
+ */
+static int ea(Sim11 *s, int spec, int byte)
+{
+    int mode = (spec >> 3) & 07;
+    int reg = spec & 07;
+    int step = (byte && reg < 6) ? 1 : 2;
+    uint16_t addr;
+
+    switch (mode) {
+    case 0:
+        return -1 - reg;
+    case 1:
+        return s->r[reg];
+    case 2:
+        addr = s->r[reg];
+        s->r[reg] += step;
+        return addr;
+    case 3:
+        addr = rd_word(s, s->r[reg]);
+        s->r[reg] += 2;
+        return addr;
+    case 4:
+        s->r[reg] -= step;
+        return s->r[reg];
+    case 5:
+        s->r[reg] -= 2;
+        return rd_word(s, s->r[reg]);
+    case 6:
+        addr = fetch(s);
+        return (uint16_t)(addr + s->r[reg]);
+    default:
+        addr = fetch(s);
+        return rd_word(s, (uint16_t)(addr + s->r[reg]));
+    }
+}
+
+static uint16_t get(Sim11 *s, int loc, int byte)
+{
+    if (loc < 0) {
+        return byte ? (s->r[-1 - loc] & 0xFF) : s->r[-1 - loc];
+    }
+    return byte ? rd_byte(s, loc) : rd_word(s, loc);
+}
+
+static void put(Sim11 *s, int loc, int byte, uint16_t v)
+{
+    if (loc < 0) {
+        int reg = -1 - loc;
+        s->r[reg] = byte ? ((s->r[reg] & 0xFF00) | (v & 0xFF)) : v;
+    } else if (byte) {
+        wr_byte(s, loc, v);
+    } else {
+        wr_word(s, loc, v);
+    }
+}
+
+static void set_nz(Sim11 *s, uint16_t v, int byte)
+{
+    uint16_t sign = byte ? 0x80 : 0x8000;
+    uint16_t mask = byte ? 0xFF : 0xFFFF;
+
+    s->psw &= ~(CC_N | CC_Z);
+    if (v & sign) {
+        s->psw |= CC_N;
+    }
+    if (!(v & mask)) {
+        s->psw |= CC_Z;
+    }
+}
+
+static void set_cc(Sim11 *s, int flag, int on)
+{
+    if (on) {
+        s->psw |= flag;
+    } else {
+        s->psw &= ~flag;
+    }
+}
+
+static void trap(Sim11 *s, int vec)
+{
+    uint16_t psw = s->psw;
+
+    s->fault = 0;
+    push(s, psw);
+    push(s, s->r[7]);
+    if (s->fault) {
+        s->state = SIM11_DOUBLE_FAULT;
+        return;
+    }
+    s->r[7] = rd_word(s, vec);
+    s->psw = rd_word(s, vec + 2);
+}
+
+/* Double operand */
+
+static void op_mov(Sim11 *s, uint16_t w)
+{
+    int byte = w >> 15;
+    uint16_t v = get(s, ea(s, (w >> 6) & 077, byte), byte);
+    int dst = ea(s, w & 077, byte);
+
+    if (byte && dst < 0) {
+        s->r[-1 - dst] = (int16_t)(int8_t)v;
+    } else {
+        put(s, dst, byte, v);
+    }
+    set_nz(s, v, byte);
+    s->psw &= ~CC_V;
+}
+
+static void op_cmp(Sim11 *s, uint16_t w)
+{
+    int byte = w >> 15;
+    uint16_t mask = byte ? 0xFF : 0xFFFF;
+    uint16_t sign = byte ? 0x80 : 0x8000;
+    uint16_t a = get(s, ea(s, (w >> 6) & 077, byte), byte);
+    uint16_t b = get(s, ea(s, w & 077, byte), byte);
+    uint16_t r = (a - b) & mask;
+
+    set_nz(s, r, byte);
+    set_cc(s, CC_V, ((a ^ b) & (a ^ r)) & sign);
+    set_cc(s, CC_C, a < b);
+}
+
+static void op_bit(Sim11 *s, uint16_t w)
+{
+    int byte = w >> 15;
+    uint16_t a = get(s, ea(s, (w >> 6) & 077, byte), byte);
+    uint16_t b = get(s, ea(s, w & 077, byte), byte);
+
+    set_nz(s, a & b, byte);
+    s->psw &= ~CC_V;
+}
+
+static void op_bic(Sim11 *s, uint16_t w)
+{
+    int byte = w >> 15;
+    uint16_t a = get(s, ea(s, (w >> 6) & 077, byte), byte);
+    int dst = ea(s, w & 077, byte);
+    uint16_t r = get(s, dst, byte) & ~a;
+
+    put(s, dst, byte, r);
+    set_nz(s, r, byte);
+    s->psw &= ~CC_V;
+}
+
+static void op_bis(Sim11 *s, uint16_t w)
+{
+    int byte = w >> 15;
+    uint16_t a = get(s, ea(s, (w >> 6) & 077, byte), byte);
+    int dst = ea(s, w & 077, byte);
+    uint16_t r = get(s, dst, byte) | a;
+
+    put(s, dst, byte, r);
+    set_nz(s, r, byte);
+    s->psw &= ~CC_V;
+}
+
+static void op_add(Sim11 *s, uint16_t w)
+{
+    uint16_t a = get(s, ea(s, (w >> 6) & 077, 0), 0);
+    int dst = ea(s, w & 077, 0);
+    uint16_t b = get(s, dst, 0);
+    uint16_t r = a + b;
+
+    put(s, dst, 0, r);
+    set_nz(s, r, 0);
+    set_cc(s, CC_V, (~(a ^ b) & (a ^ r)) & 0x8000);
+    set_cc(s, CC_C, (uint32_t)a + b > 0xFFFF);
+}
+
+static void op_sub(Sim11 *s, uint16_t w)
+{
+    uint16_t a = get(s, ea(s, (w >> 6) & 077, 0), 0);
+    int dst = ea(s, w & 077, 0);
+    uint16_t b = get(s, dst, 0);
+    uint16_t r = b - a;
+
+    put(s, dst, 0, r);
+    set_nz(s, r, 0);
+    set_cc(s, CC_V, ((a ^ b) & (b ^ r)) & 0x8000);
+    set_cc(s, CC_C, b < a);
+}
+
+static void op_xor(Sim11 *s, uint16_t w)
+{
+    int dst = ea(s, w & 077, 0);
+    uint16_t r = get(s, dst, 0) ^ s->r[(w >> 6) & 07];
+
+    put(s, dst, 0, r);
+    set_nz(s, r, 0);
+    s->psw &= ~CC_V;
+}
+
+/* Single operand */
+
+static void op_single(Sim11 *s, uint16_t w)
+{
+    int byte = w >> 15;
+    uint16_t mask = byte ? 0xFF : 0xFFFF;
+    uint16_t sign = byte ? 0x80 : 0x8000;
+    int dst = ea(s, w & 077, byte);
+    uint16_t d = get(s, dst, byte);
+    uint16_t r = d;
+    int c = s->psw & CC_C;
+    int write = 1;
+
+    switch ((w >> 6) & 077) {
+    case 050:   /* CLR */
+        r = 0;
+        s->psw &= ~(CC_V | CC_C);
+        break;
+    case 051:   /* COM */
+        r = ~d & mask;
+        s->psw &= ~CC_V;
+        s->psw |= CC_C;
+        break;
+    case 052:   /* INC */
+        r = (d + 1) & mask;
+        set_cc(s, CC_V, r == sign);
+        break;
+    case 053:   /* DEC */
+        r = (d - 1) & mask;
+        set_cc(s, CC_V, d == sign);
+        break;
+    case 054:   /* NEG */
+        r = -d & mask;
+        set_cc(s, CC_V, r == sign);
+        set_cc(s, CC_C, r != 0);
+        break;
+    case 055:   /* ADC */
+        r = (d + c) & mask;
+        set_cc(s, CC_V, c && d == (sign - 1));
+        set_cc(s, CC_C, c && d == mask);
+        break;
+    case 056:   /* SBC */
+        r = (d - c) & mask;
+        set_cc(s, CC_V, c && d == sign);
+        set_cc(s, CC_C, c && d == 0);
+        break;
+    case 057:   /* TST */
+        write = 0;
+        s->psw &= ~(CC_V | CC_C);
+        break;
+    case 060:   /* ROR */
+        r = ((d >> 1) | (c ? sign : 0)) & mask;
+        set_cc(s, CC_C, d & 1);
+        break;
+    case 061:   /* ROL */
+        r = ((d << 1) | (c ? 1 : 0)) & mask;
+        set_cc(s, CC_C, d & sign);
+        break;
+    case 062:   /* ASR */
+        r = ((d >> 1) | (d & sign)) & mask;
+        set_cc(s, CC_C, d & 1);
+        break;
+    case 063:   /* ASL */
+        r = (d << 1) & mask;
+        set_cc(s, CC_C, d & sign);
+        break;
+    }
+    if (write) {
+        put(s, dst, byte, r);
+    }
+    set_nz(s, r, byte);
+    if (((w >> 6) & 077) >= 060) {
+        set_cc(s, CC_V, !(s->psw & CC_N) != !(s->psw & CC_C));
+    }
+}
+
+static void op_swab(Sim11 *s, uint16_t w)
+{
+    int dst = ea(s, w & 077, 0);
+    uint16_t d = get(s, dst, 0);
+    uint16_t r = (d >> 8) | (d << 8);
+
+    put(s, dst, 0, r);
+    set_nz(s, r, 1);
+    s->psw &= ~(CC_V | CC_C);
+}
+
+static void op_sxt(Sim11 *s, uint16_t w)
+{
+    put(s, ea(s, w & 077, 0), 0, (s->psw & CC_N) ? 0177777 : 0);
+    set_cc(s, CC_Z, !(s->psw & CC_N));
+    s->psw &= ~CC_V;
+}
+
+static void op_mtps(Sim11 *s, uint16_t w)
+{
+    uint16_t v = get(s, ea(s, w & 077, 1), 1);
+    s->psw = (s->psw & 0177420) | (v & 0357);
+}
+
+static void op_mfps(Sim11 *s, uint16_t w)
+{
+    int dst = ea(s, w & 077, 1);
+    uint16_t v = s->psw & 0xFF;
+
+    if (dst < 0) {
+        s->r[-1 - dst] = (int16_t)(int8_t)v;
+    } else {
+        put(s, dst, 1, v);
+    }
+    set_nz(s, v, 1);
+    s->psw &= ~CC_V;
+}
+
+/* MFPI/MFPD: with no MMU, previous space is the current one. */
+static void op_mfp(Sim11 *s, uint16_t w)
+{
+    uint16_t v = get(s, ea(s, w & 077, 0), 0);
+    push(s, v);
+    set_nz(s, v, 0);
+    s->psw &= ~CC_V;
+}
+
+static void op_mtp(Sim11 *s, uint16_t w)
+{
+    uint16_t v = pop(s);
+    put(s, ea(s, w & 077, 0), 0, v);
+    set_nz(s, v, 0);
+    s->psw &= ~CC_V;
+}
+
+static void op_tstset(Sim11 *s, uint16_t w)
+{
+    int dst = ea(s, w & 077, 0);
+    if (dst < 0) {
+        fault(s, 010);
+        return;
+    }
+    uint16_t v = get(s, dst, 0);
+    s->r[0] = v;
+    put(s, dst, 0, v | 1);
+    set_nz(s, v, 0);
+    s->psw &= ~CC_V;
+    set_cc(s, CC_C, v & 1);
+}
+
+static void op_wrtlck(Sim11 *s, uint16_t w)
+{
+    int dst = ea(s, w & 077, 0);
+    if (dst < 0) {
+        fault(s, 010);
+        return;
+    }
+    put(s, dst, 0, s->r[0]);
+    set_nz(s, s->r[0], 0);
+    s->psw &= ~CC_V;
+}
+
+/* Program control */
+
+static void op_branch(Sim11 *s, uint16_t w)
+{
+    int n = !!(s->psw & CC_N);
+    int z = !!(s->psw & CC_Z);
+    int v = !!(s->psw & CC_V);
+    int c = !!(s->psw & CC_C);
+    int taken = 0;
+
+    switch (((w >> 8) & 07) | ((w >> 12) & 010)) {
+    case 001: taken = 1; break;                 /* BR */
+    case 002: taken = !z; break;                /* BNE */
+    case 003: taken = z; break;                 /* BEQ */
+    case 004: taken = (n == v); break;          /* BGE */
+    case 005: taken = (n != v); break;          /* BLT */
+    case 006: taken = !(z || n != v); break;    /* BGT */
+    case 007: taken = z || n != v; break;       /* BLE */
+    case 010: taken = !n; break;                /* BPL */
+    case 011: taken = n; break;                 /* BMI */
+    case 012: taken = !c && !z; break;          /* BHI */
+    case 013: taken = c || z; break;            /* BLOS */
+    case 014: taken = !v; break;                /* BVC */
+    case 015: taken = v; break;                 /* BVS */
+    case 016: taken = !c; break;                /* BCC */
+    case 017: taken = c; break;                 /* BCS */
+    }
+    if (taken) {
+        s->r[7] += 2 * (int8_t)(w & 0xFF);
+    }
+}
+
+static void op_jmp(Sim11 *s, uint16_t w)
+{
+    int dst = ea(s, w & 077, 0);
+    if (dst < 0) {
+        fault(s, 004);
+        return;
+    }
+    s->r[7] = dst;
+}
+
+static void op_jsr(Sim11 *s, uint16_t w)
+{
+    int reg = (w >> 6) & 07;
+    int dst = ea(s, w & 077, 0);
+    if (dst < 0) {
+        fault(s, 004);
+        return;
+    }
+    push(s, s->r[reg]);
+    s->r[reg] = s->r[7];
+    s->r[7] = dst;
+}
+
+static void op_rts(Sim11 *s, uint16_t w)
+{
+    int reg = w & 07;
+    s->r[7] = s->r[reg];
+    s->r[reg] = pop(s);
+}
+
+static void op_mark(Sim11 *s, uint16_t w)
+{
+    s->r[6] = s->r[7] + 2 * (w & 077);
+    s->r[7] = s->r[5];
+    s->r[5] = pop(s);
+}
+
+static void op_sob(Sim11 *s, uint16_t w)
+{
+    int reg = (w >> 6) & 07;
+    if (--s->r[reg]) {
+        s->r[7] -= 2 * (w & 077);
+    }
+}
+
+static void op_emt(Sim11 *s, uint16_t w)
+{
+    trap(s, 030);
+}
+
+static void op_trap(Sim11 *s, uint16_t w)
+{
+    trap(s, 034);
+}
+
+static void op_reserved(Sim11 *s, uint16_t w)
+{
+    fault(s, 010);
+}
+
+/* Miscellaneous */
+
+static void op_misc(Sim11 *s, uint16_t w)
+{
+    switch (w) {
+    case 0000000:
+        s->state = SIM11_HALT;
+        break;
+    case 0000001:
+        s->state = SIM11_WAIT;
+        break;
+    case 0000002:
+    case 0000006:
+        s->r[7] = pop(s);
+        s->psw = pop(s);
+        break;
+    case 0000003:
+        trap(s, 014);
+        break;
+    case 0000004:
+        trap(s, 020);
+        break;
+    case 0000005:
+        break;
+    case 0000007:
+        s->r[0] = s->mfpt;
+        break;
+    }
+}
+
+static void op_spl(Sim11 *s, uint16_t w)
+{
+    s->psw = (s->psw & ~0340) | ((w & 07) << 5);
+}
+
+static void op_ccode(Sim11 *s, uint16_t w)
+{
+    if (w & 020) {
+        s->psw |= w & 017;
+    } else {
+        s->psw &= ~(w & 017);
+    }
+}
+
+/* VM2 HALT-mode instructions, with CPC/CPS as the saved PC and PSW. */
+static void op_vm2(Sim11 *s, uint16_t w)
+{
+    switch (w) {
+    case 0000012:   /* GO */
+    case 0000016:   /* STEP */
+        s->r[7] = s->cpc;
+        s->psw = s->cps;
+        break;
+    case 0000020:   /* RSEL */
+        s->r[0] = 0;
+        break;
+    case 0000021:   /* MFUS */
+        s->r[0] = rd_word(s, s->r[5]);
+        s->r[5] += 2;
+        break;
+    case 0000022:   /* RCPC */
+        s->r[0] = s->cpc;
+        break;
+    case 0000024:   /* RCPS */
+        s->r[0] = s->cps;
+        break;
+    case 0000031:   /* MTUS */
+        s->r[5] -= 2;
+        wr_word(s, s->r[5], s->r[0]);
+        break;
+    case 0000032:   /* WCPC */
+        s->cpc = s->r[0];
+        break;
+    case 0000034:   /* WCPS */
+        s->cps = s->r[0];
+        break;
+    }
+}
+
+/* EIS */
+
+static void op_mul(Sim11 *s, uint16_t w)
+{
+    int reg = (w >> 6) & 07;
+    int32_t r = (int16_t)s->r[reg] * (int16_t)get(s, ea(s, w & 077, 0), 0);
+
+    if (reg & 1) {
+        s->r[reg] = r;
+    } else {
+        s->r[reg] = (uint32_t)r >> 16;
+        s->r[reg | 1] = r;
+    }
+    set_cc(s, CC_N, r < 0);
+    set_cc(s, CC_Z, r == 0);
+    s->psw &= ~CC_V;
+    set_cc(s, CC_C, r < -32768 || r > 32767);
+}
+
+static void op_div(Sim11 *s, uint16_t w)
+{
+    int reg = (w >> 6) & 07;
+    int16_t d = get(s, ea(s, w & 077, 0), 0);
+    int32_t n = (int32_t)(((uint32_t)s->r[reg] << 16) | s->r[reg | 1]);
+
+    if (d == 0) {
+        s->psw |= CC_V | CC_C;
+        return;
+    }
+    int64_t q = (int64_t)n / d;
+    int64_t rem = (int64_t)n % d;
+    s->psw &= ~CC_C;
+    if (q < -32768 || q > 32767) {
+        s->psw |= CC_V;
+        return;
+    }
+    s->r[reg] = q;
+    s->r[reg | 1] = rem;
+    set_nz(s, q, 0);
+    s->psw &= ~CC_V;
+}
+
+/* Shift count: low six bits, two's complement, positive shifts left. */
+static int shift_count(Sim11 *s, uint16_t w)
+{
+    int n = get(s, ea(s, w & 077, 0), 0) & 077;
+    return (n & 040) ? n - 64 : n;
+}
+
+static void op_ash(Sim11 *s, uint16_t w)
+{
+    int reg = (w >> 6) & 07;
+    int n = shift_count(s, w);
+    uint16_t v = s->r[reg];
+    int c = 0;
+    int ov = 0;
+
+    for (; n > 0; n--) {
+        c = v >> 15;
+        uint16_t r = v << 1;
+        ov |= (r ^ v) & 0x8000;
+        v = r;
+    }
+    for (; n < 0; n++) {
+        c = v & 1;
+        v = (v >> 1) | (v & 0x8000);
+    }
+    s->r[reg] = v;
+    set_nz(s, v, 0);
+    set_cc(s, CC_V, ov);
+    set_cc(s, CC_C, c);
+}
+
+static void op_ashc(Sim11 *s, uint16_t w)
+{
+    int reg = (w >> 6) & 07;
+    int n = shift_count(s, w);
+    uint32_t v = ((uint32_t)s->r[reg] << 16) | s->r[reg | 1];
+    int c = 0;
+    int ov = 0;
+
+    for (; n > 0; n--) {
+        c = v >> 31;
+        uint32_t r = v << 1;
+        ov |= (r ^ v) & 0x80000000u;
+        v = r;
+    }
+    for (; n < 0; n++) {
+        c = v & 1;
+        v = (v >> 1) | (v & 0x80000000u);
+    }
+    if (reg & 1) {
+        s->r[reg] = v;
+    } else {
+        s->r[reg] = v >> 16;
+        s->r[reg | 1] = v;
+    }
+    set_cc(s, CC_N, v & 0x80000000u);
+    set_cc(s, CC_Z, v == 0);
+    set_cc(s, CC_V, ov);
+    set_cc(s, CC_C, c);
+}
+
+/* FIS: two-word F-format operands, B at (Rn) and A at 4(Rn). */
+
+static double fis_get(Sim11 *s, uint16_t addr)
+{
+    uint16_t hi = rd_word(s, addr);
+    uint16_t lo = rd_word(s, addr + 2);
+    int e = (hi >> 7) & 0xFF;
+
+    if (!e) {
+        return 0.0;
+    }
+    double v = ldexp((double)(0x800000 | ((uint32_t)(hi & 0x7F) << 16) | lo), e - 128 - 24);
+    return (hi & 0x8000) ? -v : v;
+}
+
+static int fis_put(Sim11 *s, uint16_t addr, double v)
+{
+    uint16_t hi = 0;
+    uint16_t lo = 0;
+
+    if (v != 0.0) {
+        int e;
+        double f = frexp(fabs(v), &e);
+        uint32_t m = (uint32_t)ldexp(f, 24);
+        e += 128;
+        if (e > 255 || e <= 0) {
+            return 0;
+        }
+        hi = (v < 0 ? 0x8000 : 0) | (e << 7) | ((m >> 16) & 0x7F);
+        lo = m & 0xFFFF;
+    }
+    wr_word(s, addr, hi);
+    wr_word(s, addr + 2, lo);
+    s->psw &= ~(CC_N | CC_Z | CC_V | CC_C);
+    s->psw |= (hi & 0x8000) ? CC_N : 0;
+    s->psw |= (hi == 0) ? CC_Z : 0;
+    return 1;
+}
+
+static void op_fis(Sim11 *s, uint16_t w)
+{
+    int reg = w & 07;
+    uint16_t base = s->r[reg];
+    double b = fis_get(s, base);
+    double a = fis_get(s, base + 4);
+    double r;
+
+    switch ((w >> 3) & 03) {
+    case 0:
+        r = a + b;
+        break;
+    case 1:
+        r = a - b;
+        break;
+    case 2:
+        r = a * b;
+        break;
+    default:
+        if (b == 0.0) {
+            trap(s, 0244);
+            return;
+        }
+        r = a / b;
+        break;
+    }
+    if (!fis_put(s, base + 4, r)) {
+        trap(s, 0244);
+        return;
+    }
+    s->r[reg] = base + 4;
+}
+
+static void fill(unsigned int first, unsigned int last, Sim11Op op)
+{
+    for (unsigned int w = first; w <= last; w++) {
+        dispatch[w] = op;
+    }
+}
+
+void sim11_init(Sim11 *sim, uint8_t *mem, unsigned int features)
+{
+    memset(sim, 0, sizeof(*sim));
+    sim->mem = mem;
+    sim->features = features;
+    sim->console = stdout;
+
+    fill(0000000, 0177777, op_reserved);
+    fill(0000000, 0000007, op_misc);
+    if (features & SIM11_VM2) {
+        static const uint16_t vm2_ops[] = {
+            0000012, 0000016, 0000020, 0000021, 0000022, 0000024, 0000031, 0000032, 0000034
+        };
+        for (size_t i = 0; i < sizeof(vm2_ops) / sizeof(vm2_ops[0]); i++) {
+            dispatch[vm2_ops[i]] = op_vm2;
+        }
+    }
+    fill(0000100, 0000177, op_jmp);
+    fill(0000200, 0000207, op_rts);
+    fill(0000230, 0000237, op_spl);
+    fill(0000240, 0000277, op_ccode);
+    fill(0000300, 0000377, op_swab);
+    fill(0000400, 0003777, op_branch);
+    fill(0100000, 0103777, op_branch);
+    fill(0004000, 0004777, op_jsr);
+    fill(0005000, 0006377, op_single);
+    fill(0105000, 0106377, op_single);
+    fill(0006400, 0006477, op_mark);
+    fill(0006700, 0006777, op_sxt);
+    fill(0106400, 0106477, op_mtps);
+    fill(0106700, 0106777, op_mfps);
+    if (features & SIM11_MFP) {
+        fill(0006500, 0006577, op_mfp);
+        fill(0106500, 0106577, op_mfp);
+        fill(0006600, 0006677, op_mtp);
+        fill(0106600, 0106677, op_mtp);
+    }
+    if (features & SIM11_J11) {
+        fill(0007200, 0007277, op_tstset);
+        fill(0007300, 0007377, op_wrtlck);
+    }
+    fill(0010000, 0017777, op_mov);
+    fill(0110000, 0117777, op_mov);
+    fill(0020000, 0027777, op_cmp);
+    fill(0120000, 0127777, op_cmp);
+    fill(0030000, 0037777, op_bit);
+    fill(0130000, 0137777, op_bit);
+    fill(0040000, 0047777, op_bic);
+    fill(0140000, 0147777, op_bic);
+    fill(0050000, 0057777, op_bis);
+    fill(0150000, 0157777, op_bis);
+    fill(0060000, 0067777, op_add);
+    fill(0160000, 0167777, op_sub);
+    if (features & SIM11_EIS) {
+        fill(0070000, 0070777, op_mul);
+        fill(0071000, 0071777, op_div);
+        fill(0072000, 0072777, op_ash);
+        fill(0073000, 0073777, op_ashc);
+    }
+    fill(0074000, 0074777, op_xor);
+    if (features & SIM11_FIS) {
+        fill(0075000, 0075037, op_fis);
+    }
+    fill(0077000, 0077777, op_sob);
+    fill(0104000, 0104377, op_emt);
+    fill(0104400, 0104777, op_trap);
+}
+
+int sim11_run(Sim11 *s)
+{
+    s->state = SIM11_RUNNING;
+
+    while (s->state == SIM11_RUNNING) {
+        uint16_t pc = s->r[7];
+
+        if (s->max_cycles && s->cycles >= s->max_cycles) {
+            s->stop_pc = pc;
+            s->state = SIM11_CYCLE_LIMIT;
+            break;
+        }
+
+        s->fault = 0;
+        uint16_t w = fetch(s);
+        if (s->fault) {
+            trap(s, s->fault);
+            s->stop_pc = pc;
+            continue;
+        }
+        s->insns++;
+        s->cycles += s->cycle_table ? s->cycle_table[w] : 1;
+        if (s->hits) {
+            s->hits[pc >> 1]++;
+        }
+
+        dispatch[w](s, w);
+
+        if (s->fault) {
+            trap(s, s->fault);
+        }
+        s->stop_pc = pc;
+    }
+    return s->state;
+}
+
+const char *sim11_state_string(int state)
+{
+    switch (state) {
+    case SIM11_RUNNING:
+        return "running";
+    case SIM11_HALT:
+        return "HALT";
+    case SIM11_WAIT:
+        return "WAIT";
+    case SIM11_CYCLE_LIMIT:
+        return "cycle limit";
+    case SIM11_DOUBLE_FAULT:
+        return "double fault";
+    default:
+        return "unknown";
+    }
+}
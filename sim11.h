@@ -0,0 +1,58 @@
+/*
+ * Instruction-level PDP-11 simulator for microasm11 --run
+ * (c) sashz by pdaXrom.org, 2026
+ *
+ * Runs a 64 KB image with no MMU and no interrupts. Instructions are
+ * dispatched through a table of 65536 handlers built for the selected
+ * feature set; opcodes the CPU lacks trap through vector 10 like on the
+ * hardware. The DL11 console transmitter at 177564/177566 writes to the
+ * output stream and the PSW is visible at 177776.
+ */
+
+#ifndef SIM11_H
+#define SIM11_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SIM11_MEM_SIZE  65536
+
+/* Optional instruction groups */
+#define SIM11_EIS       0x01    /* MUL, DIV, ASH, ASHC */
+#define SIM11_FIS       0x02    /* FADD, FSUB, FMUL, FDIV */
+#define SIM11_VM2       0x04    /* GO, STEP, RSEL, MFUS, RCPC, RCPS, MTUS, WCPC, WCPS */
+#define SIM11_J11       0x08    /* CSM, TSTSET, WRTLCK */
+#define SIM11_MFP       0x10    /* MFPI, MTPI, MFPD, MTPD */
+
+enum {
+    SIM11_RUNNING = 0,
+    SIM11_HALT,
+    SIM11_WAIT,
+    SIM11_CYCLE_LIMIT,
+    SIM11_DOUBLE_FAULT,
+};
+
+typedef struct Sim11 {
+    uint16_t r[8];
+    uint16_t psw;
+    uint16_t cpc;               /* VM2 saved PC and PSW */
+    uint16_t cps;
+    uint8_t *mem;
+    unsigned int features;
+    int mfpt;                   /* value MFPT leaves in R0 */
+    const uint16_t *cycle_table;    /* cycles per opcode word, or NULL */
+    uint32_t *hits;             /* executions per word address / 2, or NULL */
+    uint64_t insns;
+    uint64_t cycles;
+    uint64_t max_cycles;        /* 0 for no limit */
+    uint16_t stop_pc;           /* address of the instruction that stopped */
+    int state;
+    int fault;                  /* trap vector raised while executing */
+    FILE *console;
+} Sim11;
+
+void sim11_init(Sim11 *sim, uint8_t *mem, unsigned int features);
+int sim11_run(Sim11 *sim);
+const char *sim11_state_string(int state);
+
+#endif
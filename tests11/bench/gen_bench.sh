@@ -0,0 +1,125 @@
+#!/bin/bash
+# Writes a synthetic microasm11 source of the given kind and size:
+#   gen_bench.sh <kind> <size> <dir>
+# Kinds: lines, labels, macros, locals, tables, includes, ifs. The main
+# source is <dir>/<kind>.asm; includes also writes <dir>/inc/*.inc. Code is
+# re-based with ORG every few KB so any size fits the 64 KB address space.
+KIND=$1
+SIZE=$2
+DIR=$3
+
+if [ -z "$KIND" ] || [ -z "$SIZE" ] || [ -z "$DIR" ]; then
+    echo "Usage: $0 <lines|labels|macros|locals|tables|includes|ifs> <size> <dir>" >&2
+    exit 1
+fi
+mkdir -p "$DIR" || exit 1
+OUT="$DIR/$KIND.asm"
+
+case "$KIND" in
+lines)
+    # <size> lines of straight-line code, comments and blank lines.
+    awk -v n="$SIZE" 'BEGIN {
+        split("mov r0, r1|add #12, r2|cmp (r3)+, -(r4)|inc r5|bic #17, @r1|; comment|", ins, "|")
+        for (i = 0; i < n; i++) {
+            if (i % 4000 == 0) print "\torg 1000"
+            print "\t" ins[i % 7 + 1]
+        }
+    }' > "$OUT"
+    ;;
+labels)
+    # <size> labels, each referenced from another part of the program.
+    awk -v n="$SIZE" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            if (i % 4000 == 0) print "\torg 1000"
+            printf "lab%d:\tmov #lab%d, r0\n", i, (i * 7919 + 13) % n
+        }
+    }' > "$OUT"
+    ;;
+macros)
+    # <size> expansions of an 8-deep macro chain and a 9-argument macro.
+    awk -v n="$SIZE" 'BEGIN {
+        print "\tmacro deep1 a"
+        print "\tmov a, r0"
+        print "\tendm"
+        for (d = 2; d <= 8; d++) {
+            printf "\tmacro deep%d a\n\tinc r%d\n\tdeep%d a\n\tendm\n", d, d % 6, d - 1
+        }
+        print "\tmacro wide a1, a2, a3, a4, a5, a6, a7, a8, a9"
+        for (k = 0; k < 3; k++) {
+            print "\tmov a1, a2\n\tadd a3, a4\n\tbis a5, a6\n\tbic a7, a8\n\ttst a9"
+        }
+        print "\tendm"
+        for (i = 0; i < n; i++) {
+            if (i % 500 == 0) print "\torg 1000"
+            if (i % 2) {
+                print "\twide r0, r1, #1, r2, (r3), r4, @r5, r0, -(sp)"
+            } else {
+                printf "\tdeep8 #%d\n", i % 8
+            }
+        }
+    }' > "$OUT"
+    ;;
+locals)
+    # <size> local symbol blocks with backward and forward numeric labels.
+    awk -v n="$SIZE" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            if (i % 600 == 0) print "\torg 1000"
+            printf "blk%d:\tmov #10, r0\n", i
+            print "1$:\tdec r0\n\tbne 1$\n2$:\ttst r1\n\tbeq 3$f\n\tdec r1\n\tbr 2$\n3$:\tnop"
+        }
+    }' > "$OUT"
+    ;;
+tables)
+    # <size> words of DW tables, 16 per line, some as expressions.
+    awk -v n="$SIZE" 'BEGIN {
+        print "base\tequ 1000"
+        for (i = 0; i < n; i += 16) {
+            if (i % 8192 == 0) print "\torg 1000"
+            line = "\tdw "
+            for (k = 0; k < 16 && i + k < n; k++) {
+                v = (i + k) * 37 % 65536
+                line = line (k ? ", " : "") ((k % 4) ? sprintf("%o", v) : sprintf("base+%o", v % 4096))
+            }
+            print line
+        }
+    }' > "$OUT"
+    ;;
+includes)
+    # <size> include files of 40 lines, each pulling in a shared fragment.
+    mkdir -p "$DIR/inc" || exit 1
+    echo "	mov r2, r3" > "$DIR/inc/common.inc"
+    awk -v n="$SIZE" -v dir="$DIR/inc" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            f = sprintf("%s/f%d.inc", dir, i)
+            for (k = 0; k < 40; k++) {
+                print ((k % 5) ? "\tadd #" k "., r1" : "\tinc r0") > f
+            }
+            print "\tINCLUDE \"common.inc\"" > f
+            close(f)
+            if (i % 100 == 0) print "\torg 1000"
+            printf "\tINCLUDE \"inc/f%d.inc\"\n", i
+        }
+    }' > "$OUT"
+    ;;
+ifs)
+    # <size> conditional blocks nested up to 8 deep, taken and skipped.
+    awk -v n="$SIZE" 'BEGIN {
+        for (d = 1; d <= 8; d++) printf "flag%d\tequ %d\n", d, d % 3 != 0
+        for (i = 0; i < n; i++) {
+            if (i % 1500 == 0) print "\torg 1000"
+            depth = i % 8 + 1
+            for (d = 1; d <= depth; d++) {
+                if (d % 2) printf "\tif flag%d\n", d; else print "\tifdef flag" d
+            }
+            print "\tmov r0, r1"
+            for (d = depth; d >= 1; d--) {
+                print "\telse\n\tinc r" d % 6 "\n\tendif"
+            }
+        }
+    }' > "$OUT"
+    ;;
+*)
+    echo "Unknown benchmark kind: $KIND" >&2
+    exit 1
+    ;;
+esac
@@ -0,0 +1,11 @@
+; .cycles_begin/.cycles_end: a bounded copy loop fits the budget
+; (8 x 60 + 24 + 12 = 516 cycles on vm1).
+
+	org 1000
+start:	.cycles_begin copy, 520.
+	mov	#10,r1
+1$:	mov	(r2)+,(r3)+
+	sob	r1,1$
+	clr	r0
+	.cycles_end
+	halt
@@ -0,0 +1,21 @@
+; --instrument=loops counts PROC entries and the loops at 1$, 2$ and 3$
+; in the $PROF table after the image; the source needs no changes.
+
+	org 1000
+start:	proc
+	mov	#3,r1
+1$:	jsr	pc,draw
+	sob	r1,1$
+	clr	r3
+2$:	inc	r3
+	cmp	r3,#5
+	bne	2$
+	halt
+	endp
+
+draw:	proc
+	mov	#4,r2
+3$:	inc	r4
+	sob	r2,3$
+	rts	pc
+	endp
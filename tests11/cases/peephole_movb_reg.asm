@@ -0,0 +1,10 @@
+; --optimize must not turn MOVB #0,Rn into CLRB Rn: MOVB sign-extends
+; into the whole register, so the word form is the only safe rewrite.
+
+	org 1000
+
+start:	mov	#-1,r2
+	movb	#0,r2		; clr r2, C cleared again by clc
+	clc
+	movb	#0,r3		; kept, halt may expose C
+	halt
@@ -0,0 +1,31 @@
+; --proc-profile moves the hot draw/plot pair next to start and the cold
+; PROCs after them; start holds the first byte of the image and stays first.
+
+	org 1000
+start:	proc
+	jsr	pc,init
+	mov	#100,r1
+1$:	jsr	pc,draw
+	sob	r1,1$
+	halt
+	endp
+
+init:	proc
+	mov	#1,r0
+	rts	pc
+	endp
+
+draw:	proc
+	jsr	pc,plot
+	rts	pc
+	endp
+
+table:	proc
+	ds	400
+	rts	pc
+	endp
+
+plot:	proc
+	inc	r2
+	rts	pc
+	endp
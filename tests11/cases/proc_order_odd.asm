@@ -0,0 +1,18 @@
+; --proc-profile moves the hot odd-sized msg ahead of b; b still starts on
+; a word boundary, after a padding byte.
+
+	org 1000
+start:	proc
+	mov	#msg,r1
+	jsr	pc,b
+	halt
+	endp
+
+b:	proc
+	mov	r1,r0
+	rts	pc
+	endp
+
+msg:	proc
+	db	"hello"
+	endp
@@ -0,0 +1,26 @@
+; Named sections: code stays in the default section, the table goes into
+; a data psect, the buffer into BSS, and the hot loop into its own psect.
+        org 1000
+start:  mov #table, r0
+        mov #buffer, r1
+        jsr pc, copy
+        halt
+
+        .psect data, data, ro
+table:  dw 1, 2, 3, 4
+tabend:
+
+        .psect bss, bss
+buffer: ds 10
+
+        .psect hot, code, align=10
+copy:   mov (r0)+, (r1)+
+        cmp r0, #tabend
+        bcs copy
+        rts pc
+
+        .asect
+        dw buffer, bufend-buffer
+
+        .psect bss
+bufend:
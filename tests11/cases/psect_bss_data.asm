@@ -0,0 +1,3 @@
+; Only zero fill is allowed in a BSS section.
+        .psect buf, bss
+        dw 1
@@ -0,0 +1,22 @@
+; Sections placed by psect_layout.ld: the hot loop goes to 400, the
+; message table follows it, and the default section stays at 1000.
+        org 1000
+start:  mov #msg, r0
+        jsr pc, print
+        halt
+
+        .psect text
+msg:    db "hi", 0
+        even
+
+        .psect hot
+print:  movb (r0)+, r1
+        beq 1$f
+        br print
+1$:     rts pc
+
+        .psect vars, bss
+count:  dsw 2
+
+        .asect
+        dw count, print
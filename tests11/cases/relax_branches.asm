@@ -0,0 +1,16 @@
+; --relax: out-of-range branches and SOB grow into longer forms, and a
+; branch to a BR is threaded to the final target.
+        org 1000
+start:  tst r0
+        beq far
+        mov #10, r1
+loop:   dsw 100
+        sob r1, loop
+        bne next
+        br start
+next:   beq hop
+        halt
+hop:    br start
+        dsw 200
+far:    br start
+done:   halt
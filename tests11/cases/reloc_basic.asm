@@ -0,0 +1,11 @@
+        org 1000
+start:  mov #table, r0
+        mov @#table, r1
+        mov table, r2
+        jsr pc, sub1
+        mov #10, r3
+        halt
+sub1:   rts pc
+table:  dw start, sub1, table-start, 0
+        include "../../lib11/reloc11.inc"
+        dw reloc11
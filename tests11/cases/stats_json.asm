@@ -0,0 +1,10 @@
+; --stats=json only reports on stderr; the image is unchanged.
+        org 1000
+        macro push reg
+        mov reg, -(sp)
+        endm
+        INCLUDE "inc1.inc"
+start:  push r0
+        push r1
+        mov #VAL, r2
+        halt
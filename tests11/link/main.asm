@@ -0,0 +1,10 @@
+        org 1000
+        global count
+start:  mov #hello, r0
+        jsr pc, print
+        mov @#count, r1
+        halt
+hello:  db "Hi", 0
+        even
+count:  dw 0
+table:  dw hello, print
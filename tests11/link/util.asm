@@ -0,0 +1,11 @@
+        org 0
+print   proc
+1$:     movb (r0)+, r1
+        beq 2$f
+        mov r1, @#177566
+        br 1$
+2$:     inc count
+        mov #tab, r2
+        rts pc
+tab:    dw tab
+        endp
@@ -0,0 +1,31 @@
+; --map: symbols by address, PROC sizes and the instruction mix.
+        org 1000
+start:  mov #stack, sp
+        jsr pc, copy
+        jsr pc, clear
+        halt
+
+copy    proc
+        mov #src, r0
+        mov #dst, r1
+        mov #5, r2
+loop:   movb (r0)+, (r1)+
+        sob r2, loop
+        mov @#count, r3
+        mov 4(r0), 6(r1)
+        rts pc
+        endp
+
+clear   proc
+        global last
+        clr r0
+last:   clr -(r1)
+        rts pc
+        endp
+
+count:  dw 5
+src:    db "hello"
+        even
+dst:    ds 6
+        ds 100
+stack:
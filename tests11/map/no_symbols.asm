@@ -0,0 +1,4 @@
+; A program without symbols or PROCs still gets a map.
+	org 1000
+	mov r0, r1
+	halt
@@ -0,0 +1,14 @@
+; --profile maps a PC histogram to listing lines, PROCs and loops.
+
+	org 1000
+start:	mov	#12,r1
+1$:	jsr	pc,sum
+	sob	r1,1$
+	halt
+
+sum:	proc
+	mov	#20,r2
+2$:	add	(r3)+,r0
+	sob	r2,2$
+	rts	pc
+	endp
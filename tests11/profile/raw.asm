@@ -0,0 +1,8 @@
+; A profile that is not text is read as raw little-endian PCs.
+
+	org 2000
+start:	clr	r0
+1$:	inc	r0
+	cmp	r0,#5
+	bne	1$
+	halt
@@ -0,0 +1,6 @@
+; A .cycles_begin without .cycles_end fails after pass 2 at its own line.
+        org 1000
+start:  nop
+        .cycles_begin body, 100.
+        mov r0, r1
+        halt
@@ -0,0 +1,20 @@
+; --cycles adds a timing column to the listing and sums PROCs and loops;
+; the image is the same as without it.
+
+	org 1000
+start:	mov	#12,r1
+	clr	r0
+1$:	mov	#20,r2
+2$:	add	(r3)+,r0
+	sob	r2,2$
+	sob	r1,1$
+	jsr	pc,sub1
+	halt
+
+sub1:	proc
+	mov	r0,-(sp)
+3$:	tst	(r4)+
+	bne	3$
+	mov	(sp)+,r0
+	rts	pc
+	endp
@@ -0,0 +1,6 @@
+; -q hides the --gc-procs report (info); the image is still written.
+        org 1000
+start:  halt
+unused  proc
+        rts pc
+        endp
@@ -0,0 +1,5 @@
+; -q still shows errors, located at the line of the included file.
+        org 1000
+start:  nop
+        INCLUDE "diag_bad.inc"
+        halt
@@ -0,0 +1,5 @@
+; -v lists each included file as it is opened, in both passes.
+        org 1000
+        INCLUDE "inc1.inc"
+start:  mov #VAL, r0
+        halt
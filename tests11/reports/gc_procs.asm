@@ -0,0 +1,44 @@
+; --gc-procs: only PROCs reachable from the top-level code, or kept with
+; .keep, are emitted.
+        org 1000
+        .keep vector
+start:  jsr pc, used
+        mov #table, r0
+        halt
+table:  dw twice
+
+used    proc
+        jsr pc, helper
+        rts pc
+        endp
+
+unused  proc
+        jsr pc, deep
+        db "unused", 0
+        even
+        rts pc
+        endp
+
+helper  proc
+1$:     dec r0
+        bne 1$
+        rts pc
+        endp
+
+deep    proc
+        rts pc
+        endp
+
+twice   proc
+        asl r0
+        rts pc
+        endp
+
+vector  proc
+        rti
+        endp
+
+handler proc
+        .keep
+        rti
+        endp
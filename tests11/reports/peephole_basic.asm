@@ -0,0 +1,26 @@
+; --optimize rewrites literal immediates and no-op moves
+; when the condition codes they change are dead.
+
+	org 1000
+
+start:	mov	#0,r0		; clr r0, C set again by add
+	add	#1,r1		; inc r1
+	sub	#1,r2		; dec r2
+	add	#-1,r3		; dec r3
+	movb	#0,@#177560	; clrb @#177560
+	cmp	r4,#0		; tst r4, flags identical
+	beq	1$f
+	mov	r5,r5		; dropped, NZV set by sub
+	sub	#2,sp		; tst -(sp)
+	mov	r0,(sp)
+	add	#4,sp		; cmp (sp)+,(sp)+
+	tst	r1
+1$:	add	#1,r1		; kept, C read by adc
+	adc	r2
+	mov	#0,r3		; kept, label follows
+2$:	ror	r3
+	add	#2,sp		; kept, bcc reads C
+	bcc	2$
+	mov	#5-5,r0		; clr r0, constant expression
+	add	#1,r0		; kept, halt may expose C
+	halt
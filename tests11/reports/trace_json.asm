@@ -0,0 +1,14 @@
+; --trace-json records each pass, include, macro expansion (with its nesting
+; depth) and the output as begin/end pairs.
+        org 1000
+        macro push reg
+        mov reg, -(sp)
+        endm
+        macro save2 a, b
+        push a
+        push b
+        endm
+        INCLUDE "inc1.inc"
+start:  save2 r0, r1
+        mov #VAL, r2
+        halt
@@ -0,0 +1,86 @@
+#!/bin/bash
+# Times microasm11 on the generated benchmark sources and compares lines/s
+# with a baseline recorded on this machine (BENCH_BASELINE, by default the
+# untracked tests11/bench/baseline.local.txt); without one there is nothing
+# to compare. BENCH_SCALE multiplies every size (10 gives 1M lines and 100k
+# labels), BENCH_TOLERANCE is the slowdown in percent that counts as a
+# regression, and --update rewrites the baseline entries for the current
+# scale from this run.
+ASSEMBLER=$(pwd)/microasm11
+BENCH_DIR=tests11/bench
+BASELINE=${BENCH_BASELINE:-$BENCH_DIR/baseline.local.txt}
+SCALE=${BENCH_SCALE:-1}
+TOLERANCE=${BENCH_TOLERANCE:-25}
+UPDATE=0
+TMP_DIR=$(mktemp -d)
+
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+if [ "$1" = "--update" ]; then
+    UPDATE=1
+fi
+if [ ! -x "$ASSEMBLER" ]; then
+    echo "Assembler not found at $ASSEMBLER"
+    exit 1
+fi
+
+if [ $UPDATE -eq 0 ] && [ ! -f "$BASELINE" ]; then
+    echo "No baseline at $BASELINE, timing only (run with --update to record one)"
+fi
+
+BENCHES="lines:100000 labels:10000 macros:20000 locals:5000 tables:100000 includes:1000 ifs:10000"
+
+printf "%-9s %9s %10s %11s %9s %11s %8s\n" bench lines "wall ms" "lines/s" "peak KB" baseline change
+FAIL=0
+RESULTS=
+for bench in $BENCHES; do
+    kind=${bench%%:*}
+    size=$((${bench#*:} * SCALE))
+    if ! "$BENCH_DIR/gen_bench.sh" "$kind" "$size" "$TMP_DIR/$kind"; then
+        FAIL=1
+        continue
+    fi
+    stats=$(cd "$TMP_DIR/$kind" && "$ASSEMBLER" -binary --stats=json "$kind.asm" "$kind.bin" 2>&1 >/dev/null \
+            | grep -o '"total": {[^}]*}.*')
+    if [ -z "$stats" ]; then
+        echo "FAIL: $kind did not assemble"
+        FAIL=1
+        continue
+    fi
+    lines=$(echo "$stats" | sed 's/.*"total": {[^}]*"lines": \([0-9]*\).*/\1/')
+    wall=$(echo "$stats" | sed 's/.*"total": {"wall_ms": \([0-9.]*\).*/\1/')
+    rate=$(echo "$stats" | sed 's/.*"total": {[^}]*"lines_per_sec": \([0-9]*\).*/\1/')
+    peak=$(echo "$stats" | sed 's/.*"peak_rss_kb": \([0-9]*\).*/\1/')
+    base=$(awk -v k="$kind" -v s="$SCALE" '$1 == k && $2 == s { print $3 }' "$BASELINE" 2>/dev/null)
+    change=
+    if [ -n "$base" ]; then
+        change=$(awk -v r="$rate" -v b="$base" 'BEGIN { printf "%+.1f%%", (r - b) * 100 / b }')
+        if awk -v r="$rate" -v b="$base" -v t="$TOLERANCE" 'BEGIN { exit !(r < b * (100 - t) / 100) }'; then
+            change="$change REGRESSION"
+            FAIL=1
+        fi
+    fi
+    printf "%-9s %9s %10s %11s %9s %11s %8s\n" "$kind" "$lines" "$wall" "$rate" "$peak" "${base:--}" "$change"
+    RESULTS="$RESULTS$kind $SCALE $rate $peak
+"
+done
+
+if [ $UPDATE -ne 0 ]; then
+    {
+        [ -f "$BASELINE" ] && grep -v "^[a-z]* $SCALE " "$BASELINE" | grep -v '^#'
+        printf "%s" "$RESULTS"
+    } | sort > "$TMP_DIR/baseline.txt"
+    {
+        echo "# kind scale lines_per_sec peak_rss_kb, written by run_bench.sh --update"
+        cat "$TMP_DIR/baseline.txt"
+    } > "$BASELINE"
+    echo "Baseline updated: $BASELINE"
+    exit 0
+fi
+
+if [ $FAIL -ne 0 ]; then
+    echo "FAIL: bench (slower than $TOLERANCE% under the baseline, or a build failed)"
+    exit 1
+fi
+echo "PASS: bench"
+exit 0
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Checks --cache: a repeated build is a hit with identical outputs, changing
+# an included file or an option is a miss, and --cache-size evicts old
+# entries.
+ASSEMBLER=$(pwd)/microasm11
+TMP_DIR=$(mktemp -d)
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+cp tests11/cases/include_basic.asm tests11/cases/inc1.inc tests11/cases/inc2.inc "$TMP_DIR"
+cd "$TMP_DIR" || exit 1
+
+build() {
+    "$ASSEMBLER" --cache cache "$@" 2>&1 | grep "^Cache:" | cut -d' ' -f2
+}
+
+[ "$(build -binary include_basic.asm a.bin --list a.lst --map a.map)" = "miss" ] || fail "first build is not a miss"
+[ "$(build -binary include_basic.asm b.bin --list b.lst --map b.map)" = "hit" ] || fail "second build is not a hit"
+cmp -s a.bin b.bin && cmp -s a.lst b.lst && cmp -s a.map b.map || fail "restored outputs differ"
+
+[ "$(build -binary include_basic.asm c.bin --list c.lst)" = "miss" ] || fail "dropping --map still hit"
+[ "$(build --cpu vm2 -binary include_basic.asm c.bin --list c.lst)" = "miss" ] || fail "--cpu change still hit"
+
+printf 'VAL EQU 0456\nDB 2\n' > inc2.inc
+[ "$(build -binary include_basic.asm d.bin --list d.lst --map d.map)" = "miss" ] || fail "include change still hit"
+cmp -s a.bin d.bin && fail "stale image after include change"
+"$ASSEMBLER" -binary include_basic.asm e.bin 2> /dev/null
+cmp -s d.bin e.bin || fail "image after include change differs from a direct build"
+
+[ "$(build --cache-size 0 -binary include_basic.asm f.bin)" = "miss" ] || fail "new option set still hit"
+[ "$(ls cache | grep -c '^[0-9a-f]*$')" = "1" ] || fail "--cache-size 0 kept old entries"
+[ "$(cat cache/stats)" = "1 5" ] || fail "hit/miss counters"
+
+"$ASSEMBLER" --cache cache -binary missing.asm g.bin 2> /dev/null && fail "missing input built"
+
+echo "PASS: cache"
+exit 0
@@ -0,0 +1,45 @@
+#!/bin/bash
+# Checks -MD/-MF/-MT/-MP: the rule lists the source and its includes, and a
+# Makefile using it rebuilds only when an included file changes.
+ASSEMBLER=$(pwd)/microasm11
+TMP_DIR=$(mktemp -d)
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+mkdir -p "$TMP_DIR/src"
+cp tests11/cases/include_basic.asm tests11/cases/inc1.inc tests11/cases/inc2.inc "$TMP_DIR/src"
+cd "$TMP_DIR" || exit 1
+
+"$ASSEMBLER" -MD -binary src/include_basic.asm out.bin 2> /dev/null || fail "-MD build failed"
+printf 'out.bin: src/include_basic.asm \\\n src/inc1.inc \\\n src/inc2.inc\n' > want.d
+cmp -s out.d want.d || fail "dependency rule differs"
+
+"$ASSEMBLER" -MD -MF deps.mk -MT 'rom image' -binary src/include_basic.asm out.bin 2> /dev/null
+head -1 deps.mk | grep -q '^rom\\ image: src/include_basic.asm' || fail "-MF/-MT not used"
+
+cat > Makefile <<EOF
+out.bin:
+	"$ASSEMBLER" -MD -MP -binary src/include_basic.asm out.bin 2> /dev/null
+-include out.d
+EOF
+rm -f out.bin out.d
+make -s > /dev/null || fail "make failed"
+grep -q '^src/inc2.inc:$' out.d || fail "-MP rule missing"
+make -q || fail "up to date build would run again"
+sleep 1
+touch src/inc2.inc
+make -q && fail "changed include not seen"
+make -s > /dev/null || fail "rebuild failed"
+make -q || fail "rebuild left the target out of date"
+
+sed -i 's/INCLUDE "inc2.inc"/VAL EQU 0123/' src/inc1.inc
+rm src/inc2.inc
+make -s > /dev/null || fail "make failed after an include was removed"
+grep -q "inc2" out.d && fail "removed include still listed"
+
+echo "PASS: deps"
+exit 0
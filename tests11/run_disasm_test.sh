@@ -0,0 +1,33 @@
+#!/bin/bash
+# Disassemble every golden image and check that the source assembles back
+# to the same bytes.
+ASSEMBLER=./microasm11
+CASES_DIR=tests11/cases
+TMP_DIR=$(mktemp -d)
+
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+FAIL=0
+for bin in $CASES_DIR/*.expected.bin; do
+    base=$(basename "${bin%.expected.bin}")
+    if ! $ASSEMBLER --disassemble "$bin" "$TMP_DIR/$base.asm" 2> /dev/null; then
+        echo "FAIL: $base.expected.bin did not disassemble"
+        FAIL=1
+        continue
+    fi
+    if ! $ASSEMBLER -binary "$TMP_DIR/$base.asm" "$TMP_DIR/$base.bin" > /dev/null 2>&1; then
+        echo "FAIL: $base disassembly does not assemble"
+        FAIL=1
+        continue
+    fi
+    if ! cmp -s "$bin" "$TMP_DIR/$base.bin"; then
+        echo "FAIL: $base round trip differs"
+        FAIL=1
+    fi
+done
+
+if [ $FAIL -ne 0 ]; then
+    exit 1
+fi
+echo "PASS: disassembler round trip"
+exit 0
@@ -0,0 +1,22 @@
+#!/bin/bash
+# Assemble two modules with -c, link them with microld11 and compare the image.
+LINK_DIR=tests11/link
+TMP_DIR=$(mktemp -d)
+
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+(
+    cd "$LINK_DIR" || exit 1
+    ../../microasm11 -c main.asm "$TMP_DIR/main.obj" > /dev/null 2>&1 || { echo "FAIL: main.asm"; exit 1; }
+    ../../microasm11 -c util.asm "$TMP_DIR/util.obj" > /dev/null 2>&1 || { echo "FAIL: util.asm"; exit 1; }
+    ../../microld11 -binary -o "$TMP_DIR/link.bin" "$TMP_DIR/main.obj" "$TMP_DIR/util.obj" || { echo "FAIL: link"; exit 1; }
+    cmp -s "$TMP_DIR/link.bin" expected.bin || { echo "FAIL: linked image differs"; exit 1; }
+    # A module that needs a missing symbol must not link on its own.
+    if ../../microld11 -binary -o "$TMP_DIR/bad.bin" "$TMP_DIR/util.obj" > /dev/null 2>&1; then
+        echo "FAIL: undefined symbol not reported"
+        exit 1
+    fi
+) || exit 1
+
+echo "PASS: link"
+exit 0
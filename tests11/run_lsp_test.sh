@@ -0,0 +1,68 @@
+#!/bin/bash
+# Drives --lsp over stdio: checks diagnostics for every bad line (including
+# one in an included file), that an incremental edit clears them, and
+# go-to-definition, hover (at a UTF-16 position past a surrogate pair) and
+# symbol search, and that a truncated \u escape is not read past.
+ASSEMBLER=$(pwd)/microasm11
+TMP_DIR=$(mktemp -d)
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+msg() {
+    printf 'Content-Length: %d\r\n\r\n%s' "${#1}" "$1"
+}
+
+URI="file://$TMP_DIR/main.asm"
+INC="file://$TMP_DIR/defs.inc"
+DOC='{"textDocument":{"uri":"'$URI'"}'
+TEXT='ORG 1000\nCOUNT EQU 5\nstart:\nMOV #COUNT, R0\nMOV R0\nloop:\nDEC R0\nBNE loop\nINCLUDE \"defs.inc\"\nHALT\nDB \"\ud83d\ude00\", COUNT\n'
+printf 'MOV #VAL, R1,\nVAL EQU 7\n' > "$TMP_DIR/defs.inc"
+
+{
+    msg '{"jsonrpc":"2.0","id":1,"method":"initialize","params":{"initializationOptions":{"args":["--cycles"]}}}'
+    msg '{"jsonrpc":"2.0","method":"initialized","params":{}}'
+    msg '{"jsonrpc":"2.0","method":"textDocument/didOpen","params":{"textDocument":{"uri":"'$URI'","languageId":"asm","version":1,"text":"'"$TEXT"'"}}}'
+    msg '{"jsonrpc":"2.0","id":2,"method":"textDocument/definition","params":'$DOC',"position":{"line":7,"character":6}}}'
+    msg '{"jsonrpc":"2.0","id":3,"method":"textDocument/hover","params":'$DOC',"position":{"line":3,"character":8}}}'
+    msg '{"jsonrpc":"2.0","id":4,"method":"workspace/symbol","params":{"query":"va"}}'
+    msg '{"jsonrpc":"2.0","id":5,"method":"textDocument/documentSymbol","params":'$DOC'}}'
+    msg '{"jsonrpc":"2.0","id":8,"method":"textDocument/hover","params":'$DOC',"position":{"line":10,"character":9}}}'
+    msg '{"jsonrpc":"2.0","method":"textDocument/didChange","params":{"textDocument":{"uri":"'$URI'","version":2},"contentChanges":[{"range":{"start":{"line":4,"character":4},"end":{"line":4,"character":6}},"text":"R0, R1"},{"range":{"start":{"line":8,"character":0},"end":{"line":9,"character":0}},"text":""}]}}'
+    msg '{"jsonrpc":"2.0","id":6,"method":"textDocument/hover","params":'$DOC',"position":{"line":4,"character":0}}}'
+    msg '{"jsonrpc":"2.0","id":7,"method":"shutdown"}'
+    msg '{"jsonrpc":"2.0","method":"exit"}'
+} > "$TMP_DIR/in"
+
+(cd "$TMP_DIR" && "$ASSEMBLER" --lsp < in > out) || fail "server did not exit cleanly"
+OUT=$(tr -d '\r' < "$TMP_DIR/out")
+
+BAD='{"jsonrpc":"2.0","method":"initialized","params":{"a":"\u'
+printf 'Content-Length: %d\r\n\r\n%s' "${#BAD}" "$BAD" | "$ASSEMBLER" --lsp > /dev/null 2>&1
+[ $? -le 1 ] || fail "truncated \\u escape crashed the server"
+
+reply() {
+    echo "$OUT" | grep -o "{\"jsonrpc\":\"2.0\",\"id\":$1,.*" | sed 's/}Content-Length:.*/}/'
+}
+
+DIAGS=$(echo "$OUT" | sed 's/Content-Length: [0-9]*/\n/g' | grep '"method":"textDocument/publishDiagnostics"')
+echo "$DIAGS" | head -2 | grep "main.asm" | grep -q '"start":{"line":4,' || fail "no diagnostic for line 5"
+echo "$DIAGS" | head -2 | grep "defs.inc" | grep -q '"start":{"line":0,' || fail "no diagnostic in the include"
+echo "$DIAGS" | tail -2 | grep -q "main.asm\",\"diagnostics\":\[\]" || fail "edit did not clear main.asm"
+echo "$DIAGS" | tail -2 | grep -q "defs.inc\",\"diagnostics\":\[\]" || fail "edit did not clear defs.inc"
+
+reply 2 | grep -q "\"uri\":\"$URI\",\"range\":{\"start\":{\"line\":5," || fail "definition of loop"
+reply 3 | grep -q 'COUNT\*\* = 000005 (5.) equ' || fail "hover value"
+reply 3 | grep -q '001000: 012700 000005` [0-9]* cycles' || fail "hover code"
+reply 4 | grep -q "\"name\":\"VAL\",\"kind\":14,\"location\":{\"uri\":\"$INC\"" || fail "workspace symbol"
+reply 5 | grep -q '"name":"start","kind":13' || fail "document symbols"
+reply 5 | grep -q '"VAL"' && fail "document symbols list the include"
+reply 8 | grep -q 'COUNT\*\* = 000005' || fail "hover after a surrogate pair"
+reply 6 | grep -q '001004: 010001`' || fail "hover after the edit"
+reply 7 | grep -q '"result":null' || fail "shutdown"
+
+echo "PASS: lsp"
+exit 0
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Assemble each tests11/map program with --map and compare the map file.
+ASSEMBLER=../../microasm11
+MAP_DIR=tests11/map
+TMP_DIR=$(mktemp -d)
+
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+FAIL=0
+for asm in $MAP_DIR/*.asm; do
+    base=$(basename "${asm%.asm}")
+    (
+        cd "$MAP_DIR" || exit 1
+        if ! $ASSEMBLER -binary --map "$TMP_DIR/$base.map" \
+                "$base.asm" "$TMP_DIR/$base.bin" > /dev/null 2>&1; then
+            echo "FAIL: $base.asm did not assemble"
+            exit 1
+        fi
+        if ! cmp -s "$TMP_DIR/$base.map" "$base.expected.map"; then
+            echo "FAIL: $base.asm map differs"
+            diff "$base.expected.map" "$TMP_DIR/$base.map" | head -n 10
+            exit 1
+        fi
+    ) || FAIL=1
+done
+
+if [ $FAIL -ne 0 ]; then
+    exit 1
+fi
+echo "PASS: map"
+exit 0
@@ -0,0 +1,72 @@
+#!/bin/bash
+# Checks --pch-out/--pch-in: a program built against the precompiled header
+# matches a normal build, a changed header or a symbol its conditionals test
+# that reads differently falls back to the include, and a header that emits
+# code is refused.
+ASSEMBLER=$(pwd)/microasm11
+TMP_DIR=$(mktemp -d)
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+cd "$TMP_DIR" || exit 1
+cat > sys.inc <<'EOF'
+TTYCSR EQU 177564
+TTYBUF EQU 177566
+CR EQU 15
+LF EQU CR-3
+INCLUDE "more.inc"
+.CPU vm2
+MACRO putc ch
+10$: TSTB @#TTYCSR
+    BPL 10$
+    MOVB ch, @#TTYBUF
+ENDM
+EOF
+printf 'STKTOP EQU 1000\nMACRO exit\n    HALT\nENDM\n' > more.inc
+cat > prog.asm <<'EOF'
+ORG 1000
+INCLUDE "sys.inc"
+start:
+    MOV #STKTOP, SP
+    putc #CR
+1$: putc #LF
+    BR 1$
+    exit
+EOF
+
+"$ASSEMBLER" --pch-out sys.pch sys.inc 2> /dev/null || fail "--pch-out failed"
+"$ASSEMBLER" -binary prog.asm plain.bin 2> /dev/null || fail "plain build failed"
+"$ASSEMBLER" --pch-in sys.pch -binary prog.asm pch.bin 2> /dev/null || fail "PCH build failed"
+cmp -s plain.bin pch.bin || fail "PCH build differs"
+
+printf 'MACRO putc ch\nENDM\n' > dup.asm
+"$ASSEMBLER" --pch-in sys.pch -binary dup.asm dup.bin 2> /dev/null || fail "PCH without the include failed"
+
+printf 'STKTOP EQU 2000\nMACRO exit\n    HALT\nENDM\n' > more.inc
+"$ASSEMBLER" --pch-in sys.pch -binary prog.asm stale.bin 2> stale.txt || fail "build with a stale PCH failed"
+grep -q "out of date" stale.txt || fail "stale PCH not reported"
+"$ASSEMBLER" -binary prog.asm fresh.bin 2> /dev/null
+cmp -s stale.bin fresh.bin || fail "stale PCH was used"
+
+printf 'IFDEF DEBUG\nLVL EQU 7\nELSE\nLVL EQU 1\nENDIF\n' > lvl.inc
+printf 'DEBUG EQU 1\nINCLUDE "lvl.inc"\nDW LVL\n' > dbg.asm
+printf 'INCLUDE "lvl.inc"\nDW LVL\n' > nodbg.asm
+"$ASSEMBLER" --pch-out lvl.pch lvl.inc 2> /dev/null || fail "--pch-out with a conditional failed"
+"$ASSEMBLER" --pch-in lvl.pch -binary dbg.asm dbg.bin 2> dbg.txt || fail "PCH build with DEBUG failed"
+[ "$(od -An -o dbg.bin | tr -d ' ')" = "000007" ] || fail "PCH ignored the conditional"
+grep -q "built with DEBUG undefined" dbg.txt || fail "conditional fallback not reported"
+"$ASSEMBLER" --pch-in lvl.pch -binary nodbg.asm nodbg.bin 2> nodbg.txt || fail "PCH build without DEBUG failed"
+[ "$(od -An -o nodbg.bin | tr -d ' ')" = "000001" ] || fail "PCH build without DEBUG differs"
+grep -q "included instead" nodbg.txt && fail "matching PCH not used"
+
+printf 'NOP\n' > code.inc
+"$ASSEMBLER" --pch-out code.pch code.inc 2> /dev/null && fail "header with code accepted"
+echo junk > bad.pch
+"$ASSEMBLER" --pch-in bad.pch -binary prog.asm bad.bin 2> /dev/null && fail "bad PCH accepted"
+
+echo "PASS: pch"
+exit 0
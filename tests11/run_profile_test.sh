@@ -0,0 +1,32 @@
+#!/bin/bash
+# Assemble each tests11/profile program with --profile <base>.prof and
+# compare the annotated listing.
+ASSEMBLER=../../microasm11
+PROFILE_DIR=tests11/profile
+TMP_DIR=$(mktemp -d)
+
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+FAIL=0
+for asm in $PROFILE_DIR/*.asm; do
+    base=$(basename "${asm%.asm}")
+    (
+        cd "$PROFILE_DIR" || exit 1
+        if ! $ASSEMBLER -binary --profile "$base.prof" --list "$TMP_DIR/$base.lst" \
+                "$base.asm" "$TMP_DIR/$base.bin" > /dev/null 2>&1; then
+            echo "FAIL: $base.asm did not assemble"
+            exit 1
+        fi
+        if ! cmp -s "$TMP_DIR/$base.lst" "$base.expected.lst"; then
+            echo "FAIL: $base.asm listing differs"
+            diff "$base.expected.lst" "$TMP_DIR/$base.lst" | head -n 10
+            exit 1
+        fi
+    ) || FAIL=1
+done
+
+if [ $FAIL -ne 0 ]; then
+    exit 1
+fi
+echo "PASS: profile"
+exit 0
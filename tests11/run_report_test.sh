@@ -0,0 +1,42 @@
+#!/bin/bash
+# Assemble each tests11/reports program with its .args.txt in a scratch
+# directory holding it and the .inc files, then compare every
+# <base>.expected.<ext> with the <base>.<ext> the build wrote there;
+# <base>.err is its stderr. Times, rates and memory in --stats=json output
+# and --trace-json timestamps are masked, since they differ between runs;
+# the timestamps must still be in order.
+ASSEMBLER=$(pwd)/microasm11
+REPORT_DIR=$(pwd)/tests11/reports
+TMP_DIR=$(mktemp -d)
+
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+FAIL=0
+for asm in "$REPORT_DIR"/*.asm; do
+    base=$(basename "${asm%.asm}")
+    (
+        mkdir "$TMP_DIR/$base" && cd "$TMP_DIR/$base" || exit 1
+        cp "$asm" "$REPORT_DIR"/*.inc .
+        args=$(cat "$REPORT_DIR/$base.args.txt" 2>/dev/null)
+        $ASSEMBLER -binary $args "$base.asm" "$base.bin" > /dev/null 2> "$base.err"
+        for expected in "$REPORT_DIR/$base".expected.*; do
+            ext=${expected##*.expected.}
+            if [ "$ext" = trace ] && ! grep -o '"ts": [0-9.]*' "$base.$ext" | awk '$2 < last { exit 1 } { last = $2 }'; then
+                echo "FAIL: $base.asm trace timestamps go backwards"
+                exit 1
+            fi
+            [ -f "$base.$ext" ] && sed -E -i 's/"(wall_ms|cpu_ms|lines_per_sec|peak_rss_kb|ts)": [0-9.]+/"\1": N/g' "$base.$ext"
+            if ! cmp -s "$base.$ext" "$expected"; then
+                echo "FAIL: $base.asm $ext differs"
+                diff "$expected" "$base.$ext" | head -n 10
+                exit 1
+            fi
+        done
+    ) || FAIL=1
+done
+
+if [ $FAIL -ne 0 ]; then
+    exit 1
+fi
+echo "PASS: report"
+exit 0
@@ -0,0 +1,82 @@
+#!/bin/bash
+# Starts --server and checks that --client builds match direct runs, that
+# failures keep their status and diagnostics, that in-memory overrides are
+# used, that rewritten includes are read again, that concurrent requests
+# all succeed, and that only a stale socket is replaced at the path.
+ASSEMBLER=$(pwd)/microasm11
+CASES_DIR=tests11/cases
+TMP_DIR=$(mktemp -d)
+SOCK=$TMP_DIR/asm.sock
+PID=
+
+cleanup() {
+    [ -n "$PID" ] && kill "$PID" 2>/dev/null
+    rm -rf "$TMP_DIR"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+"$ASSEMBLER" --server "$SOCK" 2> /dev/null &
+PID=$!
+for i in $(seq 50); do
+    [ -S "$SOCK" ] && break
+    sleep 0.1
+done
+
+cd "$CASES_DIR" || exit 1
+for base in include_basic dir_db_strings ea_modes_word; do
+    "$ASSEMBLER" --client "$SOCK" -binary "$base.asm" "$TMP_DIR/$base.bin" > /dev/null 2>&1 \
+        || fail "$base.asm did not assemble through the server"
+    cmp -s "$TMP_DIR/$base.bin" "$base.expected.bin" || fail "$base.asm image differs"
+done
+
+"$ASSEMBLER" --client "$SOCK" -binary branch_range_error.asm "$TMP_DIR/err.bin" 2> "$TMP_DIR/err.txt"
+[ $? -eq 1 ] || fail "failing build did not return 1"
+grep -q "branch_range_error.asm:8:" "$TMP_DIR/err.txt" || fail "diagnostics missing"
+
+printf 'VAL EQU 777\n' | "$ASSEMBLER" --client "$SOCK" -binary --override inc1.inc - \
+    include_basic.asm "$TMP_DIR/ov.bin" > /dev/null 2>&1 || fail "override build failed"
+[ "$(od -An -o "$TMP_DIR/ov.bin" | tr -d ' ')" = "000777" ] || fail "override not used"
+
+# An include rewritten in place within the same second, at the same size,
+# must not be served from the cache.
+printf 'include "sv.inc"\n\tdw V\n' > "$TMP_DIR/sv.asm"
+printf 'V equ 111\n' > "$TMP_DIR/sv.inc"
+(cd "$TMP_DIR" && "$ASSEMBLER" --client "$SOCK" -binary sv.asm sv1.bin > /dev/null 2>&1) \
+    || fail "include build failed"
+printf 'V equ 222\n' > "$TMP_DIR/sv.inc"
+(cd "$TMP_DIR" && "$ASSEMBLER" --client "$SOCK" -binary sv.asm sv2.bin > /dev/null 2>&1) \
+    || fail "rebuild after rewrite failed"
+[ "$(od -An -o "$TMP_DIR/sv1.bin" | tr -d ' ')" = "000111" ] || fail "include not read"
+[ "$(od -An -o "$TMP_DIR/sv2.bin" | tr -d ' ')" = "000222" ] || fail "stale include served"
+
+for i in $(seq 8); do
+    "$ASSEMBLER" --client "$SOCK" -binary include_basic.asm "$TMP_DIR/p$i.bin" > /dev/null 2>&1 &
+done
+wait $(jobs -p | grep -v "^$PID\$")
+for i in $(seq 8); do
+    cmp -s "$TMP_DIR/p$i.bin" include_basic.expected.bin || fail "concurrent request $i differs"
+done
+
+kill "$PID"
+wait "$PID" 2>/dev/null
+"$ASSEMBLER" --server "$SOCK" 2> /dev/null &
+PID=$!
+for i in $(seq 50); do
+    "$ASSEMBLER" --client "$SOCK" -binary include_basic.asm "$TMP_DIR/re.bin" > /dev/null 2>&1 && break
+    sleep 0.1
+done
+cmp -s "$TMP_DIR/re.bin" include_basic.expected.bin || fail "stale socket not replaced"
+
+echo keep > "$TMP_DIR/file.txt"
+"$ASSEMBLER" --server "$TMP_DIR/file.txt" 2> "$TMP_DIR/file.err"
+[ $? -eq 1 ] || fail "server started over a regular file"
+grep -q "is not a socket" "$TMP_DIR/file.err" || fail "no error for a regular file"
+[ "$(cat "$TMP_DIR/file.txt")" = keep ] || fail "regular file removed"
+
+echo "PASS: server"
+exit 0
@@ -0,0 +1,64 @@
+#!/bin/bash
+# Round-trip an image through a --shm segment and compare with -binary output,
+# then check shm11cat --wait and its timeout on an unfinished update.
+ASSEMBLER=./microasm11
+CONSUMER=./shm11cat
+SRC=tests11/cases/jsr_jmp_rts.asm
+SHM_NAME="microasm11-test-$$"
+TMP_DIR=$(mktemp -d)
+
+trap 'rm -rf "$TMP_DIR"; rm -f "/dev/shm/$SHM_NAME"' EXIT
+
+if [ ! -d /dev/shm ]; then
+    echo "SKIP: no /dev/shm"
+    exit 0
+fi
+
+$ASSEMBLER -binary "$SRC" "$TMP_DIR/ref.bin" > /dev/null 2>&1 || { echo "FAIL: reference build"; exit 1; }
+$ASSEMBLER --shm "$SHM_NAME" --shm-symbols "$SRC" > /dev/null 2>&1 || { echo "FAIL: --shm build"; exit 1; }
+$CONSUMER -o "$TMP_DIR/shm.bin" --symbols "$SHM_NAME" > "$TMP_DIR/first.txt" || { echo "FAIL: consumer"; exit 1; }
+
+if ! cmp -s "$TMP_DIR/ref.bin" "$TMP_DIR/shm.bin"; then
+    echo "FAIL: shm image differs from binary output"
+    exit 1
+fi
+grep -q "^generation 1$" "$TMP_DIR/first.txt" || { echo "FAIL: first generation"; exit 1; }
+grep -q "^\[" "$TMP_DIR/first.txt" || { echo "FAIL: no symbols"; exit 1; }
+
+# Re-assembling identical source bumps the generation with no dirty ranges.
+$ASSEMBLER --shm "$SHM_NAME" "$SRC" > /dev/null 2>&1 || { echo "FAIL: second --shm build"; exit 1; }
+$CONSUMER "$SHM_NAME" > "$TMP_DIR/second.txt" || { echo "FAIL: consumer"; exit 1; }
+grep -q "^generation 2$" "$TMP_DIR/second.txt" || { echo "FAIL: second generation"; exit 1; }
+if grep -q "^dirty" "$TMP_DIR/second.txt"; then
+    echo "FAIL: unchanged image reported dirty ranges"
+    exit 1
+fi
+
+# --wait 2 is already complete; --wait 3 returns once the third build is.
+$CONSUMER --wait 2 "$SHM_NAME" > "$TMP_DIR/wait2.txt" || { echo "FAIL: --wait for a finished build"; exit 1; }
+grep -q "^generation 2$" "$TMP_DIR/wait2.txt" || { echo "FAIL: --wait 2 generation"; exit 1; }
+$CONSUMER --wait 3 "$SHM_NAME" > "$TMP_DIR/wait3.txt" &
+WAIT_PID=$!
+sleep 0.2
+kill -0 $WAIT_PID 2> /dev/null || { echo "FAIL: --wait 3 returned before the build"; exit 1; }
+$ASSEMBLER --shm "$SHM_NAME" "$SRC" > /dev/null 2>&1 || { echo "FAIL: third --shm build"; exit 1; }
+wait $WAIT_PID || { echo "FAIL: --wait 3 consumer"; exit 1; }
+grep -q "^generation 3$" "$TMP_DIR/wait3.txt" || { echo "FAIL: --wait 3 generation"; exit 1; }
+
+# A writer that never finishes (odd counter) is reported, not waited for.
+printf '\007\000\000\000' | dd of="/dev/shm/$SHM_NAME" bs=1 seek=8 conv=notrunc 2> /dev/null
+if $CONSUMER "$SHM_NAME" > /dev/null 2> "$TMP_DIR/stuck.txt"; then
+    echo "FAIL: unfinished update accepted"
+    exit 1
+fi
+grep -q "Writer did not finish generation 4" "$TMP_DIR/stuck.txt" || { echo "FAIL: unfinished update not reported"; exit 1; }
+
+# The next build recovers: the counter ends even again and the half-written
+# image is reported dirty as a whole.
+$ASSEMBLER --shm "$SHM_NAME" "$SRC" > /dev/null 2>&1 || { echo "FAIL: build after a dead writer"; exit 1; }
+$CONSUMER "$SHM_NAME" > "$TMP_DIR/recovered.txt" || { echo "FAIL: consumer after recovery"; exit 1; }
+grep -q "^generation 4$" "$TMP_DIR/recovered.txt" || { echo "FAIL: recovered generation"; exit 1; }
+grep -q "^dirty" "$TMP_DIR/recovered.txt" || { echo "FAIL: recovered image not dirty"; exit 1; }
+
+echo "PASS: shm round trip"
+exit 0
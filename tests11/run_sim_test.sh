@@ -0,0 +1,45 @@
+#!/bin/bash
+# Run each tests11/sim program with --run and compare the report.
+ASSEMBLER=../../microasm11
+SIM_DIR=tests11/sim
+TMP_DIR=$(mktemp -d)
+
+trap 'rm -rf "$TMP_DIR"' EXIT
+
+FAIL=0
+for asm in $SIM_DIR/*.asm; do
+    base=$(basename "${asm%.asm}")
+    args=""
+    expect_fail=0
+    if [ -f "$SIM_DIR/$base.args.txt" ]; then
+        args=$(cat "$SIM_DIR/$base.args.txt")
+        if echo "$args" | grep -q "EXPECT_FAIL"; then
+            expect_fail=1
+        fi
+        args=$(echo "$args" | sed 's/EXPECT_FAIL//g')
+    fi
+    (
+        cd "$SIM_DIR" || exit 1
+        $ASSEMBLER -binary --run $args "$base.asm" "$TMP_DIR/$base.bin" > "$TMP_DIR/$base.txt" 2> /dev/null
+        rc=$?
+        if [ $expect_fail -eq 0 ] && [ $rc -ne 0 ]; then
+            echo "FAIL: $base.asm did not halt"
+            exit 1
+        fi
+        if [ $expect_fail -eq 1 ] && [ $rc -eq 0 ]; then
+            echo "FAIL: $base.asm expected failure but succeeded"
+            exit 1
+        fi
+        if ! cmp -s "$TMP_DIR/$base.txt" "$base.expected.txt"; then
+            echo "FAIL: $base.asm report differs"
+            diff "$base.expected.txt" "$TMP_DIR/$base.txt" | head -n 10
+            exit 1
+        fi
+    ) || FAIL=1
+done
+
+if [ $FAIL -ne 0 ]; then
+    exit 1
+fi
+echo "PASS: sim"
+exit 0
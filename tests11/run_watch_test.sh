@@ -0,0 +1,69 @@
+#!/bin/bash
+# Starts --watch on a program with an include, edits the include and checks
+# that the image is rebuilt, then that a save made while a build runs
+# starts another build.
+ASSEMBLER=$(pwd)/microasm11
+TMP_DIR=$(mktemp -d)
+PID=
+
+cleanup() {
+    [ -n "$PID" ] && kill "$PID" 2>/dev/null
+    rm -rf "$TMP_DIR"
+}
+trap cleanup EXIT
+
+# Waits up to 5 s for prog.bin to hold the given octal dump.
+wait_image() {
+    for i in $(seq 50); do
+        if [ "$(od -An -o "$TMP_DIR/prog.bin" 2>/dev/null | tr -s ' ')" = " $1" ]; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "FAIL: watch image is '$(od -An -o "$TMP_DIR/prog.bin" 2>/dev/null)', expected '$1'"
+    exit 1
+}
+
+# Waits up to 5 s for the first word of prog.bin.
+wait_image_start() {
+    for i in $(seq 50); do
+        [ "$(od -An -o -N2 "$TMP_DIR/prog.bin" | tr -d ' ')" = "$1" ] && return 0
+        sleep 0.1
+    done
+    echo "FAIL: watch image does not start with $1"
+    exit 1
+}
+
+printf '\tnop\n\tINCLUDE "sub.inc"\n' > "$TMP_DIR/prog.asm"
+printf '\thalt\n' > "$TMP_DIR/sub.inc"
+(cd "$TMP_DIR" && exec "$ASSEMBLER" -binary --watch prog.asm prog.bin 2> watch.log) &
+PID=$!
+
+wait_image "000240 000000"
+printf '\tmov r1, r2\n' > "$TMP_DIR/sub.inc"
+wait_image "000240 010102"
+printf '\twait\n\tINCLUDE "sub.inc"\n' > "$TMP_DIR/prog.asm"
+wait_image "000001 010102"
+
+# A build of about a second: sub.inc is saved while it runs, which must
+# start one more build rather than be lost.
+builds() {
+    grep -c '^Watch:' "$TMP_DIR/watch.log"
+}
+awk 'BEGIN { for (i = 0; i < 10000; i++) printf "lab%d:\tmov #lab%d, r0\n", i, (i * 7919 + 13) % 10000 }' > "$TMP_DIR/big.inc"
+BUILDS=$(builds)
+printf '\tINCLUDE "sub.inc"\n\tINCLUDE "big.inc"\n' > "$TMP_DIR/prog.asm"
+sleep 0.3
+printf '\treset\n' > "$TMP_DIR/sub.inc"
+for i in $(seq 100); do
+    [ "$(builds)" -ge $((BUILDS + 2)) ] && break
+    sleep 0.1
+done
+if [ "$(builds)" -lt $((BUILDS + 2)) ]; then
+    echo "FAIL: a save during a build was lost"
+    exit 1
+fi
+wait_image_start 000005
+
+echo "PASS: watch"
+exit 0
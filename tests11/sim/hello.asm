@@ -0,0 +1,23 @@
+; Console output through the DL11 transmitter, a PROC and a SOB loop.
+
+	org 1000
+start:	mov	#1000,sp
+	mov	#msg,r1
+1$:	movb	(r1)+,r0
+	beq	2$f
+	jsr	pc,putc
+	br	1$
+2$:	mov	#10,r4
+	clr	r5
+3$:	add	r4,r5
+	sob	r4,3$
+	halt
+
+putc:	proc
+1$:	tstb	@#177564
+	bpl	1$
+	movb	r0,@#177566
+	rts	pc
+	endp
+
+msg:	db	"Hello", 12, 0
@@ -0,0 +1,32 @@
+; --instrument=loops keeps N, Z and V for code that reads them after a
+; site: INC @#$PROF+2*n would set Z before BEQ at 1$ reads the flags of
+; TST, before BEQ at 4$ reads those of DEC past SEC, and before BEQ at the
+; entry of odd. Those sites are wrapped in MFPS -(SP) / MTPS (SP)+. The
+; loop at 3$ sets its own flags first and gets the plain INC.
+
+	org 1000
+start:	mov	#1000,sp
+	mov	#3,r0
+	clr	r2
+	tst	r0
+1$:	beq	2$f
+	inc	r2
+	dec	r0
+	br	1$
+2$:	mov	#2,r1
+3$:	inc	r3
+	sob	r1,3$
+	mov	#3,r1
+4$:	sec
+	beq	5$f
+	dec	r1
+	br	4$
+5$:	bit	#1,r2
+	jsr	pc,odd
+	halt
+
+odd:	proc
+	beq	1$f
+	inc	r4
+1$:	rts	pc
+	endp
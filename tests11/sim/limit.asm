@@ -0,0 +1,5 @@
+; A program that never halts stops at the --run-cycles limit and fails.
+
+	org 1000
+start:	inc	r0
+	br	start
@@ -0,0 +1,49 @@
+; Arithmetic, EIS, FIS and trap checks for --run.
+; Results are left in registers and in res..res+20 for the report.
+
+	org 30
+	dw	emt_h, 0
+	org 1000
+start:	mov	#1000,sp
+	mov	#res,r5
+
+	mov	#1,r0
+	ash	#3,r0		; 10
+	mov	r0,(r5)+
+	clr	r0
+	mov	#100,r1
+	div	#7,r0		; r0 = 11, r1 = 1
+	mov	r0,(r5)+
+	mov	r1,(r5)+
+	mov	#177777,r2
+	mov	#177776,r3
+	mul	r3,r2		; -1 * -2 = 2
+	mov	r3,(r5)+
+	mov	#1,r0
+	clr	r1
+	ashc	#-1,r0		; 0, 100000
+	mov	r1,(r5)+
+
+	mov	#fargs,r4
+	fadd	r4		; 1.0 + 2.0 = 3.0 at fargs+4
+	mov	fargs+4,(r5)+
+
+	mov	#77777,r0
+	inc	r0		; V set
+	mfps	r1
+	mov	r1,(r5)+
+	mov	#100000,r0
+	asl	r0		; C set, Z set, V set
+	mfps	r1
+	mov	r1,(r5)+
+
+	emt	12
+	mov	r0,(r5)+	; 123 from the handler
+	halt
+
+emt_h:	mov	#123,r0
+	rti
+
+fargs:	dw	040400, 0	; 2.0
+	dw	040200, 0	; 1.0
+res:	dsw	12